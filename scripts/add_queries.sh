@@ -11,6 +11,9 @@
 # make         how to make the software (make might have args or might have FOO=bar required precursors)
 # install      how to install the software (note that configure will be run with --prefix ...lava-install)
 #
+# Optionally, lavatool_apply (default false) has lavaTool apply its replacements itself
+# in one run over all the files, instead of leaving them for clang-apply-replacements.
+#
 # script proceeds to untar the software, run btrace on it to extract a compile_commands.json file,
 # which contains all information needed to compile every file in the project.
 # then, the script runs lavaTool using that compile_commands.json file, on every source file,
@@ -166,12 +169,16 @@ if [[ ! -z "$df_fn_blacklist" ]]; then
     $cmd
 fi
 
-if [ "$dataflow" = "true" ]; then
-    # Insert queries with DF - could merge this with the else if logic below instead of duplicating
-    # TODO: Just make lavaTool load dataflow from project.json instead of passing as CLI arg.
-    # Since it's okay to pass the whitelist either way
-    progress "queries" 0  "Inserting queries for dataflow"
-    for i in $c_files; do
+# The source was just untarred afresh, so start a new lavadb to go with it.
+# lavaTool adds to an existing one, and refuses one from an older lavaTool.
+rm -f "$directory/$name/lavadb"
+
+# Runs lavaTool's query action with the given arguments and files.
+insert_queries() {
+    if [ "$dataflow" = "true" ]; then
+        # Insert queries with DF - could merge this with the else if logic below instead of duplicating
+        # TODO: Just make lavaTool load dataflow from project.json instead of passing as CLI arg.
+        # Since it's okay to pass the whitelist either way
         $lava/tools/install/bin/lavaTool -action=query \
         -lava-db="$directory/$name/lavadb" \
         -p="$directory/$name/$source/compile_commands.json" \
@@ -180,12 +187,9 @@ if [ "$dataflow" = "true" ]; then
         -src-prefix=$(readlink -f "$source") \
         $ATP_TYPE \
         -db="$db" \
-        $i
-    done
-else
-    progress "queries" 0  "Inserting queries..."
-    # TODO: remove lava-wl here, unless we're using it to limit where we inject
-    for i in $c_files; do
+        "$@"
+    else
+        # TODO: remove lava-wl here, unless we're using it to limit where we inject
         $lava/tools/install/bin/lavaTool -action=query \
         -lava-db="$directory/$name/lavadb" \
         -lava-wl="$fninstr" \
@@ -193,22 +197,39 @@ else
         -src-prefix=$(readlink -f "$source") \
         $ATP_TYPE \
         -db="$db" \
-        $i
-    done
+        "$@"
+    fi
+}
+
+if [ "$dataflow" = "true" ]; then
+    progress "queries" 0  "Inserting queries for dataflow"
+else
+    progress "queries" 0  "Inserting queries..."
 fi
 
-# Do we need to explicitly apply replacements in the root source directory
-# This causes clang-apply-replacements to segfault when run a 2nd time
-#pushd "$directory/$name/$source"
-#$llvm_src/Release/bin/clang-apply-replacements .
-#popd
+if [ "$lavatool_apply" = "true" ]; then
+    # One run over all the files, which applies its own replacements
+    # (-apply) once they're all done.
+    insert_queries -jobs=$(nproc) \
+        -apply="$directory/$name/lava-queries.json" $c_files
+else
+    for i in $c_files; do
+        insert_queries $i
+    done
 
-for i in $c_dirs; do
-    echo "Applying replacements to $i"
-    pushd $i
-    $llvm_src/Release/bin/clang-apply-replacements .
-    popd
-done
+    # Do we need to explicitly apply replacements in the root source directory
+    # This causes clang-apply-replacements to segfault when run a 2nd time
+    #pushd "$directory/$name/$source"
+    #$llvm_src/Release/bin/clang-apply-replacements .
+    #popd
+
+    for i in $c_dirs; do
+        echo "Applying replacements to $i"
+        pushd $i
+        $llvm_src/Release/bin/clang-apply-replacements .
+        popd
+    done
+fi
 
 # Ensure every c file was modified
 # Alternatively, we could just check that at least one file was modified
@@ -2,6 +2,7 @@ from __future__ import print_function
 
 import os
 import re
+import json
 import sys
 import math
 import shlex
@@ -30,8 +31,7 @@ from sqlalchemy.dialects import postgresql
 from sqlalchemy.sql.expression import func
 from sqlalchemy.ext.declarative import declarative_base
 
-# from multiprocessing import cpu_count
-# from multiprocessing.pool import ThreadPool
+from multiprocessing import cpu_count
 
 from time import sleep
 
@@ -72,6 +72,7 @@ class SourceLval(Base):
     id = Column(Integer, primary_key=True)
     loc = ASTLoc.composite('loc')
     ast_name = Column(Text)
+    len_bytes = Column(Integer)
 
     def __str__(self):
         return 'Lval[{}](loc={}:{}, ast="{}")'.format(
@@ -485,11 +486,64 @@ def mutfile(filename, fuzz_labels_list, new_filename, bug,
         fuzzed_f.write(file_bytes)
 
 
-# run lavatool on this file to inject any parts of this list of bugs
-def run_lavatool(bug_list, lp, host_file, project, llvm_src, filename,
+# Write bugs and everything they refer to as a JSON manifest, which lavaTool
+# reads with -bug-manifest instead of going to the database.
+def write_bug_manifest(bugs, db, path):
+    def ast_loc(loc):
+        return {'filename': loc.filename,
+                'begin': [loc.begin.line, loc.begin.column],
+                'end': [loc.end.line, loc.end.column]}
+
+    dua_bytes = {bug.trigger.id: bug.trigger for bug in bugs}
+    extra_ids = set(extra_id for bug in bugs for extra_id in bug.extra_duas)
+    extra_ids -= set(dua_bytes.keys())
+    if extra_ids:
+        for db_ in db.session.query(DuaBytes) \
+                .filter(DuaBytes.id.in_(extra_ids)):
+            dua_bytes[db_.id] = db_
+    duas = {db_.dua.id: db_.dua for db_ in dua_bytes.values()}
+    lvals = {dua.lval.id: dua.lval for dua in duas.values()}
+    lvals.update({bug.trigger_lval.id: bug.trigger_lval for bug in bugs})
+    atps = {bug.atp.id: bug.atp for bug in bugs}
+
+    manifest = {
+        'version': 1,
+        'lvals': [{'id': lval.id, 'loc': ast_loc(lval.loc),
+                   'ast_name': lval.ast_name, 'len_bytes': lval.len_bytes}
+                  for lval in lvals.values()],
+        'atps': [{'id': atp.id, 'loc': ast_loc(atp.loc), 'type': atp.typ}
+                 for atp in atps.values()],
+        'duas': [{'id': dua.id, 'lval': dua.lval_id,
+                  'inputfile': dua.inputfile, 'max_tcn': dua.max_tcn,
+                  'max_cardinality': dua.max_cardinality,
+                  'instr': dua.instr, 'fake_dua': dua.fake_dua}
+                 for dua in duas.values()],
+        'dua_bytes': [{'id': db_.id, 'dua': db_.dua_id,
+                       'selected': [db_.selected.low, db_.selected.high]}
+                      for db_ in dua_bytes.values()],
+        # magic is a uint32 stored in a signed INTEGER column.
+        'bugs': [{'id': bug.id, 'type': bug.type, 'trigger': bug.trigger_id,
+                  'trigger_lval': bug.trigger_lval_id, 'atp': bug.atp_id,
+                  'max_liveness': int(bug.max_liveness),
+                  'extra_duas': list(bug.extra_duas),
+                  'magic': bug.magic & 0xffffffff}
+                 for bug in bugs],
+    }
+    with open(path, 'w') as f:
+        json.dump(manifest, f)
+
+
+# run lavatool on these files to inject any parts of this list of bugs
+# If bug_manifest is given, lavaTool reads the bugs from there rather than
+# from the database. lavaTool works on up to jobs files at once. If
+# apply_manifest is given, lavaTool applies its replacements itself, writing
+# a summary there, instead of leaving .yaml files for clang-apply-replacements.
+# With ast_cache, lavaTool keeps parsed ASTs there for the next run.
+def run_lavatool(bug_list, lp, host_file, project, llvm_src, filenames,
                  knobTrigger=False, dataflow=False, competition=False,
-                 randseed=0):
-    print("Running lavaTool on [{}]...".format(filename))
+                 randseed=0, bug_manifest=None, jobs=1, apply_manifest=None,
+                 ast_cache=None, site_index=None):
+    print("Running lavaTool on [{}]...".format(', '.join(filenames)))
     lt_debug = False
     if (len(bug_list)) == 0:
         print("\nWARNING: Running lavaTool but no bugs \
@@ -505,8 +559,13 @@ def run_lavatool(bug_list, lp, host_file, project, llvm_src, filename,
 
     cmd = [
         lp.lava_tool, '-action=inject', '-bug-list=' + bug_list_str,
-        '-src-prefix=' + lp.bugs_build, '-db=' + db_name,
-        '-main-files=' + main_files, join(lp.bugs_build, filename)]
+        '-src-prefix=' + lp.bugs_build,
+        '-main-files=' + main_files, '-jobs={}'.format(jobs)]
+    cmd.extend(join(lp.bugs_build, filename) for filename in filenames)
+    if bug_manifest:
+        cmd.insert(3, '-bug-manifest=' + bug_manifest)
+    else:
+        cmd.insert(3, '-db=' + db_name)
 
     # Todo either paramaterize here or hardcode everywhere else
     # For now, lavaTool will only work if it has a whitelist, so we always pass this
@@ -523,12 +582,21 @@ def run_lavatool(bug_list, lp, host_file, project, llvm_src, filename,
         cmd.append('-competition')
     if randseed:
         cmd.append('-randseed={}'.format(randseed))
+    if apply_manifest:
+        cmd.append('-apply=' + apply_manifest)
+    if ast_cache:
+        cmd.append('-ast-cache=' + ast_cache)
+    if site_index:
+        cmd.append('-site-index=' + site_index)
     print("lavaTool command: {}".format(' '.join(cmd)))
 
     ret = run_cmd_notimeout(cmd)
     log_dir = join(project["output_dir"], "logs")
 
-    safe_fname = filename.replace("/", "_").replace(".", "-")
+    if len(filenames) == 1:
+        safe_fname = filenames[0].replace("/", "_").replace(".", "-")
+    else:
+        safe_fname = "all"
 
     with open(join(log_dir, "lavaTool-{}-stdout.log"
                    .format(safe_fname)), "w") as f:
@@ -806,65 +874,69 @@ def inject_bugs(bug_list, db, lp, host_file, project, args,
         # print('all_c_files: {}'.format(all_c_files))
         # print('all_files: {}'.format(all_files))
         all_files = all_files.union(all_c_files)
-    # try:
-        # pool = ThreadPool(max(cpu_count(), 1))
-    # except Exception as e:
-        # print("Warning: could not create ThreadPool, \
-        # running with single-thread. {}".format(e))
-        # pool = None
-
-    def modify_source(dirname):
-        return run_lavatool(bugs_to_inject, lp, host_file, project,
-                            llvm_src, dirname, knobTrigger=args.knobTrigger,
-                            dataflow=dataflow, competition=competition, randseed=lavatoolseed)
-
-    bug_solutions = {}  # Returned by lavaTool
-
-    for filename in all_files:
-        # TODO call on directories instead of each file,
-        # but still store results in bug_solutions
-        bug_solutions.update(modify_source(filename))
-
-    # TODO: Use our ThreadPool for modifying source and update bug_solutions
-    # with results instead of single-thread
-    # if pool:
-        # pool.map(modify_source, all_files)
-    clang_apply = join(llvm_src, 'Release', 'bin',
-                        'clang-apply-replacements')
-
-    src_dirs = set()
-    src_dirs.add("") # Empty path for root
-    for filename in all_files:
-        src_dir = dirname(filename)
-        if len(src_dir):
-            src_dirs.add(src_dir.encode("ascii", "ignore"))
-
-    # TODO use pool here as well
-
-    # Here we need to apply replacements. Unfortunately it can be a little complicated
-    # compile_commands.json will be in lp.bugs_build. But then it contains data like:
-        # directory: "[lp.bugs_build]/" file: src/foo.c" OR
-        # directory: "[lp.bugs_build]/src" file: foo.c"
-    # depending on how the makefile works
-
-    # In theory, we should be able to run clang-apply-replacements
-    # from the lp.bugs_build directory and it should _just work_ but that doesn't
-    # always happen. Instead, we'll run it inside each unique src directory
-
-    one_replacement_success = False
-    for src_dir in src_dirs:
-        clang_cmd = [clang_apply, '.', '-remove-change-desc-files']
-        if debugging:  # Don't remove desc files
-            clang_cmd = [clang_apply, '.']
-        print("Apply replacements in {} with {}"
-                .format(join(lp.bugs_build, src_dir), clang_cmd))
-        (rv, outp) = run_cmd_notimeout(clang_cmd, cwd=join(lp.bugs_build, src_dir))
-
-        if rv == 0:
-            print("Success in {}".format(src_dir))
-            one_replacement_success = True
-
-    assert (one_replacement_success), "clang-apply-replacements failed in all possible directories"
+
+    # lavaTool reads the bugs from here, not the database.
+    bug_manifest = join(lp.bugs_parent, 'lava-bugs.json')
+    write_bug_manifest(bugs_to_inject, db, bug_manifest)
+
+    # One lavaTool run over every file, spread over all cores, so it can
+    # tell which bugs didn't make it into any of them. With lavatool_apply,
+    # lavaTool applies its replacements itself rather than leaving .yaml
+    # files for clang-apply-replacements.
+    lavatool_apply = project.get('lavatool_apply', False)
+    bug_solutions = run_lavatool(bugs_to_inject, lp, host_file, project,
+                                 llvm_src, sorted(all_files),
+                                 knobTrigger=args.knobTrigger,
+                                 dataflow=dataflow, competition=competition,
+                                 randseed=lavatoolseed,
+                                 bug_manifest=bug_manifest,
+                                 jobs=max(cpu_count(), 1),
+                                 apply_manifest=join(lp.bugs_parent,
+                                                     'lava-replacements.json')
+                                 if lavatool_apply else None,
+                                 ast_cache=join(lp.bugs_parent, 'ast-cache'),
+                                 # Needs -apply; not supported with dataflow.
+                                 site_index=join(lp.bugs_parent,
+                                                 'lava-sites.idx')
+                                 if lavatool_apply and not dataflow else None)
+
+    if not lavatool_apply:
+        clang_apply = join(llvm_src, 'Release', 'bin',
+                            'clang-apply-replacements')
+
+        src_dirs = set()
+        src_dirs.add("") # Empty path for root
+        for filename in all_files:
+            src_dir = dirname(filename)
+            if len(src_dir):
+                src_dirs.add(src_dir.encode("ascii", "ignore"))
+
+        # TODO use pool here as well
+
+        # Here we need to apply replacements. Unfortunately it can be a little complicated
+        # compile_commands.json will be in lp.bugs_build. But then it contains data like:
+            # directory: "[lp.bugs_build]/" file: src/foo.c" OR
+            # directory: "[lp.bugs_build]/src" file: foo.c"
+        # depending on how the makefile works
+
+        # In theory, we should be able to run clang-apply-replacements
+        # from the lp.bugs_build directory and it should _just work_ but that doesn't
+        # always happen. Instead, we'll run it inside each unique src directory
+
+        one_replacement_success = False
+        for src_dir in src_dirs:
+            clang_cmd = [clang_apply, '.', '-remove-change-desc-files']
+            if debugging:  # Don't remove desc files
+                clang_cmd = [clang_apply, '.']
+            print("Apply replacements in {} with {}"
+                    .format(join(lp.bugs_build, src_dir), clang_cmd))
+            (rv, outp) = run_cmd_notimeout(clang_cmd, cwd=join(lp.bugs_build, src_dir))
+
+            if rv == 0:
+                print("Success in {}".format(src_dir))
+                one_replacement_success = True
+
+        assert (one_replacement_success), "clang-apply-replacements failed in all possible directories"
 
     # Ugh.  Lavatool very hard to get right
     # Permit automated fixups via script after bugs inject
@@ -38,6 +38,8 @@ db="$(jq -r .db $json)$db_suffix"
 extradockerargs="$(jq -r .extra_docker_args $json)"
 exitCode="$(jq -r .expected_exit_code $json)"
 dataflow="$(jq -r '.dataflow // "false"' $json)" # TODO use everywhere, stop passing as argument
+# Let lavaTool apply its own replacements (-apply) rather than clang-apply-replacements
+lavatool_apply="$(jq -r '.lavatool_apply // "false"' $json)"
 
 # List of function names to blacklist for data_flow injection, merged as fn1\|fn2\|fn3 so we can use sed
 # Or an empty string if not present
@@ -1,5 +1,5 @@
 #!/bin/bash
 
 . test_fns.sh
-echo "Project       RESET    CLEAN    ADD      MAKE     TAINT    INJECT   COMP"
+echo "Project       RESET    CLEAN    ADD      MAKE     TAINT    FBI-J    FBI-R    FBI-M    FBI-K    INJECT   COMP"
 run_tests $1
@@ -3,7 +3,7 @@
 . test_fns.sh
 
 results=./results.txt
-echo "Project       RESET    CLEAN    ADD      MAKE     TAINT    INJECT   COMP" > $results
+echo "Project       RESET    CLEAN    ADD      MAKE     TAINT    FBI-J    FBI-R    FBI-M    FBI-K    INJECT   COMP" > $results
 for project in ../target_configs/*; do
     run_tests $(basename $project) >> $results
 done
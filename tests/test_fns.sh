@@ -35,6 +35,201 @@ test_competition() {
     return 0
 }
 
+fbi_setup() {
+    # args: project, log_name
+    # Common setup for the fbi tests: sets log, hostjson, fbi, config_dir
+    # and out, a new temp dir, and lists "plog input" for each of the
+    # project's inputs in $out/plogs, read on fd 3 so that what runs in the
+    # loop can't eat it.
+    # returns 1 if any input has no pandalog
+    log="logs/$1/$2.txt"
+    hostjson="$(cd .. && pwd)/host.json"
+    fbi="../tools/install/bin/fbi"
+    config_dir="$(jq -r '.config_dir' $hostjson)/$1"
+    name="$(jq -r '.name' $config_dir/$1.json)"
+    plog_dir="$(jq -r '.output_dir' $hostjson)/$name"
+    out=$(mktemp -d)
+    db=""
+    touch $out/plogs
+    setup_rc=0
+    for input in $(jq -r '.inputs[]' $config_dir/$1.json); do
+        input_base=$(basename $input)
+        plog=$(ls $plog_dir/queries-*-$input_base.iso.plog 2>/dev/null | head -n 1)
+        if [ -z "$plog" ]; then
+            echo "No pandalog for $input" >> "$log"
+            setup_rc=1
+            continue
+        fi
+        echo "$plog $input_base" >> $out/plogs
+    done
+    return $setup_rc
+}
+
+scratch_db_setup() {
+    # args: project, suffix
+    # After fbi_setup: creates a scratch database named with suffix after the
+    # host's db_suffix, with an empty LAVA schema, and writes $out/host.json
+    # pointing at it. Sets db.
+    # returns 0 on success
+    suffix="$(jq -r '.db_suffix // ""' $hostjson)$2"
+    db="$(jq -r '.db' $config_dir/$1.json)$suffix"
+    jq ".db_suffix = \"$suffix\"" $hostjson > $out/host.json
+    dropdb --if-exists -U postgres $db &>> "$log"
+    createdb -U postgres $db &>> "$log" &&
+        psql -d $db -U postgres -f ../tools/lavaODB/generated/lava.sql &>> "$log"
+}
+
+scratch_db_empty() {
+    # Empties the scratch database's tables. Not RESTART IDENTITY: the
+    # sequences carry on, so rows get new ids.
+    psql -U postgres -d $db -c "TRUNCATE bug, duabytes, dua_viable_bytes,
+        dua, labelset, attackpoint, sourcelval" &>> "$log"
+}
+
+fbi_teardown() {
+    # Undoes fbi_setup, and scratch_db_setup if it was run.
+    if [ -n "$db" ]; then
+        dropdb --if-exists -U postgres $db &>> "$log"
+        db=""
+    fi
+    rm -rf $out
+}
+
+test_fbi_windows() {
+    # args: project, log_name, jobs
+    # Reruns fbi on each of the project's pandalogs, once serially and once
+    # split into instruction windows with --jobs, and checks that the two
+    # bug files are identical.
+    # returns 0 on success
+    rc=0
+    fbi_setup $1 $2 || rc=1
+    while read plog input_base <&3; do
+        if ! $fbi -o $out/serial.bugs $hostjson $1 $plog $input_base &>> "$log" ||
+                ! $fbi -j $3 -o $out/windows.bugs $hostjson $1 $plog $input_base &>> "$log"; then
+            rc=1
+        elif ! cmp $out/serial.bugs $out/windows.bugs >> "$log"; then
+            echo "Windowed fbi differs from serial on $plog" >> "$log"
+            rc=1
+        fi
+    done 3< $out/plogs
+    fbi_teardown
+    return $rc
+}
+
+test_fbi_range() {
+    # args: project, log_name, jobs
+    # Reruns fbi on each of the project's pandalogs with --instr-range
+    # starting a quarter of the way in, so that label sets defined before the
+    # range get used in it, once serially and once with --jobs, and checks
+    # that both finish and agree.
+    # returns 0 on success
+    plog_query="../tools/install/bin/plog_query"
+    rc=0
+    fbi_setup $1 $2 || rc=1
+    while read plog input_base <&3; do
+        instrs=$($plog_query index $plog | sed -n 's/.* instrs \([0-9]*\)\.\.\([0-9]*\)$/\1 \2/p')
+        first=${instrs% *}
+        last=${instrs#* }
+        if [ -z "$instrs" ] || [ "$last" -le "$first" ]; then
+            echo "Could not find the instrs of $plog" >> "$log"
+            rc=1
+            continue
+        fi
+        range="$((first + (last - first) / 4)):"
+        echo "--instr-range $range on $plog" >> "$log"
+        if ! $fbi --instr-range $range -o $out/serial.bugs $hostjson $1 $plog $input_base &>> "$log" ||
+                ! $fbi --instr-range $range -j $3 -o $out/windows.bugs $hostjson $1 $plog $input_base &>> "$log"; then
+            rc=1
+        elif ! cmp $out/serial.bugs $out/windows.bugs >> "$log"; then
+            echo "Windowed fbi differs from serial on $plog from $range" >> "$log"
+            rc=1
+        fi
+    done 3< $out/plogs
+    fbi_teardown
+    return $rc
+}
+
+test_fbi_magic() {
+    # args: project, log_name, jobs
+    # Runs fbi into a scratch database twice: serially, one input at a time,
+    # then with --jobs over all inputs after emptying the tables, so rows get
+    # different ids the second time. Checks that the same bugs come out with
+    # the same magic values, matched on what they are rather than their ids.
+    # returns 0 on success
+    dump="SELECT a.loc_filename, a.loc_begin_line, a.loc_begin_column,
+            a.loc_end_line, a.loc_end_column, a.type,
+            l.loc_filename, l.loc_begin_line, l.loc_begin_column,
+            l.loc_end_line, l.loc_end_column, l.ast_name, b.type, b.magic
+        FROM bug b JOIN attackpoint a ON b.atp = a.id
+            JOIN sourcelval l ON b.trigger_lval = l.id ORDER BY 1,2,3,4,5,6,7,8,9,10,11,12,13"
+    rc=0
+    fbi_setup $1 $2 || rc=1
+    if ! scratch_db_setup $1 _fbimagic; then
+        fbi_teardown
+        return 1
+    fi
+    while read plog input_base <&3; do
+        $fbi $out/host.json $1 $plog $input_base &>> "$log" || rc=1
+    done 3< $out/plogs
+    psql -At -U postgres -d $db -c "$dump" > $out/serial.txt 2>> "$log" || rc=1
+    scratch_db_empty || rc=1
+    $fbi -j $3 $out/host.json $1 $(cat $out/plogs) &>> "$log" || rc=1
+    psql -At -U postgres -d $db -c "$dump" > $out/jobs.txt 2>> "$log" || rc=1
+    if [ $rc -eq 0 ] && ! diff $out/serial.txt $out/jobs.txt >> "$log"; then
+        echo "Bugs or magic values differ between serial and -j $3 runs" >> "$log"
+        rc=1
+    fi
+    fbi_teardown
+    return $rc
+}
+
+test_fbi_top_k() {
+    # args: project, log_name, jobs, k
+    # Runs fbi into a scratch database without fbi_top_k, then with it set to
+    # k, serially one input at a time and then with --jobs over all inputs.
+    # Checks that each (attack point, type) gets min(k, its bugs without the
+    # limit): never more than k, however many times it was reached, and no
+    # fewer when a trigger in the best k is rejected and others are viable.
+    # returns 0 on success
+    # Matched on what the attack points are; ids change between runs.
+    counts="SELECT a.loc_filename, a.loc_begin_line, a.loc_begin_column,
+            a.loc_end_line, a.loc_end_column, a.type, b.type,
+            least(count(*), $4)
+        FROM bug b JOIN attackpoint a ON b.atp = a.id
+        GROUP BY 1,2,3,4,5,6,7 ORDER BY 1,2,3,4,5,6,7"
+    rc=0
+    fbi_setup $1 $2 || rc=1
+    if ! scratch_db_setup $1 _fbitopk; then
+        fbi_teardown
+        return 1
+    fi
+    mkdir -p $out/config/$1
+    jq ".fbi_top_k = $4" $config_dir/$1.json > $out/config/$1/$1.json
+    jq ".config_dir = \"$out/config\"" $out/host.json > $out/host_k.json
+    $fbi -j $3 $out/host.json $1 $(cat $out/plogs) &>> "$log" || rc=1
+    psql -At -U postgres -d $db -c "$counts" > $out/all.txt 2>> "$log" || rc=1
+    if [ ! -s $out/all.txt ]; then
+        echo "No bugs without fbi_top_k" >> "$log"
+        rc=1
+    fi
+    scratch_db_empty || rc=1
+    while read plog input_base <&3; do
+        $fbi $out/host_k.json $1 $plog $input_base &>> "$log" || rc=1
+    done 3< $out/plogs
+    psql -At -U postgres -d $db -c "$counts" > $out/serial.txt 2>> "$log" || rc=1
+    scratch_db_empty || rc=1
+    $fbi -j $3 $out/host_k.json $1 $(cat $out/plogs) &>> "$log" || rc=1
+    psql -At -U postgres -d $db -c "$counts" > $out/jobs.txt 2>> "$log" || rc=1
+    for pass in serial jobs; do
+        if ! diff $out/all.txt $out/$pass.txt >> "$log"; then
+            echo "$pass: bugs per (atp, type) differ from min($4, all)" >> "$log"
+            rc=1
+        fi
+    done
+    fbi_teardown
+    return $rc
+}
+
 pass() {
     out="PASS"
     printf '%s %*.*s' $out 0 $((padlength - ${#out})) "$pad"
@@ -68,6 +263,14 @@ run_tests() {
     pass &&
     run_test $project "05_taint" "--taint --curtail 1000 -k" &&
     pass &&
+    test_fbi_windows $project "05_fbi_windows" 4 &&
+    pass &&
+    test_fbi_range $project "05_fbi_range" 4 &&
+    pass &&
+    test_fbi_magic $project "05_fbi_magic" 4 &&
+    pass &&
+    test_fbi_top_k $project "05_fbi_top_k" 4 2 &&
+    pass &&
     run_test $project "06_inject" "--inject 3 -k" &&
     pass &&
     test_competition $project "07_comp" "-m 100" &&
@@ -0,0 +1,73 @@
+/*
+  Bulk-load bug files written by fbi --bug-file into the database.
+
+  ./fbi_load host.json ProjectName bugfile [bugfile ...]
+
+  SourceLvals and AttackPoints are matched against what's already in the
+  database (their uniqueness doesn't depend on the input file); everything
+  else is new by construction. Bugs that already exist for the same
+  (type, atp, trigger lval) are dropped, as fbi itself would have done, and
+  so are bugs past the project's fbi_top_k at an (atp, type).
+*/
+
+#include <jsoncpp/json/json.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "pgarray.hxx"
+#include "lava.hxx"
+#include "lava-odb.hxx"
+#include "lava_version.h"
+#include "batch_persist.hxx"
+#include "bug_merge.hxx"
+#include <odb/pgsql/database.hxx>
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        printf("FBI bug file loader -- Version %s\n", LAVA_VER);
+        printf("usage: fbi_load host.json ProjectName bugfile [bugfile ...]\n");
+        printf("    bugfile: Written by fbi --bug-file\n");
+        exit(1);
+    }
+
+    std::ifstream host_json(argv[1]);
+    Json::Value host;
+    host_json >> host;
+
+    std::string name = argv[2];
+    std::string project_json_path = host["config_dir"].asString() + "/" + name +"/"+name+".json";
+    std::ifstream project_json(project_json_path.c_str());
+    Json::Value project;
+    project_json >> project;
+
+    uint32_t batch_size = project.get("fbi_batch_size", 10000).asUInt();
+    uint32_t flush_seconds = project.get("fbi_flush_seconds", 30).asUInt();
+    uint32_t top_k = project.get("fbi_top_k", 0).asUInt();
+
+    std::string db_name = project["db"].asString() + host.get("db_suffix", "").asString();
+    odb::pgsql::database db("postgres", "postgrespostgres", db_name);
+    BatchPersister persister(db, batch_size, std::chrono::seconds(flush_seconds));
+
+    BugFileMerger merger(persister, &db, top_k);
+    for (int i = 3; i < argc; i++) {
+        uint64_t bugs_before = merger.num_bugs;
+        uint64_t duplicates_before = merger.num_duplicate_bugs;
+        uint64_t over_top_k_before = merger.num_over_top_k_bugs;
+        merger.merge(argv[i]);
+        std::cout << argv[i] << ": "
+            << merger.num_bugs - bugs_before << " bugs loaded, "
+            << merger.num_duplicate_bugs - duplicates_before
+            << " duplicate bugs skipped, "
+            << merger.num_over_top_k_bugs - over_top_k_before
+            << " over fbi_top_k\n";
+    }
+    persister.finish();
+
+    std::cout << merger.num_duas << " duas, " << merger.num_bugs
+        << " bugs loaded in total\n";
+    return 0;
+}
@@ -0,0 +1,268 @@
+#ifndef __FBI_STATS_H
+#define __FBI_STATS_H
+
+extern "C" {
+#include <sys/resource.h>
+#include <unistd.h>
+}
+
+#include <jsoncpp/json/json.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Where fbi's time and memory go: counts of each kind of entry, time spent
+// in each handler and in the database, histograms of the sizes that drive
+// that time, and RSS over the run. Written out as JSON with --stats FILE and
+// summarized in a live progress line with --progress.
+//
+// Recording is cheap enough to leave on: a timer is two steady_clock reads
+// and two adds, and nothing is timed more finely than once per pandalog
+// entry or database operation. Timers nest (a taint query's time includes
+// the bugs it records), so they don't add up to the total.
+class FbiStats {
+public:
+    enum Counter {
+        ENTRIES,
+        TAINT_QUERIES,
+        TAINTED_BRANCHES,
+        ATTACK_POINTS,
+        OTHER_ENTRIES,
+        LABEL_SETS,
+        DUA_CANDIDATES,
+        REAL_DUAS,
+        FAKE_DUAS,
+        // Triggers considered at attack points, and how many became bugs.
+        BUG_CANDIDATES,
+        BUGS,
+        NUM_COUNTERS
+    };
+
+    enum Timer {
+        // Waiting on the reader thread for decoded entries.
+        DECODE_WAIT,
+        // Handlers, per entry.
+        TAINT_QUERY,
+        TAINTED_BRANCH,
+        ATTACK_POINT,
+        // Within those.
+        LIVENESS,
+        RECORD_BUGS,
+        // Lookups in the database, flushes of batched writes to it (or the
+        // bug file), and checkpoints.
+        DB_QUERY,
+        FLUSH,
+        CHECKPOINT,
+        // Windowed runs: digesting a window in a worker, replaying it here.
+        DIGEST,
+        REPLAY,
+        // Reading the label sets defined before --instr-range.
+        LABEL_SET_SCAN,
+        NUM_TIMERS
+    };
+
+    enum Histogram {
+        // Labels in each label set defined.
+        LABEL_SET_SIZE,
+        // Labels in the union on a tainted branch.
+        BRANCH_LABELS,
+        // Viable duas at each attack point, which is what it costs.
+        DUAS_AT_ATTACK_POINT,
+        // Bugs recorded at each attack point.
+        BUGS_AT_ATTACK_POINT,
+        NUM_HISTOGRAMS
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    // Times the enclosing scope.
+    class Scope {
+    public:
+        Scope(FbiStats &stats, Timer timer)
+            : stats(stats), timer(timer), start(Clock::now()) {}
+        ~Scope() { stats.add_time(timer, Clock::now() - start); }
+
+    private:
+        FbiStats &stats;
+        Timer timer;
+        Clock::time_point start;
+    };
+
+    FbiStats() : start(Clock::now()), last_sample(start) {}
+
+    void count(Counter c, uint64_t n = 1) { counters[c] += n; }
+    uint64_t get(Counter c) const { return counters[c]; }
+
+    void add_time(Timer t, Clock::duration d) {
+        timers[t].calls++;
+        timers[t].ns += std::chrono::duration_cast<
+            std::chrono::nanoseconds>(d).count();
+    }
+
+    // Histograms bucket values by bit length: bucket 0 is 0, bucket i holds
+    // [2^(i-1), 2^i).
+    void record(Histogram h, uint64_t value) {
+        HistogramData &data = histograms[h];
+        data.buckets[value ? 64 - __builtin_clzll(value) : 0]++;
+        data.count++;
+        data.sum += value;
+        if (value > data.max) data.max = value;
+    }
+
+    // Called every so often from the main loop. At most once a second,
+    // samples RSS and, with --progress, updates the progress line.
+    void tick() {
+        Clock::time_point now = Clock::now();
+        if (now - last_sample < std::chrono::seconds(1)) return;
+        last_sample = now;
+        rss_samples.push_back(RssSample{seconds_since_start(now),
+                counters[ENTRIES], current_rss_kb()});
+        if (progress) {
+            double secs = seconds_since_start(now);
+            fprintf(stderr, "\r%lu entries (%.0f/s), %lu duas, %lu bugs, "
+                    "%lu MB    ", counters[ENTRIES],
+                    secs > 0 ? counters[ENTRIES] / secs : 0.0,
+                    counters[REAL_DUAS], counters[BUGS],
+                    rss_samples.back().rss_kb / 1024);
+        }
+    }
+
+    // Stats files written by worker processes, to include in this report.
+    void add_worker(const std::string &path) {
+        std::ifstream in(path);
+        Json::Value worker;
+        if (in >> worker) workers.append(worker);
+    }
+
+    Json::Value report() const {
+        Json::Value root;
+        Clock::time_point now = Clock::now();
+        root["wall_seconds"] = seconds_since_start(now);
+        struct rusage self, children;
+        getrusage(RUSAGE_SELF, &self);
+        getrusage(RUSAGE_CHILDREN, &children);
+        root["cpu_user_seconds"] = seconds(self.ru_utime);
+        root["cpu_system_seconds"] = seconds(self.ru_stime);
+        root["peak_rss_kb"] = (Json::UInt64)self.ru_maxrss;
+        root["children_peak_rss_kb"] = (Json::UInt64)children.ru_maxrss;
+
+        Json::Value &counter_json = root["counters"];
+        for (int c = 0; c < NUM_COUNTERS; c++) {
+            counter_json[counter_names[c]] = (Json::UInt64)counters[c];
+        }
+
+        Json::Value &timer_json = root["timers"];
+        for (int t = 0; t < NUM_TIMERS; t++) {
+            Json::Value &timer = timer_json[timer_names[t]];
+            timer["calls"] = (Json::UInt64)timers[t].calls;
+            timer["ns"] = (Json::UInt64)timers[t].ns;
+            timer["mean_ns"] = timers[t].calls
+                ? (double)timers[t].ns / timers[t].calls : 0.0;
+        }
+
+        Json::Value &histogram_json = root["histograms"];
+        for (int h = 0; h < NUM_HISTOGRAMS; h++) {
+            const HistogramData &data = histograms[h];
+            Json::Value &histogram = histogram_json[histogram_names[h]];
+            histogram["count"] = (Json::UInt64)data.count;
+            histogram["sum"] = (Json::UInt64)data.sum;
+            histogram["max"] = (Json::UInt64)data.max;
+            Json::Value &buckets = histogram["log2_buckets"];
+            buckets = Json::Value(Json::arrayValue);
+            int last = 64;
+            while (last > 0 && data.buckets[last] == 0) last--;
+            for (int i = 0; i <= last; i++) {
+                buckets.append((Json::UInt64)data.buckets[i]);
+            }
+        }
+
+        // [seconds, entries, rss_kb]
+        Json::Value &samples = root["rss_samples"];
+        samples = Json::Value(Json::arrayValue);
+        for (const RssSample &s : rss_samples) {
+            Json::Value sample(Json::arrayValue);
+            sample.append(s.seconds);
+            sample.append((Json::UInt64)s.entries);
+            sample.append((Json::UInt64)s.rss_kb);
+            samples.append(sample);
+        }
+
+        if (!workers.empty()) root["workers"] = workers;
+        return root;
+    }
+
+    void write(const std::string &path) const {
+        std::ofstream out(path);
+        out << report();
+        if (!out) throw std::runtime_error("Could not write " + path);
+    }
+
+    bool progress = false;
+
+private:
+    struct TimerData {
+        uint64_t calls = 0;
+        uint64_t ns = 0;
+    };
+
+    struct HistogramData {
+        uint64_t buckets[65] = {0};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+    };
+
+    struct RssSample {
+        double seconds;
+        uint64_t entries;
+        uint64_t rss_kb;
+    };
+
+    const char *counter_names[NUM_COUNTERS] = {
+        "entries", "taint_queries", "tainted_branches", "attack_points",
+        "other_entries", "label_sets", "dua_candidates", "real_duas",
+        "fake_duas", "bug_candidates", "bugs"
+    };
+    const char *timer_names[NUM_TIMERS] = {
+        "decode_wait", "taint_query", "tainted_branch", "attack_point",
+        "liveness", "record_bugs", "db_query", "flush", "checkpoint",
+        "digest", "replay", "label_set_scan"
+    };
+    const char *histogram_names[NUM_HISTOGRAMS] = {
+        "label_set_size", "branch_labels", "duas_at_attack_point",
+        "bugs_at_attack_point"
+    };
+
+    uint64_t counters[NUM_COUNTERS] = {0};
+    TimerData timers[NUM_TIMERS];
+    HistogramData histograms[NUM_HISTOGRAMS];
+    std::vector<RssSample> rss_samples;
+    Json::Value workers;
+
+    Clock::time_point start, last_sample;
+
+    double seconds_since_start(Clock::time_point now) const {
+        return std::chrono::duration<double>(now - start).count();
+    }
+
+    static double seconds(const struct timeval &tv) {
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    // Resident set size now, from /proc.
+    static uint64_t current_rss_kb() {
+        FILE *f = fopen("/proc/self/statm", "r");
+        if (!f) return 0;
+        unsigned long size = 0, resident = 0;
+        int n = fscanf(f, "%lu %lu", &size, &resident);
+        fclose(f);
+        return n == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+    }
+};
+
+#endif
@@ -3,6 +3,21 @@
 
   ./fbi pandalog lavadb ml mtcn mc minl maxl maxlval inputfilename
 
+  ./fbi --bug-file out.bugs ... writes everything to a columnar bug file
+  instead of the database; fbi_load imports it later.
+
+  ./fbi --checkpoint fbi.ckpt ... saves its state every so often; running the
+  same command again after a crash or a curtail resumes from there.
+
+  ./fbi --instr-range LO:HI ... only analyzes that part of the pandalog;
+  plog_query shows what's where.
+
+  ./fbi --stats fbi-stats.json --progress ... reports where the time and
+  memory went, as JSON at exit and in a progress line as it goes.
+
+  ./fbi -j 8 ... with a single pandalog decodes it in 8 windows at once,
+  then replays them in order; see digest_window.
+
   ml = 0.5 means max liveness of any byte on extent is 0.5
   mtcn = 10 means max taint compute number of any byte on extent is 10
   mc =4 means max card of a taint labelset on any byte on extent is 4
@@ -17,7 +32,9 @@
 extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "panda/plog.h"
 #include "panda/plog-cc-bridge.h"
@@ -29,12 +46,14 @@ extern "C" {
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <vector>
 #include <sstream>
 #include <algorithm>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cassert>
@@ -43,7 +62,19 @@ extern "C" {
 #include "pgarray.hxx"
 #include "lava.hxx"
 #include "lava-odb.hxx"
+#include "lava_rng.hxx"
+#include "label_ops.hxx"
+#include "label_bitmap.hxx"
 #include "spit.hxx"
+#include "persister.hxx"
+#include "batch_persist.hxx"
+#include "bug_file.hxx"
+#include "bug_merge.hxx"
+#include "plog_prefetch.h"
+#include "plog_index.h"
+#include "fbi_stats.h"
+#include "flat_containers.h"
+#include "snapshot.h"
 #include "lava_version.h"
 #include <odb/pgsql/database.hxx>
 #include <odb/session.hxx>
@@ -59,7 +90,13 @@ extern "C" {
 
 std::string inputfile;
 // Map LavaDB string indices to actual strings.
-std::vector<std::string> ind2str;
+std::unique_ptr<LavaDB> lavadb;
+
+// The string with LavaDB index id, or "" if there isn't one.
+std::string ind2str(uint32_t id) {
+    const char *s = lavadb->str(id);
+    return s ? s : "";
+}
 
 uint64_t num_real_duas = 0;
 uint64_t num_fake_duas = 0;
@@ -68,7 +105,15 @@ uint64_t num_bugs_added_to_db = 0;
 uint64_t num_bugs_of_type[Bug::TYPE_END] = {0};
 
 using namespace odb::core;
+// Null when writing to a bug file instead of the database.
 std::unique_ptr<odb::pgsql::database> db;
+// All persistence goes through here: either rows written behind in batches to
+// the database or a bug file.
+std::unique_ptr<Persister> persister;
+
+// Counters and timers for --stats and --progress.
+FbiStats stats;
+std::string stats_path;
 
 bool debug = true;
 #define dprintf(...) if (debug) { printf(__VA_ARGS__); fflush(stdout); }
@@ -79,34 +124,79 @@ uint32_t max_tcn = 0;
 uint32_t max_lval = 0;
 bool chaff_bugs = false;
 uint32_t curtail = 0;
+// Only entries with instr_lo <= instr < instr_hi are analyzed (--instr-range).
+uint64_t instr_lo = 0;
+uint64_t instr_hi = UINT64_MAX;
+// Seed for decimation, extra dua choice and magic values (--seed). Each
+// choice draws from a stream keyed on the atp and lval it concerns rather
+// than from one global sequence, so it doesn't depend on what came before.
+uint64_t rng_seed = LAVA_RNG_SEED;
+
+// Ranking of bug candidates (project JSON fbi_top_k, fbi_score_weights). With
+// top_k > 0, at most top_k bugs are recorded at each (atp, type), however
+// often it is reached: the best-scoring triggers of each visit, until the
+// quota is used up. 0 records them all. See score_trigger.
+uint32_t top_k = 0;
+struct ScoreWeights {
+    double liveness = 1.0;
+    double tcn = 1.0;
+    double distance = 1.0;
+    double diversity = 1.0;
+};
+ScoreWeights score_weights;
 
 uint32_t num_potential_bugs = 0;
 uint32_t num_potential_nonbugs = 0;
 
 // These map pointer values in the PANDA taint run to the sets they refer to.
 typedef uint64_t Ptr;
-std::map<Ptr, const LabelSet*> ptr_to_labelset;
+PtrHashMap<const LabelSet*> ptr_to_labelset;
 
 // Liveness for each input byte.
 std::vector<uint64_t> liveness;
 
-// Map from source lval ID to most recent DUA incarnation.
-std::map<unsigned long, const Dua*> recent_dead_duas;
+// Map from source lval ID to most recent DUA incarnation. Iterates in
+// lval ID order.
+SortedVecMap<unsigned long, const Dua*> recent_dead_duas;
 
 bool less_by_instr(const Dua *a, const Dua *b) {
     return a->instr < b->instr;
 }
-// List of recent duas sorted by dua->instr. Invariant should hold that:
-// set(recent_dead_duas.values()) == set(recent_duas_by_instr).
+// List of recent duas sorted by dua->instr. Duas dropped from
+// recent_dead_duas stay here, marked retired, until compact_recent_duas().
+// After that, set(recent_dead_duas.values()) == set(recent_duas_by_instr).
 std::vector<const Dua *> recent_duas_by_instr;
+uint64_t num_retired_by_instr = 0;
+
+// Viability of each dua we've put in recent_dead_duas, kept up to date
+// incrementally. A dua is viable while it has a run of
+// LAVA_MAGIC_VALUE_SIZE consecutive bytes that are tainted and whose labels
+// are all within max_liveness. Liveness only grows, so a byte can only go
+// from viable to not, and only when one of its labels first crosses
+// max_liveness. That's the only time a dua needs to be looked at again.
+struct DuaViability {
+    const Dua *dua;
+    // Whether each byte is still viable.
+    std::vector<uint8_t> byte_viable;
+    // Number of runs of LAVA_MAGIC_VALUE_SIZE viable bytes, counted by the
+    // position they end at. The dua is viable iff this is nonzero.
+    uint32_t viable_runs;
+    // True once the dua has left recent_dead_duas.
+    bool retired;
+};
+std::vector<DuaViability> dua_viability;
+// Dua pointer -> index into dua_viability.
+PtrHashMap<uint32_t> dua_viability_index;
 
-// Map from label to duas that are tainted by that label.
-// So when we update liveness, we know what duas might be invalidated.
-std::map<uint32_t, std::set<const Dua *> > dua_dependencies;
+// Map from label to duas (indices into dua_viability) that are tainted by
+// that label and so might be invalidated when it crosses max_liveness.
+// Labels already past max_liveness have no entries. Sized along with
+// liveness.
+LabelIndex<uint32_t> dua_dependencies;
 
 // Returns true with probability 1/ratio.
-inline bool decimate(double ratio) {
-    return rand() * ratio < RAND_MAX;
+inline bool decimate(double ratio, LavaRng &rng) {
+    return rng.uniform() * ratio < 1.0;
 }
 
 // This will make bugs less likely to be injected if there are more of that
@@ -124,9 +214,11 @@ inline double decimation_ratio(Bug::Type bug_type, uint64_t potential) {
     return diff < 10000 ? 1.0 : 1.0 + (diff - 10000) * 0.2;
 }
 
-// Returns true if we should inject bug.
-inline bool decimate_by_type(Bug::Type bug_type) {
-    return decimate(decimation_ratio(bug_type, 1));
+// Returns true if we should inject bug of bug_type at atp with lval.
+inline bool decimate_by_type(Bug::Type bug_type, const AttackPoint *atp,
+        const SourceLval *lval) {
+    LavaRng rng(rng_seed, atp->rng_key(), lval->rng_key(), bug_type);
+    return decimate(decimation_ratio(bug_type, 1), rng);
 }
 
 // Templated query to ensure uniqueness across runs.
@@ -177,17 +269,25 @@ struct eq_query<AttackPoint> {
     }
 };
 
+// Every object of type T created (or looked up) so far. Checkpoints save
+// and restore these.
+template<class T>
+static std::set<T> &existing_objects() {
+    static std::set<T> existing;
+    return existing;
+}
+
 // Returns a pointer to object and true if we just created it
 // (false if it existed already).
 template<class T, typename U = typename eq_query<T>::disabled>
 static std::pair<const U*, bool> create_full(T no_id) {
-    static std::set<U> existing;
+    std::set<U> &existing = existing_objects<U>();
 
     bool new_object = false;
     auto it = existing.lower_bound(no_id);
     // it now guaranteed to be >= no_id. make sure not ==.
     if (it == existing.end() || no_id < *it) {
-        db->persist(no_id);
+        persister->persist(no_id);
         it = existing.insert(it, no_id);
         new_object = true;
     }
@@ -196,12 +296,20 @@ static std::pair<const U*, bool> create_full(T no_id) {
 
 template<class T, typename P = typename eq_query<T>::Params>
 static std::pair<const T*, bool> create_full(T no_id) {
-    static std::set<T> existing;
+    std::set<T> &existing = existing_objects<T>();
 
     bool new_object = false;
     auto it = existing.lower_bound(no_id);
     // see note above.
     if (it == existing.end() || no_id < *it) {
+        // Without a database there is nothing to look up; only this run's
+        // objects (in existing) can be duplicates.
+        if (!db) {
+            persister->persist(no_id);
+            it = existing.insert(it, no_id);
+            return std::make_pair(&*it, true);
+        }
+
         P *param;
         odb::prepared_query<T> pq(db->lookup_query<T>(eq_query<T>::name, param));
         if (!pq) {
@@ -212,9 +320,13 @@ static std::pair<const T*, bool> create_full(T no_id) {
         }
         *param = P(no_id);
 
-        const T *result = pq.execute_one();
+        const T *result;
+        {
+            FbiStats::Scope timer(stats, FbiStats::DB_QUERY);
+            result = pq.execute_one();
+        }
         if (!result) {
-            db->persist(no_id);
+            persister->persist(no_id);
             result = &no_id;
             new_object = true;
         }
@@ -229,63 +341,68 @@ static const T* create(T no_id) {
     return create_full(no_id).first;
 }
 
-std::vector<std::string> LoadIDB(std::string fn) {
-    std::string sfn = std::string(fn);
-    std::map<std::string,uint32_t> x = LoadDB(sfn);
-    return InvertDB(x);
-}
-
-void update_unique_taint_sets(const Panda__TaintQueryUniqueLabelSet *tquls) {
-    if (debug) {
-        printf("UNIQUE TAINT SET\n");
-        spit_tquls(tquls);
-        printf("\n");
-    }
-    // maintain mapping from ptr (uint64_t) to actual set of taint labels
-    Ptr p = tquls->ptr;
-    auto it = ptr_to_labelset.lower_bound(p);
-    if (it == ptr_to_labelset.end() || p < it->first) {
+// Record the labels of the set at pointer p, the first time we see it.
+void define_label_set(Ptr p, const uint32_t *label, size_t n_label) {
+    if (!ptr_to_labelset.find(p)) {
         const LabelSet *ls = create(LabelSet{0, p, inputfile,
-                std::vector<uint32_t>(tquls->label,
-                        tquls->label + tquls->n_label)});
-        ptr_to_labelset.insert(it, std::make_pair(p, ls));
+                std::vector<uint32_t>(label, label + n_label)});
+        ptr_to_labelset.insert(p, ls);
+        stats.count(FbiStats::LABEL_SETS);
+        stats.record(FbiStats::LABEL_SET_SIZE, n_label);
 
         auto &labels = ls->labels;
         uint32_t max_label = *std::max_element(
                 labels.begin(), labels.end());
         if (liveness.size() <= max_label) {
             liveness.resize(max_label + 1, 0);
+            dua_dependencies.resize(max_label + 1);
         }
     }
     dprintf("%lu unique taint sets\n", ptr_to_labelset.size());
 }
 
+void update_unique_taint_sets(const Panda__TaintQueryUniqueLabelSet *tquls) {
+    if (debug) {
+        printf("UNIQUE TAINT SET\n");
+        spit_tquls(tquls);
+        printf("\n");
+    }
+    // maintain mapping from ptr (uint64_t) to actual set of taint labels
+    define_label_set(tquls->ptr, tquls->label, tquls->n_label);
+}
+
 bool is_header_file(std::string filename) {
     uint32_t l = filename.length();
     return (filename[l-2] == '.' && filename[l-1] == 'h');
 }
 
 // Check if sets are disjoint.
-template<class InputIt1, class InputIt2>
-inline bool disjoint(InputIt1 first1, InputIt1 last1,
-        InputIt2 first2, InputIt2 last2) {
-    while (first1 != last1 && first2 != last2) {
-        if (*first1 < *first2) ++first1;
-        else if (*first2 < *first1) ++first2;
-        else return false; // *first1 == *first2
-    }
-    return true;
-}
-
 template<class T1, class T2>
 inline bool disjoint(const T1 &range1, const T2 &range2) {
-    return disjoint(range1.begin(), range1.end(), range2.begin(), range2.end());
+    // Only ever used on label arrays, so use the vectorized test.
+    return labels_disjoint(range1.data(), range1.size(),
+            range2.data(), range2.size());
 }
 
 inline bool disjoint(const DuaBytes *db1, const DuaBytes *db2) {
     return disjoint(db1->all_labels, db2->all_labels);
 }
 
+DuaBytes::DuaBytes(const Dua *dua, Range selected)
+        : dua(dua), selected(selected) {
+    assert(selected.low <= selected.high);
+    assert(selected.high <= dua->viable_bytes.size());
+    const auto &viable_bytes = dua->viable_bytes;
+    auto it = viable_bytes.cbegin() + selected.low;
+    auto end = viable_bytes.cbegin() + selected.high;
+    LabelBitmap labels;
+    for (; it != end; it++) {
+        const LabelSet *ls = *it;
+        labels.add(ls->labels);
+    }
+    all_labels = LabelVec(labels.to_vector());
+}
+
 template<class T>
 uint32_t count_nonzero(std::vector<T> arr) {
     uint32_t count = 0;
@@ -293,10 +410,10 @@ uint32_t count_nonzero(std::vector<T> arr) {
     return count;
 }
 
-// get first 4-or-larger dead range. to_avoid is a sorted vector of labels that
-// can't be used
+// get first 4-or-larger dead range. to_avoid is the set of labels that can't
+// be used
 inline Range get_dead_range(const std::vector<const LabelSet *> viable_bytes,
-        const std::vector<uint32_t> &to_avoid) {
+        const LabelBitmap &to_avoid) {
     Range current_run{0, 0};
 
     // NB: we have already checked dua for viability wrt tcn & card at induction
@@ -305,7 +422,7 @@ inline Range get_dead_range(const std::vector<const LabelSet *> viable_bytes,
         bool byte_viable = true;
         const LabelSet *ls = viable_bytes[i];
         if (ls) {
-            if (!disjoint(ls->labels, to_avoid)) {
+            if (to_avoid.intersects(ls->labels)) {
                 byte_viable = false;
             } else {
                 for (auto l : ls->labels) {
@@ -337,7 +454,7 @@ inline Range get_dead_range(const std::vector<const LabelSet *> viable_bytes,
     return current_run;
 }
 
-inline Range get_dua_dead_range(const Dua *dua, const std::vector<uint32_t> &to_avoid) {
+inline Range get_dua_dead_range(const Dua *dua, const LabelBitmap &to_avoid) {
     const auto &viable_bytes = dua->viable_bytes;
     dprintf("checking viability of dua: currently %u viable bytes\n",
             count_nonzero(viable_bytes));
@@ -387,16 +504,320 @@ inline Range get_dua_exploit_pad(const Dua *dua) {
     return largest_run;
 }
 
-// determine if this dua is viable at all.
-inline bool is_dua_dead(const Dua *dua) {
-    return get_dua_dead_range(dua, {}).size() == LAVA_MAGIC_VALUE_SIZE;
+inline DuaViability &viability_of(const Dua *dua) {
+    return dua_viability[dua_viability_index.at((uintptr_t)dua)];
+}
+
+// Start tracking viability for a dua about to go into recent_dead_duas.
+// Returns false if it isn't viable to begin with.
+bool track_dua(const Dua *dua) {
+    uint32_t index = dua_viability.size();
+    dua_viability.push_back(DuaViability{dua, {}, 0, false});
+    dua_viability_index.insert((uintptr_t)dua, index);
+    DuaViability &v = dua_viability.back();
+
+    // Fake duas aren't subject to liveness.
+    if (dua->fake_dua) {
+        v.viable_runs = 1;
+        return true;
+    }
+    if (dua->lval->ast_name.find("nodua") != std::string::npos) {
+        return false;
+    }
+
+    uint32_t run = 0;
+    for (const LabelSet *ls : dua->viable_bytes) {
+        bool viable = ls != nullptr;
+        if (ls) {
+            for (uint32_t l : ls->labels) {
+                if (liveness[l] > max_liveness) {
+                    viable = false;
+                    break;
+                }
+            }
+        }
+        v.byte_viable.push_back(viable);
+        run = viable ? run + 1 : 0;
+        if (run >= LAVA_MAGIC_VALUE_SIZE) v.viable_runs++;
+    }
+    if (v.viable_runs == 0) return false;
+
+    for (uint32_t l : dua->all_labels) {
+        if (liveness[l] <= max_liveness) dua_dependencies.insert(l, index);
+    }
+    return true;
+}
+
+// Mark byte i of a dua non-viable and drop the runs that went through it.
+inline void kill_dua_byte(DuaViability &v, size_t i) {
+    const size_t n = v.byte_viable.size();
+    const size_t w = LAVA_MAGIC_VALUE_SIZE;
+    for (size_t end = std::max(i, w - 1); end < std::min(n, i + w); end++) {
+        bool whole_run = true;
+        for (size_t j = end + 1 - w; j <= end; j++) {
+            whole_run = whole_run && v.byte_viable[j];
+        }
+        if (whole_run) v.viable_runs--;
+    }
+    v.byte_viable[i] = 0;
+}
+
+// Mark a dua as no longer in recent_dead_duas. It is left in
+// recent_duas_by_instr, since finding it there is linear; see
+// compact_recent_duas().
+inline void retire_dua(DuaViability &v) {
+    assert(!v.retired);
+    v.retired = true;
+    num_retired_by_instr++;
+}
+
+// Drop retired duas from recent_duas_by_instr, in one pass.
+void compact_recent_duas() {
+    if (num_retired_by_instr == 0) return;
+    recent_duas_by_instr.erase(
+            std::remove_if(recent_duas_by_instr.begin(),
+                recent_duas_by_instr.end(),
+                [](const Dua *dua) { return viability_of(dua).retired; }),
+            recent_duas_by_instr.end());
+    num_retired_by_instr = 0;
+    // set(recent_dead_duas.values()) == set(recent_duas_by_instr).
+    assert(recent_dead_duas.size() == recent_duas_by_instr.size());
+}
+
+// Called exactly once per label, when its liveness first exceeds
+// max_liveness. Invalidates the duas that no longer have a viable run.
+void label_crossed_max_liveness(uint32_t l) {
+    const auto &depends = dua_dependencies[l];
+    dprintf("label %u crossed max liveness; checking %u duas\n", l,
+            (uint32_t)depends.size());
+    for (uint32_t index : depends) {
+        DuaViability &v = dua_viability[index];
+        if (v.retired) continue;
+        const Dua *dua = v.dua;
+        for (size_t i = 0; i < v.byte_viable.size(); i++) {
+            if (!v.byte_viable[i]) continue;
+            const auto &labels = dua->viable_bytes[i]->labels;
+            if (std::find(labels.begin(), labels.end(), l) != labels.end()) {
+                kill_dua_byte(v, i);
+            }
+        }
+        if (v.viable_runs == 0) {
+            dprintf("%s\n ** DUA not viable\n", std::string(*dua).c_str());
+            recent_dead_duas.erase(dua->lval->id);
+            retire_dua(v);
+        }
+    }
+    // Nothing can depend on l crossing again.
+    dua_dependencies.clear(l);
+}
+
+// A byte of a taint query, as dua_candidate sees it.
+struct QueriedByte {
+    uint32_t offset;
+    uint32_t tcn;
+    Ptr ptr;
+};
+
+// What a taint query says about a possible dua before liveness comes into
+// it. That only depends on the query and the label sets it names, so
+// windowed runs (see digest_window) can work it out in parallel.
+struct DuaCandidate {
+    uint64_t instr;
+    uint32_t len;
+    uint32_t ast_loc_id;
+    std::string astnodename;
+    // Label set of each byte that is ok to use, or 0.
+    std::vector<Ptr> viable_ptrs;
+    std::vector<uint32_t> byte_tcn;
+    // Union of the labels on viable bytes.
+    std::vector<uint32_t> all_labels;
+    uint32_t max_tcn;
+    uint32_t max_card;
+};
+
+// Fills in c's bytes from the queried bytes, with resolve(ptr) giving the
+// labels of a set. Returns false if c can't be a dua however dead its labels
+// turn out to be.
+template<typename Resolve>
+bool dua_candidate(DuaCandidate &c, uint32_t num_tainted,
+        const QueriedByte *bytes, size_t n, Resolve resolve) {
+    // if lval is 12 bytes, these vectors will have 12 elements
+    // viable_ptrs[i] is 0 if it is NOT viable
+    // otherwise it is a ptr to a taint set.
+    c.viable_ptrs.assign(c.len, 0);
+    c.byte_tcn.assign(c.len, 0);
+    c.all_labels.clear();
+    c.max_tcn = c.max_card = 0;
+    // optimization. don't need to check each byte if we don't have enough.
+    if (num_tainted < LAVA_MAGIC_VALUE_SIZE) return false;
+
+    // collects set of labels on all viable bytes
+    LabelBitmap all_labels;
+    uint32_t num_viable_bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        const QueriedByte &b = bytes[i];
+        if (b.offset >= c.len) continue;
+        dprintf("considering offset = %d\n", b.offset);
+        const auto &labels = *resolve(b.ptr);
+
+        c.byte_tcn[b.offset] = b.tcn;
+
+        // flag for tracking *why* we discarded a byte
+        // check tcn and cardinality of taint set first
+        uint32_t current_byte_not_ok = 0;
+        current_byte_not_ok |= (b.tcn > max_tcn) << CBNO_TCN_BIT;
+        current_byte_not_ok |= (labels.size() > max_card) << CBNO_CRD_BIT;
+        if (current_byte_not_ok && debug) {
+            // discard this byte
+            dprintf("discarding byte -- here's why: %x\n", current_byte_not_ok);
+            if (debug && current_byte_not_ok) {
+                if (1<<CBNO_TCN_BIT) printf("** tcn too high\n");
+                if (1<<CBNO_CRD_BIT) printf("** card too high\n");
+            }
+        } else {
+            dprintf("retaining byte\n");
+            // this byte is ok to retain.
+            // keep track of highest tcn, liveness, and card for any viable byte for this lval
+            c.max_tcn = std::max(b.tcn, c.max_tcn);
+            c.max_card = std::max((uint32_t) labels.size(), c.max_card);
+
+            all_labels.add(labels);
+
+            dprintf("keeping byte @ offset %d\n", b.offset);
+            // add this byte to the list of ok bytes
+            c.viable_ptrs[b.offset] = b.ptr;
+            num_viable_bytes++;
+        }
+    }
+    dprintf("%u viable bytes in lval\n", num_viable_bytes);
+    c.all_labels = all_labels.to_vector();
+
+    // NB: Duas with <4 taint labels cannot possibly work. Nor can ones
+    // without a run of LAVA_MAGIC_VALUE_SIZE viable bytes, which is all
+    // get_dead_range asks for besides liveness.
+    if (num_viable_bytes < LAVA_MAGIC_VALUE_SIZE
+            || c.all_labels.size() < LAVA_MAGIC_VALUE_SIZE) {
+        return false;
+    }
+    uint32_t run = 0;
+    for (Ptr p : c.viable_ptrs) {
+        run = p ? run + 1 : 0;
+        if (run >= LAVA_MAGIC_VALUE_SIZE) return true;
+    }
+    return false;
+}
+
+// Label sets of the viable bytes of a candidate.
+std::vector<const LabelSet *> viable_label_sets(const DuaCandidate &c) {
+    std::vector<const LabelSet *> viable_byte(c.viable_ptrs.size(), nullptr);
+    for (size_t i = 0; i < c.viable_ptrs.size(); i++) {
+        if (c.viable_ptrs[i]) viable_byte[i] = ptr_to_labelset.at(c.viable_ptrs[i]);
+    }
+    return viable_byte;
 }
 
 template<Bug::Type bug_type>
 void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
+        uint64_t atp_instr,
         std::initializer_list<const DuaBytes *> extra_duas);
 
+// Record a dua found at a taint query, with bugs at the query itself, and
+// make it the current one for its lval.
+void record_dua(DuaCandidate &&c, std::vector<const LabelSet *> &&viable_byte,
+        bool is_fake_dua) {
+    // looks like we can subvert this for either real or fake bug.
+    // NB: we don't know liveness info yet. defer byte selection until later.
+    LavaASTLoc ast_loc(ind2str(c.ast_loc_id));
+    assert(ast_loc.filename.size() > 0);
+
+    const SourceLval *lval = create(SourceLval{0,
+            ast_loc, c.astnodename, c.len});
+
+    const Dua *dua = create(Dua(lval, std::move(viable_byte),
+            std::move(c.byte_tcn), std::move(c.all_labels), inputfile,
+            c.max_tcn, c.max_card, c.instr, is_fake_dua));
+
+    const AttackPoint *pad_atp;
+    bool is_new_atp;
+    std::tie(pad_atp, is_new_atp) = create_full(
+            AttackPoint{0, ast_loc, AttackPoint::QUERY_POINT});
+    if (c.len >= 20 && decimate_by_type(Bug::RET_BUFFER, pad_atp, lval)) {
+        Range range = get_dua_exploit_pad(dua);
+        const DuaBytes *dua_bytes = create(DuaBytes(dua, range));
+        if (is_fake_dua || range.size() >= 20) {
+            record_injectable_bugs_at<Bug::RET_BUFFER>(
+                    pad_atp, is_new_atp, c.instr, { dua_bytes });
+        }
+    }
+    dprintf("OK DUA.\n");
+
+    // Update recent_dead_duas + recent_duas_by_instr:
+    // 1) retire the dua previously seen for this lval, if any.
+    // 2) insert/update in recent_dead_duas, if the new dua is viable.
+    // 3) append the new dua to r_d_by_instr.
+    unsigned long lval_id = lval->id;
+    // Only tracks liveness dependencies for non-fake duas.
+    bool viable = track_dua(dua);
+    auto it_lval = recent_dead_duas.lower_bound(lval_id);
+    bool seen_lval = it_lval != recent_dead_duas.end()
+        && !(lval_id < it_lval->first);
+    if (seen_lval) {
+        const Dua *old_dua = it_lval->second;
+        assert(old_dua->lval->id == lval_id);
+        uint32_t old_index = dua_viability_index.at((uintptr_t)old_dua);
+        for (uint32_t l : old_dua->all_labels) {
+            dua_dependencies.erase(l, old_index);
+        }
+        retire_dua(dua_viability[old_index]);
+        dprintf("previously observed lval\n");
+    } else {
+        dprintf("new lval\n");
+    }
+
+    if (viable) {
+        if (seen_lval) {
+            it_lval->second = dua;
+        } else {
+            recent_dead_duas.insert(it_lval, std::make_pair(lval_id, dua));
+        }
+        assert(recent_duas_by_instr.empty() ||
+                dua->instr >= recent_duas_by_instr.back()->instr);
+        recent_duas_by_instr.push_back(dua);
+    } else {
+        dprintf("dua has no viable run of bytes\n");
+        if (seen_lval) recent_dead_duas.erase(lval_id);
+        // Never went into the recent lists, so nothing to compact.
+        dua_viability.back().retired = true;
+    }
+
+    // Invariant should hold that:
+    // set(recent_dead_duas.values()) == set(recent_duas_by_instr) - retired.
+    assert(recent_dead_duas.size() + num_retired_by_instr
+            == recent_duas_by_instr.size());
+
+    if (is_fake_dua) {
+        num_fake_duas++;
+        stats.count(FbiStats::FAKE_DUAS);
+    } else {
+        num_real_duas++;
+        stats.count(FbiStats::REAL_DUAS);
+    }
+}
+
+// Finish off a candidate that could be a dua now that liveness is known.
+// Returns true if it was one; if not, c is left as it was.
+bool add_dua_candidate(DuaCandidate &&c) {
+    stats.count(FbiStats::DUA_CANDIDATES);
+    std::vector<const LabelSet *> viable_byte = viable_label_sets(c);
+    if (get_dead_range(viable_byte, {}).size() < LAVA_MAGIC_VALUE_SIZE) {
+        return false;
+    }
+    record_dua(std::move(c), std::move(viable_byte), false);
+    return true;
+}
+
 void taint_query_pri(Panda__LogEntry *ple) {
+    FbiStats::Scope timer(stats, FbiStats::TAINT_QUERY);
     assert (ple != NULL);
     Panda__TaintQueryPri *tqh = ple->taint_query_pri;
     assert (tqh != NULL);
@@ -412,17 +833,8 @@ void taint_query_pri(Panda__LogEntry *ple) {
     // entry 2 is callstack -- ignore
     Panda__CallStack *cs = tqh->call_stack;
     assert (cs != NULL);
-    uint64_t instr = ple->instr;
     dprintf("TAINT QUERY HYPERCALL len=%d num_tainted=%d\n", len, num_tainted);
 
-    // collects set (as sorted vec) of labels on all viable bytes
-    std::vector<uint32_t> all_labels;
-    // keep track of min / max for each of these measures over all bytes
-    // in this queried lval
-    uint32_t c_max_tcn = 0, c_max_card = 0;
-
-    transaction t(db->begin());
-
     // consider all bytes in this extent that were queried and found to be tainted
     // collect "ok" bytes, which have low enough taint compute num and card,
     // and also aren't tainted by too-live input bytes
@@ -435,77 +847,33 @@ void taint_query_pri(Panda__LogEntry *ple) {
         }
     }
 
-    // if lval is 12 bytes, this vector will have 12 elements
-    // viable_byte[i] is 0 if it is NOT viable
-    // otherwise it is a ptr to a taint set.
-
-    // Make vector of length len and fill w/ zeroes.
-    std::vector<const LabelSet*> viable_byte(len, nullptr);
-    std::vector<uint32_t> byte_tcn(len, 0);
-
     dprintf("considering taint queries on %lu bytes\n", tqh->n_taint_query);
-
-    bool is_dua = false;
-    bool is_fake_dua = false;
-    uint32_t num_viable_bytes = 0;
-    // optimization. don't need to check each byte if we don't have enough.
+    std::vector<QueriedByte> bytes;
     if (num_tainted >= LAVA_MAGIC_VALUE_SIZE) {
+        bytes.reserve(tqh->n_taint_query);
         for (uint32_t i = 0; i < tqh->n_taint_query; i++) {
             Panda__TaintQuery *tq = tqh->taint_query[i];
-            uint32_t offset = tq->offset;
-            if (offset >= len) continue;
-            dprintf("considering offset = %d\n", offset);
-            const LabelSet *ls = ptr_to_labelset.at(tq->ptr);
-
-            byte_tcn[offset] = tq->tcn;
-
-            // flag for tracking *why* we discarded a byte
-            // check tcn and cardinality of taint set first
-            uint32_t current_byte_not_ok = 0;
-            current_byte_not_ok |= (tq->tcn > max_tcn) << CBNO_TCN_BIT;
-            current_byte_not_ok |= (ls->labels.size() > max_card) << CBNO_CRD_BIT;
-            if (current_byte_not_ok && debug) {
-                // discard this byte
-                dprintf("discarding byte -- here's why: %x\n", current_byte_not_ok);
-                if (debug && current_byte_not_ok) {
-                    if (1<<CBNO_TCN_BIT) printf("** tcn too high\n");
-                    if (1<<CBNO_CRD_BIT) printf("** card too high\n");
-                }
-            } else {
-                dprintf("retaining byte\n");
-                // this byte is ok to retain.
-                // keep track of highest tcn, liveness, and card for any viable byte for this lval
-                c_max_tcn = std::max(tq->tcn, c_max_tcn);
-                c_max_card = std::max((uint32_t) ls->labels.size(), c_max_card);
-
-                merge_into(ls->labels.begin(), ls->labels.end(), all_labels);
-
-                dprintf("keeping byte @ offset %d\n", offset);
-                // add this byte to the list of ok bytes
-                viable_byte[offset] = ls;
-                num_viable_bytes++;
-            }
-        }
-        dprintf("%u viable bytes in lval\n", num_viable_bytes);
-
-        // three possibilities at this point
-        // 1. this is a dua which we can use to make bugs,
-        // 2. it's a non-dua which has enough untainted parts to make a fake bug
-        // 3. or its neither and we truly discard.
-        // NB: Duas with <4 taint labels cannot possibly work.
-        if (num_viable_bytes >= LAVA_MAGIC_VALUE_SIZE
-                && all_labels.size() >= LAVA_MAGIC_VALUE_SIZE
-                && get_dead_range(viable_byte, {}).size() >= LAVA_MAGIC_VALUE_SIZE) {
-            is_dua = true;
+            bytes.push_back(QueriedByte{tq->offset, tq->tcn, tq->ptr});
         }
     }
+    DuaCandidate c{ple->instr, len, si->ast_loc_id, si->astnodename};
+    bool maybe_dua = dua_candidate(c, num_tainted, bytes.data(), bytes.size(),
+            [](Ptr p) { return &ptr_to_labelset.at(p)->labels; });
+
+    // three possibilities at this point
+    // 1. this is a dua which we can use to make bugs,
+    // 2. it's a non-dua which has enough untainted parts to make a fake bug
+    // 3. or its neither and we truly discard.
+    if (maybe_dua) {
+        assert(si->has_ast_loc_id);
+        if (add_dua_candidate(std::move(c))) return;
+    }
 
     // create a fake dua if we can
-    if (chaff_bugs && !is_dua
-            && tqh->len - num_tainted >= LAVA_MAGIC_VALUE_SIZE) {
+    if (chaff_bugs && tqh->len - num_tainted >= LAVA_MAGIC_VALUE_SIZE) {
         dprintf("not enough taint -- what about non-taint?\n");
         dprintf("len=%d num_tainted=%d\n", len, num_tainted);
-        viable_byte.assign(viable_byte.size(), nullptr);
+        std::vector<const LabelSet*> viable_byte(len, nullptr);
         uint32_t count = 0;
         Panda__TaintQuery **tqp = tqh->taint_query;
         Panda__TaintQuery **tqp_end = tqp + tqh->n_taint_query;
@@ -533,105 +901,33 @@ void taint_query_pri(Panda__LogEntry *ple) {
             if (count >= LAVA_MAGIC_VALUE_SIZE) break;
         }
         assert(count >= LAVA_MAGIC_VALUE_SIZE);
-        is_fake_dua = true;
-    }
-
-    dprintf("is_dua=%d is_fake_dua=%d\n", is_dua, is_fake_dua);
-    assert(!(is_dua && is_fake_dua));
-    if (is_dua || is_fake_dua) {
-        // looks like we can subvert this for either real or fake bug.
-        // NB: we don't know liveness info yet. defer byte selection until later.
         assert(si->has_ast_loc_id);
-        LavaASTLoc ast_loc(ind2str[si->ast_loc_id]);
-        assert(ast_loc.filename.size() > 0);
-
-        const SourceLval *lval = create(SourceLval{0,
-                ast_loc, si->astnodename, len});
-
-        const Dua *dua = create(Dua(lval, std::move(viable_byte),
-                std::move(byte_tcn), std::move(all_labels), inputfile,
-                c_max_tcn, c_max_card, ple->instr, is_fake_dua));
-
-        if (is_dua) {
-            // Only track liveness for non-fake duas.
-            for (uint32_t l : dua->all_labels) {
-                dua_dependencies[l].insert(dua);
-            }
-        }
-
-        const AttackPoint *pad_atp;
-        bool is_new_atp;
-        std::tie(pad_atp, is_new_atp) = create_full(
-                AttackPoint{0, ast_loc, AttackPoint::QUERY_POINT});
-        if (len >= 20 && decimate_by_type(Bug::RET_BUFFER)) {
-            Range range = get_dua_exploit_pad(dua);
-            const DuaBytes *dua_bytes = create(DuaBytes(dua, range));
-            if (is_fake_dua || range.size() >= 20) {
-                record_injectable_bugs_at<Bug::RET_BUFFER>(
-                        pad_atp, is_new_atp, { dua_bytes });
-            }
-        }
-        dprintf("OK DUA.\n");
-
-        // Update recent_dead_duas + recent_duas_by_instr:
-        // 1) erase at most one in r_d_by_instr w/ same lval_id.
-        // 2) insert/update in recent_dead_duas
-        // 2) insert new dua into r_d_by_instr, probably at end.
-        unsigned long lval_id = lval->id;
-        auto it_lval = recent_dead_duas.lower_bound(lval_id);
-        if (it_lval == recent_dead_duas.end() || lval_id < it_lval->first) {
-            recent_dead_duas.insert(it_lval, std::make_pair(lval_id, dua));
-            dprintf("new lval\n");
-        } else {
-            // recent_duas_by_instr should contain a dua w/ this lval.
-            const Dua *old_dua = it_lval->second;
-            assert(old_dua->lval->id == lval_id);
-            auto instr_range = std::equal_range(
-                    recent_duas_by_instr.begin(),
-                    recent_duas_by_instr.end(),
-                    old_dua, less_by_instr);
-            auto it_instr = std::find(instr_range.first, instr_range.second,
-                    old_dua);
-            assert(it_instr != instr_range.second); // found
-            assert((*it_instr)->lval->id == lval_id);
-            recent_duas_by_instr.erase(it_instr);
-
-            // replace value in recent_dead_duas and erase old from
-            // dua_dependencies.
-            for (uint32_t l : old_dua->all_labels) {
-                dua_dependencies[l].erase(old_dua);
-            }
-            it_lval->second = dua;
-            dprintf("previously observed lval\n");
-        }
-
-        assert(recent_duas_by_instr.empty() ||
-                dua->instr >= recent_duas_by_instr.back()->instr);
-        recent_duas_by_instr.push_back(dua);
+        // Keeps the tcns and labels of whatever tainted bytes there were.
+        record_dua(std::move(c), std::move(viable_byte), true);
+        return;
+    }
 
-        // Invariant should hold that:
-        // set(recent_dead_duas.values()) == set(recent_duas_by_instr).
-        assert(recent_dead_duas.size() == recent_duas_by_instr.size());
+    dprintf("discarded %s:%u %s", si->filename, si->linenum, si->astnodename);
+}
 
-        if (is_dua) num_real_duas++;
-        if (is_fake_dua) num_fake_duas++;
-    } else {
-        dprintf("discarded %u viable bytes %lu labels %s:%u %s",
-                num_viable_bytes, all_labels.size(), si->filename, si->linenum,
-                si->astnodename);
+// A tainted branch depends on label l.
+inline void label_used(uint32_t l) {
+    // A dua can only stop being viable when one of its labels first goes
+    // over max_liveness, so that's the only time we look at duas at all.
+    if (++liveness[l] == max_liveness + 1) {
+        label_crossed_max_liveness(l);
     }
-    t.commit();
 }
 
 // update liveness measure for each of taint labels (file bytes) associated with a byte in lval that was queried
 void update_liveness(Panda__LogEntry *ple) {
+    FbiStats::Scope timer(stats, FbiStats::TAINTED_BRANCH);
     assert (ple != NULL);
     Panda__TaintedBranch *tb = ple->tainted_branch;
     assert (tb != NULL);
     dprintf("TAINTED BRANCH\n");
 
-    transaction t(db->begin());
-    std::vector<uint32_t> all_labels;
+    LabelBitmap all_labels;
     for (uint32_t i=0; i<tb->n_taint_query; i++) {
         Panda__TaintQuery *tq = tb->taint_query[i];
         assert (tq);
@@ -641,54 +937,13 @@ void update_liveness(Panda__LogEntry *ple) {
         }
 //        if (debug) { spit_tq(tq); printf("\n"); }
 
-        // This should be O(mn) for m sets, n elems each.
-        // though we should have n >> m in our worst case.
-        const std::vector<uint32_t> &cur_labels =
-            ptr_to_labelset.at(tq->ptr)->labels;
-        merge_into(cur_labels.begin(), cur_labels.end(), all_labels);
-    }
-    t.commit();
-
-    // For each label, look at all duas tainted by that label.
-    // If they aren't viable anymore, erase them from recent_dead_duas list and
-    // also erase them from dependency tracker.
-    std::vector<const Dua *> duas_to_check;
-    for (uint32_t l : all_labels) {
-        liveness[l]++;
-
-        dprintf("checking viability of %lu duas\n", recent_dead_duas.size());
-        auto it_duas = dua_dependencies.find(l);
-        if (it_duas != dua_dependencies.end()) {
-            std::set<const Dua *> &depends = it_duas->second;
-            merge_into(depends.begin(), depends.end(), depends.size(), duas_to_check);
-        }
+        // O(n) per set of n labels, however big the union gets.
+        all_labels.add(ptr_to_labelset.at(tq->ptr)->labels);
     }
 
-    std::vector<const Dua *> non_viable_duas;
-    for (const Dua *dua : duas_to_check) {
-        // is this dua still viable?
-        if (!is_dua_dead(dua)) {
-            dprintf("%s\n ** DUA not viable\n", std::string(*dua).c_str());
-            recent_dead_duas.erase(dua->lval->id);
-            recent_duas_by_instr.erase(
-                    std::remove(recent_duas_by_instr.begin(),
-                        recent_duas_by_instr.end(), dua),
-                    recent_duas_by_instr.end());
-            assert(recent_dead_duas.size() == recent_duas_by_instr.size());
-            non_viable_duas.push_back(dua);
-        }
-    }
-
-    dprintf("%lu non-viable duas \n", non_viable_duas.size());
-    // discard non-viable duas
-    for (const Dua *dua : non_viable_duas) {
-        for (uint32_t l : dua->all_labels) {
-            auto it_depend = dua_dependencies.find(l);
-            if (it_depend != dua_dependencies.end()) {
-                dua_dependencies.erase(it_depend);
-            }
-        }
-    }
+    stats.record(FbiStats::BRANCH_LABELS, all_labels.size());
+    FbiStats::Scope liveness_timer(stats, FbiStats::LIVENESS);
+    all_labels.for_each(label_used);
 }
 
 /*
@@ -715,39 +970,96 @@ struct BugParam {
     }
 };
 
+// Sorted trigger lval ids of the bugs at each (atp, type). Loaded from the
+// database at startup and kept up to date as bugs are recorded, so checking
+// for repeats at an attack point never touches the database. That only works
+// with no other writer; BatchPersister's writer lock sees to that.
 std::map<BugParam, std::vector<uint64_t>> cached_skip_lists;
 
+// Runs in the persister's transaction.
+void load_skip_lists() {
+    FbiStats::Scope timer(stats, FbiStats::DB_QUERY);
+    cached_skip_lists.clear();
+    auto result = db->query<BugTrigger>();
+    size_t count = 0;
+    for (auto it = result.begin(); it != result.end(); it++, count++) {
+        // Rows come sorted by atp, type, lval, so each list is sorted too.
+        cached_skip_lists[BugParam{it->atp, it->type}].push_back(
+                it->trigger_lval);
+    }
+    printf("loaded %lu existing bugs at %lu (atp, type) pairs\n", count,
+            cached_skip_lists.size());
+}
+
+// Bugs recorded so far with their trigger in each source file, for
+// score_trigger.
+std::unordered_map<std::string, uint64_t> bugs_per_file;
+
+// How good a bug the selected bytes of dua would trigger at an attack point
+// reached at atp_instr; higher is better. Triggers score higher the less
+// live and the less computed their bytes are, the closer to the attack point
+// they were seen and the fewer bugs their file has already. Each term is a
+// log so that none of them swamps the rest, scaled by score_weights.
+double score_trigger(const Dua *dua, Range selected, uint64_t atp_instr) {
+    uint64_t trigger_liveness = 0;
+    for (uint32_t i = selected.low; i < selected.high; i++) {
+        for (uint32_t l : dua->viable_bytes[i]->labels) {
+            trigger_liveness = std::max(trigger_liveness, liveness[l]);
+        }
+    }
+    uint64_t distance = atp_instr > dua->instr ? atp_instr - dua->instr : 0;
+    auto it = bugs_per_file.find(dua->lval->loc.filename);
+    uint64_t file_bugs = it == bugs_per_file.end() ? 0 : it->second;
+
+    return -(score_weights.liveness * log2(1.0 + trigger_liveness)
+            + score_weights.tcn * log2(1.0 + dua->max_tcn)
+            + score_weights.distance * log2(1.0 + distance)
+            + score_weights.diversity * log2(1.0 + file_bugs));
+}
+
+// A trigger at an attack point that made it past the skip list, waiting to
+// be turned into a bug.
+struct TriggerCandidate {
+    double score;
+    uint64_t lval_id;
+    const Dua *dua;
+    Range selected;
+
+    // Better first: higher score, then lower lval id so ties break the same
+    // way every run.
+    bool operator<(const TriggerCandidate &other) const {
+        if (score != other.score) return score > other.score;
+        return lval_id < other.lval_id;
+    }
+};
+
 template<Bug::Type bug_type>
 void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
+        uint64_t atp_instr,
         std::initializer_list<const DuaBytes *> extra_duas_prechosen) {
-    std::vector<uint64_t> empty;
-    std::vector<uint64_t> *skip_trigger_lvals = &empty;
+    FbiStats::Scope timer(stats, FbiStats::RECORD_BUGS);
+    // Extra duas are drawn from recent_duas_by_instr, so it must not hold
+    // any retired ones.
+    compact_recent_duas();
+
+    static const std::vector<uint64_t> empty;
+    const std::vector<uint64_t> *skip_trigger_lvals = &empty;
+    // lval ids of bugs recorded here.
+    std::vector<uint64_t> new_trigger_lvals;
     if (!is_new_atp) {
         // This means that all bug opportunities here might be repeats: same
         // atp/lval/type combo. Let's head that off at the pass.
-        // So get all lval_ids that have been used with this ATP/type/extra dua
+        // So get all lval_ids that have been used with this ATP/type
         // before, and skip them as we iterate over recent_dead_duas.
-        const char *query_name = "atp-shortcut";
-        typedef odb::query<BugLval> q;
-        BugParam *param;
-        odb::prepared_query<BugLval> pq(
-                db->lookup_query<BugLval>(query_name, param));
-        if (!pq) {
-            std::unique_ptr<BugParam> param_ptr(new BugParam);
-            param = param_ptr.get();
-            pq = db->prepare_query<BugLval>(query_name,
-                    q::atp == q::_ref(param->atp_id) &&
-                    q::type == q::_ref(param->type));
-            db->cache_query(pq, std::move(param_ptr));
-        }
-        param->atp_id = atp->id;
-        param->type = bug_type;
-
-        auto result = pq.execute();
-        skip_trigger_lvals->reserve(result.size());
-        for (auto it = result.begin(); it != result.end(); it++) {
-            skip_trigger_lvals->push_back(it->trigger_lval);
-        }
+        auto it = cached_skip_lists.find(BugParam{atp->id, bug_type});
+        if (it != cached_skip_lists.end()) skip_trigger_lvals = &it->second;
+    }
+    // With top_k, at most top_k bugs per (atp, type) over every visit, so
+    // only what's left of that once earlier visits' bugs are counted.
+    size_t quota = top_k;
+    if (top_k > 0) {
+        if (skip_trigger_lvals->size() >= top_k) return;
+        quota = top_k - skip_trigger_lvals->size();
     }
 
     // every still viable dua is a bug inj opportunity at this point in trace
@@ -758,13 +1070,17 @@ void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
     int num_extra_duas = Bug::num_extra_duas[bug_type] -
         extra_duas_prechosen.size();
     assert(num_extra_duas >= 0);
-    std::vector<uint32_t> prechosen_labels;
+    LabelBitmap prechosen_labels;
 
     for (const DuaBytes* extra : extra_duas_prechosen) {
-        merge_into(extra->all_labels.begin(), extra->all_labels.end(),
-                prechosen_labels);
+        prechosen_labels.add(extra->all_labels);
     }
 
+    // Triggers to make bugs of. With top_k, every viable one is scored here
+    // and they're tried best first below until quota of them have made bugs:
+    // choosing extra duas can still reject a trigger, and then the next best
+    // takes its place. Nothing is created for the ones never tried.
+    std::vector<TriggerCandidate> candidates;
     for ( const auto &kvp : recent_dead_duas ) {
         unsigned long lval_id = kvp.first;
         // fast-forward skip_it so *skip_it >= lval_id
@@ -781,16 +1097,39 @@ void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
             // This means prechosen_labels conflicts with trigger
             continue;
         }
-
         assert(selected.size() >= LAVA_MAGIC_VALUE_SIZE);
-        const DuaBytes *trigger = create(DuaBytes{trigger_dua, selected});
+        stats.count(FbiStats::BUG_CANDIDATES);
+
+        double score = top_k > 0
+            ? score_trigger(trigger_dua, selected, atp_instr) : 0.0;
+        candidates.push_back(
+                TriggerCandidate{score, lval_id, trigger_dua, selected});
+    }
+
+    // With top_k, a heap with the best on top, popped one at a time to the
+    // back; otherwise lval order.
+    auto worse = [](const TriggerCandidate &a, const TriggerCandidate &b) {
+        return b < a;
+    };
+    auto heap_end = candidates.end();
+    if (top_k > 0) std::make_heap(candidates.begin(), heap_end, worse);
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (top_k > 0) {
+            if (new_trigger_lvals.size() >= quota) break;
+            std::pop_heap(candidates.begin(), heap_end--, worse);
+        }
+        const TriggerCandidate &candidate =
+            top_k > 0 ? *heap_end : candidates[i];
+        uint64_t lval_id = candidate.lval_id;
+        const Dua *trigger_dua = candidate.dua;
+        const DuaBytes *trigger = create(DuaBytes{trigger_dua,
+                candidate.selected});
 
         // Now select extra duas. One set of extra duas per (lval, atp, type).
         std::vector<const DuaBytes *> extra_duas = extra_duas_prechosen;
-        std::vector<uint32_t> labels_so_far = prechosen_labels;
+        LabelBitmap labels_so_far = prechosen_labels;
 
-        merge_into(trigger->all_labels.begin(), trigger->all_labels.end(),
-                labels_so_far);
+        labels_so_far.add(trigger->all_labels);
 
         // Get list of duas observed before chosen trigger.
         // Otherwise a bug might partially trigger - some duas might not be
@@ -801,6 +1140,8 @@ void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
         auto begin_it = recent_duas_by_instr.begin();
         auto distance = std::distance(begin_it, end_it);
         if (num_extra_duas < distance) { // do we have enough other duas??
+            LavaRng rng(rng_seed, atp->rng_key(),
+                    trigger_dua->lval->rng_key(), bug_type);
             for (int i = 0; i < num_extra_duas; i++) {
                 const DuaBytes *extra;
                 unsigned tries;
@@ -808,19 +1149,18 @@ void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
                 // trigger.
                 for (tries = 0; tries < 2; tries++) {
                     auto it = begin_it;
-                    std::advance(it, rand() % distance);
+                    std::advance(it, rng.below(distance));
                     const Dua *extra_dua = *it;
                     Range selected = get_dua_dead_range(extra_dua, labels_so_far);
                     if (selected.empty()) continue;
                     extra = create(DuaBytes(extra_dua, selected));
-                    if (disjoint(labels_so_far, extra->all_labels)) break;
+                    if (!labels_so_far.intersects(extra->all_labels)) break;
                 }
                 if (tries == 2) break;
                 extra_duas.push_back(extra);
 
                 size_t new_size = extra->all_labels.size() + labels_so_far.size();
-                merge_into(extra->all_labels.begin(), extra->all_labels.end(),
-                        labels_so_far);
+                labels_so_far.add(extra->all_labels);
                 assert(new_size == labels_so_far.size());
             }
         }
@@ -844,9 +1184,12 @@ void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
         assert(bug_type != Bug::RET_BUFFER ||
                 atp->type == AttackPoint::QUERY_POINT);
         assert(extra_duas.size() == Bug::num_extra_duas[bug_type]);
-        Bug bug(bug_type, trigger, c_max_liveness, atp, extra_duas);
-        db->persist(bug);
+        Bug bug(bug_type, trigger, c_max_liveness, atp, extra_duas, rng_seed);
+        persister->persist(bug);
+        stats.count(FbiStats::BUGS);
         num_bugs_of_type[bug_type]++;
+        bugs_per_file[trigger_dua->lval->loc.filename]++;
+        new_trigger_lvals.push_back(lval_id);
 
         num_bugs_added_to_db++;
         if (trigger_dua->fake_dua) {
@@ -855,83 +1198,1114 @@ void record_injectable_bugs_at(const AttackPoint *atp, bool is_new_atp,
             num_potential_bugs++;
         }
     }
-}
-
-void attack_point_lval_usage(Panda__LogEntry *ple) {
-    assert (ple != NULL);
-    Panda__AttackPoint *pleatp = ple->attack_point;
-    if (pleatp->src_info->has_ast_loc_id)
-        dprintf ("attack point id = %d\n", pleatp->src_info->ast_loc_id);
 
-    assert (pleatp != NULL);
-    Panda__SrcInfo *si = pleatp->src_info;
-    // ignore duas in header files
-    if (is_header_file(ind2str[si->filename])) return;
+    if (!new_trigger_lvals.empty()) {
+        // Best first with top_k; the skip lists are in lval order.
+        if (top_k > 0) {
+            std::sort(new_trigger_lvals.begin(), new_trigger_lvals.end());
+        }
+        std::vector<uint64_t> &cached =
+            cached_skip_lists[BugParam{atp->id, bug_type}];
+        merge_into(new_trigger_lvals.begin(), new_trigger_lvals.end(), cached);
+    }
+}
 
-    assert (si != NULL);
+// An attack point of type info (an AttackPoint::Type) was reached at instr,
+// at the source location with lavadb index ast_loc_id.
+void attack_point_at(uint64_t instr, uint32_t info, uint32_t ast_loc_id) {
     dprintf("ATTACK POINT\n");
+    stats.record(FbiStats::DUAS_AT_ATTACK_POINT, recent_dead_duas.size());
     if (recent_dead_duas.size() == 0) {
         dprintf("no duas yet -- discarding attack point\n");
         return;
     }
 
     dprintf("%lu viable duas remain\n", recent_dead_duas.size());
-    assert(si->has_ast_loc_id);
-    LavaASTLoc ast_loc(ind2str[si->ast_loc_id]);
+    LavaASTLoc ast_loc(ind2str(ast_loc_id));
     assert(ast_loc.filename.size() > 0);
-    transaction t(db->begin());
     const AttackPoint *atp;
     bool is_new_atp;
     std::tie(atp, is_new_atp) = create_full(AttackPoint{0,
-            ast_loc, (AttackPoint::Type)pleatp->info});
+            ast_loc, (AttackPoint::Type)info});
     dprintf("@ATP: %s\n", std::string(*atp).c_str());
+    uint64_t bugs_before = num_bugs_added_to_db;
 
     // Don't decimate PTR_ADD bugs.
-    switch ((AttackPoint::Type)pleatp->info) {
+    switch ((AttackPoint::Type)info) {
     case AttackPoint::POINTER_WRITE:
-        record_injectable_bugs_at<Bug::REL_WRITE>(atp, is_new_atp, { });
+        record_injectable_bugs_at<Bug::REL_WRITE>(atp, is_new_atp, instr, { });
         // fall through
     case AttackPoint::POINTER_READ:
     case AttackPoint::FUNCTION_ARG:
-        record_injectable_bugs_at<Bug::PTR_ADD>(atp, is_new_atp, { });
+        record_injectable_bugs_at<Bug::PTR_ADD>(atp, is_new_atp, instr, { });
         break;
     case AttackPoint::PRINTF_LEAK:
-        record_injectable_bugs_at<Bug::PRINTF_LEAK>(atp, is_new_atp, { });
+        record_injectable_bugs_at<Bug::PRINTF_LEAK>(atp, is_new_atp, instr,
+                { });
         break;
     }
-    t.commit();
+    stats.record(FbiStats::BUGS_AT_ATTACK_POINT,
+            num_bugs_added_to_db - bugs_before);
+}
+
+void attack_point_lval_usage(Panda__LogEntry *ple) {
+    FbiStats::Scope timer(stats, FbiStats::ATTACK_POINT);
+    assert (ple != NULL);
+    Panda__AttackPoint *pleatp = ple->attack_point;
+    if (pleatp->src_info->has_ast_loc_id)
+        dprintf ("attack point id = %d\n", pleatp->src_info->ast_loc_id);
+
+    assert (pleatp != NULL);
+    Panda__SrcInfo *si = pleatp->src_info;
+    // ignore duas in header files
+    if (is_header_file(ind2str(si->filename))) return;
+
+    assert (si != NULL);
+    assert(recent_dead_duas.empty() || si->has_ast_loc_id);
+    attack_point_at(ple->instr, pleatp->info, si->ast_loc_id);
 }
 
 void record_call(Panda__LogEntry *ple) { }
 
 void record_ret(Panda__LogEntry *ple) { }
 
-int main (int argc, char **argv) {
-    if (argc != 5 && argc !=6 ) {
-        printf("Find Bug Inject (FBI) -- Version %s\n", LAVA_VER);
-        printf("usage: fbi host.json ProjectName pandalog inputfile [curtail count]\n");
-        printf("    Project JSON file may specify properties:\n");
-        printf("        max_liveness: Maximum liveness for DUAs\n");
-        printf("        max_cardinality: Maximum cardinality for labelsets on DUAs\n");
-        printf("        max_tcn: Maximum taint compute number for DUAs\n");
-        printf("        max_lval_size: Maximum bytewise size for \n");
-        printf("    pandalog: Pandalog. Should be like queries-file-5.22-bash.iso.plog\n");
-        printf("    inputfile: Input file basename, like malware.pcap\n");
-        exit (1);
+// Checkpoints (--checkpoint FILE). Every checkpoint_interval, fbi saves all
+// of its analysis state and its position in the pandalog to FILE. A run that
+// died, or that stopped at curtail, picks up from there when started again
+// with the same arguments (and a different curtail, if wanted). A run that
+// gets to the end of the pandalog removes its checkpoint files, since there
+// is nothing left to resume.
+//
+// The persister saves its own state next to FILE. It alternates between two
+// files, FILE.0.out and FILE.1.out, so the one FILE refers to stays intact
+// until FILE itself has been replaced.
+#define CHECKPOINT_MAGIC "FBICKPT1"
+#define CHECKPOINT_VERSION 2
+
+std::string checkpoint_path;
+std::chrono::seconds checkpoint_interval(600);
+uint64_t checkpoint_seq = 0;
+
+// Where we are in the pandalog. Several entries can share an instr, so this
+// is the instr of the last entry processed and how many entries with that
+// instr have been processed.
+struct PlogPosition {
+    uint64_t instr = 0;
+    uint64_t entries_at_instr = 0;
+    uint64_t num_entries_read = 0;
+};
+
+static std::string checkpoint_state_path(uint64_t seq) {
+    return checkpoint_path + "." + std::to_string(seq % 2) + ".out";
+}
+
+// Remove the checkpoint and both persister states.
+static void remove_checkpoint() {
+    unlink(checkpoint_path.c_str());
+    unlink(checkpoint_state_path(0).c_str());
+    unlink(checkpoint_state_path(1).c_str());
+}
+
+static void put_loc(SnapshotWriter &w, const LavaASTLoc &loc) {
+    w.put_str(loc.filename);
+    w.put(loc.begin);
+    w.put(loc.end);
+}
+
+static LavaASTLoc get_loc(SnapshotReader &r) {
+    std::string filename = r.get_str();
+    Loc begin = r.get<Loc>();
+    Loc end = r.get<Loc>();
+    return LavaASTLoc(filename, begin, end);
+}
+
+void save_checkpoint(const std::string &plog, const PlogPosition &pos) {
+    FbiStats::Scope timer(stats, FbiStats::CHECKPOINT);
+    uint64_t seq = checkpoint_seq + 1;
+    persister->save_state(checkpoint_state_path(seq));
+
+    SnapshotWriter w(checkpoint_path, CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+    // What this is a checkpoint of.
+    w.put_str(plog);
+    w.put_str(inputfile);
+    w.put(max_liveness);
+    w.put(max_card);
+    w.put(max_tcn);
+    w.put(max_lval);
+    w.put(chaff_bugs);
+    w.put(rng_seed);
+    w.put(top_k);
+    w.put(score_weights);
+
+    w.put(seq);
+    w.put(pos);
+    w.put(num_real_duas);
+    w.put(num_fake_duas);
+    w.put(num_bugs_added_to_db);
+    w.put(num_bugs_of_type);
+    w.put(num_potential_bugs);
+    w.put(num_potential_nonbugs);
+    w.put(num_retired_by_instr);
+
+    // Objects, each type after the types it points to. Pointers are saved
+    // as indices into the objects of their type.
+    PtrHashMap<uint32_t> index;
+    uint32_t i = 0;
+    w.put<uint64_t>(existing_objects<SourceLval>().size());
+    for (const SourceLval &lval : existing_objects<SourceLval>()) {
+        index.insert((uint64_t)&lval, i++);
+        w.put(lval.id);
+        put_loc(w, lval.loc);
+        w.put_str(lval.ast_name);
+        w.put(lval.len_bytes);
+    }
+    i = 0;
+    w.put<uint64_t>(existing_objects<LabelSet>().size());
+    for (const LabelSet &ls : existing_objects<LabelSet>()) {
+        index.insert((uint64_t)&ls, i++);
+        w.put(ls.id);
+        w.put(ls.ptr);
+        w.put_str(ls.inputfile);
+        w.put_array(ls.labels.data(), ls.labels.size());
+    }
+    w.put<uint64_t>(existing_objects<AttackPoint>().size());
+    for (const AttackPoint &atp : existing_objects<AttackPoint>()) {
+        w.put(atp.id);
+        put_loc(w, atp.loc);
+        w.put<uint32_t>(atp.type);
+    }
+    i = 0;
+    w.put<uint64_t>(existing_objects<Dua>().size());
+    for (const Dua &dua : existing_objects<Dua>()) {
+        index.insert((uint64_t)&dua, i++);
+        w.put(dua.id);
+        w.put(index.at((uint64_t)dua.lval));
+        // Index + 1, or 0 for none.
+        std::vector<uint32_t> viable_bytes;
+        for (const LabelSet *ls : dua.viable_bytes) {
+            viable_bytes.push_back(ls ? index.at((uint64_t)ls) + 1 : 0);
+        }
+        w.put_vec(viable_bytes);
+        w.put_vec(dua.byte_tcn);
+        w.put_array(dua.all_labels.data(), dua.all_labels.size());
+        w.put_str(dua.inputfile);
+        w.put(dua.max_tcn);
+        w.put(dua.max_cardinality);
+        w.put(dua.instr);
+        w.put(dua.fake_dua);
+    }
+    w.put<uint64_t>(existing_objects<DuaBytes>().size());
+    for (const DuaBytes &dua_bytes : existing_objects<DuaBytes>()) {
+        w.put(dua_bytes.id);
+        w.put(index.at((uint64_t)dua_bytes.dua));
+        w.put(dua_bytes.selected);
+        w.put_array(dua_bytes.all_labels.data(), dua_bytes.all_labels.size());
+    }
+
+    // Analysis state.
+    w.put<uint64_t>(ptr_to_labelset.size());
+    ptr_to_labelset.for_each([&w, &index](uint64_t ptr, const LabelSet *ls) {
+        w.put(ptr);
+        w.put(index.at((uint64_t)ls));
+    });
+    w.put_vec(liveness);
+    w.put<uint64_t>(recent_dead_duas.size());
+    for (const auto &kvp : recent_dead_duas) {
+        w.put<uint64_t>(kvp.first);
+        w.put(index.at((uint64_t)kvp.second));
+    }
+    std::vector<uint32_t> by_instr;
+    for (const Dua *dua : recent_duas_by_instr) {
+        by_instr.push_back(index.at((uint64_t)dua));
     }
+    w.put_vec(by_instr);
+    w.put<uint64_t>(dua_viability.size());
+    for (const DuaViability &v : dua_viability) {
+        w.put(index.at((uint64_t)v.dua));
+        w.put_vec(v.byte_viable);
+        w.put(v.viable_runs);
+        w.put(v.retired);
+    }
+    // Only labels that have any.
+    uint64_t num_dependent_labels = 0;
+    for (uint32_t l = 0; l < dua_dependencies.size(); l++) {
+        if (!dua_dependencies[l].empty()) num_dependent_labels++;
+    }
+    w.put(num_dependent_labels);
+    for (uint32_t l = 0; l < dua_dependencies.size(); l++) {
+        const auto &deps = dua_dependencies[l];
+        if (deps.empty()) continue;
+        w.put(l);
+        w.put_array(deps.begin(), deps.size());
+    }
+    w.put<uint64_t>(cached_skip_lists.size());
+    for (const auto &kvp : cached_skip_lists) {
+        w.put<uint64_t>(kvp.first.atp_id);
+        w.put<uint32_t>(kvp.first.type);
+        w.put_vec(kvp.second);
+    }
+    w.put<uint64_t>(bugs_per_file.size());
+    for (const auto &kvp : bugs_per_file) {
+        w.put_str(kvp.first);
+        w.put(kvp.second);
+    }
+    w.commit();
+    checkpoint_seq = seq;
+
+    printf("checkpoint %lu written to %s at pandalog entry %lu\n", seq,
+            checkpoint_path.c_str(), pos.num_entries_read);
+}
+
+// Restores everything save_checkpoint saved. Returns the position to resume
+// from and sets persister_state to the persister's saved state.
+PlogPosition load_checkpoint(const std::string &plog,
+        std::string &persister_state) {
+    SnapshotReader r(checkpoint_path, CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+    std::string saved_plog = r.get_str();
+    std::string saved_inputfile = r.get_str();
+    if (saved_plog != plog || saved_inputfile != inputfile) {
+        throw std::runtime_error(checkpoint_path + " is a checkpoint of "
+                + saved_plog + " (" + saved_inputfile + ")");
+    }
+    if (r.get<uint64_t>() != max_liveness || r.get<uint32_t>() != max_card
+            || r.get<uint32_t>() != max_tcn || r.get<uint32_t>() != max_lval
+            || r.get<bool>() != chaff_bugs) {
+        throw std::runtime_error(checkpoint_path
+                + " was made with different DUA limits");
+    }
+    uint64_t saved_seed = r.get<uint64_t>();
+    uint32_t saved_top_k = r.get<uint32_t>();
+    ScoreWeights saved_weights = r.get<ScoreWeights>();
+    if (saved_seed != rng_seed || saved_top_k != top_k
+            || memcmp(&saved_weights, &score_weights,
+                sizeof(saved_weights)) != 0) {
+        throw std::runtime_error(checkpoint_path
+                + " was made with a different seed or bug scoring");
+    }
+
+    checkpoint_seq = r.get<uint64_t>();
+    persister_state = checkpoint_state_path(checkpoint_seq);
+    PlogPosition pos = r.get<PlogPosition>();
+    num_real_duas = r.get<uint64_t>();
+    num_fake_duas = r.get<uint64_t>();
+    num_bugs_added_to_db = r.get<uint64_t>();
+    for (uint64_t &n : num_bugs_of_type) n = r.get<uint64_t>();
+    num_potential_bugs = r.get<uint32_t>();
+    num_potential_nonbugs = r.get<uint32_t>();
+    num_retired_by_instr = r.get<uint64_t>();
+
+    std::vector<const SourceLval *> lvals(r.get<uint64_t>());
+    for (const SourceLval *&lval : lvals) {
+        uint64_t id = r.get<uint64_t>();
+        LavaASTLoc loc = get_loc(r);
+        std::string ast_name = r.get_str();
+        uint32_t len_bytes = r.get<uint32_t>();
+        lval = &*existing_objects<SourceLval>().insert(
+                SourceLval{id, loc, ast_name, len_bytes}).first;
+    }
+    std::vector<const LabelSet *> label_sets(r.get<uint64_t>());
+    for (const LabelSet *&ls : label_sets) {
+        uint64_t id = r.get<uint64_t>();
+        uint64_t ptr = r.get<uint64_t>();
+        std::string ls_inputfile = r.get_str();
+        LabelVec labels(r.get_vec<uint32_t>());
+        ls = &*existing_objects<LabelSet>().insert(
+                LabelSet{id, ptr, ls_inputfile, labels}).first;
+    }
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        uint64_t id = r.get<uint64_t>();
+        LavaASTLoc loc = get_loc(r);
+        auto type = (AttackPoint::Type)r.get<uint32_t>();
+        existing_objects<AttackPoint>().insert(AttackPoint{id, loc, type});
+    }
+    std::vector<const Dua *> duas(r.get<uint64_t>());
+    for (const Dua *&dua : duas) {
+        uint64_t id = r.get<uint64_t>();
+        const SourceLval *lval = lvals.at(r.get<uint32_t>());
+        std::vector<const LabelSet *> viable_bytes;
+        for (uint32_t ls : r.get_vec<uint32_t>()) {
+            viable_bytes.push_back(ls ? label_sets.at(ls - 1) : nullptr);
+        }
+        std::vector<uint32_t> byte_tcn = r.get_vec<uint32_t>();
+        std::vector<uint32_t> all_labels = r.get_vec<uint32_t>();
+        std::string dua_inputfile = r.get_str();
+        uint32_t dua_max_tcn = r.get<uint32_t>();
+        uint32_t dua_max_card = r.get<uint32_t>();
+        uint64_t instr = r.get<uint64_t>();
+        bool fake_dua = r.get<bool>();
+        Dua restored(lval, std::move(viable_bytes), std::move(byte_tcn),
+                std::move(all_labels), dua_inputfile, dua_max_tcn,
+                dua_max_card, instr, fake_dua);
+        restored.id = id;
+        dua = &*existing_objects<Dua>().insert(std::move(restored)).first;
+    }
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        DuaBytes dua_bytes;
+        dua_bytes.id = r.get<uint64_t>();
+        dua_bytes.dua = duas.at(r.get<uint32_t>());
+        dua_bytes.selected = r.get<Range>();
+        dua_bytes.all_labels = LabelVec(r.get_vec<uint32_t>());
+        existing_objects<DuaBytes>().insert(dua_bytes);
+    }
+
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        uint64_t ptr = r.get<uint64_t>();
+        ptr_to_labelset.insert(ptr, label_sets.at(r.get<uint32_t>()));
+    }
+    liveness = r.get_vec<uint64_t>();
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        unsigned long lval_id = r.get<uint64_t>();
+        const Dua *dua = duas.at(r.get<uint32_t>());
+        recent_dead_duas.insert(recent_dead_duas.end(),
+                std::make_pair(lval_id, dua));
+    }
+    for (uint32_t dua : r.get_vec<uint32_t>()) {
+        recent_duas_by_instr.push_back(duas.at(dua));
+    }
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        DuaViability v;
+        v.dua = duas.at(r.get<uint32_t>());
+        v.byte_viable = r.get_vec<uint8_t>();
+        v.viable_runs = r.get<uint32_t>();
+        v.retired = r.get<bool>();
+        dua_viability_index.insert((uint64_t)v.dua, dua_viability.size());
+        dua_viability.push_back(std::move(v));
+    }
+    dua_dependencies.resize(liveness.size());
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        uint32_t l = r.get<uint32_t>();
+        for (uint32_t dep : r.get_vec<uint32_t>()) dua_dependencies.insert(l, dep);
+    }
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        BugParam param;
+        param.atp_id = r.get<uint64_t>();
+        param.type = (Bug::Type)r.get<uint32_t>();
+        cached_skip_lists[param] = r.get_vec<uint64_t>();
+    }
+    bugs_per_file.clear();
+    for (uint64_t n = r.get<uint64_t>(); n > 0; n--) {
+        std::string filename = r.get_str();
+        bugs_per_file[filename] = r.get<uint64_t>();
+    }
+    if (!r.at_end()) {
+        throw std::runtime_error(checkpoint_path + " has trailing data");
+    }
+
+    printf("resuming from checkpoint %lu in %s at pandalog entry %lu\n",
+            checkpoint_seq, checkpoint_path.c_str(), pos.num_entries_read);
+    return pos;
+}
+
+// Count an entry we're about to look at, by kind.
+inline void count_entry(const Panda__LogEntry *ple) {
+    stats.count(FbiStats::ENTRIES);
+    if (ple->taint_query_pri) stats.count(FbiStats::TAINT_QUERIES);
+    else if (ple->tainted_branch) stats.count(FbiStats::TAINTED_BRANCHES);
+    else if (ple->attack_point) stats.count(FbiStats::ATTACK_POINTS);
+    else stats.count(FbiStats::OTHER_ENTRIES);
+    if ((stats.get(FbiStats::ENTRIES) % 1024) == 0) stats.tick();
+}
+
+// Calls define(tquls) for each label set defined by an entry with instr < hi,
+// in log order, skipping the same entries the handlers do. This is all that
+// matters from before --instr-range: liveness starts afresh at the start of
+// the range, but the label sets used in it may have been defined long before.
+// Only taint queries and tainted branches define label sets, so stretches of
+// the log with neither (going by its PlogIndex) aren't decoded at all.
+template<typename Define>
+void scan_label_sets(const std::string &plog, uint64_t hi, Define define) {
+    FbiStats::Scope timer(stats, FbiStats::LABEL_SET_SCAN);
+    PlogIndex index = PlogIndex::open(plog);
+    const auto &buckets = index.buckets;
+    auto defines_sets = [](const PlogIndex::Bucket &b) {
+        return b.counts.kind[PlogIndex::TAINT_QUERY] > 0
+            || b.counts.kind[PlogIndex::TAINTED_BRANCH] > 0;
+    };
+    uint64_t num_sets = 0;
+    size_t i = 0;
+    while (i < buckets.size() && buckets[i].first_instr < hi) {
+        if (!defines_sets(buckets[i])) {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < buckets.size() && buckets[end].first_instr < hi
+                && defines_sets(buckets[end])) {
+            end++;
+        }
+        uint64_t lo = buckets[i].first_instr;
+        uint64_t run_hi = end < buckets.size()
+            ? std::min(hi, buckets[end].first_instr) : hi;
+        PlogPrefetcher reader(plog, lo);
+        while (Panda__LogEntry *ple = reader.next()) {
+            if (ple->instr >= run_hi) break;
+            if (ple->instr < lo) continue;
+            size_t n = 0;
+            Panda__TaintQuery **tqs = nullptr;
+            if (Panda__TaintQueryPri *tqh = ple->taint_query_pri) {
+                // As in taint_query_pri.
+                if (is_header_file(std::string(tqh->src_info->filename))) {
+                    continue;
+                }
+                n = tqh->n_taint_query;
+                tqs = tqh->taint_query;
+            } else if (Panda__TaintedBranch *tb = ple->tainted_branch) {
+                n = tb->n_taint_query;
+                tqs = tb->taint_query;
+            }
+            for (size_t j = 0; j < n; j++) {
+                if (tqs[j]->unique_label_set) {
+                    define(tqs[j]->unique_label_set);
+                    num_sets++;
+                }
+            }
+        }
+        i = end;
+    }
+    printf("%lu label set definitions before instr %lu\n", num_sets, hi);
+}
+
+// Analyze one pandalog, from the start or from a checkpoint's position.
+// inputfile and persister must already be set up. Returns false if we hit
+// curtail.
+bool process_pandalog(const std::string &plog,
+        PlogPosition pos = PlogPosition()) {
+    /*
+     re-read pandalog, this time focusing on taint queries.  Look for
+     dead available data, attack points, and thus bug injection oppotunities
+    */
+    if (pos.instr < instr_lo) {
+        scan_label_sets(plog, instr_lo, update_unique_taint_sets);
+        pos = PlogPosition{instr_lo, 0, 0};
+    }
+    // Entries are decoded ahead on a background thread, which also frees them.
+    PlogPrefetcher reader(plog, pos.instr);
+    uint64_t &num_entries_read = pos.num_entries_read;
+    // Entries at pos.instr that were processed before the checkpoint.
+    uint64_t to_skip = pos.entries_at_instr;
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    bool complete = true;
+
+    while (1) {
+        // collect log entries that have same instr count (and pc).
+        // these are to be considered together.
+        Panda__LogEntry *ple;
+        {
+            FbiStats::Scope timer(stats, FbiStats::DECODE_WAIT);
+            ple = reader.next();
+        }
+        if (ple == NULL)  break;
+        if (ple->instr >= instr_hi) break;
+        if (ple->instr < pos.instr) continue;
+        if (to_skip > 0 && ple->instr == pos.instr) {
+            to_skip--;
+            continue;
+        }
+        to_skip = 0;
+        num_entries_read++;
+        count_entry(ple);
+        if ((num_entries_read % 10000) == 0) {
+            printf("processed %lu pandalog entries \n", num_entries_read);
+            std::cout << num_bugs_added_to_db << " added to db "
+                << recent_dead_duas.size() << " current duas "
+                << num_real_duas << " real duas "
+                << num_fake_duas << " fake duas\n";
+        }
 
-    if (argc == 6) {
-        curtail = atoi(argv[5]);
+        if (ple->taint_query_pri) {
+            taint_query_pri(ple);
+        } else if (ple->tainted_branch) {
+            update_liveness(ple);
+        } else if (ple->attack_point) {
+            attack_point_lval_usage(ple);
+        } else if (ple->dwarf_call) {
+            record_call(ple);
+        } else if (ple->dwarf_ret) {
+            record_ret(ple);
+        }
+        {
+            FbiStats::Scope timer(stats, FbiStats::FLUSH);
+            persister->maybe_flush();
+        }
+
+        if (ple->instr != pos.instr) {
+            pos.instr = ple->instr;
+            pos.entries_at_instr = 0;
+        }
+        pos.entries_at_instr++;
+
+        if (curtail > 0 && num_real_duas > curtail) {
+            std::cout << "*** Curtailing output of fbi at " << num_real_duas << "\n";
+            // So a later run with a bigger curtail can carry on from here.
+            if (!checkpoint_path.empty()) save_checkpoint(plog, pos);
+            complete = false;
+            break;
+        }
+
+        if (!checkpoint_path.empty() && (num_entries_read % 1024) == 0
+                && std::chrono::steady_clock::now() - last_checkpoint
+                    >= checkpoint_interval) {
+            save_checkpoint(plog, pos);
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
     }
+    LabelPool::report(std::cout, LabelPool::get_stats());
+    return complete;
+}
+
+// Windowed analysis (--jobs N with a single pandalog). The log is cut into N
+// instruction windows of similar work (see PlogIndex::split), and a process
+// per window decodes it and does the part of the analysis that doesn't need
+// to know what came before: resolving label sets, the union of labels on
+// each tainted branch, and which taint queries could be duas given dead
+// enough labels. Each writes what it found, in log order, to a digest.
+//
+// Liveness is the one thing that needs all of the log before a point, so the
+// rest happens in this process: replaying the digests in order adds up the
+// liveness changes as they come, rechecks each candidate dua against the
+// liveness at its query, and records bugs at attack points, through the same
+// code as a serial run. Bugs, ids and decimation come out exactly as they
+// would have serially.
+static constexpr const char *DIGEST_MAGIC = "FBIDIGS1";
+static constexpr uint32_t DIGEST_VERSION = 2;
+
+enum DigestRecord : uint8_t {
+    // Ptr, labels.
+    DIGEST_LABEL_SET,
+    // A DuaCandidate.
+    DIGEST_DUA_CANDIDATE,
+    // QueryHeader and QueriedBytes of a query whose label sets were defined
+    // before the window; this process works out the candidate.
+    DIGEST_QUERY,
+    // Sorted labels on a tainted branch.
+    DIGEST_BRANCH_LABELS,
+    // Label set ptrs of a tainted branch that uses sets from before the
+    // window.
+    DIGEST_BRANCH_PTRS,
+    // instr, info, ast_loc_id.
+    DIGEST_ATTACK_POINT,
+};
 
-    // We want decimation to be deterministic, so srand w/ magic value.
-    srand(0x6c617661);
+struct QueryHeader {
+    uint64_t instr;
+    uint32_t len;
+    uint32_t num_tainted;
+    uint32_t ast_loc_id;
+};
+
+static void put_candidate(SnapshotWriter &w, const DuaCandidate &c) {
+    w.put(c.instr);
+    w.put(c.len);
+    w.put(c.ast_loc_id);
+    w.put(c.max_tcn);
+    w.put(c.max_card);
+    w.put_str(c.astnodename);
+    w.put_vec(c.viable_ptrs);
+    w.put_vec(c.byte_tcn);
+    w.put_vec(c.all_labels);
+}
 
-    std::ifstream host_json(argv[1]);
+static DuaCandidate get_candidate(SnapshotReader &r) {
+    DuaCandidate c;
+    c.instr = r.get<uint64_t>();
+    c.len = r.get<uint32_t>();
+    c.ast_loc_id = r.get<uint32_t>();
+    c.max_tcn = r.get<uint32_t>();
+    c.max_card = r.get<uint32_t>();
+    c.astnodename = r.get_str();
+    c.viable_ptrs = r.get_vec<Ptr>();
+    c.byte_tcn = r.get_vec<uint32_t>();
+    c.all_labels = r.get_vec<uint32_t>();
+    return c;
+}
+
+// Digest the entries with lo <= instr < hi. Runs in a worker process, so it
+// must not persist anything.
+void digest_window(const std::string &plog, uint64_t lo, uint64_t hi,
+        const std::string &path) {
+    FbiStats::Scope timer(stats, FbiStats::DIGEST);
+    SnapshotWriter w(path, DIGEST_MAGIC, DIGEST_VERSION);
+    // Label sets defined in this window.
+    PtrHashMap<uint32_t> set_index;
+    std::vector<std::vector<uint32_t>> sets;
+    auto resolve = [&](Ptr p) -> const std::vector<uint32_t> * {
+        uint32_t *i = set_index.find(p);
+        return i ? &sets[*i] : nullptr;
+    };
+    auto define = [&](const Panda__TaintQueryUniqueLabelSet *tquls) {
+        w.put<uint8_t>(DIGEST_LABEL_SET);
+        w.put<Ptr>(tquls->ptr);
+        w.put_array(tquls->label, tquls->n_label);
+        if (set_index.insert(tquls->ptr, sets.size())) {
+            sets.emplace_back(tquls->label, tquls->label + tquls->n_label);
+        }
+    };
+
+    uint64_t num_entries_read = 0, num_candidates = 0;
+    std::vector<QueriedByte> bytes;
+    std::vector<Ptr> ptrs;
+    PlogPrefetcher reader(plog, lo);
+    while (true) {
+        Panda__LogEntry *ple;
+        {
+            FbiStats::Scope timer(stats, FbiStats::DECODE_WAIT);
+            ple = reader.next();
+        }
+        if (!ple || ple->instr >= hi) break;
+        if (ple->instr < lo) continue;
+        num_entries_read++;
+        count_entry(ple);
+
+        if (Panda__TaintQueryPri *tqh = ple->taint_query_pri) {
+            // As in taint_query_pri.
+            Panda__SrcInfoPri *si = tqh->src_info;
+            if (is_header_file(std::string(si->filename))) continue;
+            bool resolved = true;
+            bytes.clear();
+            for (uint32_t i = 0; i < tqh->n_taint_query; i++) {
+                Panda__TaintQuery *tq = tqh->taint_query[i];
+                if (tq->unique_label_set) define(tq->unique_label_set);
+                bytes.push_back(QueriedByte{tq->offset, tq->tcn, tq->ptr});
+            }
+            uint32_t len = std::min(tqh->len, max_lval);
+            if (tqh->num_tainted >= LAVA_MAGIC_VALUE_SIZE) {
+                for (const QueriedByte &b : bytes) {
+                    if (b.offset < len && !resolve(b.ptr)) resolved = false;
+                }
+            }
+            if (!resolved) {
+                w.put<uint8_t>(DIGEST_QUERY);
+                w.put(QueryHeader{ple->instr, len, tqh->num_tainted,
+                        si->ast_loc_id});
+                w.put_str(si->astnodename);
+                w.put_vec(bytes);
+                continue;
+            }
+            DuaCandidate c{ple->instr, len, si->ast_loc_id, si->astnodename};
+            if (dua_candidate(c, tqh->num_tainted, bytes.data(), bytes.size(),
+                        resolve)) {
+                assert(si->has_ast_loc_id);
+                w.put<uint8_t>(DIGEST_DUA_CANDIDATE);
+                put_candidate(w, c);
+                num_candidates++;
+            }
+        } else if (Panda__TaintedBranch *tb = ple->tainted_branch) {
+            // As in update_liveness.
+            bool resolved = true;
+            ptrs.clear();
+            for (uint32_t i = 0; i < tb->n_taint_query; i++) {
+                Panda__TaintQuery *tq = tb->taint_query[i];
+                if (tq->unique_label_set) define(tq->unique_label_set);
+                ptrs.push_back(tq->ptr);
+                if (!resolve(tq->ptr)) resolved = false;
+            }
+            if (resolved) {
+                LabelBitmap all_labels;
+                for (Ptr p : ptrs) all_labels.add(*resolve(p));
+                w.put<uint8_t>(DIGEST_BRANCH_LABELS);
+                w.put_vec(all_labels.to_vector());
+            } else {
+                w.put<uint8_t>(DIGEST_BRANCH_PTRS);
+                w.put_vec(ptrs);
+            }
+        } else if (Panda__AttackPoint *pleatp = ple->attack_point) {
+            // As in attack_point_lval_usage.
+            Panda__SrcInfo *si = pleatp->src_info;
+            if (is_header_file(ind2str(si->filename))) continue;
+            w.put<uint8_t>(DIGEST_ATTACK_POINT);
+            w.put<uint64_t>(ple->instr);
+            w.put<uint32_t>(pleatp->info);
+            w.put<uint32_t>(si->has_ast_loc_id ? si->ast_loc_id : UINT32_MAX);
+        }
+    }
+    w.commit();
+    printf("window [%lu, %lu): %lu pandalog entries, %lu candidate duas, "
+            "%lu label sets\n", lo, hi, num_entries_read, num_candidates,
+            sets.size());
+}
+
+// Digest just the label sets defined before instr hi, for a windowed run
+// that starts at --instr-range's LO. Runs in a worker process.
+void digest_label_sets(const std::string &plog, uint64_t hi,
+        const std::string &path) {
+    FbiStats::Scope timer(stats, FbiStats::DIGEST);
+    SnapshotWriter w(path, DIGEST_MAGIC, DIGEST_VERSION);
+    // Only the first definition of a ptr counts, as in define_label_set.
+    PtrHashMap<bool> seen;
+    scan_label_sets(plog, hi,
+            [&](const Panda__TaintQueryUniqueLabelSet *tquls) {
+                if (!seen.insert(tquls->ptr, true)) return;
+                w.put<uint8_t>(DIGEST_LABEL_SET);
+                w.put<Ptr>(tquls->ptr);
+                w.put_array(tquls->label, tquls->n_label);
+            });
+    w.commit();
+}
+
+// Replay one window's digest, in order. Returns false if we hit curtail.
+bool replay_digest(const std::string &path) {
+    FbiStats::Scope timer(stats, FbiStats::REPLAY);
+    SnapshotReader r(path, DIGEST_MAGIC, DIGEST_VERSION);
+    for (uint64_t records = 1; !r.at_end(); records++) {
+        switch (r.get<uint8_t>()) {
+        case DIGEST_LABEL_SET: {
+            Ptr p = r.get<Ptr>();
+            std::vector<uint32_t> labels = r.get_vec<uint32_t>();
+            const LabelSet **known = ptr_to_labelset.find(p);
+            // A worker only knew its own window's sets; if one of them meant
+            // something else before, its candidates are wrong.
+            if (known && !std::equal(labels.begin(), labels.end(),
+                        (*known)->labels.begin(), (*known)->labels.end())) {
+                throw std::runtime_error("label set " + std::to_string(p)
+                        + " redefined; rerun without --jobs");
+            }
+            define_label_set(p, labels.data(), labels.size());
+            break;
+        }
+        case DIGEST_DUA_CANDIDATE:
+            add_dua_candidate(get_candidate(r));
+            break;
+        case DIGEST_QUERY: {
+            QueryHeader h = r.get<QueryHeader>();
+            DuaCandidate c{h.instr, h.len, h.ast_loc_id, r.get_str()};
+            std::vector<QueriedByte> bytes = r.get_vec<QueriedByte>();
+            if (dua_candidate(c, h.num_tainted, bytes.data(), bytes.size(),
+                        [](Ptr p) { return &ptr_to_labelset.at(p)->labels; })) {
+                add_dua_candidate(std::move(c));
+            }
+            break;
+        }
+        case DIGEST_BRANCH_LABELS: {
+            std::vector<uint32_t> labels = r.get_vec<uint32_t>();
+            stats.record(FbiStats::BRANCH_LABELS, labels.size());
+            FbiStats::Scope liveness_timer(stats, FbiStats::LIVENESS);
+            for (uint32_t l : labels) label_used(l);
+            break;
+        }
+        case DIGEST_BRANCH_PTRS: {
+            LabelBitmap all_labels;
+            for (Ptr p : r.get_vec<Ptr>()) {
+                all_labels.add(ptr_to_labelset.at(p)->labels);
+            }
+            stats.record(FbiStats::BRANCH_LABELS, all_labels.size());
+            FbiStats::Scope liveness_timer(stats, FbiStats::LIVENESS);
+            all_labels.for_each(label_used);
+            break;
+        }
+        case DIGEST_ATTACK_POINT: {
+            uint64_t instr = r.get<uint64_t>();
+            uint32_t info = r.get<uint32_t>();
+            uint32_t ast_loc_id = r.get<uint32_t>();
+            assert(recent_dead_duas.empty() || ast_loc_id != UINT32_MAX);
+            attack_point_at(instr, info, ast_loc_id);
+            break;
+        }
+        default:
+            throw std::runtime_error(path + " is corrupt");
+        }
+        {
+            FbiStats::Scope timer(stats, FbiStats::FLUSH);
+            persister->maybe_flush();
+        }
+        if ((records % 1024) == 0) stats.tick();
+
+        if (curtail > 0 && num_real_duas > curtail) {
+            std::cout << "*** Curtailing output of fbi at " << num_real_duas << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Digest plog's windows in up to jobs worker processes. Returns the digests,
+// in log order.
+std::vector<std::string> digest_windows(const std::string &plog,
+        unsigned jobs, const std::string &tmpdir) {
+    assert(!db);
+    if (chaff_bugs) {
+        // Fake duas need the whole query, which digests don't keep.
+        throw std::runtime_error("chaff bugs need a serial run");
+    }
+    PlogIndex index = PlogIndex::open(plog);
+    std::vector<std::pair<uint64_t, uint64_t>> windows;
+    for (auto window : index.split(jobs)) {
+        window.first = std::max(window.first, instr_lo);
+        window.second = std::min(window.second, instr_hi);
+        if (window.first < window.second) windows.push_back(window);
+    }
+    // The first window may use label sets defined before LO; one more worker
+    // collects those, and its digest goes first.
+    bool scan_before = instr_lo > 0 && !windows.empty();
+    if (scan_before) windows.insert(windows.begin(), std::make_pair(0, instr_lo));
+
+    std::vector<std::string> digests;
+    std::map<pid_t, size_t> running;
+    for (size_t i = 0; i < windows.size(); i++) {
+        std::string base = tmpdir + "/window-" + std::to_string(i);
+        digests.push_back(base + ".digest");
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw std::runtime_error("fork failed");
+        } else if (pid == 0) {
+            int status = 0;
+            try {
+                if (!freopen((base + ".log").c_str(), "w", stdout)) {
+                    throw std::runtime_error("Could not open " + base + ".log");
+                }
+                stats = FbiStats();
+                if (scan_before && i == 0) {
+                    digest_label_sets(plog, instr_lo, digests.back());
+                } else {
+                    digest_window(plog, windows[i].first, windows[i].second,
+                            digests.back());
+                }
+                if (!stats_path.empty()) stats.write(base + ".stats.json");
+            } catch (std::exception &e) {
+                std::cerr << base << ": " << e.what() << "\n";
+                status = 1;
+            }
+            fflush(stdout);
+            _exit(status);
+        }
+        printf("worker %d: instrs [%lu, %lu)\n", pid, windows[i].first,
+                windows[i].second);
+        running[pid] = i;
+    }
+
+    bool failed = false;
+    while (!running.empty()) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) throw std::runtime_error("waitpid failed");
+        auto it = running.find(pid);
+        if (it == running.end()) continue;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("worker %d FAILED. See %s/window-%lu.log\n", pid,
+                    tmpdir.c_str(), it->second);
+            failed = true;
+        }
+        running.erase(it);
+    }
+    if (failed) throw std::runtime_error("fbi worker failed");
+    return digests;
+}
+
+// Set up db and persister: the database, or a bug file if one was given.
+// When resuming from a checkpoint, persister_state is the persister's saved
+// state.
+void open_output(const Json::Value &host, const Json::Value &project,
+        const std::string &bug_file, uint32_t batch_size,
+        uint32_t flush_seconds, const std::string &persister_state = "") {
+    if (bug_file.empty()) {
+        std::string db_name = project["db"].asString() + host.get("db_suffix", "").asString();
+        db.reset(new odb::pgsql::database("postgres", "postgrespostgres",
+                    db_name));
+        persister.reset(new BatchPersister(*db, batch_size,
+                    std::chrono::seconds(flush_seconds)));
+    } else {
+        printf("Writing bug file %s, not touching the database\n",
+                bug_file.c_str());
+        persister.reset(new BugFileWriter(bug_file));
+    }
+    if (!persister_state.empty()) {
+        persister->restore_state(persister_state, inputfile);
+    }
+    // After restoring, which may drop bugs recorded since the checkpoint.
+    if (db) load_skip_lists();
+}
+
+// Analyze each (pandalog, inputfile) run in a worker process, at most jobs at
+// a time, and return the bug files they wrote, in the order of runs.
+//
+// Workers are processes rather than threads because PANDA's pandalog reader
+// keeps its state in globals, as does the analysis here. Each worker gets a
+// fresh copy of that state at fork, so runs can't see each other's duas;
+// that matches running fbi once per input. Worker output goes to
+// tmpdir/<i>.log and results to tmpdir/<i>.bugs. This must be called before
+// we connect to the database, so no worker shares the connection.
+std::vector<std::string> run_workers(
+        const std::vector<std::pair<std::string, std::string>> &runs,
+        unsigned jobs, const std::string &tmpdir) {
+    assert(!db);
+    std::vector<std::string> bug_files;
+    std::map<pid_t, size_t> running;
+    size_t next = 0;
+    bool failed = false;
+    while (running.size() > 0 || (next < runs.size() && !failed)) {
+        if (next < runs.size() && !failed && running.size() < jobs) {
+            std::string base = tmpdir + "/" + std::to_string(next);
+            bug_files.push_back(base + ".bugs");
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0) {
+                throw std::runtime_error("fork failed");
+            } else if (pid == 0) {
+                int status = 0;
+                try {
+                    if (!freopen((base + ".log").c_str(), "w", stdout)) {
+                        throw std::runtime_error("Could not open " + base + ".log");
+                    }
+                    inputfile = runs[next].second;
+                    stats = FbiStats();
+                    persister.reset(new BugFileWriter(bug_files.back()));
+                    process_pandalog(runs[next].first);
+                    persister->finish();
+                    std::cout << num_bugs_added_to_db << " bugs found\n";
+                    if (!stats_path.empty()) stats.write(base + ".stats.json");
+                } catch (std::exception &e) {
+                    std::cerr << runs[next].first << ": " << e.what() << "\n";
+                    status = 1;
+                }
+                fflush(stdout);
+                _exit(status);
+            }
+            printf("worker %d: %s (%s)\n", pid, runs[next].first.c_str(),
+                    runs[next].second.c_str());
+            running[pid] = next++;
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) throw std::runtime_error("waitpid failed");
+        auto it = running.find(pid);
+        if (it == running.end()) continue;
+        size_t i = it->second;
+        running.erase(it);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            printf("worker %d done: %s\n", pid, runs[i].first.c_str());
+        } else {
+            // Let the others finish, but don't start any more.
+            printf("worker %d FAILED: %s. See %s/%lu.log\n", pid,
+                    runs[i].first.c_str(), tmpdir.c_str(), i);
+            failed = true;
+        }
+    }
+    if (failed) throw std::runtime_error("fbi worker failed");
+    return bug_files;
+}
+
+// A fresh directory for workers' files under directory.
+std::string make_tmpdir(const std::string &directory) {
+    std::string tmpdir_template = directory + "/fbi-XXXXXX";
+    if (!mkdtemp(&tmpdir_template[0])) {
+        throw std::runtime_error("Could not create " + tmpdir_template);
+    }
+    return tmpdir_template;
+}
+
+void usage() {
+    printf("Find Bug Inject (FBI) -- Version %s\n", LAVA_VER);
+    printf("usage: fbi [options] host.json ProjectName pandalog inputfile [curtail count]\n");
+    printf("       fbi [options] host.json ProjectName pandalog inputfile [pandalog inputfile ...]\n");
+    printf("    Options:\n");
+    printf("        -o, --bug-file FILE: Write results to columnar bug FILE\n");
+    printf("            instead of the database. Import with fbi_load.\n");
+    printf("        -j, --jobs N: Analyze up to N pandalogs at once, each in\n");
+    printf("            its own process, then merge and dedup the results.\n");
+    printf("            With one pandalog, split it into N windows that are\n");
+    printf("            decoded in parallel; results are as for a serial run.\n");
+    printf("        -c, --checkpoint FILE: Save analysis state to FILE as we go,\n");
+    printf("            and at curtail. If FILE exists, resume from it.\n");
+    printf("            Single pandalog only.\n");
+    printf("        --checkpoint-seconds N: Seconds between checkpoints\n");
+    printf("            (default 600).\n");
+    printf("        --stats FILE: Write counts, timings, histograms and memory\n");
+    printf("            use to FILE as JSON at the end.\n");
+    printf("        --progress: Keep a progress line on stderr.\n");
+    printf("        --instr-range LO:HI: Only analyze entries with instr in\n");
+    printf("            [LO, HI). Either end may be left out. Taint seen before\n");
+    printf("            LO doesn't count toward liveness, but the label sets\n");
+    printf("            defined before LO are still read.\n");
+    printf("        --seed N: Seed for decimation, extra duas and magic values\n");
+    printf("            (default 0x6c617661). Results depend only on the seed,\n");
+    printf("            not on how the run is split up.\n");
+    printf("    Only one fbi or fbi_load may write to a database at a time.\n");
+    printf("    Project JSON file may specify properties:\n");
+    printf("        max_liveness: Maximum liveness for DUAs\n");
+    printf("        max_cardinality: Maximum cardinality for labelsets on DUAs\n");
+    printf("        max_tcn: Maximum taint compute number for DUAs\n");
+    printf("        max_lval_size: Maximum bytewise size for \n");
+    printf("        fbi_batch_size: Rows to buffer before writing to the DB\n");
+    printf("        fbi_flush_seconds: Max seconds between DB writes\n");
+    printf("        fbi_top_k: Bugs to keep per attack point and type, best\n");
+    printf("            scoring first (default 0, keep all)\n");
+    printf("        fbi_score_weights: Object with weights (default 1) for\n");
+    printf("            liveness, tcn, distance and diversity in the score\n");
+    printf("    pandalog: Pandalog. Should be like queries-file-5.22-bash.iso.plog\n");
+    printf("    inputfile: Input file basename, like malware.pcap\n");
+    exit (1);
+}
+
+int main (int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "bug-file", required_argument, nullptr, 'o' },
+        { "jobs", required_argument, nullptr, 'j' },
+        { "checkpoint", required_argument, nullptr, 'c' },
+        { "checkpoint-seconds", required_argument, nullptr, 'C' },
+        { "instr-range", required_argument, nullptr, 'r' },
+        { "stats", required_argument, nullptr, 'S' },
+        { "progress", no_argument, nullptr, 'P' },
+        { "seed", required_argument, nullptr, 's' },
+        { nullptr, 0, nullptr, 0 }
+    };
+    std::string bug_file;
+    unsigned jobs = 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:j:c:", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'o':
+            bug_file = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs == 0) usage();
+            break;
+        case 'c':
+            checkpoint_path = optarg;
+            break;
+        case 'C':
+            checkpoint_interval = std::chrono::seconds(atoi(optarg));
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'P':
+            stats.progress = true;
+            break;
+        case 's':
+            rng_seed = strtoull(optarg, nullptr, 0);
+            break;
+        case 'r': {
+            const char *colon = strchr(optarg, ':');
+            if (!colon) usage();
+            if (colon != optarg) instr_lo = strtoull(optarg, nullptr, 0);
+            if (colon[1] != '\0') instr_hi = strtoull(colon + 1, nullptr, 0);
+            if (instr_lo >= instr_hi) usage();
+            break;
+        }
+        default:
+            usage();
+        }
+    }
+    // Positional arguments.
+    int nargs = argc - optind;
+    char **args = argv + optind;
+    // Either one pandalog/inputfile pair and an optional curtail count, or
+    // any number of pairs.
+    if (nargs < 4 || (nargs % 2 == 1 && nargs != 5)) usage();
+
+    if (nargs == 5) {
+        curtail = atoi(args[4]);
+        nargs = 4;
+    }
+
+    std::ifstream host_json(args[0]);
     Json::Value host;
     host_json >> host;
 
-    std::string name = argv[2];
+    std::string name = args[1];
 
     // Find project json
     std::string project_json_path = host["config_dir"].asString() + "/" + name +"/"+name+".json";
@@ -942,12 +2316,9 @@ int main (int argc, char **argv) {
     std::string root_directory = host["output_dir"].asString();
     std::string directory = root_directory + "/" + name;
 
-    std::string plog = argv[3];
-    std::string lavadb = directory + "/lavadb";
-
     // maps from ind -> (filename, lvalname, attackpointname)
-    ind2str = LoadIDB(lavadb);
-    printf("%d strings in lavadb\n", (int)ind2str.size());
+    lavadb.reset(new LavaDB(directory + "/lavadb"));
+    printf("%u strings in lavadb\n", lavadb->size());
 
     if (!project.isMember("max_liveness")) {
         printf("max_liveness not set, using default 100000\n");
@@ -991,6 +2362,66 @@ int main (int argc, char **argv) {
     max_lval = project["max_lval_size"].asUInt();
     printf("max lval size = %d\n", max_lval);
 
+    if (!project.isMember("fbi_batch_size")) {
+        printf("fbi_batch_size not set, using default 10000\n");
+        project["fbi_batch_size"] = 10000;
+    }
+    if (!project["fbi_batch_size"].isUInt()
+            || project["fbi_batch_size"].asUInt() == 0) {
+        throw std::runtime_error("Could not parse fbi_batch_size");
+    }
+    uint32_t batch_size = project["fbi_batch_size"].asUInt();
+    printf("db batch size = %d\n", batch_size);
+
+    if (!project.isMember("fbi_flush_seconds")) {
+        printf("fbi_flush_seconds not set, using default 30\n");
+        project["fbi_flush_seconds"] = 30;
+    }
+    if (!project["fbi_flush_seconds"].isUInt()) {
+        throw std::runtime_error("Could not parse fbi_flush_seconds");
+    }
+    uint32_t flush_seconds = project["fbi_flush_seconds"].asUInt();
+    printf("db flush interval = %ds\n", flush_seconds);
+
+    if (!project.isMember("fbi_top_k")) {
+        printf("fbi_top_k not set, keeping all bugs\n");
+        project["fbi_top_k"] = 0;
+    }
+    if (!project["fbi_top_k"].isUInt()) {
+        throw std::runtime_error("Could not parse fbi_top_k");
+    }
+    top_k = project["fbi_top_k"].asUInt();
+    if (top_k > 0) {
+        printf("keeping top %u bugs per attack point and type\n", top_k);
+    }
+
+    // Missing weights keep their defaults.
+    const Json::Value &weights = project["fbi_score_weights"];
+    if (!weights.isNull()) {
+        if (!weights.isObject()) {
+            throw std::runtime_error("Could not parse fbi_score_weights");
+        }
+        std::pair<const char *, double *> fields[] = {
+            { "liveness", &score_weights.liveness },
+            { "tcn", &score_weights.tcn },
+            { "distance", &score_weights.distance },
+            { "diversity", &score_weights.diversity },
+        };
+        for (const auto &field : fields) {
+            if (!weights.isMember(field.first)) continue;
+            if (!weights[field.first].isNumeric()) {
+                throw std::runtime_error(std::string("Could not parse "
+                            "fbi_score_weights.") + field.first);
+            }
+            *field.second = weights[field.first].asDouble();
+        }
+    }
+    if (top_k > 0) {
+        printf("score weights: liveness %g, tcn %g, distance %g, "
+                "diversity %g\n", score_weights.liveness, score_weights.tcn,
+                score_weights.distance, score_weights.diversity);
+    }
+
     /* Unsupported for now (why?)
     // Chaff has default value of false
     if (!project["chaff"].isBool()) {
@@ -1012,56 +2443,107 @@ int main (int argc, char **argv) {
     }
     printf("Curtail is %d\n", curtail);
 
-    inputfile = std::string(argv[4]);
+    std::vector<std::pair<std::string, std::string>> runs;
+    for (int i = 2; i + 1 < nargs; i += 2) {
+        runs.push_back(std::make_pair(args[i], args[i + 1]));
+    }
 
-    std::string db_name = project["db"].asString() + host.get("db_suffix", "").asString();
-    db.reset(new odb::pgsql::database("postgres", "postgrespostgres",
-                db_name));
-    /*
-     re-read pandalog, this time focusing on taint queries.  Look for
-     dead available data, attack points, and thus bug injection oppotunities
-    */
-    pandalog_open(plog.c_str(), "r");
-    uint64_t num_entries_read = 0;
+    if (!checkpoint_path.empty() && (runs.size() != 1 || jobs != 1)) {
+        throw std::runtime_error("--checkpoint needs a single pandalog and no --jobs");
+    }
 
-    while (1) {
-        // collect log entries that have same instr count (and pc).
-        // these are to be considered together.
-        Panda__LogEntry *ple;
-        ple = pandalog_read_entry();
-        if (ple == NULL)  break;
-        num_entries_read++;
-        if ((num_entries_read % 10000) == 0) {
-            printf("processed %lu pandalog entries \n", num_entries_read);
-            std::cout << num_bugs_added_to_db << " added to db "
-                << recent_dead_duas.size() << " current duas "
-                << num_real_duas << " real duas "
-                << num_fake_duas << " fake duas\n";
+    // With one input, analyze it in this process, straight to the output:
+    // all at once, or window by window with --jobs.
+    if (runs.size() == 1) {
+        inputfile = runs[0].second;
+        // Whether we got to the end of the pandalog, rather than curtail.
+        bool complete = true;
+        if (jobs == 1) {
+            PlogPosition start;
+            std::string persister_state;
+            if (!checkpoint_path.empty() && access(checkpoint_path.c_str(), F_OK) == 0) {
+                start = load_checkpoint(runs[0].first, persister_state);
+            }
+            open_output(host, project, bug_file, batch_size, flush_seconds,
+                    persister_state);
+            complete = process_pandalog(runs[0].first, start);
+        } else {
+            std::string tmpdir = make_tmpdir(directory);
+            printf("Analyzing %s in %u windows in %s\n",
+                    runs[0].first.c_str(), jobs, tmpdir.c_str());
+            std::vector<std::string> digests =
+                digest_windows(runs[0].first, jobs, tmpdir);
+
+            open_output(host, project, bug_file, batch_size, flush_seconds);
+            for (size_t i = 0; i < digests.size(); i++) {
+                bool more = replay_digest(digests[i]);
+                printf("replayed window %lu: %lu real duas, %lu bugs so far\n",
+                        i, num_real_duas, num_bugs_added_to_db);
+                if (!more) break;
+            }
+            LabelPool::report(std::cout, LabelPool::get_stats());
+
+            for (size_t i = 0; i < digests.size(); i++) {
+                std::string base = tmpdir + "/window-" + std::to_string(i);
+                if (!stats_path.empty()) stats.add_worker(base + ".stats.json");
+                unlink(digests[i].c_str());
+                unlink((base + ".log").c_str());
+                unlink((base + ".stats.json").c_str());
+            }
+            rmdir(tmpdir.c_str());
         }
-
-        if (ple->taint_query_pri) {
-            taint_query_pri(ple);
-        } else if (ple->tainted_branch) {
-            update_liveness(ple);
-        } else if (ple->attack_point) {
-            attack_point_lval_usage(ple);
-        } else if (ple->dwarf_call) {
-            record_call(ple);
-        } else if (ple->dwarf_ret) {
-            record_ret(ple);
+        {
+            FbiStats::Scope timer(stats, FbiStats::FLUSH);
+            persister->finish();
         }
-        pandalog_free_entry(ple);
+        // Everything is written, so the checkpoint can't be of use.
+        if (complete && !checkpoint_path.empty()) remove_checkpoint();
+        std::cout << num_bugs_added_to_db << " added to db ";
 
-        if (curtail > 0 && num_real_duas > curtail) {
-            std::cout << "*** Curtailing output of fbi at " << num_real_duas << "\n";
-            break;
+        std::cout << num_potential_bugs << " potential bugs\n";
+        std::cout << num_potential_nonbugs << " potential non bugs\n";
+    } else {
+        std::string tmpdir = make_tmpdir(directory);
+        printf("Analyzing %lu pandalogs with %u workers in %s\n",
+                runs.size(), jobs, tmpdir.c_str());
+        std::vector<std::string> bug_files = run_workers(runs, jobs, tmpdir);
+
+        open_output(host, project, bug_file, batch_size, flush_seconds);
+        BugFileMerger merger(*persister, db.get(), top_k);
+        for (size_t i = 0; i < bug_files.size(); i++) {
+            merger.merge(bug_files[i]);
+            printf("merged %s: %lu bugs so far\n", runs[i].first.c_str(),
+                    merger.num_bugs);
+        }
+        persister->finish();
+
+        // Only clean up after a successful merge; worker logs are handy when
+        // something went wrong.
+        for (size_t i = 0; i < bug_files.size(); i++) {
+            std::string base = tmpdir + "/" + std::to_string(i);
+            if (!stats_path.empty()) stats.add_worker(base + ".stats.json");
+            unlink(bug_files[i].c_str());
+            unlink((base + ".log").c_str());
+            unlink((base + ".stats.json").c_str());
+        }
+        rmdir(tmpdir.c_str());
+
+        num_bugs_added_to_db = merger.num_bugs;
+        num_potential_bugs = merger.num_bugs - merger.num_fake_bugs;
+        num_potential_nonbugs = merger.num_fake_bugs;
+        std::cout << num_bugs_added_to_db << " added to db, "
+            << merger.num_duplicate_bugs << " duplicates across inputs\n";
+        if (top_k > 0) {
+            std::cout << merger.num_over_top_k_bugs
+                << " dropped over fbi_top_k\n";
         }
     }
-    std::cout << num_bugs_added_to_db << " added to db ";
-    pandalog_close();
 
-    std::cout << num_potential_bugs << " potential bugs\n";
-    std::cout << num_potential_nonbugs << " potential non bugs\n";
+    if (stats.progress) fprintf(stderr, "\n");
+    if (!stats_path.empty()) {
+        stats.write(stats_path);
+        printf("stats written to %s\n", stats_path.c_str());
+    }
 
     if (num_potential_bugs == 0) {
         // Typically caused by no duas being identified because
@@ -0,0 +1,250 @@
+#ifndef __FLAT_CONTAINERS_H
+#define __FLAT_CONTAINERS_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Cache-friendly replacements for the std::map/std::set structures fbi hits
+// for every tainted byte and every tainted branch.
+
+// Open-addressing hash map from 64-bit keys (taint set pointers) to a
+// pointer-sized value, with linear probing. Entries are never erased.
+template<typename V>
+class PtrHashMap {
+public:
+    PtrHashMap() : slots(INITIAL_CAPACITY) {}
+
+    size_t size() const { return count; }
+
+    // Returns null if key isn't present.
+    V *find(uint64_t key) {
+        Slot &slot = slots[probe(key)];
+        return slot.used ? &slot.value : nullptr;
+    }
+
+    // Like std::map::at.
+    V &at(uint64_t key) {
+        V *value = find(key);
+        if (!value) throw std::out_of_range("PtrHashMap::at");
+        return *value;
+    }
+
+    // Inserts key if it isn't present yet. Returns true if it was inserted.
+    bool insert(uint64_t key, V value) {
+        // Keep the load factor under 1/2 so probe sequences stay short.
+        if ((count + 1) * 2 > slots.size()) grow();
+        Slot &slot = slots[probe(key)];
+        if (slot.used) return false;
+        slot.used = true;
+        slot.key = key;
+        slot.value = value;
+        count++;
+        return true;
+    }
+
+    // Calls f(key, value) for every entry, in no particular order.
+    template<typename F>
+    void for_each(F f) const {
+        for (const Slot &slot : slots) {
+            if (slot.used) f(slot.key, slot.value);
+        }
+    }
+
+private:
+    static constexpr size_t INITIAL_CAPACITY = 1024;
+
+    struct Slot {
+        uint64_t key = 0;
+        V value = V();
+        bool used = false;
+    };
+    std::vector<Slot> slots;
+    size_t count = 0;
+
+    // Taint set pointers are heap addresses, so their low bits are mostly
+    // zero. Multiplicative hashing mixes the high bits down.
+    size_t hash(uint64_t key) const {
+        return (key * 0x9E3779B97F4A7C15ULL) >> 17;
+    }
+
+    // Index of key's slot, or of the empty slot where it would go.
+    size_t probe(uint64_t key) const {
+        size_t mask = slots.size() - 1;
+        size_t i = hash(key) & mask;
+        while (slots[i].used && slots[i].key != key) i = (i + 1) & mask;
+        return i;
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (const Slot &slot : old) {
+            if (slot.used) slots[probe(slot.key)] = slot;
+        }
+    }
+};
+
+// Map kept as a vector of pairs sorted by key. Iterates in key order, like
+// std::map, but contiguously. Insertions are cheap when keys arrive mostly
+// in increasing order, as lval ids do.
+template<typename K, typename V>
+class SortedVecMap {
+public:
+    typedef std::pair<K, V> value_type;
+    typedef typename std::vector<value_type>::iterator iterator;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+    size_t size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+    const_iterator begin() const { return items.begin(); }
+    const_iterator end() const { return items.end(); }
+    iterator begin() { return items.begin(); }
+    iterator end() { return items.end(); }
+
+    iterator lower_bound(const K &key) {
+        if (items.empty() || items.back().first < key) return items.end();
+        return std::lower_bound(items.begin(), items.end(), key,
+                [](const value_type &item, const K &key) {
+                    return item.first < key;
+                });
+    }
+
+    iterator insert(iterator hint, value_type item) {
+        assert(hint == items.end() || item.first < hint->first);
+        return items.insert(hint, std::move(item));
+    }
+
+    // O(n): everything after key shifts down. fbi only erases when a dua
+    // stops being viable, far less often than it looks lvals up, and each
+    // attack point walks the whole map anyway, which costs more than
+    // the move.
+    size_t erase(const K &key) {
+        iterator it = lower_bound(key);
+        if (it == items.end() || key < it->first) return 0;
+        items.erase(it);
+        return 1;
+    }
+
+private:
+    std::vector<value_type> items;
+};
+
+// Vector with room for N elements inline; spills to the heap beyond that.
+// Only for trivially copyable T (pointers, ints).
+template<typename T, size_t N>
+class SmallVec {
+public:
+    SmallVec() {}
+    SmallVec(const SmallVec &other) { *this = other; }
+    SmallVec &operator=(const SmallVec &other) {
+        if (this == &other) return *this;
+        clear();
+        reserve(other.len);
+        std::memcpy(data(), other.data(), other.len * sizeof(T));
+        len = other.len;
+        return *this;
+    }
+    SmallVec(SmallVec &&other) noexcept { *this = std::move(other); }
+    SmallVec &operator=(SmallVec &&other) noexcept {
+        if (this == &other) return *this;
+        release();
+        if (other.heap) {
+            heap = other.heap;
+            cap = other.cap;
+            other.heap = nullptr;
+            other.cap = N;
+        } else {
+            std::memcpy(inline_items, other.inline_items, other.len * sizeof(T));
+        }
+        len = other.len;
+        other.len = 0;
+        return *this;
+    }
+    ~SmallVec() { release(); }
+
+    T *data() { return heap ? heap : inline_items; }
+    const T *data() const { return heap ? heap : inline_items; }
+    T *begin() { return data(); }
+    T *end() { return data() + len; }
+    const T *begin() const { return data(); }
+    const T *end() const { return data() + len; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+
+    void clear() { len = 0; }
+
+    void insert(T *pos, T value) {
+        size_t i = pos - data();
+        reserve(len + 1);
+        T *d = data();
+        std::memmove(d + i + 1, d + i, (len - i) * sizeof(T));
+        d[i] = value;
+        len++;
+    }
+
+    void erase(T *pos) {
+        std::memmove(pos, pos + 1, (end() - pos - 1) * sizeof(T));
+        len--;
+    }
+
+    void reserve(size_t n) {
+        if (n <= cap) return;
+        size_t new_cap = std::max(n, (size_t)cap * 2);
+        T *new_heap = new T[new_cap];
+        std::memcpy(new_heap, data(), len * sizeof(T));
+        release();
+        heap = new_heap;
+        cap = new_cap;
+    }
+
+private:
+    T inline_items[N];
+    T *heap = nullptr;
+    uint32_t len = 0;
+    uint32_t cap = N;
+
+    void release() {
+        delete[] heap;
+        heap = nullptr;
+        cap = N;
+    }
+};
+
+// For each label (input byte), the set of items tainted by it. Labels are
+// small dense integers, so this is a vector indexed by label; each set is a
+// sorted SmallVec, since most labels taint only a handful of items.
+template<typename T>
+class LabelIndex {
+public:
+    typedef SmallVec<T, 3> Set;
+
+    // Labels must be < size().
+    size_t size() const { return sets.size(); }
+    void resize(size_t n) { if (n > sets.size()) sets.resize(n); }
+
+    const Set &operator[](uint32_t label) const { return sets[label]; }
+
+    void insert(uint32_t label, T item) {
+        Set &set = sets[label];
+        T *it = std::lower_bound(set.begin(), set.end(), item);
+        if (it == set.end() || item < *it) set.insert(it, item);
+    }
+
+    void erase(uint32_t label, T item) {
+        Set &set = sets[label];
+        T *it = std::lower_bound(set.begin(), set.end(), item);
+        if (it != set.end() && !(item < *it)) set.erase(it);
+    }
+
+    void clear(uint32_t label) { sets[label].clear(); }
+
+private:
+    std::vector<Set> sets;
+};
+
+#endif
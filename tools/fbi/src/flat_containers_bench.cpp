@@ -0,0 +1,260 @@
+/*
+  Microbenchmark for the containers in flat_containers.h against the
+  std::map/std::set structures they replaced in fbi.
+
+  ./flat_containers_bench [ops] [seed]
+
+  Each test drives both versions with the same operations, shaped like
+  what fbi does with them, checks that they end up agreeing, and prints
+  the time per operation:
+
+  - ptr_to_labelset: label sets are defined as the pandalog goes, with
+    heap-address-like pointers, and every tainted byte of a query or
+    branch looks up its set, mostly one defined recently.
+  - recent_dead_duas: taint queries keep hitting a working set of lvals;
+    each one looks up its lval, replaces its dua or inserts a new one, and
+    now and then a dua dies and is erased. Every attack point walks the
+    whole map in lval order.
+  - dua_dependencies: each new dua is added under its labels (mostly a
+    near-contiguous run of input offsets), the dua it replaced is removed
+    from its labels, and a label crossing max_liveness clears its entry.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "flat_containers.h"
+
+static double ns_per_op(std::chrono::steady_clock::time_point start,
+        size_t ops) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+}
+
+static void report(const char *name, double old_ns, double new_ns) {
+    printf("%-20s std %8.1f ns/op   flat %8.1f ns/op   (%.2fx)\n", name,
+            old_ns, new_ns, old_ns / new_ns);
+}
+
+// ptr_to_labelset: std::map<Ptr, const LabelSet *> vs PtrHashMap.
+static bool bench_ptr_map(std::mt19937_64 &rng, size_t ops) {
+    // A new set on about one byte in eight; the rest look one up.
+    std::vector<uint64_t> defined;
+    std::vector<std::pair<bool, uint64_t>> trace;
+    uint64_t next_ptr = 0x7f0000000000ULL;
+    for (size_t i = 0; i < ops; i++) {
+        if (defined.empty() || rng() % 8 == 0) {
+            next_ptr += 16 * (1 + rng() % 8);
+            defined.push_back(next_ptr);
+            trace.push_back(std::make_pair(true, next_ptr));
+        } else {
+            // Mostly among the last few hundred sets.
+            size_t back = rng() % 4 ? rng() % std::min<size_t>(256,
+                    defined.size()) : rng() % defined.size();
+            trace.push_back(std::make_pair(false,
+                        defined[defined.size() - 1 - back]));
+        }
+    }
+
+    uintptr_t old_sum = 0, new_sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::map<uint64_t, uintptr_t> old_map;
+    for (const auto &op : trace) {
+        if (op.first) old_map.insert(std::make_pair(op.second, op.second));
+        else old_sum += old_map.at(op.second);
+    }
+    double old_ns = ns_per_op(start, ops);
+
+    start = std::chrono::steady_clock::now();
+    PtrHashMap<uintptr_t> new_map;
+    for (const auto &op : trace) {
+        if (op.first) new_map.insert(op.second, op.second);
+        else new_sum += new_map.at(op.second);
+    }
+    double new_ns = ns_per_op(start, ops);
+
+    report("ptr_to_labelset", old_ns, new_ns);
+    if (old_sum != new_sum || old_map.size() != new_map.size()) {
+        printf("ptr_to_labelset: MISMATCH\n");
+        return false;
+    }
+    return true;
+}
+
+// recent_dead_duas: std::map<unsigned long, const Dua *> vs SortedVecMap.
+static bool bench_dua_map(std::mt19937_64 &rng, size_t ops) {
+    enum Kind { QUERY, DIE, ATTACK_POINT };
+    std::vector<std::pair<Kind, unsigned long>> trace;
+    unsigned long num_lvals = 0;
+    for (size_t i = 0; i < ops; i++) {
+        // Attack points are rare next to taint queries, but each one walks
+        // the whole map.
+        uint32_t r = rng() % 1000;
+        if (r < 1) {
+            trace.push_back(std::make_pair(ATTACK_POINT, 0UL));
+        } else if (r < 20 && num_lvals > 0) {
+            trace.push_back(std::make_pair(DIE, rng() % num_lvals));
+        } else if (num_lvals == 0 || rng() % 16 == 0) {
+            // lval ids come from the database in increasing order.
+            trace.push_back(std::make_pair(QUERY, num_lvals++));
+        } else {
+            trace.push_back(std::make_pair(QUERY, rng() % num_lvals));
+        }
+    }
+
+    uintptr_t old_sum = 0, new_sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::map<unsigned long, uintptr_t> old_map;
+    for (size_t i = 0; i < trace.size(); i++) {
+        unsigned long lval = trace[i].second;
+        switch (trace[i].first) {
+        case QUERY: {
+            auto it = old_map.lower_bound(lval);
+            if (it != old_map.end() && !(lval < it->first)) it->second = i;
+            else old_map.insert(it, std::make_pair(lval, (uintptr_t)i));
+            break;
+        }
+        case DIE:
+            old_map.erase(lval);
+            break;
+        case ATTACK_POINT:
+            for (const auto &kvp : old_map) old_sum += kvp.first ^ kvp.second;
+            break;
+        }
+    }
+    double old_ns = ns_per_op(start, ops);
+
+    start = std::chrono::steady_clock::now();
+    SortedVecMap<unsigned long, uintptr_t> new_map;
+    for (size_t i = 0; i < trace.size(); i++) {
+        unsigned long lval = trace[i].second;
+        switch (trace[i].first) {
+        case QUERY: {
+            auto it = new_map.lower_bound(lval);
+            if (it != new_map.end() && !(lval < it->first)) it->second = i;
+            else new_map.insert(it, std::make_pair(lval, (uintptr_t)i));
+            break;
+        }
+        case DIE:
+            new_map.erase(lval);
+            break;
+        case ATTACK_POINT:
+            for (const auto &kvp : new_map) new_sum += kvp.first ^ kvp.second;
+            break;
+        }
+    }
+    double new_ns = ns_per_op(start, ops);
+
+    report("recent_dead_duas", old_ns, new_ns);
+    if (old_sum != new_sum || old_map.size() != new_map.size()) {
+        printf("recent_dead_duas: MISMATCH\n");
+        return false;
+    }
+    return true;
+}
+
+// dua_dependencies: std::map<uint32_t, std::set<uint32_t>> vs LabelIndex.
+static bool bench_label_index(std::mt19937_64 &rng, size_t ops) {
+    const uint32_t input_size = 1 << 16;
+    struct Op {
+        uint32_t dua, old_dua;
+        // Labels of the new dua, and of the one it replaces (if any).
+        std::vector<uint32_t> labels, old_labels;
+        // Label that crossed max_liveness, or UINT32_MAX.
+        uint32_t crossed;
+    };
+    std::vector<Op> trace;
+    std::vector<std::vector<uint32_t>> dua_labels;
+    size_t num_ops = 0;
+    while (num_ops < ops) {
+        Op op;
+        op.dua = dua_labels.size();
+        uint32_t label = rng() % input_size;
+        for (size_t n = 4 + rng() % 28; n > 0; n--) {
+            op.labels.push_back(label % input_size);
+            label += rng() % 8 == 0 ? 2 + rng() % 32 : 1;
+        }
+        std::sort(op.labels.begin(), op.labels.end());
+        op.labels.erase(std::unique(op.labels.begin(), op.labels.end()),
+                op.labels.end());
+        op.old_dua = 0;
+        if (!dua_labels.empty() && rng() % 2) {
+            op.old_dua = rng() % dua_labels.size();
+            op.old_labels = dua_labels[op.old_dua];
+        }
+        op.crossed = rng() % 4 == 0 ? rng() % input_size : UINT32_MAX;
+        num_ops += op.labels.size() + op.old_labels.size() + 1;
+        dua_labels.push_back(op.labels);
+        trace.push_back(std::move(op));
+    }
+
+    size_t old_sum = 0, new_sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::map<uint32_t, std::set<uint32_t>> old_index;
+    for (const Op &op : trace) {
+        for (uint32_t l : op.old_labels) {
+            auto it = old_index.find(l);
+            if (it != old_index.end()) it->second.erase(op.old_dua);
+        }
+        for (uint32_t l : op.labels) old_index[l].insert(op.dua);
+        if (op.crossed != UINT32_MAX) {
+            auto it = old_index.find(op.crossed);
+            if (it != old_index.end()) {
+                for (uint32_t dua : it->second) old_sum += dua;
+                old_index.erase(it);
+            }
+        }
+    }
+    double old_ns = ns_per_op(start, num_ops);
+
+    start = std::chrono::steady_clock::now();
+    LabelIndex<uint32_t> new_index;
+    new_index.resize(input_size);
+    for (const Op &op : trace) {
+        for (uint32_t l : op.old_labels) new_index.erase(l, op.old_dua);
+        for (uint32_t l : op.labels) new_index.insert(l, op.dua);
+        if (op.crossed != UINT32_MAX) {
+            for (uint32_t dua : new_index[op.crossed]) new_sum += dua;
+            new_index.clear(op.crossed);
+        }
+    }
+    double new_ns = ns_per_op(start, num_ops);
+
+    report("dua_dependencies", old_ns, new_ns);
+    bool same = old_sum == new_sum;
+    for (uint32_t l = 0; same && l < input_size; l++) {
+        auto it = old_index.find(l);
+        const auto &set = new_index[l];
+        if (it == old_index.end()) {
+            same = set.empty();
+        } else {
+            same = std::equal(it->second.begin(), it->second.end(),
+                    set.begin(), set.end());
+        }
+    }
+    if (!same) {
+        printf("dua_dependencies: MISMATCH\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    size_t ops = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    unsigned seed = argc > 2 ? strtoul(argv[2], nullptr, 10) : 0x6c617661;
+
+    std::mt19937_64 rng(seed);
+    printf("%zu operations per test\n", ops);
+    bool ok = true;
+    ok &= bench_ptr_map(rng, ops);
+    ok &= bench_dua_map(rng, ops);
+    ok &= bench_label_index(rng, ops);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+/*
+  Microbenchmark for the sorted label-set kernels in label_ops.hxx, and for
+  accumulating unions in a LabelBitmap (label_bitmap.hxx) instead.
+
+  ./label_ops_bench [pairs] [seed]
+
+  Times union, disjointness test and difference at every level the CPU
+  supports, over random pairs of label sets, and checks each result against
+  the scalar version. Set sizes follow what fbi sees: most taint sets on a
+  byte have a handful of labels, dua and DuaBytes unions tens to hundreds,
+  and a few huge ones come from bytes computed over large parts of the
+  input. Labels are input offsets and mostly come in near-contiguous runs.
+
+  The accumulation test unions groups of sets spread over a multi-megabyte
+  input, the way fbi builds the label set of a dua or a tainted branch.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "label_bitmap.hxx"
+#include "label_ops.hxx"
+
+typedef std::vector<uint32_t> Labels;
+
+static const uint32_t INPUT_SIZE = 1 << 16;
+
+static size_t pick_size(std::mt19937 &rng) {
+    uint32_t bucket = rng() % 100;
+    if (bucket < 60) return 1 + rng() % 4;          // single byte taint sets
+    if (bucket < 90) return 5 + rng() % 60;         // small unions
+    if (bucket < 99) return 65 + rng() % 500;       // dua unions
+    return 1000 + rng() % 8000;                     // computed-over-input
+}
+
+static Labels make_labels(std::mt19937 &rng, size_t n, uint32_t start) {
+    Labels result;
+    uint32_t label = start;
+    while (result.size() < n) {
+        result.push_back(label);
+        // Mostly adjacent bytes, with the occasional jump.
+        label += (rng() % 8 == 0) ? 2 + rng() % 64 : 1;
+    }
+    return result;
+}
+
+typedef size_t (*SetOp)(const uint32_t *, size_t, const uint32_t *, size_t,
+        uint32_t *);
+typedef bool (*TestOp)(const uint32_t *, size_t, const uint32_t *, size_t);
+
+struct Pairs {
+    std::vector<Labels> a, b;
+    size_t max_size = 0;
+};
+
+static double ns_per_op(std::chrono::steady_clock::time_point start,
+        size_t ops) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+}
+
+// Returns false on a mismatch with reference.
+static bool bench_set_op(const char *name, SetOp op, SetOp reference,
+        const Pairs &pairs, int reps) {
+    std::vector<uint32_t> out(2 * pairs.max_size + LABEL_OPS_SLACK);
+    std::vector<uint32_t> expected(out.size());
+    for (size_t i = 0; i < pairs.a.size(); i++) {
+        const Labels &a = pairs.a[i], &b = pairs.b[i];
+        size_t n = op(a.data(), a.size(), b.data(), b.size(), out.data());
+        size_t m = reference(a.data(), a.size(), b.data(), b.size(),
+                expected.data());
+        if (n != m || !std::equal(out.begin(), out.begin() + n,
+                    expected.begin())) {
+            printf("%s: MISMATCH on pair %zu\n", name, i);
+            return false;
+        }
+    }
+
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < reps; rep++) {
+        for (size_t i = 0; i < pairs.a.size(); i++) {
+            const Labels &a = pairs.a[i], &b = pairs.b[i];
+            total += op(a.data(), a.size(), b.data(), b.size(), out.data());
+        }
+    }
+    printf("%-28s %8.1f ns/op  (checksum %zu)\n", name,
+            ns_per_op(start, reps * pairs.a.size()), total);
+    return true;
+}
+
+static bool bench_test_op(const char *name, TestOp op, const Pairs &pairs,
+        int reps) {
+    for (size_t i = 0; i < pairs.a.size(); i++) {
+        const Labels &a = pairs.a[i], &b = pairs.b[i];
+        if (op(a.data(), a.size(), b.data(), b.size())
+                != labels_disjoint_scalar(a.data(), a.size(), b.data(), b.size())) {
+            printf("%s: MISMATCH on pair %zu\n", name, i);
+            return false;
+        }
+    }
+
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int rep = 0; rep < reps; rep++) {
+        for (size_t i = 0; i < pairs.a.size(); i++) {
+            const Labels &a = pairs.a[i], &b = pairs.b[i];
+            total += op(a.data(), a.size(), b.data(), b.size());
+        }
+    }
+    printf("%-28s %8.1f ns/op  (%zu disjoint)\n", name,
+            ns_per_op(start, reps * pairs.a.size()), total);
+    return true;
+}
+
+// Union of each group of sets: repeated merges into a sorted vector (what
+// merge_into does) against adding to a LabelBitmap.
+static bool bench_accumulate(std::mt19937 &rng, size_t num_groups,
+        size_t group_size) {
+    const uint32_t big_input = 8 << 20;
+    std::vector<std::vector<Labels>> groups(num_groups);
+    for (auto &group : groups) {
+        for (size_t i = 0; i < group_size; i++) {
+            group.push_back(make_labels(rng, pick_size(rng),
+                        rng() % big_input));
+        }
+    }
+
+    size_t total = 0;
+    std::vector<std::vector<uint32_t>> expected;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint32_t> acc, prev;
+    for (const auto &group : groups) {
+        acc.clear();
+        for (const Labels &labels : group) {
+            prev.swap(acc);
+            acc.resize(prev.size() + labels.size() + LABEL_OPS_SLACK);
+            acc.resize(label_union(prev.data(), prev.size(),
+                        labels.data(), labels.size(), acc.data()));
+        }
+        total += acc.size();
+        expected.push_back(acc);
+    }
+    printf("%-28s %8.1f us/union (%zu sets, %zu labels)\n",
+            "accumulate sorted vector", ns_per_op(start, num_groups) / 1000,
+            group_size, total / num_groups);
+
+    start = std::chrono::steady_clock::now();
+    std::vector<std::vector<uint32_t>> results;
+    for (const auto &group : groups) {
+        LabelBitmap bitmap;
+        for (const Labels &labels : group) bitmap.add(labels);
+        results.push_back(bitmap.to_vector());
+    }
+    printf("%-28s %8.1f us/union\n", "accumulate LabelBitmap",
+            ns_per_op(start, num_groups) / 1000);
+    if (results != expected) {
+        printf("accumulate LabelBitmap: MISMATCH\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    size_t num_pairs = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    unsigned seed = argc > 2 ? strtoul(argv[2], nullptr, 10) : 0x6c617661;
+    const int reps = 5;
+
+    std::mt19937 rng(seed);
+    Pairs pairs;
+    for (size_t i = 0; i < num_pairs; i++) {
+        // Half the pairs overlap, as when unioning the taint sets of
+        // neighboring bytes; the rest are anywhere in the input.
+        uint32_t start = rng() % INPUT_SIZE;
+        pairs.a.push_back(make_labels(rng, pick_size(rng), start));
+        uint32_t b_start = rng() % 2 ? start + rng() % 16 : rng() % INPUT_SIZE;
+        pairs.b.push_back(make_labels(rng, pick_size(rng), b_start));
+        pairs.max_size = std::max(pairs.max_size,
+                std::max(pairs.a.back().size(), pairs.b.back().size()));
+    }
+    printf("%zu pairs, max set size %zu, best level %d\n", num_pairs,
+            pairs.max_size, (int)label_ops_level());
+
+    bool ok = true;
+    ok &= bench_set_op("union scalar", label_union_scalar,
+            label_union_scalar, pairs, reps);
+    ok &= bench_test_op("disjoint scalar", labels_disjoint_scalar, pairs, reps);
+    ok &= bench_set_op("difference scalar", label_difference_scalar,
+            label_difference_scalar, pairs, reps);
+#ifdef LABEL_OPS_X86
+    if (label_ops_level() >= LabelOpsLevel::SSE41) {
+        ok &= bench_set_op("union sse4.1", label_union_sse41,
+                label_union_scalar, pairs, reps);
+        ok &= bench_test_op("disjoint sse4.1", labels_disjoint_sse41,
+                pairs, reps);
+        ok &= bench_set_op("difference sse4.1", label_difference_sse41,
+                label_difference_scalar, pairs, reps);
+    }
+    if (label_ops_level() >= LabelOpsLevel::AVX2) {
+        ok &= bench_test_op("disjoint avx2", labels_disjoint_avx2, pairs, reps);
+    }
+#endif
+    ok &= bench_accumulate(rng, 200, 16);
+    ok &= bench_accumulate(rng, 20, 1000);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,247 @@
+#ifndef __PLOG_INDEX_H
+#define __PLOG_INDEX_H
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "plog_prefetch.h"
+#include "snapshot.h"
+
+// Sidecar index of a pandalog, kept next to it as <plog>.idx and built with
+// one pass over the log the first time it's needed.
+//
+// The log is cut into buckets of about BUCKET_ENTRIES entries, never splitting
+// the entries of one instr. For each bucket the index has its first entry
+// number, its instr range and how many entries of each kind fbi cares about
+// it holds. That is enough to turn an entry number into an instr (and back),
+// to count entries of a kind over an instr range without reading it, and to
+// cut the log into ranges with similar amounts of work.
+//
+// Seeking itself goes through pandalog_seek, which uses the pandalog's own
+// chunk directory; since buckets start at an instr boundary, seeking to a
+// bucket's first_instr lands on its first entry.
+class PlogIndex {
+public:
+    static constexpr uint32_t BUCKET_ENTRIES = 4096;
+
+    enum Kind { TAINT_QUERY, TAINTED_BRANCH, ATTACK_POINT, OTHER, NUM_KINDS };
+
+    struct Counts {
+        uint64_t entries = 0;
+        uint64_t kind[NUM_KINDS] = {0};
+
+        Counts &operator+=(const Counts &other) {
+            entries += other.entries;
+            for (int k = 0; k < NUM_KINDS; k++) kind[k] += other.kind[k];
+            return *this;
+        }
+    };
+
+    struct Bucket {
+        uint64_t first_entry;
+        uint64_t first_instr;
+        uint64_t last_instr;
+        Counts counts;
+    };
+
+    // Where to start reading to get to an entry: seek to instr, then skip
+    // this many entries.
+    struct Seek {
+        uint64_t instr;
+        uint64_t skip;
+    };
+
+    std::vector<Bucket> buckets;
+    Counts total;
+
+    static Kind kind_of(const Panda__LogEntry *ple) {
+        if (ple->taint_query_pri) return TAINT_QUERY;
+        if (ple->tainted_branch) return TAINTED_BRANCH;
+        if (ple->attack_point) return ATTACK_POINT;
+        return OTHER;
+    }
+
+    static const char *kind_name(int kind) {
+        static const char *names[NUM_KINDS] = {
+            "taint_query_pri", "tainted_branch", "attack_point", "other"
+        };
+        return names[kind];
+    }
+
+    static std::string path_for(const std::string &plog) {
+        return plog + ".idx";
+    }
+
+    // The index of plog, from its sidecar if that's up to date, or built
+    // (and saved, if we can) if not.
+    static PlogIndex open(const std::string &plog) {
+        PlogIndex index;
+        if (index.load(plog)) return index;
+        printf("indexing %s\n", plog.c_str());
+        index = build(plog);
+        try {
+            index.save(plog);
+        } catch (std::runtime_error &e) {
+            // A read-only log directory just means indexing again next time.
+            printf("not saving index: %s\n", e.what());
+        }
+        return index;
+    }
+
+    static PlogIndex build(const std::string &plog) {
+        PlogIndex index;
+        PlogPrefetcher reader(plog);
+        Bucket bucket = {};
+        while (Panda__LogEntry *ple = reader.next()) {
+            if (bucket.counts.entries >= BUCKET_ENTRIES
+                    && ple->instr != bucket.last_instr) {
+                index.add(bucket);
+                bucket = Bucket{};
+                bucket.first_entry = index.total.entries;
+            }
+            if (bucket.counts.entries == 0) bucket.first_instr = ple->instr;
+            bucket.last_instr = ple->instr;
+            bucket.counts.entries++;
+            bucket.counts.kind[kind_of(ple)]++;
+        }
+        if (bucket.counts.entries > 0) index.add(bucket);
+        return index;
+    }
+
+    // Entry number -> where to seek.
+    Seek seek_to_entry(uint64_t entry) const {
+        auto it = std::upper_bound(buckets.begin(), buckets.end(), entry,
+                [](uint64_t entry, const Bucket &b) {
+                    return entry < b.first_entry;
+                });
+        if (it == buckets.begin()) return Seek{0, entry};
+        --it;
+        return Seek{it->first_instr, entry - it->first_entry};
+    }
+
+    // The bucket holding the first entry with instr >= instr, or null if
+    // there isn't one. Reading from its first_instr gets there, with entry
+    // numbers counting from its first_entry.
+    const Bucket *bucket_for(uint64_t instr) const {
+        auto it = bucket_at(instr);
+        return it == buckets.end() ? nullptr : &*it;
+    }
+
+    // Entries in buckets overlapping [instr_lo, instr_hi).
+    Counts count(uint64_t instr_lo, uint64_t instr_hi) const {
+        Counts result;
+        for (auto it = bucket_at(instr_lo);
+                it != buckets.end() && it->first_instr < instr_hi; it++) {
+            result += it->counts;
+        }
+        return result;
+    }
+
+    // Cuts the log into at most n instr ranges [lo, hi) covering all of it,
+    // each with about the same number of taint queries, tainted branches and
+    // attack points, which is where fbi spends its time.
+    std::vector<std::pair<uint64_t, uint64_t>> split(unsigned n) const {
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        if (buckets.empty() || n == 0) return ranges;
+        uint64_t work = 0;
+        for (const Bucket &b : buckets) work += weight(b);
+        uint64_t per_range = std::max<uint64_t>(1, (work + n - 1) / n);
+
+        uint64_t lo = 0, so_far = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            so_far += weight(buckets[i]);
+            if (so_far >= per_range && i + 1 < buckets.size()
+                    && ranges.size() + 1 < n) {
+                uint64_t hi = buckets[i + 1].first_instr;
+                ranges.push_back(std::make_pair(lo, hi));
+                lo = hi;
+                so_far = 0;
+            }
+        }
+        ranges.push_back(std::make_pair(lo, UINT64_MAX));
+        return ranges;
+    }
+
+    void save(const std::string &plog) const {
+        SnapshotWriter w(path_for(plog), PLOG_INDEX_MAGIC, PLOG_INDEX_VERSION);
+        put_stamp(w, plog);
+        w.put_vec(buckets);
+        w.commit();
+    }
+
+    // False if there's no index, or it's for a different version of the log.
+    bool load(const std::string &plog) {
+        struct stat st;
+        if (stat(path_for(plog).c_str(), &st) != 0) return false;
+        try {
+            SnapshotReader r(path_for(plog), PLOG_INDEX_MAGIC, PLOG_INDEX_VERSION);
+            if (r.get<uint64_t>() != file_size(plog)
+                    || r.get<int64_t>() != file_mtime(plog)) {
+                return false;
+            }
+            buckets.clear();
+            total = Counts();
+            for (const Bucket &b : r.get_vec<Bucket>()) add(b);
+            return true;
+        } catch (std::runtime_error &e) {
+            printf("ignoring index: %s\n", e.what());
+            return false;
+        }
+    }
+
+private:
+    static constexpr const char *PLOG_INDEX_MAGIC = "PLOGIDX1";
+    static constexpr uint32_t PLOG_INDEX_VERSION = 1;
+
+    void add(const Bucket &b) {
+        buckets.push_back(b);
+        total += b.counts;
+    }
+
+    static uint64_t weight(const Bucket &b) {
+        return b.counts.kind[TAINT_QUERY] + b.counts.kind[TAINTED_BRANCH]
+            + b.counts.kind[ATTACK_POINT];
+    }
+
+    // First bucket whose instrs reach instr.
+    std::vector<Bucket>::const_iterator bucket_at(uint64_t instr) const {
+        return std::lower_bound(buckets.begin(), buckets.end(), instr,
+                [](const Bucket &b, uint64_t instr) {
+                    return b.last_instr < instr;
+                });
+    }
+
+    // The log the index was built from, so a rewritten log isn't matched
+    // with a stale index.
+    static uint64_t file_size(const std::string &plog) {
+        struct stat st;
+        if (stat(plog.c_str(), &st) != 0) {
+            throw std::runtime_error("Could not stat " + plog);
+        }
+        return st.st_size;
+    }
+
+    static int64_t file_mtime(const std::string &plog) {
+        struct stat st;
+        if (stat(plog.c_str(), &st) != 0) {
+            throw std::runtime_error("Could not stat " + plog);
+        }
+        return st.st_mtime;
+    }
+
+    static void put_stamp(SnapshotWriter &w, const std::string &plog) {
+        w.put(file_size(plog));
+        w.put(file_mtime(plog));
+    }
+};
+
+#endif
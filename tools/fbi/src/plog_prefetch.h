@@ -0,0 +1,188 @@
+#ifndef __PLOG_PREFETCH_H
+#define __PLOG_PREFETCH_H
+
+extern "C" {
+#include "panda/plog.h"
+}
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reads a pandalog on a background thread so that decompression and protobuf
+// decoding overlap with analysis.
+//
+// The reader thread decodes entries into batches and hands full batches to
+// the analysis thread through a bounded single-producer single-consumer ring.
+// Batches the consumer is done with go back to the reader thread through a
+// second ring. The reader frees their entries in bulk and reuses the batch.
+//
+// There is exactly one reader thread. PANDA's pandalog reader keeps its state
+// in globals, so decoding can't be split further within one process. Every
+// pandalog_* call happens on the reader thread, including free and close.
+//
+// Usage:
+//     PlogPrefetcher reader(plog);  // or reader(plog, instr) to start there
+//     while (Panda__LogEntry *ple = reader.next()) { ... }
+//
+// An entry stays valid until the next call to next(). The consumer must not
+// free entries itself.
+class PlogPrefetcher {
+public:
+    // Entries per batch, and batches in flight between the two threads.
+    static constexpr size_t BATCH_SIZE = 1024;
+    static constexpr size_t QUEUE_DEPTH = 16;
+
+    // If start_instr is nonzero, reading starts at the first entry with
+    // instr >= start_instr.
+    PlogPrefetcher(const std::string &plog, uint64_t start_instr = 0) {
+        pandalog_open(plog.c_str(), "r");
+        if (start_instr > 0) pandalog_seek(start_instr);
+        thread = std::thread(&PlogPrefetcher::read_loop, this);
+    }
+
+    ~PlogPrefetcher() {
+        // Stopping early (e.g. when curtailing) is fine; the reader drops
+        // whatever it has decoded ahead.
+        stop.store(true, std::memory_order_release);
+        thread.join();
+    }
+
+    // Returns the next entry, or NULL at the end of the log.
+    Panda__LogEntry *next() {
+        while (!current || pos == current->size()) {
+            if (current) {
+                free_batches.push(current);
+                current = nullptr;
+            }
+            if (done) return nullptr;
+            bool got = full_batches.pop(current);
+            for (Backoff backoff; !got; backoff.wait()) {
+                // finished is set after the last push, so if it was set
+                // before the ring came up empty, nothing more is coming.
+                bool last = finished.load(std::memory_order_acquire);
+                got = full_batches.pop(current);
+                if (!got && last) {
+                    done = true;
+                    return nullptr;
+                }
+            }
+            pos = 0;
+        }
+        return (*current)[pos++];
+    }
+
+private:
+    typedef std::vector<Panda__LogEntry *> Batch;
+
+    // Bounded lock-free ring for one producer and one consumer. Capacity is
+    // N - 1.
+    template<typename T, size_t N>
+    class SpscRing {
+    public:
+        bool push(T value) {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            size_t next = (tail + 1) % N;
+            if (next == head_.load(std::memory_order_acquire)) return false;
+            slots[tail] = value;
+            tail_.store(next, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &value) {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire)) return false;
+            value = slots[head];
+            head_.store((head + 1) % N, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        std::array<T, N> slots;
+        // Kept on separate cache lines so the two threads don't false-share.
+        alignas(64) std::atomic<size_t> head_{0};
+        alignas(64) std::atomic<size_t> tail_{0};
+    };
+
+    // Spin briefly, then back off to sleeping, so a stalled side doesn't
+    // burn a core waiting on the other.
+    struct Backoff {
+        unsigned spins = 0;
+        void wait() {
+            if (spins++ < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    };
+
+    // Every batch is in exactly one place: the reader, full_batches,
+    // current, or free_batches. QUEUE_DEPTH + 1 slots per ring means a push
+    // of an owned batch can never fail.
+    std::array<Batch, QUEUE_DEPTH> batches;
+    SpscRing<Batch *, QUEUE_DEPTH + 1> full_batches;
+    SpscRing<Batch *, QUEUE_DEPTH + 1> free_batches;
+
+    std::thread thread;
+    // Set by the reader once the last batch has been pushed.
+    std::atomic<bool> finished{false};
+    // Set by the consumer when it is done with the reader.
+    std::atomic<bool> stop{false};
+
+    // Consumer side.
+    Batch *current = nullptr;
+    size_t pos = 0;
+    bool done = false;
+
+    static void free_entries(Batch *batch) {
+        for (Panda__LogEntry *ple : *batch) pandalog_free_entry(ple);
+        batch->clear();
+    }
+
+    // Reader thread.
+    void read_loop() {
+        for (Batch &batch : batches) {
+            batch.reserve(BATCH_SIZE);
+            free_batches.push(&batch);
+        }
+        bool eof = false;
+        while (!eof && !stop.load(std::memory_order_acquire)) {
+            Batch *batch;
+            for (Backoff backoff; !free_batches.pop(batch); backoff.wait()) {
+                if (stop.load(std::memory_order_acquire)) break;
+            }
+            if (stop.load(std::memory_order_acquire)) break;
+
+            free_entries(batch);
+            while (batch->size() < BATCH_SIZE) {
+                Panda__LogEntry *ple = pandalog_read_entry();
+                if (ple == NULL) {
+                    eof = true;
+                    break;
+                }
+                batch->push_back(ple);
+            }
+            if (!batch->empty()) {
+                bool pushed = full_batches.push(batch);
+                assert(pushed);
+                (void)pushed;
+            }
+        }
+        finished.store(true, std::memory_order_release);
+
+        // Wait for the consumer to be done with everything, then clean up.
+        while (!stop.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (Batch &batch : batches) free_entries(&batch);
+        pandalog_close();
+    }
+};
+
+#endif
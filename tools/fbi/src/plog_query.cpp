@@ -0,0 +1,319 @@
+/*
+  Query a pandalog through its index (plog_index.h), building the index
+  first if there isn't an up-to-date one.
+
+  ./plog_query index PLOG
+      Build (or rebuild) PLOG.idx and print a summary.
+  ./plog_query stats PLOG [LO:HI]
+      Entries of each kind over an instr range, from the index alone.
+  ./plog_query seek PLOG ENTRY
+      Print entry number ENTRY (counting from 0) and where it is.
+  ./plog_query entries PLOG LO:HI [KIND]
+      Print the entries with LO <= instr < HI, optionally only of one kind.
+  ./plog_query sample PLOG N KIND [SEED]
+      Print N entries of KIND picked uniformly at random.
+  ./plog_query scan PLOG JOBS [LO:HI]
+      Count entries over a range by reading it, cut into JOBS pieces read in
+      parallel, and check the counts against the index.
+
+  KIND is one of taint_query_pri, tainted_branch, attack_point, other. In a
+  range, LO or HI can be left out to mean the start or end of the log.
+*/
+
+#define __STDC_FORMAT_MACROS
+#include "inttypes.h"
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "plog_index.h"
+#include "plog_prefetch.h"
+
+typedef std::pair<uint64_t, uint64_t> InstrRange;
+
+static void usage() {
+    printf("usage: plog_query index PLOG\n");
+    printf("       plog_query stats PLOG [LO:HI]\n");
+    printf("       plog_query seek PLOG ENTRY\n");
+    printf("       plog_query entries PLOG LO:HI [KIND]\n");
+    printf("       plog_query sample PLOG N KIND [SEED]\n");
+    printf("       plog_query scan PLOG JOBS [LO:HI]\n");
+    printf("    KIND: taint_query_pri, tainted_branch, attack_point or other\n");
+    exit(1);
+}
+
+static InstrRange parse_range(const char *arg) {
+    const char *colon = strchr(arg, ':');
+    if (!colon) usage();
+    InstrRange range(0, UINT64_MAX);
+    if (colon != arg) range.first = strtoull(arg, nullptr, 0);
+    if (colon[1] != '\0') range.second = strtoull(colon + 1, nullptr, 0);
+    if (range.first >= range.second) usage();
+    return range;
+}
+
+static int parse_kind(const char *arg) {
+    for (int k = 0; k < PlogIndex::NUM_KINDS; k++) {
+        if (strcmp(arg, PlogIndex::kind_name(k)) == 0) return k;
+    }
+    usage();
+    return -1;
+}
+
+static void print_counts(const PlogIndex::Counts &counts) {
+    printf("%" PRIu64 " entries\n", counts.entries);
+    for (int k = 0; k < PlogIndex::NUM_KINDS; k++) {
+        printf("    %-16s %" PRIu64 "\n", PlogIndex::kind_name(k),
+                counts.kind[k]);
+    }
+}
+
+static void print_entry(uint64_t entry_num, const Panda__LogEntry *ple) {
+    printf("entry %" PRIu64 " instr %" PRIu64 " pc 0x%" PRIx64 " ",
+            entry_num, ple->instr, ple->pc);
+    if (Panda__TaintQueryPri *tqh = ple->taint_query_pri) {
+        printf("taint_query_pri %s:%u %s len=%u num_tainted=%u bytes=%zu\n",
+                tqh->src_info->filename, tqh->src_info->linenum,
+                tqh->src_info->astnodename, tqh->len, tqh->num_tainted,
+                tqh->n_taint_query);
+    } else if (Panda__TaintedBranch *tb = ple->tainted_branch) {
+        printf("tainted_branch bytes=%zu\n", tb->n_taint_query);
+    } else if (Panda__AttackPoint *ap = ple->attack_point) {
+        // Strings are lavadb indices; see lavaDB to look them up.
+        printf("attack_point info=%u file=%u line=%u ast_loc_id=%u\n",
+                ap->info, ap->src_info->filename, ap->src_info->linenum,
+                ap->src_info->ast_loc_id);
+    } else {
+        printf("other\n");
+    }
+}
+
+// Reads the entries with instr in range, calling f(entry_num, ple) on each.
+// Stops early if f returns false.
+template<typename F>
+static void read_range(const std::string &plog, const PlogIndex &index,
+        InstrRange range, F f) {
+    const PlogIndex::Bucket *b = index.bucket_for(range.first);
+    if (!b) return;
+    // Start at the bucket's first entry so entry numbers come out right.
+    uint64_t entry_num = b->first_entry;
+    PlogPrefetcher reader(plog, b->first_instr);
+    while (Panda__LogEntry *ple = reader.next()) {
+        if (ple->instr >= range.second) break;
+        // pandalog_seek lands at a chunk boundary, which can be earlier.
+        if (ple->instr < b->first_instr) continue;
+        if (ple->instr < range.first) {
+            entry_num++;
+            continue;
+        }
+        if (!f(entry_num++, ple)) break;
+    }
+}
+
+static int cmd_index(const std::string &plog) {
+    PlogIndex index = PlogIndex::build(plog);
+    index.save(plog);
+    printf("%s: %zu buckets, instrs %" PRIu64 "..%" PRIu64 "\n",
+            PlogIndex::path_for(plog).c_str(), index.buckets.size(),
+            index.buckets.empty() ? 0 : index.buckets.front().first_instr,
+            index.buckets.empty() ? 0 : index.buckets.back().last_instr);
+    print_counts(index.total);
+    return 0;
+}
+
+static int cmd_stats(const std::string &plog, InstrRange range) {
+    PlogIndex index = PlogIndex::open(plog);
+    printf("instrs [%" PRIu64 ", %" PRIu64 "), to bucket precision: ",
+            range.first, range.second);
+    print_counts(index.count(range.first, range.second));
+    return 0;
+}
+
+static int cmd_seek(const std::string &plog, uint64_t entry) {
+    PlogIndex index = PlogIndex::open(plog);
+    if (entry >= index.total.entries) {
+        printf("%s has only %" PRIu64 " entries\n", plog.c_str(),
+                index.total.entries);
+        return 1;
+    }
+    PlogIndex::Seek seek = index.seek_to_entry(entry);
+    printf("seek to instr %" PRIu64 ", skip %" PRIu64 "\n", seek.instr,
+            seek.skip);
+    uint64_t to_skip = seek.skip;
+    read_range(plog, index, InstrRange(seek.instr, UINT64_MAX),
+            [&](uint64_t, Panda__LogEntry *ple) {
+                if (to_skip-- > 0) return true;
+                print_entry(entry, ple);
+                return false;
+            });
+    return 0;
+}
+
+static int cmd_entries(const std::string &plog, InstrRange range, int kind) {
+    PlogIndex index = PlogIndex::open(plog);
+    read_range(plog, index, range, [&](uint64_t n, Panda__LogEntry *ple) {
+                if (kind < 0 || PlogIndex::kind_of(ple) == kind) {
+                    print_entry(n, ple);
+                }
+                return true;
+            });
+    return 0;
+}
+
+static int cmd_sample(const std::string &plog, uint64_t n, int kind,
+        unsigned seed) {
+    PlogIndex index = PlogIndex::open(plog);
+    uint64_t of_kind = index.total.kind[kind];
+    n = std::min(n, of_kind);
+
+    // Pick n distinct ordinals among the entries of this kind, in order.
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> picks;
+    std::uniform_int_distribution<uint64_t> dist(0, of_kind - 1);
+    while (picks.size() < n) {
+        picks.push_back(dist(rng));
+        if (picks.size() == n) {
+            std::sort(picks.begin(), picks.end());
+            picks.erase(std::unique(picks.begin(), picks.end()), picks.end());
+        }
+    }
+
+    // Then read only the buckets they fall in.
+    uint64_t ordinal = 0;
+    auto pick = picks.begin();
+    for (const PlogIndex::Bucket &b : index.buckets) {
+        uint64_t in_bucket = b.counts.kind[kind];
+        if (pick == picks.end()) break;
+        if (*pick >= ordinal + in_bucket) {
+            ordinal += in_bucket;
+            continue;
+        }
+        read_range(plog, index, InstrRange(b.first_instr, b.last_instr + 1),
+                [&](uint64_t entry_num, Panda__LogEntry *ple) {
+                    if (PlogIndex::kind_of(ple) != kind) return true;
+                    if (pick != picks.end() && *pick == ordinal) {
+                        print_entry(entry_num, ple);
+                        pick++;
+                    }
+                    ordinal++;
+                    return true;
+                });
+    }
+    return 0;
+}
+
+// Counts of one piece, read in a child process. PANDA's pandalog reader is
+// global to a process, so that's the only way to read pieces in parallel.
+static pid_t scan_piece(const std::string &plog, const PlogIndex &index,
+        InstrRange range, int fd) {
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error("fork failed");
+    if (pid > 0) return pid;
+
+    PlogIndex::Counts counts;
+    read_range(plog, index, range, [&](uint64_t, Panda__LogEntry *ple) {
+                counts.entries++;
+                counts.kind[PlogIndex::kind_of(ple)]++;
+                return true;
+            });
+    bool ok = write(fd, &counts, sizeof(counts)) == sizeof(counts);
+    _exit(ok ? 0 : 1);
+}
+
+static int cmd_scan(const std::string &plog, unsigned jobs,
+        InstrRange range) {
+    PlogIndex index = PlogIndex::open(plog);
+    // Pieces of the whole log, clipped to range.
+    std::vector<InstrRange> pieces;
+    for (InstrRange piece : index.split(jobs)) {
+        piece.first = std::max(piece.first, range.first);
+        piece.second = std::min(piece.second, range.second);
+        if (piece.first < piece.second) pieces.push_back(piece);
+    }
+
+    std::vector<std::pair<pid_t, int>> children;
+    for (InstrRange piece : pieces) {
+        int fds[2];
+        if (pipe(fds) != 0) throw std::runtime_error("pipe failed");
+        pid_t pid = scan_piece(plog, index, piece, fds[1]);
+        close(fds[1]);
+        children.push_back(std::make_pair(pid, fds[0]));
+    }
+
+    PlogIndex::Counts total;
+    bool failed = false;
+    for (size_t i = 0; i < children.size(); i++) {
+        PlogIndex::Counts counts;
+        bool got = read(children[i].second, &counts, sizeof(counts))
+            == sizeof(counts);
+        close(children[i].second);
+        int status;
+        waitpid(children[i].first, &status, 0);
+        if (!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("piece %zu failed\n", i);
+            failed = true;
+            continue;
+        }
+        printf("instrs [%" PRIu64 ", %" PRIu64 "): %" PRIu64 " entries\n",
+                pieces[i].first, pieces[i].second, counts.entries);
+        total += counts;
+    }
+    if (failed) return 1;
+
+    print_counts(total);
+    // Over the whole log, the index should agree exactly.
+    if (range.first == 0 && range.second == UINT64_MAX
+            && memcmp(&total, &index.total, sizeof(total)) != 0) {
+        printf("MISMATCH with index; rebuild it with plog_query index\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) usage();
+    std::string cmd = argv[1];
+    std::string plog = argv[2];
+    InstrRange everything(0, UINT64_MAX);
+
+    try {
+        if (cmd == "index" && argc == 3) {
+            return cmd_index(plog);
+        } else if (cmd == "stats" && argc <= 4) {
+            return cmd_stats(plog, argc == 4 ? parse_range(argv[3]) : everything);
+        } else if (cmd == "seek" && argc == 4) {
+            return cmd_seek(plog, strtoull(argv[3], nullptr, 0));
+        } else if (cmd == "entries" && (argc == 4 || argc == 5)) {
+            return cmd_entries(plog, parse_range(argv[3]),
+                    argc == 5 ? parse_kind(argv[4]) : -1);
+        } else if (cmd == "sample" && (argc == 5 || argc == 6)) {
+            return cmd_sample(plog, strtoull(argv[3], nullptr, 0),
+                    parse_kind(argv[4]),
+                    argc == 6 ? strtoul(argv[5], nullptr, 0) : 0x6c617661);
+        } else if (cmd == "scan" && (argc == 4 || argc == 5)) {
+            unsigned jobs = strtoul(argv[3], nullptr, 0);
+            if (jobs == 0) usage();
+            return cmd_scan(plog, jobs,
+                    argc == 5 ? parse_range(argv[4]) : everything);
+        }
+    } catch (std::runtime_error &e) {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    usage();
+    return 1;
+}
@@ -0,0 +1,149 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Flat binary files for fbi checkpoints: a magic string, a version, then
+// whatever the writer puts, in host byte order. Vectors and strings are a u64
+// length followed by the raw elements.
+//
+// SnapshotWriter writes under a temporary name and renames into place on
+// commit(), so a snapshot that exists is always complete.
+
+class SnapshotWriter {
+public:
+    SnapshotWriter(const std::string &path, const char magic[8],
+            uint32_t version) : path(path), tmp_path(path + ".tmp") {
+        f = fopen(tmp_path.c_str(), "wb");
+        if (!f) throw std::runtime_error("Could not open " + tmp_path);
+        put_raw(magic, 8);
+        put(version);
+    }
+
+    ~SnapshotWriter() {
+        if (f) {
+            fclose(f);
+            unlink_tmp();
+        }
+    }
+
+    template<typename T>
+    void put(const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "put: not POD");
+        put_raw(&value, sizeof(T));
+    }
+
+    void put_str(const std::string &s) {
+        put<uint64_t>(s.size());
+        put_raw(s.data(), s.size());
+    }
+
+    template<typename T>
+    void put_array(const T *values, size_t n) {
+        static_assert(std::is_trivially_copyable<T>::value, "put: not POD");
+        put<uint64_t>(n);
+        put_raw(values, n * sizeof(T));
+    }
+
+    template<typename T>
+    void put_vec(const std::vector<T> &v) { put_array(v.data(), v.size()); }
+
+    void commit() {
+        FILE *done = f;
+        f = nullptr;
+        if (fclose(done) != 0) {
+            unlink_tmp();
+            throw std::runtime_error("Could not write " + tmp_path);
+        }
+        if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+            unlink_tmp();
+            throw std::runtime_error("Could not rename " + tmp_path);
+        }
+    }
+
+private:
+    std::string path, tmp_path;
+    FILE *f;
+
+    void put_raw(const void *data, size_t size) {
+        if (size > 0 && fwrite(data, 1, size, f) != size) {
+            throw std::runtime_error("Short write to " + tmp_path);
+        }
+    }
+
+    void unlink_tmp() { remove(tmp_path.c_str()); }
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader(const std::string &path, const char magic[8],
+            uint32_t version) : path(path) {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) throw std::runtime_error("Could not open " + path);
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            data.insert(data.end(), chunk, chunk + n);
+        }
+        fclose(f);
+
+        char file_magic[8];
+        get_raw(file_magic, 8);
+        if (memcmp(file_magic, magic, 8) != 0 || get<uint32_t>() != version) {
+            throw std::runtime_error(path + " is not a compatible snapshot");
+        }
+    }
+
+    template<typename T>
+    T get() {
+        static_assert(std::is_trivially_copyable<T>::value, "get: not POD");
+        T value;
+        get_raw(&value, sizeof(T));
+        return value;
+    }
+
+    std::string get_str() {
+        uint64_t n = get<uint64_t>();
+        check(n);
+        std::string s(data.data() + pos, n);
+        pos += n;
+        return s;
+    }
+
+    template<typename T>
+    std::vector<T> get_vec() {
+        static_assert(std::is_trivially_copyable<T>::value, "get: not POD");
+        uint64_t n = get<uint64_t>();
+        check(n * sizeof(T));
+        std::vector<T> v(n);
+        get_raw(v.data(), n * sizeof(T));
+        return v;
+    }
+
+    bool at_end() const { return pos == data.size(); }
+
+private:
+    std::string path;
+    std::vector<char> data;
+    size_t pos = 0;
+
+    void check(uint64_t size) const {
+        if (size > data.size() - pos) {
+            throw std::runtime_error(path + " is truncated");
+        }
+    }
+
+    void get_raw(void *out, size_t size) {
+        check(size);
+        if (size > 0) memcpy(out, data.data() + pos, size);
+        pos += size;
+    }
+};
+
+#endif
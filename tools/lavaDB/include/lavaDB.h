@@ -1,21 +1,86 @@
 #ifndef __LAVA_DB_H_
 #define __LAVA_DB_H_
 
+#include <cstddef>
 #include <cstdint>
-#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
-// save a string -> index db to file
-void SaveDB(const std::map<std::string,uint32_t> &StringIDs, std::string dbfile);
+// The string <-> index db, shared by lavaTool (which hands out indices for
+// source locations and writes them into the queries it adds) and fbi (which
+// gets them back in the pandalog and needs the strings).
+//
+// On disk it is an append-only log: a header, then one record per string,
+// the string's index being its position in the log. Records are only ever
+// appended, under an exclusive flock on the file, so any number of
+// processes can add strings to the same db at once and agree on indices.
+//
+// The file is memory-mapped and nothing is read until it's asked for:
+// looking up index i walks the record headers up to i, once, and the
+// string -> index hash table is built only the first time a string is looked
+// up. Opening a db is O(1), and a reader like fbi never builds the table.
+class LavaDB {
+public:
+    static const uint32_t NO_ID = UINT32_MAX;
 
-// load a string -> index db from file
-std::map<std::string,uint32_t> LoadDB(std::string dbfile);
+    // Opens the db at path, creating it if it doesn't exist. An empty path
+    // makes a private db in a temporary file, removed when it's closed.
+    // Throws std::runtime_error if path isn't a db.
+    explicit LavaDB(const std::string &path);
+    ~LavaDB();
 
-// invert to get index -> string db
-std::vector<std::string> InvertDB(std::map<std::string,uint32_t> &n2ind);
+    LavaDB(const LavaDB &) = delete;
+    LavaDB &operator=(const LavaDB &) = delete;
 
-// Add string to DB or return existing ID.
-uint32_t GetStringID(std::map<std::string, uint32_t> &StringIDs, std::string s);
+    // Index of s, adding it to the db if it's new.
+    uint32_t id(const std::string &s);
+
+    // Index of s, or NO_ID if it isn't in the db.
+    uint32_t find(const std::string &s);
+
+    // The string with index id, or null if there isn't one. The string is
+    // NUL-terminated and stays put as long as the db is open.
+    const char *str(uint32_t id);
+
+    // Number of strings in the db.
+    uint32_t size();
+
+    // Call in a child after fork() before using the db there. flock() locks
+    // belong to the open file, which a child shares with its parent, so
+    // the child needs its own to be kept apart from it.
+    void reopen();
+
+private:
+    std::string path;
+    bool temporary;
+    int fd;
+
+    // The file, as mapped. Mappings outgrown as the file grows are kept
+    // until the db is closed, so pointers from str() stay good.
+    const char *base;
+    size_t mapped;
+    size_t capacity;
+    std::vector<std::pair<void *, size_t>> old_maps;
+
+    // Offsets of the records walked so far, and where the next one starts.
+    std::vector<size_t> offsets;
+    size_t scanned;
+
+    // Open-addressed string -> index table over the first hashed records;
+    // each slot is 0 or index + 1.
+    std::vector<uint32_t> slots;
+    uint32_t hashed;
+
+    void open_file();
+    void remap(size_t file_size);
+    void refresh();
+    void refresh_locked();
+    void scan(uint32_t until);
+    void hash_all();
+    void insert_slot(uint32_t id);
+    uint32_t lookup_slot(const std::string &s) const;
+    uint32_t find_mapped(const std::string &s);
+};
 
 #endif
@@ -1,60 +1,259 @@
+extern "C" {
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
-#include <fstream>
-#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
 #include <string>
-#include <tuple>
 #include <vector>
-#include <algorithm>
 
-std::vector<std::string> InvertDB(std::map<std::string, uint32_t> &n2ind) {
-    std::vector<std::string> ind2n;
-    uint32_t max_index = 0;
-    for ( auto kvp : n2ind ) {
-        max_index = std::max(max_index, kvp.second);
-    }
-    ind2n.resize(max_index + 1);
-    for ( auto kvp : n2ind ) {
-        ind2n[kvp.second] = kvp.first;
-    }
-    return ind2n;
-}
-
-std::map<std::string,uint32_t> LoadDB(std::string dbfile) {
-    // Parse the db
-    std::map<std::string,uint32_t> StringIDs;
-    std::ifstream db(dbfile);
-    if (db.is_open()) {
-        std::string str;
-        std::string istr;
-        while (std::getline(db, istr, '\0')) {
-            std::getline(db, str, '\0');
-            StringIDs[str] = strtoul(istr.c_str(), NULL, 0);
+#include "lavaDB.h"
+
+// File layout: MAGIC, then records of
+//     uint32_t len; char str[len]; '\0'; padding to a multiple of 4.
+static const char MAGIC[8] = { 'L', 'A', 'V', 'A', 'D', 'B', '0', '2' };
+static const size_t HEADER_SIZE = sizeof(MAGIC);
+
+static size_t record_size(size_t len) {
+    return (sizeof(uint32_t) + len + 1 + 3) & ~(size_t)3;
+}
+
+static uint32_t fnv1a(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static std::runtime_error db_error(const std::string &path,
+        const char *what) {
+    return std::runtime_error(std::string(what) + " " + path + ": "
+            + strerror(errno));
+}
+
+namespace {
+// Holds a flock() for as long as it's in scope.
+class FileLock {
+public:
+    FileLock(int fd, int op) : fd(fd) {
+        while (flock(fd, op) != 0) {
+            if (errno != EINTR) throw std::runtime_error("flock failed");
+        }
+    }
+    ~FileLock() { flock(fd, LOCK_UN); }
+
+private:
+    int fd;
+};
+}
+
+LavaDB::LavaDB(const std::string &path)
+    : path(path), temporary(path.empty()), fd(-1), base(nullptr), mapped(0),
+      capacity(0), scanned(HEADER_SIZE), hashed(0) {
+    if (temporary) {
+        char tmp[] = "/tmp/lavadb.XXXXXX";
+        int tmp_fd = mkstemp(tmp);
+        if (tmp_fd < 0) throw db_error(tmp, "Could not create");
+        close(tmp_fd);
+        this->path = tmp;
+    }
+    open_file();
+
+    FileLock lock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) != 0) throw db_error(this->path, "Could not stat");
+    if (st.st_size == 0) {
+        if (pwrite(fd, MAGIC, HEADER_SIZE, 0) != (ssize_t)HEADER_SIZE) {
+            throw db_error(this->path, "Could not write");
+        }
+    } else {
+        char magic[HEADER_SIZE];
+        if (pread(fd, magic, HEADER_SIZE, 0) != (ssize_t)HEADER_SIZE
+                || memcmp(magic, MAGIC, HEADER_SIZE) != 0) {
+            throw std::runtime_error(this->path + " is not a lavadb, or is "
+                    "from an older lavaTool; delete it and rerun add_queries");
         }
     }
+    refresh_locked();
+}
+
+LavaDB::~LavaDB() {
+    if (base) munmap((void *)base, capacity);
+    for (const auto &m : old_maps) munmap(m.first, m.second);
+    if (fd >= 0) close(fd);
+    if (temporary) unlink(path.c_str());
+}
 
-    return StringIDs;
+void LavaDB::open_file() {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    // Reading a db we can't write is fine until we need to add to it.
+    if (fd < 0 && errno == EACCES) fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw db_error(path, "Could not open");
 }
 
-void SaveDB(const std::map<std::string, uint32_t> &StringIDs, std::string dbfile) {
-    std::ofstream db(dbfile);
-    for (auto p : StringIDs) {
-        db << p.second << '\0' << p.first << '\0';
+void LavaDB::reopen() {
+    close(fd);
+    open_file();
+}
+
+// Maps at least file_size bytes of the file. The mapping runs well past
+// the end of the file, so that as it grows, most of the time the new part
+// is already mapped.
+void LavaDB::remap(size_t file_size) {
+    if (file_size > capacity) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t new_capacity = std::max<size_t>(file_size * 2, 1 << 20);
+        new_capacity = (new_capacity + page - 1) / page * page;
+        void *p = mmap(nullptr, new_capacity, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) throw db_error(path, "Could not map");
+        if (base) old_maps.push_back(std::make_pair((void *)base, capacity));
+        base = (const char *)p;
+        capacity = new_capacity;
     }
+    mapped = file_size;
+}
+
+// Catches up with records other processes have appended. Writers hold an
+// exclusive lock while they append, so with the lock held the file ends
+// on a record boundary (unless a writer died mid-record).
+void LavaDB::refresh() {
+    FileLock lock(fd, LOCK_SH);
+    refresh_locked();
 }
 
-uint32_t GetStringID(std::map<std::string, uint32_t> &StringIDs, std::string s) {
-    std::map<std::string, uint32_t>::iterator it;
-    // This does nothing if s is already in StringIDs.
-    std::tie(it, std::ignore) =
-        StringIDs.insert(std::make_pair(s, StringIDs.size()));
-    return it->second;
+void LavaDB::refresh_locked() {
+    struct stat st;
+    if (fstat(fd, &st) != 0) throw db_error(path, "Could not stat");
+    if ((size_t)st.st_size != mapped) remap(st.st_size);
+}
+
+// Walks records in the mapped part of the file until there are offsets
+// for index until, or there are no more.
+void LavaDB::scan(uint32_t until) {
+    while (offsets.size() <= until && scanned + sizeof(uint32_t) <= mapped) {
+        uint32_t len;
+        memcpy(&len, base + scanned, sizeof(len));
+        size_t next = scanned + record_size(len);
+        // A record cut short by a writer that died; the next writer
+        // truncates it.
+        if (next > mapped) break;
+        offsets.push_back(scanned);
+        scanned = next;
+    }
+}
+
+const char *LavaDB::str(uint32_t id) {
+    if (id >= offsets.size()) scan(id);
+    if (id >= offsets.size()) {
+        refresh();
+        scan(id);
+        if (id >= offsets.size()) return nullptr;
+    }
+    return base + offsets[id] + sizeof(uint32_t);
+}
+
+uint32_t LavaDB::size() {
+    refresh();
+    scan(NO_ID);
+    return offsets.size();
+}
+
+void LavaDB::insert_slot(uint32_t id) {
+    uint32_t len;
+    memcpy(&len, base + offsets[id], sizeof(len));
+    size_t mask = slots.size() - 1;
+    size_t i = fnv1a(base + offsets[id] + sizeof(uint32_t), len) & mask;
+    while (slots[i] != 0) i = (i + 1) & mask;
+    slots[i] = id + 1;
+}
+
+// Brings the hash table up to date with the records walked so far, keeping
+// it at most half full.
+void LavaDB::hash_all() {
+    if (offsets.size() * 2 > slots.size()) {
+        size_t new_size = 64;
+        while (new_size < offsets.size() * 4) new_size *= 2;
+        slots.assign(new_size, 0);
+        hashed = 0;
+    }
+    for (; hashed < offsets.size(); hashed++) insert_slot(hashed);
+}
+
+uint32_t LavaDB::lookup_slot(const std::string &s) const {
+    if (slots.empty()) return NO_ID;
+    size_t mask = slots.size() - 1;
+    for (size_t i = fnv1a(s.data(), s.size()) & mask; slots[i] != 0;
+            i = (i + 1) & mask) {
+        uint32_t id = slots[i] - 1;
+        uint32_t len;
+        memcpy(&len, base + offsets[id], sizeof(len));
+        if (len == s.size()
+                && memcmp(base + offsets[id] + sizeof(uint32_t), s.data(),
+                    len) == 0) {
+            return id;
+        }
+    }
+    return NO_ID;
+}
+
+// Looks s up in what's mapped already, without going back to the file.
+uint32_t LavaDB::find_mapped(const std::string &s) {
+    scan(NO_ID);
+    hash_all();
+    return lookup_slot(s);
+}
+
+uint32_t LavaDB::find(const std::string &s) {
+    uint32_t id = find_mapped(s);
+    if (id != NO_ID) return id;
+    refresh();
+    return find_mapped(s);
+}
+
+uint32_t LavaDB::id(const std::string &s) {
+    uint32_t id = find_mapped(s);
+    if (id != NO_ID) return id;
+
+    // Someone else may have just added it; check again with the lock that
+    // keeps anyone else from adding anything.
+    FileLock lock(fd, LOCK_EX);
+    refresh_locked();
+    id = find_mapped(s);
+    if (id != NO_ID) return id;
+
+    if (scanned < mapped) {
+        if (ftruncate(fd, scanned) != 0) throw db_error(path, "Could not truncate");
+        mapped = scanned;
+    }
+    std::vector<char> record(record_size(s.size()), '\0');
+    uint32_t len = s.size();
+    memcpy(record.data(), &len, sizeof(len));
+    memcpy(record.data() + sizeof(len), s.data(), len);
+    if (pwrite(fd, record.data(), record.size(), scanned)
+            != (ssize_t)record.size()) {
+        throw db_error(path, "Could not write");
+    }
+    remap(scanned + record.size());
+    scan(NO_ID);
+    hash_all();
+    return offsets.size() - 1;
 }
 
 #ifdef DBTEST
 int main(int argc, char **argv) {
-    std::map<std::string,uint32_t> db = LoadDB(argv[1]);
-    for (auto p : db) {
-        printf ("%s => %u\n", p.first.c_str(), p.second);
+    LavaDB db(argv[1]);
+    for (uint32_t i = 0; i < db.size(); i++) {
+        printf ("%u => %s\n", i, db.str(i));
     }
     return 0;
 }
@@ -0,0 +1,366 @@
+#ifndef __BATCH_PERSIST_HXX
+#define __BATCH_PERSIST_HXX
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <odb/pgsql/database.hxx>
+
+#include "lava.hxx"
+#include "lava-odb.hxx"
+#include "persister.hxx"
+
+// Write-behind persistence for fbi.
+//
+// Instead of one INSERT round trip per object, LabelSet, AttackPoint, Dua,
+// DuaBytes and Bug rows are rendered into SQL tuples as they are created and
+// written out with multi-row INSERTs once batch_size rows are pending or
+// flush_interval has passed. Ids are handed out locally from blocks reserved
+// from each table's sequence, so in-memory pointers (and the ids other rows
+// refer to) are valid before the row ever reaches Postgres.
+//
+// The persister also owns the one long-running transaction fbi works in. It
+// is committed at every flush and a new one begun, so lookups (eq_query etc.)
+// always have a transaction to run in.
+//
+// Only one BatchPersister may write to a database at a time. fbi checks for
+// repeat bugs against skip lists it loads once at startup, so a second writer
+// would insert bugs the first one doesn't know about, and the first one's
+// next batch would fail on BugUniq. Each persister holds a Postgres advisory
+// lock on its connection for as long as it lives, and the constructor throws
+// if another process has it.
+//
+// Table and column names must match the schema odb generates from lava.hxx
+// (see lavaODB/generated/lava.sql).
+class BatchPersister : public Persister {
+public:
+    BatchPersister(odb::pgsql::database &db, size_t batch_size,
+            std::chrono::seconds flush_interval)
+        : db(db), batch_size(batch_size), flush_interval(flush_interval),
+            last_flush(std::chrono::steady_clock::now()),
+            labelset_ids("labelset_id_seq"),
+            attackpoint_ids("attackpoint_id_seq"), dua_ids("dua_id_seq"),
+            duabytes_ids("duabytes_id_seq"), bug_ids("bug_id_seq"),
+            conn(db.connection()) {
+        begin();
+        lock();
+    }
+
+    ~BatchPersister() {
+        // Dropping rows on the floor silently would be worse than failing.
+        assert(num_pending == 0 && "BatchPersister destroyed without finish()");
+    }
+
+    // Lvals are looked up before they are created (see eq_query in fbi), so
+    // they go straight to the database.
+    void persist(SourceLval &lval) override { db.persist(lval); }
+
+    void persist(LabelSet &ls) override {
+        ls.id = next_id(labelset_ids);
+        std::string row = "(";
+        append_int(row, ls.id); row += ',';
+        append_int(row, ls.ptr); row += ',';
+        append_str(row, ls.inputfile); row += ',';
+        append_array(row, ls.labels); row += ')';
+        add_row(labelset_rows, std::move(row));
+    }
+
+    void persist(AttackPoint &atp) override {
+        atp.id = next_id(attackpoint_ids);
+        std::string row = "(";
+        append_int(row, atp.id); row += ',';
+        append_loc(row, atp.loc); row += ',';
+        append_int(row, (int32_t)atp.type); row += ')';
+        add_row(attackpoint_rows, std::move(row));
+    }
+
+    void persist(Dua &dua) override {
+        dua.id = next_id(dua_ids);
+        std::string row = "(";
+        append_int(row, dua.id); row += ',';
+        append_int(row, dua.lval->id); row += ',';
+        append_array(row, dua.byte_tcn); row += ',';
+        append_array(row, dua.all_labels); row += ',';
+        append_str(row, dua.inputfile); row += ',';
+        append_int(row, (int32_t)dua.max_tcn); row += ',';
+        append_int(row, (int32_t)dua.max_cardinality); row += ',';
+        append_int(row, dua.instr); row += ',';
+        row += dua.fake_dua ? "TRUE" : "FALSE";
+        row += ')';
+        add_row(dua_rows, std::move(row));
+
+        // viable_bytes is a container, so it lives in its own table.
+        for (size_t i = 0; i < dua.viable_bytes.size(); i++) {
+            const LabelSet *ls = dua.viable_bytes[i];
+            std::string vb_row = "(";
+            append_int(vb_row, dua.id); vb_row += ',';
+            append_int(vb_row, (uint64_t)i); vb_row += ',';
+            if (ls) append_int(vb_row, ls->id);
+            else vb_row += "NULL";
+            vb_row += ')';
+            viable_bytes_rows.push_back(std::move(vb_row));
+        }
+    }
+
+    void persist(DuaBytes &dua_bytes) override {
+        dua_bytes.id = next_id(duabytes_ids);
+        std::string row = "(";
+        append_int(row, dua_bytes.id); row += ',';
+        append_int(row, dua_bytes.dua->id); row += ',';
+        append_int(row, (int32_t)dua_bytes.selected.low); row += ',';
+        append_int(row, (int32_t)dua_bytes.selected.high); row += ',';
+        append_array(row, dua_bytes.all_labels); row += ')';
+        add_row(duabytes_rows, std::move(row));
+    }
+
+    void persist(Bug &bug) override {
+        bug.id = next_id(bug_ids);
+        std::string row = "(";
+        append_int(row, bug.id); row += ',';
+        append_int(row, (int32_t)bug.type); row += ',';
+        append_int(row, bug.trigger->id); row += ',';
+        append_int(row, bug.trigger_lval->id); row += ',';
+        append_int(row, bug.atp->id); row += ',';
+        append_int(row, bug.max_liveness); row += ',';
+        append_array(row, bug.extra_duas); row += ',';
+        append_int(row, (int32_t)bug.magic); row += ')';
+        add_row(bug_rows, std::move(row));
+    }
+
+    size_t pending() const { return num_pending; }
+
+    // Flush if the batch is full or it has been too long since last flush.
+    void maybe_flush() override {
+        if (num_pending == 0) return;
+        if (num_pending >= batch_size
+                || std::chrono::steady_clock::now() - last_flush >= flush_interval) {
+            flush();
+        }
+    }
+
+    // Write out everything pending and commit.
+    void flush() override {
+        insert_rows("labelset", "id, ptr, inputfile, labels", labelset_rows);
+        insert_rows("attackpoint", "id, loc_filename, loc_begin_line, "
+                "loc_begin_column, loc_end_line, loc_end_column, type",
+                attackpoint_rows);
+        insert_rows("dua", "id, lval, byte_tcn, all_labels, inputfile, "
+                "max_tcn, max_cardinality, instr, fake_dua", dua_rows);
+        insert_rows("dua_viable_bytes", "object_id, \"index\", value",
+                viable_bytes_rows);
+        insert_rows("duabytes", "id, dua, selected_low, selected_high, "
+                "all_labels", duabytes_rows);
+        insert_rows("bug", "id, type, trigger, trigger_lval, atp, "
+                "max_liveness, extra_duas, magic", bug_rows);
+        num_pending = 0;
+
+        txn->commit();
+        txn.reset();
+        begin();
+        last_flush = std::chrono::steady_clock::now();
+    }
+
+    // The state is the last id handed out from each table's sequence. Rows
+    // this run wrote after it have higher ids; restore_state() deletes the
+    // ones that belong to inputfile.
+    void save_state(const std::string &path) override {
+        flush();
+        std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream out(tmp_path);
+            for (const IdBlock *block : id_blocks()) {
+                out << block->sequence << " " << block->last << "\n";
+            }
+            if (!out) throw std::runtime_error("Could not write " + tmp_path);
+        }
+        if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Could not rename " + tmp_path);
+        }
+    }
+
+    void restore_state(const std::string &path,
+            const std::string &inputfile) override {
+        std::ifstream in(path);
+        for (IdBlock *block : id_blocks()) {
+            std::string sequence;
+            if (!(in >> sequence >> block->last) || sequence != block->sequence) {
+                throw std::runtime_error("Bad persister state in " + path);
+            }
+        }
+
+        // Everything else is either looked up before it's created
+        // (SourceLval, AttackPoint) or hangs off this input's duas.
+        std::string file;
+        append_str(file, inputfile);
+        std::string duas = "(SELECT id FROM dua WHERE inputfile = " + file + ")";
+        db.execute("DELETE FROM bug WHERE id > " + std::to_string(bug_ids.last)
+                + " AND trigger IN (SELECT id FROM duabytes WHERE dua IN "
+                + duas + ")");
+        db.execute("DELETE FROM duabytes WHERE id > "
+                + std::to_string(duabytes_ids.last) + " AND dua IN " + duas);
+        db.execute("DELETE FROM dua_viable_bytes WHERE object_id IN "
+                "(SELECT id FROM dua WHERE id > " + std::to_string(dua_ids.last)
+                + " AND inputfile = " + file + ")");
+        db.execute("DELETE FROM dua WHERE id > " + std::to_string(dua_ids.last)
+                + " AND inputfile = " + file);
+        db.execute("DELETE FROM labelset WHERE id > "
+                + std::to_string(labelset_ids.last) + " AND inputfile = " + file);
+        flush();
+    }
+
+    // Final flush; leaves no transaction open.
+    void finish() override {
+        flush();
+        txn->commit();
+        txn.reset();
+        conn->execute(std::string("SELECT pg_advisory_unlock(")
+                + WRITER_LOCK_KEY + ")");
+    }
+
+private:
+    // Ids are pulled from the table's sequence a block at a time. nextval()
+    // is never rolled back, so ids can't collide with concurrent fbi runs.
+    struct IdBlock {
+        std::string sequence;
+        std::vector<uint64_t> ids;
+        size_t next = 0;
+        // Last id handed out, by this process or the one it resumed.
+        uint64_t last = 0;
+
+        IdBlock(std::string sequence) : sequence(sequence) {}
+    };
+
+    // Max rows per INSERT statement, to keep statement size reasonable.
+    static constexpr size_t ROWS_PER_STATEMENT = 1000;
+
+    // Advisory lock key for the writer lock: "lava". Advisory locks are per
+    // database, so this only keeps out writers to the same one.
+    static constexpr const char *WRITER_LOCK_KEY = "1818326625";
+
+    odb::pgsql::database &db;
+    std::unique_ptr<odb::transaction> txn;
+
+    size_t batch_size;
+    std::chrono::seconds flush_interval;
+    std::chrono::steady_clock::time_point last_flush;
+    size_t num_pending = 0;
+
+    IdBlock labelset_ids, attackpoint_ids, dua_ids, duabytes_ids, bug_ids;
+
+    std::vector<std::string> labelset_rows, attackpoint_rows, dua_rows,
+        viable_bytes_rows, duabytes_rows, bug_rows;
+
+    std::vector<IdBlock *> id_blocks() {
+        return { &labelset_ids, &attackpoint_ids, &dua_ids, &duabytes_ids,
+            &bug_ids };
+    }
+
+    // Every transaction runs on conn, which holds the writer lock.
+    odb::pgsql::connection_ptr conn;
+
+    void begin() {
+        txn.reset(new odb::transaction(conn->begin()));
+    }
+
+    // Take the writer lock, in the first transaction.
+    void lock() {
+        auto result = db.query<SequenceValue>(
+                std::string("SELECT CAST(pg_try_advisory_lock(")
+                + WRITER_LOCK_KEY + ") AS BIGINT)");
+        if (result.begin() == result.end() || result.begin()->value == 0) {
+            txn->rollback();
+            txn.reset();
+            throw std::runtime_error("Another fbi or fbi_load is writing to "
+                    "this database; only one may run at a time");
+        }
+    }
+
+    uint64_t next_id(IdBlock &block) {
+        if (block.next == block.ids.size()) {
+            std::string sql = "SELECT nextval('" + block.sequence + "') "
+                "FROM generate_series(1, " + std::to_string(batch_size) + ")";
+            block.ids.clear();
+            block.next = 0;
+            auto result = db.query<SequenceValue>(sql);
+            for (auto it = result.begin(); it != result.end(); it++) {
+                block.ids.push_back(it->value);
+            }
+            assert(!block.ids.empty());
+        }
+        block.last = block.ids[block.next++];
+        return block.last;
+    }
+
+    void add_row(std::vector<std::string> &rows, std::string &&row) {
+        rows.push_back(std::move(row));
+        num_pending++;
+    }
+
+    void insert_rows(const char *table, const char *columns,
+            std::vector<std::string> &rows) {
+        for (size_t i = 0; i < rows.size(); i += ROWS_PER_STATEMENT) {
+            size_t end = std::min(rows.size(), i + ROWS_PER_STATEMENT);
+            std::string sql = "INSERT INTO ";
+            sql += table;
+            sql += " (";
+            sql += columns;
+            sql += ") VALUES ";
+            for (size_t j = i; j < end; j++) {
+                if (j != i) sql += ',';
+                sql += rows[j];
+            }
+            db.execute(sql);
+        }
+        rows.clear();
+    }
+
+    // Same bit patterns odb's value_traits would bind for these types.
+    static void append_int(std::string &out, uint64_t value) {
+        out += std::to_string((int64_t)value);
+    }
+
+    static void append_int(std::string &out, int32_t value) {
+        out += std::to_string(value);
+    }
+
+    static void append_str(std::string &out, const std::string &s) {
+        out += '\'';
+        for (char c : s) {
+            if (c == '\'') out += '\'';
+            out += c;
+        }
+        out += '\'';
+    }
+
+    static void append_loc(std::string &out, const LavaASTLoc &loc) {
+        append_str(out, loc.filename); out += ',';
+        append_int(out, (int32_t)loc.begin.line); out += ',';
+        append_int(out, (int32_t)loc.begin.column); out += ',';
+        append_int(out, (int32_t)loc.end.line); out += ',';
+        append_int(out, (int32_t)loc.end.column);
+    }
+
+    // Same text representation as pgarray.hxx. For std::vectors and
+    // LabelVecs.
+    template<typename Array>
+    static void append_array(std::string &out, const Array &v) {
+        out += "'{";
+        for (auto it = v.begin(); it != v.end(); it++) {
+            if (it != v.begin()) out += ',';
+            out += std::to_string(*it);
+        }
+        out += "}'";
+    }
+};
+
+#endif
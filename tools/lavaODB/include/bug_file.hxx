@@ -0,0 +1,474 @@
+#ifndef __BUG_FILE_HXX
+#define __BUG_FILE_HXX
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lava.hxx"
+#include "persister.hxx"
+
+// Columnar "bug file": what fbi writes instead of talking to Postgres when
+// run with --bug-file, and what fbi_load later imports into the database.
+//
+// There is one table per lava.hxx object fbi creates and one column per
+// database column, using the same names as the generated lava.sql. The only
+// difference is that containers (Dua::viable_bytes) are stored inline as list
+// columns instead of in a side table. Pointers are stored as the id of the
+// pointed-to row; ids are local to the file and start at 1.
+//
+// Layout, host (little-endian) byte order, every segment 8-byte aligned so
+// the file can be used straight out of mmap:
+//     BugFileHeader
+//     column segments: [offsets (u64, rows + 1) for variable-width kinds] data
+//     directory: for each table, BugFileTableDesc then its BugFileColumnDescs
+
+#define BUG_FILE_MAGIC "LAVABUG1"
+#define BUG_FILE_VERSION 1
+
+enum class ColumnKind : uint32_t {
+    U8, U32, U64,               // fixed width
+    STR, U32_LIST, U64_LIST,    // variable width
+};
+
+inline bool is_variable(ColumnKind kind) { return kind >= ColumnKind::STR; }
+
+struct BugFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_tables;
+    uint64_t directory_offset;
+};
+
+struct BugFileTableDesc {
+    char name[24];
+    uint64_t rows;
+    uint32_t num_columns;
+    uint32_t pad;
+};
+
+struct BugFileColumnDesc {
+    char name[24];
+    uint32_t kind;
+    uint32_t pad;
+    uint64_t offsets_offset;    // 0 for fixed-width columns
+    uint64_t data_offset;
+    uint64_t data_size;
+};
+
+struct BugFileColumn {
+    std::string name;
+    ColumnKind kind;
+    std::vector<uint8_t> data;
+    std::vector<uint64_t> offsets;
+
+    BugFileColumn(std::string name, ColumnKind kind) : name(name), kind(kind) {
+        if (is_variable(kind)) offsets.push_back(0);
+    }
+
+    template<typename T>
+    void put(T value) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(&value);
+        data.insert(data.end(), p, p + sizeof(T));
+    }
+
+    template<typename T>
+    void put_list(const T *first, size_t count) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(first);
+        data.insert(data.end(), p, p + count * sizeof(T));
+        offsets.push_back(data.size());
+    }
+};
+
+struct BugFileTable {
+    std::string name;
+    uint64_t rows = 0;
+    std::vector<BugFileColumn> columns;
+
+    BugFileTable(std::string name,
+            std::initializer_list<std::pair<const char *, ColumnKind>> cols)
+        : name(name) {
+        for (const auto &col : cols) columns.emplace_back(col.first, col.second);
+    }
+};
+
+// Appends one row to a table, one column at a time and in column order.
+class BugFileRow {
+public:
+    BugFileRow(BugFileTable &table) : table(table) {}
+    ~BugFileRow() {
+        assert(next == table.columns.size());
+        table.rows++;
+    }
+
+    BugFileRow &u8(uint8_t v) { column(ColumnKind::U8).put(v); return *this; }
+    BugFileRow &u32(uint32_t v) { column(ColumnKind::U32).put(v); return *this; }
+    BugFileRow &u64(uint64_t v) { column(ColumnKind::U64).put(v); return *this; }
+
+    BugFileRow &str(const std::string &s) {
+        column(ColumnKind::STR).put_list(s.data(), s.size());
+        return *this;
+    }
+    BugFileRow &u32_list(const std::vector<uint32_t> &v) {
+        column(ColumnKind::U32_LIST).put_list(v.data(), v.size());
+        return *this;
+    }
+    BugFileRow &u32_list(const LabelVec &v) {
+        column(ColumnKind::U32_LIST).put_list(v.data(), v.size());
+        return *this;
+    }
+    BugFileRow &u64_list(const std::vector<uint64_t> &v) {
+        column(ColumnKind::U64_LIST).put_list(v.data(), v.size());
+        return *this;
+    }
+
+    BugFileRow &loc(const LavaASTLoc &loc) {
+        return str(loc.filename).u32(loc.begin.line).u32(loc.begin.column)
+            .u32(loc.end.line).u32(loc.end.column);
+    }
+
+private:
+    BugFileTable &table;
+    size_t next = 0;
+
+    BugFileColumn &column(ColumnKind kind) {
+        assert(next < table.columns.size());
+        BugFileColumn &col = table.columns[next++];
+        assert(col.kind == kind);
+        return col;
+    }
+};
+
+#define LOC_COLUMNS(prefix) \
+    { prefix "_filename", ColumnKind::STR }, \
+    { prefix "_begin_line", ColumnKind::U32 }, \
+    { prefix "_begin_column", ColumnKind::U32 }, \
+    { prefix "_end_line", ColumnKind::U32 }, \
+    { prefix "_end_column", ColumnKind::U32 }
+
+// Persister that collects everything in memory and writes the bug file at
+// finish(). The file is written under a temporary name and renamed into
+// place, so a bug file that exists is always complete.
+class BugFileWriter : public Persister {
+public:
+    BugFileWriter(std::string path) : path(path),
+        sourcelval("sourcelval", {
+                { "id", ColumnKind::U64 }, LOC_COLUMNS("loc"),
+                { "ast_name", ColumnKind::STR },
+                { "len_bytes", ColumnKind::U32 } }),
+        labelset("labelset", {
+                { "id", ColumnKind::U64 }, { "ptr", ColumnKind::U64 },
+                { "inputfile", ColumnKind::STR },
+                { "labels", ColumnKind::U32_LIST } }),
+        attackpoint("attackpoint", {
+                { "id", ColumnKind::U64 }, LOC_COLUMNS("loc"),
+                { "type", ColumnKind::U32 } }),
+        dua("dua", {
+                { "id", ColumnKind::U64 }, { "lval", ColumnKind::U64 },
+                { "viable_bytes", ColumnKind::U64_LIST },
+                { "byte_tcn", ColumnKind::U32_LIST },
+                { "all_labels", ColumnKind::U32_LIST },
+                { "inputfile", ColumnKind::STR },
+                { "max_tcn", ColumnKind::U32 },
+                { "max_cardinality", ColumnKind::U32 },
+                { "instr", ColumnKind::U64 }, { "fake_dua", ColumnKind::U8 } }),
+        duabytes("duabytes", {
+                { "id", ColumnKind::U64 }, { "dua", ColumnKind::U64 },
+                { "selected_low", ColumnKind::U32 },
+                { "selected_high", ColumnKind::U32 },
+                { "all_labels", ColumnKind::U32_LIST } }),
+        bug("bug", {
+                { "id", ColumnKind::U64 }, { "type", ColumnKind::U32 },
+                { "trigger", ColumnKind::U64 },
+                { "trigger_lval", ColumnKind::U64 },
+                { "atp", ColumnKind::U64 },
+                { "max_liveness", ColumnKind::U64 },
+                { "extra_duas", ColumnKind::U64_LIST },
+                { "magic", ColumnKind::U32 } }) {}
+
+    void persist(SourceLval &lval) override {
+        lval.id = sourcelval.rows + 1;
+        BugFileRow(sourcelval).u64(lval.id).loc(lval.loc).str(lval.ast_name)
+            .u32(lval.len_bytes);
+    }
+
+    void persist(LabelSet &ls) override {
+        ls.id = labelset.rows + 1;
+        BugFileRow(labelset).u64(ls.id).u64(ls.ptr).str(ls.inputfile)
+            .u32_list(ls.labels);
+    }
+
+    void persist(AttackPoint &atp) override {
+        atp.id = attackpoint.rows + 1;
+        BugFileRow(attackpoint).u64(atp.id).loc(atp.loc).u32(atp.type);
+    }
+
+    void persist(Dua &d) override {
+        d.id = dua.rows + 1;
+        std::vector<uint64_t> viable_bytes;
+        viable_bytes.reserve(d.viable_bytes.size());
+        for (const LabelSet *ls : d.viable_bytes) {
+            viable_bytes.push_back(ls ? ls->id : 0);
+        }
+        BugFileRow(dua).u64(d.id).u64(d.lval->id).u64_list(viable_bytes)
+            .u32_list(d.byte_tcn).u32_list(d.all_labels).str(d.inputfile)
+            .u32(d.max_tcn).u32(d.max_cardinality).u64(d.instr)
+            .u8(d.fake_dua);
+    }
+
+    void persist(DuaBytes &dua_bytes) override {
+        dua_bytes.id = duabytes.rows + 1;
+        BugFileRow(duabytes).u64(dua_bytes.id).u64(dua_bytes.dua->id)
+            .u32(dua_bytes.selected.low).u32(dua_bytes.selected.high)
+            .u32_list(dua_bytes.all_labels);
+    }
+
+    void persist(Bug &b) override {
+        b.id = bug.rows + 1;
+        BugFileRow(bug).u64(b.id).u32(b.type).u64(b.trigger->id)
+            .u64(b.trigger_lval->id).u64(b.atp->id).u64(b.max_liveness)
+            .u64_list(b.extra_duas).u32(b.magic);
+    }
+
+    void finish() override { write(path); }
+
+    // The state is everything so far, as a bug file.
+    void save_state(const std::string &state_path) override {
+        write(state_path);
+    }
+
+    void restore_state(const std::string &state_path,
+            const std::string &inputfile) override;
+
+private:
+    std::string path;
+    BugFileTable sourcelval, labelset, attackpoint, dua, duabytes, bug;
+
+    std::vector<BugFileTable *> tables() {
+        return { &sourcelval, &labelset, &attackpoint, &dua, &duabytes, &bug };
+    }
+
+    void write(const std::string &out_path) {
+        std::string tmp_path = out_path + ".tmp";
+        FILE *f = fopen(tmp_path.c_str(), "wb");
+        if (!f) throw std::runtime_error("Could not open " + tmp_path);
+
+        BugFileHeader header = {};
+        memcpy(header.magic, BUG_FILE_MAGIC, sizeof(header.magic));
+        header.version = BUG_FILE_VERSION;
+        header.num_tables = tables().size();
+        write_segment(f, &header, sizeof(header));
+
+        std::vector<BugFileColumnDesc> column_descs;
+        for (BugFileTable *table : tables()) {
+            for (const BugFileColumn &col : table->columns) {
+                BugFileColumnDesc desc = {};
+                strncpy(desc.name, col.name.c_str(), sizeof(desc.name) - 1);
+                desc.kind = (uint32_t)col.kind;
+                if (is_variable(col.kind)) {
+                    desc.offsets_offset = write_segment(f, col.offsets.data(),
+                            col.offsets.size() * sizeof(uint64_t));
+                }
+                desc.data_offset = write_segment(f, col.data.data(), col.data.size());
+                desc.data_size = col.data.size();
+                column_descs.push_back(desc);
+            }
+        }
+
+        header.directory_offset = align(f);
+        auto col_it = column_descs.begin();
+        for (BugFileTable *table : tables()) {
+            BugFileTableDesc desc = {};
+            strncpy(desc.name, table->name.c_str(), sizeof(desc.name) - 1);
+            desc.rows = table->rows;
+            desc.num_columns = table->columns.size();
+            write_segment(f, &desc, sizeof(desc));
+            for (size_t i = 0; i < table->columns.size(); i++, col_it++) {
+                write_segment(f, &*col_it, sizeof(*col_it));
+            }
+        }
+
+        fseek(f, 0, SEEK_SET);
+        write_segment(f, &header, sizeof(header));
+        if (fclose(f) != 0) {
+            throw std::runtime_error("Could not write " + tmp_path);
+        }
+        if (rename(tmp_path.c_str(), out_path.c_str()) != 0) {
+            throw std::runtime_error("Could not rename " + tmp_path);
+        }
+    }
+
+    static uint64_t align(FILE *f) {
+        static const char zeros[8] = {0};
+        long pos = ftell(f);
+        if (pos % 8) fwrite(zeros, 1, 8 - pos % 8, f);
+        return ftell(f);
+    }
+
+    // Returns offset the data was written at.
+    static uint64_t write_segment(FILE *f, const void *data, size_t size) {
+        uint64_t offset = align(f);
+        if (size > 0 && fwrite(data, 1, size, f) != size) {
+            throw std::runtime_error("Short write to bug file");
+        }
+        return offset;
+    }
+};
+
+#undef LOC_COLUMNS
+
+// Read-only view of a bug file, mapped into memory.
+class BugFileReader {
+public:
+    struct Column {
+        ColumnKind kind;
+        const uint8_t *data;
+        const uint64_t *offsets;
+        uint64_t data_size;
+
+        uint8_t u8(uint64_t row) const { return get<uint8_t>(row); }
+        uint32_t u32(uint64_t row) const { return get<uint32_t>(row); }
+        uint64_t u64(uint64_t row) const { return get<uint64_t>(row); }
+
+        std::string str(uint64_t row) const {
+            assert(kind == ColumnKind::STR);
+            return std::string((const char *)data + offsets[row],
+                    offsets[row + 1] - offsets[row]);
+        }
+        std::vector<uint32_t> u32_list(uint64_t row) const {
+            assert(kind == ColumnKind::U32_LIST);
+            return get_list<uint32_t>(row);
+        }
+        std::vector<uint64_t> u64_list(uint64_t row) const {
+            assert(kind == ColumnKind::U64_LIST);
+            return get_list<uint64_t>(row);
+        }
+
+    private:
+        template<typename T>
+        T get(uint64_t row) const {
+            assert(!is_variable(kind));
+            T value;
+            memcpy(&value, data + row * sizeof(T), sizeof(T));
+            return value;
+        }
+
+        template<typename T>
+        std::vector<T> get_list(uint64_t row) const {
+            std::vector<T> result((offsets[row + 1] - offsets[row]) / sizeof(T));
+            memcpy(result.data(), data + offsets[row], result.size() * sizeof(T));
+            return result;
+        }
+    };
+
+    struct Table {
+        uint64_t rows = 0;
+        std::map<std::string, Column> columns;
+
+        const Column &operator[](const std::string &name) const {
+            auto it = columns.find(name);
+            if (it == columns.end()) {
+                throw std::runtime_error("Bug file has no column " + name);
+            }
+            return it->second;
+        }
+
+        LavaASTLoc loc(const std::string &prefix, uint64_t row) const {
+            const Table &t = *this;
+            return LavaASTLoc(t[prefix + "_filename"].str(row),
+                    Loc(t[prefix + "_begin_line"].u32(row),
+                        t[prefix + "_begin_column"].u32(row)),
+                    Loc(t[prefix + "_end_line"].u32(row),
+                        t[prefix + "_end_column"].u32(row)));
+        }
+    };
+
+    BugFileReader(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Could not open " + path);
+        struct stat st;
+        fstat(fd, &st);
+        size = st.st_size;
+        base = (const uint8_t *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED || size < sizeof(BugFileHeader)) {
+            throw std::runtime_error("Could not map " + path);
+        }
+
+        const BugFileHeader *header = (const BugFileHeader *)base;
+        if (memcmp(header->magic, BUG_FILE_MAGIC, sizeof(header->magic)) != 0
+                || header->version != BUG_FILE_VERSION) {
+            throw std::runtime_error(path + " is not a bug file");
+        }
+
+        const uint8_t *p = base + header->directory_offset;
+        for (uint32_t i = 0; i < header->num_tables; i++) {
+            const BugFileTableDesc *tdesc = (const BugFileTableDesc *)p;
+            p += sizeof(*tdesc);
+            Table &table = tables[tdesc->name];
+            table.rows = tdesc->rows;
+            for (uint32_t j = 0; j < tdesc->num_columns; j++) {
+                const BugFileColumnDesc *cdesc = (const BugFileColumnDesc *)p;
+                p += sizeof(*cdesc);
+                Column col;
+                col.kind = (ColumnKind)cdesc->kind;
+                col.data = base + cdesc->data_offset;
+                col.data_size = cdesc->data_size;
+                col.offsets = is_variable(col.kind)
+                    ? (const uint64_t *)(base + cdesc->offsets_offset) : nullptr;
+                table.columns[cdesc->name] = col;
+            }
+        }
+    }
+
+    ~BugFileReader() { munmap((void *)base, size); }
+
+    BugFileReader(const BugFileReader &) = delete;
+    BugFileReader &operator=(const BugFileReader &) = delete;
+
+    const Table &operator[](const std::string &name) const {
+        auto it = tables.find(name);
+        if (it == tables.end()) {
+            throw std::runtime_error("Bug file has no table " + name);
+        }
+        return it->second;
+    }
+
+private:
+    const uint8_t *base;
+    size_t size;
+    std::map<std::string, Table> tables;
+};
+
+// Picks up where the bug file at state_path left off: same rows, so ids
+// carry on from there.
+inline void BugFileWriter::restore_state(const std::string &state_path,
+        const std::string &inputfile) {
+    BugFileReader reader(state_path);
+    for (BugFileTable *table : tables()) {
+        const BugFileReader::Table &saved = reader[table->name];
+        table->rows = saved.rows;
+        for (BugFileColumn &col : table->columns) {
+            const BugFileReader::Column &saved_col = saved[col.name];
+            col.data.assign(saved_col.data, saved_col.data + saved_col.data_size);
+            if (is_variable(col.kind)) {
+                col.offsets.assign(saved_col.offsets,
+                        saved_col.offsets + saved.rows + 1);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef __BUG_MERGE_HXX
+#define __BUG_MERGE_HXX
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <odb/pgsql/database.hxx>
+
+#include "lava.hxx"
+#include "lava-odb.hxx"
+#include "persister.hxx"
+#include "bug_file.hxx"
+
+// Merges bug files into a Persister (the database or another bug file),
+// deduplicating on the objects' unique keys as it goes:
+//   SourceLval   by SourceLvalUniq  (loc, ast_name)
+//   AttackPoint  by AttackPointUniq (loc, type)
+//   Bug          by BugUniq         (type, atp, trigger_lval)
+// Everything else is specific to one input file and so new by construction.
+//
+// If db is non-null, lvals, atps and bugs already in the database count as
+// seen too. Every id is remapped onto whatever ids out hands out.
+//
+// With top_k (fbi_top_k), a bug is dropped once its (atp, type) already has
+// top_k bugs, counting those in the database, just as a serial fbi run over
+// the inputs in merge order would stop adding bugs there.
+class BugFileMerger {
+public:
+    uint64_t num_bugs = 0;
+    uint64_t num_fake_bugs = 0;
+    uint64_t num_duplicate_bugs = 0;
+    uint64_t num_over_top_k_bugs = 0;
+    uint64_t num_duas = 0;
+
+    BugFileMerger(Persister &out, odb::pgsql::database *db,
+            uint32_t top_k = 0)
+        : out(out), db(db), top_k(top_k) {}
+
+    void merge(const std::string &path) {
+        BugFileReader bf(path);
+
+        // In each of these, index i holds the object with file-local id i.
+        // Ids in a bug file are dense and start at 1.
+        const auto &lval_t = bf["sourcelval"];
+        std::vector<const SourceLval *> lvals(lval_t.rows + 1, nullptr);
+        for (uint64_t row = 0; row < lval_t.rows; row++) {
+            lvals.at(lval_t["id"].u64(row)) = create_lval(SourceLval{0,
+                    lval_t.loc("loc", row), lval_t["ast_name"].str(row),
+                    lval_t["len_bytes"].u32(row)});
+        }
+
+        const auto &atp_t = bf["attackpoint"];
+        std::vector<const AttackPoint *> atps(atp_t.rows + 1, nullptr);
+        for (uint64_t row = 0; row < atp_t.rows; row++) {
+            atps.at(atp_t["id"].u64(row)) = create_atp(AttackPoint{0,
+                    atp_t.loc("loc", row),
+                    (AttackPoint::Type)atp_t["type"].u32(row)});
+        }
+
+        // The stores keep objects alive until everything pointing at them
+        // has been persisted too.
+        const auto &ls_t = bf["labelset"];
+        std::deque<LabelSet> labelset_store;
+        std::vector<const LabelSet *> labelsets(ls_t.rows + 1, nullptr);
+        for (uint64_t row = 0; row < ls_t.rows; row++) {
+            labelset_store.push_back(LabelSet{0, ls_t["ptr"].u64(row),
+                    ls_t["inputfile"].str(row), ls_t["labels"].u32_list(row)});
+            out.persist(labelset_store.back());
+            labelsets.at(ls_t["id"].u64(row)) = &labelset_store.back();
+        }
+
+        const auto &dua_t = bf["dua"];
+        std::deque<Dua> dua_store;
+        std::vector<const Dua *> duas(dua_t.rows + 1, nullptr);
+        for (uint64_t row = 0; row < dua_t.rows; row++) {
+            dua_store.emplace_back();
+            Dua &dua = dua_store.back();
+            dua.lval = lvals.at(dua_t["lval"].u64(row));
+            for (uint64_t ls_id : dua_t["viable_bytes"].u64_list(row)) {
+                dua.viable_bytes.push_back(ls_id ? labelsets.at(ls_id) : nullptr);
+            }
+            dua.byte_tcn = dua_t["byte_tcn"].u32_list(row);
+            dua.all_labels = dua_t["all_labels"].u32_list(row);
+            dua.inputfile = dua_t["inputfile"].str(row);
+            dua.max_tcn = dua_t["max_tcn"].u32(row);
+            dua.max_cardinality = dua_t["max_cardinality"].u32(row);
+            dua.instr = dua_t["instr"].u64(row);
+            dua.fake_dua = dua_t["fake_dua"].u8(row);
+            out.persist(dua);
+            duas.at(dua_t["id"].u64(row)) = &dua;
+        }
+        num_duas += dua_t.rows;
+
+        const auto &bytes_t = bf["duabytes"];
+        std::deque<DuaBytes> dua_bytes_store;
+        std::vector<const DuaBytes *> dua_bytes(bytes_t.rows + 1, nullptr);
+        for (uint64_t row = 0; row < bytes_t.rows; row++) {
+            dua_bytes_store.emplace_back();
+            DuaBytes &bytes = dua_bytes_store.back();
+            bytes.dua = duas.at(bytes_t["dua"].u64(row));
+            bytes.selected = Range{bytes_t["selected_low"].u32(row),
+                bytes_t["selected_high"].u32(row)};
+            bytes.all_labels = bytes_t["all_labels"].u32_list(row);
+            out.persist(bytes);
+            dua_bytes.at(bytes_t["id"].u64(row)) = &bytes;
+        }
+
+        const auto &bug_t = bf["bug"];
+        for (uint64_t row = 0; row < bug_t.rows; row++) {
+            Bug bug;
+            bug.type = (Bug::Type)bug_t["type"].u32(row);
+            bug.trigger = dua_bytes.at(bug_t["trigger"].u64(row));
+            bug.trigger_lval = lvals.at(bug_t["trigger_lval"].u64(row));
+            bug.atp = atps.at(bug_t["atp"].u64(row));
+            if (bug_exists(bug.type, bug.atp, bug.trigger_lval)) {
+                num_duplicate_bugs++;
+                continue;
+            }
+            uint32_t &at_atp = bugs_at[std::make_pair(bug.atp->id, bug.type)];
+            if (top_k > 0 && at_atp >= top_k) {
+                num_over_top_k_bugs++;
+                continue;
+            }
+            at_atp++;
+            bug.max_liveness = bug_t["max_liveness"].u64(row);
+            for (uint64_t extra_id : bug_t["extra_duas"].u64_list(row)) {
+                bug.extra_duas.push_back(dua_bytes.at(extra_id)->id);
+            }
+            bug.magic = bug_t["magic"].u32(row);
+            out.persist(bug);
+            num_bugs++;
+            if (bug.trigger->dua->fake_dua) num_fake_bugs++;
+        }
+        out.maybe_flush();
+    }
+
+private:
+    Persister &out;
+    odb::pgsql::database *db;
+    uint32_t top_k;
+
+    // Shared by all bug files merged by this object.
+    std::set<SourceLval> known_lvals;
+    std::set<AttackPoint> known_atps;
+    // Ids of atps that were in the database before we started.
+    std::set<uint64_t> preexisting_atps;
+
+    typedef std::tuple<Bug::Type, uint64_t, uint64_t> BugKey; // type, atp, lval
+    std::set<BugKey> known_bugs;
+    std::set<std::pair<uint64_t, Bug::Type>> loaded_bug_keys;
+    // Bugs at each (atp, type), in the database or merged.
+    std::map<std::pair<uint64_t, Bug::Type>, uint32_t> bugs_at;
+
+    const SourceLval *create_lval(SourceLval lval) {
+        auto it = known_lvals.find(lval);
+        if (it != known_lvals.end()) return &*it;
+
+        std::unique_ptr<SourceLval> found;
+        if (db) {
+            typedef odb::query<SourceLval> q;
+            found.reset(db->query_one<SourceLval>(
+                    q::loc.filename == lval.loc.filename &&
+                    q::loc.begin.line == lval.loc.begin.line &&
+                    q::loc.begin.column == lval.loc.begin.column &&
+                    q::loc.end.line == lval.loc.end.line &&
+                    q::loc.end.column == lval.loc.end.column &&
+                    q::ast_name == lval.ast_name));
+        }
+        if (found) {
+            lval = *found;
+        } else {
+            out.persist(lval);
+        }
+        return &*known_lvals.insert(lval).first;
+    }
+
+    const AttackPoint *create_atp(AttackPoint atp) {
+        auto it = known_atps.find(atp);
+        if (it != known_atps.end()) return &*it;
+
+        std::unique_ptr<AttackPoint> found;
+        if (db) {
+            typedef odb::query<AttackPoint> q;
+            found.reset(db->query_one<AttackPoint>(
+                    q::loc.filename == atp.loc.filename &&
+                    q::loc.begin.line == atp.loc.begin.line &&
+                    q::loc.begin.column == atp.loc.begin.column &&
+                    q::loc.end.line == atp.loc.end.line &&
+                    q::loc.end.column == atp.loc.end.column &&
+                    q::type == atp.type));
+        }
+        if (found) {
+            atp = *found;
+            preexisting_atps.insert(atp.id);
+        } else {
+            out.persist(atp);
+        }
+        return &*known_atps.insert(atp).first;
+    }
+
+    // Returns true if this bug is already in the database or was merged
+    // earlier. Marks it as known either way.
+    bool bug_exists(Bug::Type type, const AttackPoint *atp,
+            const SourceLval *lval) {
+        if (db && preexisting_atps.count(atp->id) > 0
+                && loaded_bug_keys.insert(std::make_pair(atp->id, type)).second) {
+            typedef odb::query<BugLval> q;
+            auto result = db->query<BugLval>(q::atp == atp->id && q::type == type);
+            for (auto it = result.begin(); it != result.end(); it++) {
+                known_bugs.insert(BugKey(type, atp->id, it->trigger_lval));
+                bugs_at[std::make_pair(atp->id, type)]++;
+            }
+        }
+        return !known_bugs.insert(BugKey(type, atp->id, lval->id)).second;
+    }
+};
+
+#endif
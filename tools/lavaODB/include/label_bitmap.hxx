@@ -0,0 +1,308 @@
+#ifndef __LABEL_BITMAP_HXX
+#define __LABEL_BITMAP_HXX
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+// Compressed bitmap of taint labels, in the style of Roaring bitmaps.
+//
+// Labels are split by their high 16 bits into chunks of 65536, and each chunk
+// with any labels in it gets a container chosen by density:
+//   ARRAY   sorted 16-bit values, while there are at most 4096 of them;
+//   RUNS    sorted (first, last) pairs, when an array outgrows that but its
+//           labels come in long runs, as they do for bytes computed over
+//           whole regions of the input;
+//   BITMAP  65536 bits, otherwise.
+// None of them ever takes more than 8 KiB per chunk.
+//
+// fbi uses this to accumulate unions of many taint sets: all the labels on a
+// dua's bytes, on a tainted branch, or on a bug's trigger and extra duas. With
+// multi-megabyte inputs those unions are large and span the whole input, and
+// merging each set into a sorted vector costs time proportional to the union
+// so far. Adding a set here costs time proportional to the set.
+//
+// Stored label sets stay sorted LabelVecs (INTEGER[] in the database);
+// to_vector() converts.
+class LabelBitmap {
+public:
+    // Number of labels.
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Adds labels[0..n), which must be sorted and free of duplicates.
+    void add(const uint32_t *labels, size_t n) {
+        size_t i = 0;
+        while (i < n) {
+            uint16_t key = labels[i] >> 16;
+            size_t j = i + 1;
+            while (j < n && (labels[j] >> 16) == key) j++;
+            Container &c = container(key);
+            count -= c.count;
+            add_to(c, labels + i, j - i);
+            count += c.count;
+            i = j;
+        }
+    }
+
+    template<typename Labels>
+    void add(const Labels &labels) { add(labels.data(), labels.size()); }
+
+    void insert(uint32_t label) { add(&label, 1); }
+
+    bool contains(uint32_t label) const {
+        const Container *c = find(label >> 16);
+        if (!c) return false;
+        uint16_t v = label;
+        switch (c->kind) {
+        case ARRAY:
+            return std::binary_search(c->values.begin(), c->values.end(), v);
+        case BITMAP:
+            return (c->bits[v >> 6] >> (v & 63)) & 1;
+        case RUNS: {
+            // Last run starting at or before v.
+            size_t lo = 0, hi = c->values.size() / 2;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (c->values[2 * mid] <= v) lo = mid + 1;
+                else hi = mid;
+            }
+            return lo > 0 && v <= c->values[2 * lo - 1];
+        }
+        }
+        return false;
+    }
+
+    // True if any of labels[0..n) (sorted) is in the bitmap.
+    bool intersects(const uint32_t *labels, size_t n) const {
+        size_t i = 0;
+        while (i < n) {
+            uint16_t key = labels[i] >> 16;
+            size_t j = i + 1;
+            while (j < n && (labels[j] >> 16) == key) j++;
+            const Container *c = find(key);
+            if (c && intersects(*c, labels + i, j - i)) return true;
+            i = j;
+        }
+        return false;
+    }
+
+    template<typename Labels>
+    bool intersects(const Labels &labels) const {
+        return intersects(labels.data(), labels.size());
+    }
+
+    // Calls f(label) for every label, in increasing order.
+    template<typename F>
+    void for_each(F f) const {
+        for (const Container &c : containers) {
+            uint32_t high = (uint32_t)c.key << 16;
+            switch (c.kind) {
+            case ARRAY:
+                for (uint16_t v : c.values) f(high | v);
+                break;
+            case BITMAP:
+                for (size_t w = 0; w < BITMAP_WORDS; w++) {
+                    for (uint64_t word = c.bits[w]; word; word &= word - 1) {
+                        f(high | (uint32_t)(w * 64 + __builtin_ctzll(word)));
+                    }
+                }
+                break;
+            case RUNS:
+                for (size_t r = 0; r < c.values.size(); r += 2) {
+                    for (uint32_t v = c.values[r]; v <= c.values[r + 1]; v++) {
+                        f(high | v);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    std::vector<uint32_t> to_vector() const {
+        std::vector<uint32_t> result;
+        result.reserve(count);
+        for_each([&result](uint32_t label) { result.push_back(label); });
+        return result;
+    }
+
+private:
+    static const size_t ARRAY_MAX = 4096;
+    // In (first, last) pairs. Past this many runs a bitmap is smaller.
+    static const size_t RUNS_MAX = 2048;
+    static const size_t BITMAP_WORDS = 1024;
+
+    enum Kind : uint8_t { ARRAY, RUNS, BITMAP };
+
+    struct Container {
+        uint16_t key;
+        Kind kind;
+        uint32_t count;
+        // ARRAY: sorted values. RUNS: (first, last) pairs, sorted, with no
+        // two runs overlapping or adjacent.
+        std::vector<uint16_t> values;
+        // BITMAP only.
+        std::vector<uint64_t> bits;
+    };
+
+    // Sorted by key.
+    std::vector<Container> containers;
+    size_t count = 0;
+
+    // Scratch space for merges.
+    std::vector<uint16_t> low, merged;
+
+    const Container *find(uint16_t key) const {
+        auto it = std::lower_bound(containers.begin(), containers.end(), key,
+                [](const Container &c, uint16_t key) { return c.key < key; });
+        return it != containers.end() && it->key == key ? &*it : nullptr;
+    }
+
+    Container &container(uint16_t key) {
+        // Labels mostly arrive in increasing order.
+        if (!containers.empty() && containers.back().key == key) {
+            return containers.back();
+        }
+        auto it = std::lower_bound(containers.begin(), containers.end(), key,
+                [](const Container &c, uint16_t key) { return c.key < key; });
+        if (it == containers.end() || it->key != key) {
+            it = containers.insert(it, Container{key, ARRAY, 0, {}, {}});
+        }
+        return *it;
+    }
+
+    void add_to(Container &c, const uint32_t *labels, size_t n) {
+        switch (c.kind) {
+        case ARRAY:
+            if (c.values.empty() || c.values.back() < (uint16_t)labels[0]) {
+                for (size_t i = 0; i < n; i++) c.values.push_back(labels[i]);
+            } else {
+                low.assign(labels, labels + n);
+                merged.clear();
+                merged.reserve(c.values.size() + n);
+                std::set_union(c.values.begin(), c.values.end(),
+                        low.begin(), low.end(), std::back_inserter(merged));
+                c.values.swap(merged);
+            }
+            c.count = c.values.size();
+            if (c.count > ARRAY_MAX) {
+                merged.clear();
+                values_to_runs(c.values.data(), c.values.size(), merged);
+                if (merged.size() / 2 <= RUNS_MAX) {
+                    c.kind = RUNS;
+                    c.values.swap(merged);
+                } else {
+                    to_bitmap(c);
+                }
+            }
+            break;
+        case RUNS:
+            low.assign(labels, labels + n);
+            merged.clear();
+            values_to_runs(low.data(), low.size(), merged);
+            low.swap(merged);
+            merge_runs(c.values, low, merged);
+            c.values.swap(merged);
+            c.count = 0;
+            for (size_t r = 0; r < c.values.size(); r += 2) {
+                c.count += c.values[r + 1] - c.values[r] + 1;
+            }
+            if (c.values.size() / 2 > RUNS_MAX) to_bitmap(c);
+            break;
+        case BITMAP:
+            for (size_t i = 0; i < n; i++) {
+                uint16_t v = labels[i];
+                uint64_t &word = c.bits[v >> 6];
+                uint64_t bit = 1ULL << (v & 63);
+                c.count += !(word & bit);
+                word |= bit;
+            }
+            break;
+        }
+    }
+
+    static bool intersects(const Container &c, const uint32_t *labels,
+            size_t n) {
+        size_t i = 0, k = 0;
+        switch (c.kind) {
+        case ARRAY:
+            while (i < n && k < c.values.size()) {
+                uint16_t v = labels[i];
+                if (v == c.values[k]) return true;
+                if (v < c.values[k]) i++;
+                else k++;
+            }
+            return false;
+        case RUNS:
+            while (i < n && k < c.values.size()) {
+                uint16_t v = labels[i];
+                if (v < c.values[k]) i++;
+                else if (v > c.values[k + 1]) k += 2;
+                else return true;
+            }
+            return false;
+        case BITMAP:
+            for (; i < n; i++) {
+                uint16_t v = labels[i];
+                if ((c.bits[v >> 6] >> (v & 63)) & 1) return true;
+            }
+            return false;
+        }
+        return false;
+    }
+
+    static void to_bitmap(Container &c) {
+        c.bits.assign(BITMAP_WORDS, 0);
+        if (c.kind == ARRAY) {
+            for (uint16_t v : c.values) c.bits[v >> 6] |= 1ULL << (v & 63);
+        } else {
+            for (size_t r = 0; r < c.values.size(); r += 2) {
+                for (uint32_t v = c.values[r]; v <= c.values[r + 1]; v++) {
+                    c.bits[v >> 6] |= 1ULL << (v & 63);
+                }
+            }
+        }
+        c.kind = BITMAP;
+        std::vector<uint16_t>().swap(c.values);
+    }
+
+    // Appends the runs in sorted values[0..n) to runs.
+    static void values_to_runs(const uint16_t *values, size_t n,
+            std::vector<uint16_t> &runs) {
+        for (size_t i = 0; i < n;) {
+            size_t j = i;
+            while (j + 1 < n && values[j + 1] == values[j] + 1) j++;
+            runs.push_back(values[i]);
+            runs.push_back(values[j]);
+            i = j + 1;
+        }
+    }
+
+    // Union of two run lists.
+    static void merge_runs(const std::vector<uint16_t> &a,
+            const std::vector<uint16_t> &b, std::vector<uint16_t> &out) {
+        out.clear();
+        size_t i = 0, j = 0;
+        while (i < a.size() || j < b.size()) {
+            const uint16_t *next;
+            if (j == b.size() || (i < a.size() && a[i] <= b[j])) {
+                next = &a[i];
+                i += 2;
+            } else {
+                next = &b[j];
+                j += 2;
+            }
+            // Extend the last run if next overlaps or touches it.
+            if (!out.empty() && next[0] <= out.back() + 1) {
+                out.back() = std::max(out.back(), next[1]);
+            } else {
+                out.push_back(next[0]);
+                out.push_back(next[1]);
+            }
+        }
+    }
+};
+
+#endif
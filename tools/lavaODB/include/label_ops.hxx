@@ -0,0 +1,345 @@
+#ifndef __LABEL_OPS_HXX
+#define __LABEL_OPS_HXX
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LABEL_OPS_X86 1
+#include <immintrin.h>
+#endif
+
+// Set operations on sorted, duplicate-free uint32 arrays (taint labels).
+//
+//   label_union(a, na, b, nb, out)       writes a | b to out, returns size
+//   labels_disjoint(a, na, b, nb)        true iff a & b is empty
+//   label_difference(a, na, b, nb, out)  writes a - b to out, returns size
+//
+// Each has a scalar version and an SSE4.1 version; labels_disjoint also has
+// an AVX2 version. Only labels_disjoint picks the best one the CPU supports,
+// at runtime, so nothing needs building with -msse4.1 or -mavx2.
+// LAVA_LABEL_OPS=scalar (or sse41) in the environment caps the level, for
+// comparison.
+//
+// label_union and label_difference always use the scalar code. Labels come
+// in near-contiguous runs, so the two inputs rarely interleave, and the
+// scalar merge then runs through each in turn with predictable branches;
+// the vector merge is no faster there (union) or slower (difference). Their
+// SSE4.1 versions are kept for label_ops_bench.
+//
+// The vector kernels store whole registers, so out must have room for
+// LABEL_OPS_SLACK elements past the largest possible result (na + nb for
+// union, na for difference). out must not overlap the inputs.
+//
+// Most label sets are tiny; inputs shorter than one register go straight to
+// the scalar code.
+
+static const size_t LABEL_OPS_SLACK = 4;
+
+// Below this many elements in either input, union and difference use the
+// scalar code: setting up the vector merge costs more than it saves.
+static const size_t LABEL_OPS_MIN_VECTOR = 16;
+
+// Scalar versions.
+
+inline size_t label_union_scalar(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb, uint32_t *out) {
+    return std::set_union(a, a + na, b, b + nb, out) - out;
+}
+
+inline bool labels_disjoint_scalar(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb) {
+    const uint32_t *a_end = a + na, *b_end = b + nb;
+    while (a != a_end && b != b_end) {
+        if (*a < *b) a++;
+        else if (*b < *a) b++;
+        else return false;
+    }
+    return true;
+}
+
+inline size_t label_difference_scalar(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb, uint32_t *out) {
+    return std::set_difference(a, a + na, b, b + nb, out) - out;
+}
+
+#ifdef LABEL_OPS_X86
+
+// pshufb masks that pack the lanes of a 4 x uint32 register whose bit is
+// clear in a 4-bit mask to the front, in order.
+struct LabelOpsPackTable {
+    uint8_t shuffle[16][16];
+
+    LabelOpsPackTable() {
+        for (int mask = 0; mask < 16; mask++) {
+            int out = 0;
+            for (int lane = 0; lane < 4; lane++) {
+                if (mask & (1 << lane)) continue;
+                for (int byte = 0; byte < 4; byte++) {
+                    shuffle[mask][out * 4 + byte] = lane * 4 + byte;
+                }
+                out++;
+            }
+            for (; out < 4; out++) {
+                for (int byte = 0; byte < 4; byte++) {
+                    shuffle[mask][out * 4 + byte] = 0x80;
+                }
+            }
+        }
+    }
+
+    static const LabelOpsPackTable &get() {
+        static const LabelOpsPackTable table;
+        return table;
+    }
+};
+
+// Store the lanes of v not set in drop_mask to out. Returns how many.
+__attribute__((target("sse4.1")))
+inline size_t label_ops_pack_store(__m128i v, int drop_mask, uint32_t *out) {
+    const __m128i shuffle = _mm_loadu_si128(
+            (const __m128i *)LabelOpsPackTable::get().shuffle[drop_mask]);
+    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, shuffle));
+    return 4 - __builtin_popcount(drop_mask);
+}
+
+// Store the sorted lanes of v that differ from their predecessor (lane 3 of
+// prev, for the first). Sets prev to v. Returns how many were stored.
+__attribute__((target("sse4.1")))
+inline size_t label_ops_store_unique(__m128i v, __m128i &prev, uint32_t *out) {
+    __m128i shifted = _mm_alignr_epi8(v, prev, 12);
+    int dups = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, shifted)));
+    prev = v;
+    return label_ops_pack_store(v, dups, out);
+}
+
+// Bitonic merge of two sorted registers: on return, lo holds the smallest
+// four of the eight values and hi the largest four, each sorted.
+__attribute__((target("sse4.1")))
+inline void label_ops_merge4(__m128i &lo, __m128i &hi) {
+    __m128i tmp = _mm_min_epu32(lo, hi);
+    hi = _mm_max_epu32(lo, hi);
+    for (int round = 0; round < 3; round++) {
+        tmp = _mm_alignr_epi8(tmp, tmp, 4);
+        lo = _mm_min_epu32(tmp, hi);
+        hi = _mm_max_epu32(tmp, hi);
+        tmp = lo;
+    }
+    lo = _mm_alignr_epi8(tmp, tmp, 4);
+}
+
+// Bitmask of the lanes of va equal to some lane of vb.
+__attribute__((target("sse4.1")))
+inline __m128i label_ops_match4(__m128i va, __m128i vb) {
+    __m128i r1 = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+    __m128i r2 = _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2));
+    __m128i r3 = _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3));
+    return _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, r1)),
+            _mm_or_si128(_mm_cmpeq_epi32(va, r2), _mm_cmpeq_epi32(va, r3)));
+}
+
+__attribute__((target("sse4.1")))
+inline size_t label_union_sse41(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb, uint32_t *out) {
+    if (na < LABEL_OPS_MIN_VECTOR || nb < LABEL_OPS_MIN_VECTOR) {
+        return label_union_scalar(a, na, b, nb, out);
+    }
+    // Labels are input offsets and often come in separate runs.
+    if (a[na - 1] < b[0] || b[nb - 1] < a[0]) {
+        if (b[0] < a[0]) {
+            std::swap(a, b);
+            std::swap(na, nb);
+        }
+        std::memcpy(out, a, na * sizeof(uint32_t));
+        std::memcpy(out + na, b, nb * sizeof(uint32_t));
+        return na + nb;
+    }
+
+    uint32_t *const out_begin = out;
+    size_t i = 4, j = 4;
+    __m128i lo = _mm_loadu_si128((const __m128i *)a);
+    __m128i hi = _mm_loadu_si128((const __m128i *)b);
+    label_ops_merge4(lo, hi);
+
+    // The last value stored, in lane 3, for dropping duplicates across
+    // stores. Starts as something unequal to the minimum.
+    __m128i prev = _mm_set1_epi32(std::min(a[0], b[0]) - 1);
+    out += label_ops_store_unique(lo, prev, out);
+
+    // Everything still in a or b is >= everything stored so far.
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i next;
+        if (a[i] <= b[j]) {
+            next = _mm_loadu_si128((const __m128i *)(a + i));
+            i += 4;
+        } else {
+            next = _mm_loadu_si128((const __m128i *)(b + j));
+            j += 4;
+        }
+        label_ops_merge4(next, hi);
+        out += label_ops_store_unique(next, prev, out);
+    }
+
+    // Finish off with a scalar merge of what's left of hi, a and b,
+    // dropping anything equal to the last value stored. The few values
+    // left in hi go first, three ways.
+    uint32_t rest[4 + LABEL_OPS_SLACK];
+    const uint32_t *rest_it = rest;
+    const uint32_t *rest_end = rest + label_ops_store_unique(hi, prev, rest);
+    const uint32_t *a_it = a + i, *a_end = a + na;
+    const uint32_t *b_it = b + j, *b_end = b + nb;
+    uint32_t last = out[-1];
+    while (rest_it != rest_end) {
+        uint32_t v = *rest_it;
+        const uint32_t **min_it = &rest_it;
+        if (a_it != a_end && *a_it < v) { v = *a_it; min_it = &a_it; }
+        if (b_it != b_end && *b_it < v) { v = *b_it; min_it = &b_it; }
+        (*min_it)++;
+        if (v != last) *out++ = last = v;
+    }
+    // Only a and b can still hold last, and only at their heads.
+    if (a_it != a_end && *a_it == last) a_it++;
+    if (b_it != b_end && *b_it == last) b_it++;
+    out = std::set_union(a_it, a_end, b_it, b_end, out);
+    return out - out_begin;
+}
+
+__attribute__((target("sse4.1")))
+inline bool labels_disjoint_sse41(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb) {
+    if (na == 0 || nb == 0 || a[na - 1] < b[0] || b[nb - 1] < a[0]) {
+        return true;
+    }
+    size_t i = 0, j = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+        __m128i match = label_ops_match4(va, vb);
+        if (!_mm_testz_si128(match, match)) return false;
+        uint32_t a_max = a[i + 3], b_max = b[j + 3];
+        if (a_max <= b_max) i += 4;
+        if (b_max <= a_max) j += 4;
+    }
+    return labels_disjoint_scalar(a + i, na - i, b + j, nb - j);
+}
+
+__attribute__((target("sse4.1")))
+inline size_t label_difference_sse41(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb, uint32_t *out) {
+    if (na < LABEL_OPS_MIN_VECTOR || nb < LABEL_OPS_MIN_VECTOR) {
+        return label_difference_scalar(a, na, b, nb, out);
+    }
+    if (a[na - 1] < b[0] || b[nb - 1] < a[0]) {
+        std::memcpy(out, a, na * sizeof(uint32_t));
+        return na;
+    }
+
+    uint32_t *const out_begin = out;
+    size_t i = 0, j = 0;
+    // Invariant: every b before j is less than every a from i on.
+    for (; i + 4 <= na; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        uint32_t a_max = a[i + 3];
+        int found = 0;
+        // Skip b blocks entirely below this a block without comparing.
+        while (j + 4 <= nb && b[j + 3] < a[i]) j += 4;
+        for (;;) {
+            if (j + 4 > nb) {
+                // Fewer than a register's worth of b left.
+                for (int lane = 0; lane < 4; lane++) {
+                    if (std::binary_search(b + j, b + nb, a[i + lane])) {
+                        found |= 1 << lane;
+                    }
+                }
+                break;
+            }
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+            found |= _mm_movemask_ps(_mm_castsi128_ps(label_ops_match4(va, vb)));
+            // This b block might overlap the next a block too.
+            if (b[j + 3] >= a_max) break;
+            j += 4;
+        }
+        out += label_ops_pack_store(va, found, out);
+    }
+    return (out - out_begin)
+        + label_difference_scalar(a + i, na - i, b + j, nb - j, out);
+}
+
+__attribute__((target("avx2")))
+inline bool labels_disjoint_avx2(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb) {
+    if (na == 0 || nb == 0 || a[na - 1] < b[0] || b[nb - 1] < a[0]) {
+        return true;
+    }
+    size_t i = 0, j = 0;
+    const __m256i rotate = _mm256_set_epi32(0, 7, 6, 5, 4, 3, 2, 1);
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+        __m256i match = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; r++) {
+            vb = _mm256_permutevar8x32_epi32(vb, rotate);
+            match = _mm256_or_si256(match, _mm256_cmpeq_epi32(va, vb));
+        }
+        if (!_mm256_testz_si256(match, match)) return false;
+        uint32_t a_max = a[i + 7], b_max = b[j + 7];
+        if (a_max <= b_max) i += 8;
+        if (b_max <= a_max) j += 8;
+    }
+    return labels_disjoint_sse41(a + i, na - i, b + j, nb - j);
+}
+
+#endif // LABEL_OPS_X86
+
+enum class LabelOpsLevel { SCALAR, SSE41, AVX2 };
+
+inline LabelOpsLevel label_ops_level() {
+    static const LabelOpsLevel level = []() {
+        LabelOpsLevel best = LabelOpsLevel::SCALAR;
+#ifdef LABEL_OPS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) best = LabelOpsLevel::AVX2;
+        else if (__builtin_cpu_supports("sse4.1")) best = LabelOpsLevel::SSE41;
+#endif
+        const char *cap = getenv("LAVA_LABEL_OPS");
+        if (cap && strcmp(cap, "scalar") == 0) {
+            best = LabelOpsLevel::SCALAR;
+        } else if (cap && strcmp(cap, "sse41") == 0
+                && best == LabelOpsLevel::AVX2) {
+            best = LabelOpsLevel::SSE41;
+        }
+        return best;
+    }();
+    return level;
+}
+
+inline size_t label_union(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb, uint32_t *out) {
+    return label_union_scalar(a, na, b, nb, out);
+}
+
+inline bool labels_disjoint(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb) {
+#ifdef LABEL_OPS_X86
+    switch (label_ops_level()) {
+    case LabelOpsLevel::AVX2:
+        return labels_disjoint_avx2(a, na, b, nb);
+    case LabelOpsLevel::SSE41:
+        return labels_disjoint_sse41(a, na, b, nb);
+    case LabelOpsLevel::SCALAR:
+        break;
+    }
+#endif
+    return labels_disjoint_scalar(a, na, b, nb);
+}
+
+inline size_t label_difference(const uint32_t *a, size_t na,
+        const uint32_t *b, size_t nb, uint32_t *out) {
+    return label_difference_scalar(a, na, b, nb, out);
+}
+
+#endif
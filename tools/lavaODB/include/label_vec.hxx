@@ -0,0 +1,110 @@
+#ifndef __LABEL_VEC_HXX
+#define __LABEL_VEC_HXX
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <ostream>
+#include <vector>
+
+// Immutable, interned array of taint labels.
+//
+// fbi creates millions of LabelSets, Duas and DuaBytes, and each used to own
+// a separately allocated std::vector<uint32_t> of labels. Most of those
+// arrays are small, and many are identical (the same union over the same
+// bytes comes up again and again). LabelVec instead points into an arena
+// owned by a global LabelPool, which hash-conses arrays so each distinct
+// one is stored exactly once. Copying a LabelVec copies a pointer, and
+// equality is pointer equality.
+//
+// Arrays are never freed; they live as long as the process. The pool itself
+// is in label_pool.cpp, built into the lava-odb libraries, so that what
+// includes lava.hxx only sees the handle.
+//
+// Maps to INTEGER[] in Postgres, like std::vector<uint32_t> (see pgarray.hxx).
+
+class LabelPool {
+public:
+    struct Stats {
+        uint64_t requests = 0;        // arrays interned
+        uint64_t request_words = 0;   // labels in those arrays
+        uint64_t unique = 0;          // distinct arrays stored
+        uint64_t unique_words = 0;    // labels in distinct arrays
+        uint64_t arena_bytes = 0;     // bytes allocated for the arena
+        uint64_t table_bytes = 0;     // bytes in the hash table
+    };
+
+    // Layout of an interned array: words[0] is the size, words[1] the hash,
+    // and the labels follow.
+    static constexpr size_t HEADER_WORDS = 2;
+
+    // The empty array, which isn't stored in the pool. Here rather than in
+    // label_pool.cpp so that default LabelVecs don't need the library.
+    static const uint32_t *empty() {
+        static const uint32_t words[HEADER_WORDS] = { 0, 0 };
+        return words;
+    }
+
+    // Returns the canonical copy of labels[0..n). Thread-safe.
+    static const uint32_t *intern(const uint32_t *labels, size_t n);
+
+    static Stats get_stats();
+
+    // What the same arrays would have cost as individual std::vectors
+    // (object, heap block, allocator header) against what they cost here
+    // (one pointer each, plus the arena and hash table).
+    static void report(std::ostream &os, const Stats &s);
+};
+
+class LabelVec {
+public:
+    typedef uint32_t value_type;
+    typedef const uint32_t *const_iterator;
+    typedef const_iterator iterator;
+
+    LabelVec() : words(LabelPool::empty()) {}
+    LabelVec(const std::vector<uint32_t> &labels)
+        : words(LabelPool::intern(labels.data(), labels.size())) {}
+    LabelVec(std::initializer_list<uint32_t> labels)
+        : words(LabelPool::intern(labels.begin(), labels.size())) {}
+    LabelVec(const uint32_t *labels, size_t n)
+        : words(LabelPool::intern(labels, n)) {}
+
+    const uint32_t *data() const { return words + LabelPool::HEADER_WORDS; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + size(); }
+    size_t size() const { return words[0]; }
+    bool empty() const { return size() == 0; }
+    uint32_t operator[](size_t i) const { return data()[i]; }
+    uint32_t front() const { return data()[0]; }
+    uint32_t back() const { return data()[size() - 1]; }
+
+    std::vector<uint32_t> to_vector() const {
+        return std::vector<uint32_t>(begin(), end());
+    }
+
+    // Interned, so equal contents means equal pointers.
+    bool operator==(const LabelVec &other) const { return words == other.words; }
+    bool operator!=(const LabelVec &other) const { return words != other.words; }
+    // Lexicographic, like std::vector.
+    bool operator<(const LabelVec &other) const {
+        return words != other.words && std::lexicographical_compare(
+                begin(), end(), other.begin(), other.end());
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const LabelVec &v) {
+        os << '{';
+        for (const_iterator it = v.begin(); it != v.end(); it++) {
+            if (it != v.begin()) os << ',';
+            os << *it;
+        }
+        os << '}';
+        return os;
+    }
+
+private:
+    const uint32_t *words;
+};
+
+#endif
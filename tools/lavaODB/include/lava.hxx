@@ -13,6 +13,9 @@
 #include <algorithm>
 #include <iterator>
 
+#include "label_vec.hxx"
+#include "lava_rng.hxx"
+
 template<typename T, class InputIt>
 inline void merge_into(InputIt first, InputIt last, size_t size, std::vector<T> &dest) {
     // Make empty array and swap with all_labels.
@@ -43,6 +46,9 @@ typedef std::vector<uint32_t> uint32_t_vec;
 typedef std::vector<uint64_t> uint64_t_vec;
 #pragma db value(uint64_t_vec) type("BIGINT[]")
 
+// Interned label arrays; also INTEGER[]. See label_vec.hxx.
+#pragma db value(LabelVec) type("INTEGER[]")
+
 namespace clang { class FullSourceLoc; }
 #pragma db value
 struct Loc {
@@ -81,6 +87,13 @@ struct LavaASTLoc {
     LavaASTLoc(std::string filename, Loc begin, Loc end) :
         filename(filename), begin(begin), end(end) {}
 
+    // Stable across runs and databases, unlike ids; see LavaRng.
+    uint64_t rng_key() const {
+        uint64_t h = lava_rng_hash(0, filename);
+        h = lava_rng_hash(h, ((uint64_t)begin.line << 32) | begin.column);
+        return lava_rng_hash(h, ((uint64_t)end.line << 32) | end.column);
+    }
+
     explicit LavaASTLoc(std::string serialized) {
         std::vector<std::string> components;
         std::istringstream iss(serialized);
@@ -162,6 +175,11 @@ struct SourceLval { // was DuaKey
 
 #pragma db index("SourceLvalUniq") unique members(loc, ast_name)
 
+    // Of what the lval is unique on.
+    uint64_t rng_key() const {
+        return lava_rng_hash(loc.rng_key(), ast_name);
+    }
+
     bool operator<(const SourceLval &other) const {
         return std::tie(loc, ast_name) <
             std::tie(other.loc, other.ast_name);
@@ -182,7 +200,7 @@ struct LabelSet {
     uint64_t ptr;           // Pointer to labelset during taint run
     std::string inputfile;  // Inputfile used for this run.
 
-    std::vector<uint32_t> labels;
+    LabelVec labels;
 
 #pragma db index("LabelSetUniq") unique members(ptr, inputfile)
 
@@ -205,7 +223,7 @@ struct Dua {
     std::vector<uint32_t> byte_tcn;
 
     // Union of labelsets in viable_bytes.
-    std::vector<uint32_t> all_labels;
+    LabelVec all_labels;
 
     // Inputfile used when this dua appeared.
     std::string inputfile;
@@ -269,22 +287,15 @@ struct DuaBytes {
     Range selected;
 
 #pragma db not_null
-    std::vector<uint32_t> all_labels;
+    LabelVec all_labels;
 
 #pragma db index("DuaBytesUniq") unique members(dua, selected)
 
     DuaBytes() {}
-    DuaBytes(const Dua *dua, Range selected) : dua(dua), selected(selected) {
-        assert(selected.low <= selected.high);
-        assert(selected.high <= dua->viable_bytes.size());
-        const auto &viable_bytes = dua->viable_bytes;
-        auto it = viable_bytes.cbegin() + selected.low;
-        auto end = viable_bytes.cbegin() + selected.high;
-        for (; it != end; it++) {
-            const LabelSet *ls = *it;
-            merge_into(ls->labels.begin(), ls->labels.end(), all_labels);
-        }
-    }
+    // all_labels is the union of the selected bytes' label sets. Defined in
+    // fbi, which is all that builds these; the label set kernels it uses
+    // stay out of the schema and the i386 tools.
+    DuaBytes(const Dua *dua, Range selected);
 
     bool operator<(const DuaBytes &other) const {
         return std::tie(dua->id, selected) <
@@ -315,6 +326,11 @@ struct AttackPoint {
 
 #pragma db index("AttackPointUniq") unique members(loc, type)
 
+    // Of what the attack point is unique on.
+    uint64_t rng_key() const {
+        return lava_rng_hash(loc.rng_key(), type);
+    }
+
     bool operator<(const AttackPoint &other) const {
         return std::tie(type, loc) <
             std::tie(other.type, other.loc);
@@ -381,21 +397,29 @@ struct Bug {
 #pragma db index("BugLvalsQuery") members(atp, type)
 
     Bug() {}
+    // Magic is a function of seed and the (atp, trigger lval, type) the bug
+    // is unique on, so it comes out the same whichever order bugs are found
+    // and whatever ids they got.
     Bug(Type type, const DuaBytes *trigger, uint64_t max_liveness,
-            const AttackPoint *atp, std::vector<uint64_t> extra_duas)
+            const AttackPoint *atp, std::vector<uint64_t> extra_duas,
+            uint64_t seed = LAVA_RNG_SEED)
         : id(0), type(type), trigger(trigger), trigger_lval(trigger->dua->lval),
             atp(atp), max_liveness(max_liveness), extra_duas(extra_duas),
             magic(0) {
+        LavaRng rng(seed, atp->rng_key(), trigger_lval->rng_key(), type);
         for (int i = 0; i < 4; i++) {
+            uint64_t r = rng.next();
             magic <<= 8;
-            magic |= rand() % 26 + 0x60;
-            magic ^= rand() & 0x20; // maybe flip case
+            magic |= r % 26 + 0x60;
+            magic ^= (r >> 32) & 0x20; // maybe flip case
         }
     }
 
     Bug(Type type, const DuaBytes *trigger, uint64_t max_liveness,
-            const AttackPoint *atp, std::vector<const DuaBytes *> extra_duas_)
-        : Bug(type, trigger, max_liveness, atp, std::initializer_list<uint64_t>({})) {
+            const AttackPoint *atp, std::vector<const DuaBytes *> extra_duas_,
+            uint64_t seed = LAVA_RNG_SEED)
+        : Bug(type, trigger, max_liveness, atp,
+                std::initializer_list<uint64_t>({}), seed) {
         for (const DuaBytes *dua_bytes : extra_duas_) {
             extra_duas.push_back(dua_bytes->id);
         }
@@ -424,6 +448,59 @@ struct BugLval {
     uint64_t trigger_lval;
 };
 
+// Every (atp, type, trigger lval) that has a bug, in that order. fbi loads
+// these once at startup rather than querying per attack point.
+#pragma db view object(Bug) \
+    query((?) + "ORDER BY" + Bug::atp + "," + Bug::type + "," \
+            + Bug::trigger_lval, distinct)
+struct BugTrigger {
+    uint64_t atp;
+    Bug::Type type;
+    uint64_t trigger_lval;
+};
+
+// Flat rows of bugs and the DuaBytes and Duas they point to, with pointers
+// left as ids. lavaTool fetches these with one query per table and links
+// them up itself; loading Bug objects would load each one, and every label
+// set of each of its duas, with a query apiece.
+#pragma db view object(Bug)
+struct BugRow {
+    uint64_t id;
+    Bug::Type type;
+    uint64_t trigger;
+    uint64_t trigger_lval;
+    uint64_t atp;
+    uint64_t max_liveness;
+    std::vector<uint64_t> extra_duas;
+    uint32_t magic;
+};
+
+#pragma db view object(DuaBytes)
+struct DuaBytesRow {
+    uint64_t id;
+    uint64_t dua;
+    Range selected;
+};
+
+// Everything but the label sets, which lavaTool never looks at.
+#pragma db view object(Dua)
+struct DuaRow {
+    uint64_t id;
+    uint64_t lval;
+    std::string inputfile;
+    uint32_t max_tcn;
+    uint32_t max_cardinality;
+    uint64_t instr;
+    bool fake_dua;
+};
+
+// Native view with no query of its own. Used to pull blocks of ids out of the
+// object sequences (e.g. dua_id_seq) so fbi can assign ids locally.
+#pragma db view
+struct SequenceValue {
+    uint64_t value;
+};
+
 #pragma db object
 struct Build {
 #pragma db id auto
@@ -0,0 +1,79 @@
+#ifndef __LAVA_RNG_HXX__
+#define __LAVA_RNG_HXX__
+
+#include <cstdint>
+#include <string>
+
+// Default seed for fbi's random choices: "lava".
+static const uint64_t LAVA_RNG_SEED = 0x6c617661;
+
+// SplitMix64's output function. A bijection on 64 bits that mixes every
+// input bit into every output bit.
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Fold a value into a running hash h, for RNG keys.
+inline uint64_t lava_rng_hash(uint64_t h, uint64_t value) {
+    return splitmix64(h ^ value);
+}
+
+// FNV-1a over the bytes, then folded in as above.
+inline uint64_t lava_rng_hash(uint64_t h, const std::string &s) {
+    uint64_t fnv = 0xcbf29ce484222325ULL;
+    for (unsigned char c : s) {
+        fnv = (fnv ^ c) * 0x100000001b3ULL;
+    }
+    return lava_rng_hash(h, fnv);
+}
+
+// Counter-based random numbers: the stream is a pure function of a seed and
+// a key, so a draw doesn't depend on how many draws came before it anywhere
+// else in the program. fbi keys its choices on the attack point and lval
+// they concern, which keeps bug choice and magic values the same however
+// the work is split across processes or batched.
+//
+// Keys must come from what the objects are, not their ids: ids depend on
+// what is in the database already and, with --jobs, on which worker made
+// the row. AttackPoint and SourceLval have rng_key() for this.
+//
+//     LavaRng rng(seed, atp->rng_key(), lval->rng_key());
+//     uint32_t r = rng.below(26);
+class LavaRng {
+public:
+    LavaRng(uint64_t seed, uint64_t key1 = 0, uint64_t key2 = 0,
+            uint64_t key3 = 0)
+        : key(splitmix64(splitmix64(splitmix64(seed ^ key1) ^ key2) ^ key3)),
+          counter(0) {}
+
+    uint64_t next() { return splitmix64(key + counter++); }
+
+    // Uniform in [0, n). n must be nonzero.
+    uint64_t below(uint64_t n) {
+        // Multiply-shift rather than %; the bias is at most n / 2^64.
+        return mul_high(next(), n);
+    }
+
+    // Uniform in [0, 1).
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    uint64_t key;
+    uint64_t counter;
+
+    // High 64 bits of the 128-bit product, from 32-bit halves: lava.hxx,
+    // and so this, is built for i386 too, which has no __int128.
+    static uint64_t mul_high(uint64_t a, uint64_t b) {
+        uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+        uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+        uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+        uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+        uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+        return hi_hi + (hi_lo >> 32) + (cross >> 32);
+    }
+};
+
+#endif
@@ -5,17 +5,7 @@
 #include <string>
 #include <vector>
 #include <memory>
-
-template<typename InputIt>
-static void infix(InputIt first, InputIt last, std::ostream &os,
-        std::string begin, std::string sep, std::string end) {
-    InputIt it = first;
-    os << begin;
-    for (; it != last - 1; it++) {
-        os << *it << sep;
-    }
-    os << *it << end;
-}
+#include <utility>
 
 struct LExpr {
     enum Type {
@@ -25,105 +15,172 @@ struct LExpr {
 
     uint32_t value;
     std::string str;
+    // Subtrees are never changed once built, so copies of an LExpr share
+    // them.
     std::vector<std::shared_ptr<LExpr>> args;
     std::vector<std::string> instrs;
 
     LExpr(Type t, uint32_t value, std::string str)
-        : t(t), value(value), str(str) {}
+        : t(t), value(value), str(std::move(str)) {}
 
     LExpr(Type t, uint32_t value, std::string str,
             std::initializer_list<std::shared_ptr<LExpr>> args)
-        : t(t), value(value), str(str), args(args) {}
+        : t(t), value(value), str(std::move(str)), args(args) {}
 
     LExpr(Type t, uint32_t value, std::string str,
             std::initializer_list<LExpr> init_args,
             std::initializer_list<std::string> instrs)
-        : t(t), value(value), str(str), instrs(instrs) {
+        : t(t), value(value), str(std::move(str)), instrs(instrs) {
+        args.reserve(init_args.size());
         for (const LExpr &arg : init_args) {
-            args.emplace_back(new LExpr(arg));
+            args.push_back(std::make_shared<LExpr>(arg));
         }
     }
 
     LExpr(Type t, uint32_t value, std::string str,
             std::initializer_list<LExpr> init_args)
-        : LExpr(t, value, str, init_args, {}) {}
+        : LExpr(t, value, std::move(str), init_args, {}) {}
 
     LExpr(Type t, uint32_t value, std::string str,
             std::vector<LExpr> init_args)
-        : t(t), value(value), str(str) {
-        for (const LExpr &arg : init_args) {
-            args.emplace_back(new LExpr(std::move(arg)));
+        : t(t), value(value), str(std::move(str)) {
+        args.reserve(init_args.size());
+        for (LExpr &arg : init_args) {
+            args.push_back(std::make_shared<LExpr>(std::move(arg)));
+        }
+    }
+
+    // Appends the C for this expression to out, so one buffer can be
+    // reused for many.
+    void render(std::string &out) const {
+        switch (t) {
+        case STR:
+            out += str;
+            break;
+        case HEX:
+            out += "0x";
+            append_uint(out, value, 16);
+            break;
+        case DECIMAL:
+            append_uint(out, value, 10);
+            break;
+        case BINOP:
+            out += '(';
+            for (size_t i = 0; i < args.size(); i++) {
+                if (i > 0) {
+                    out += ' ';
+                    out += str;
+                    out += ' ';
+                }
+                args[i]->render(out);
+            }
+            out += ')';
+            break;
+        case FUNC:
+            out += str;
+            infix(out, "(", ", ", ")");
+            break;
+        case BLOCK:
+            infix(out, "({", "; ", ";})");
+            break;
+        case IF:
+            out += "if (";
+            out += str;
+            out += ") ";
+            infix(out, "{\n", ";\n", ";\n}\n");
+            break;
+        case CAST:
+            // Careful about precedence. Only problem is (CAST)INDEX[0].
+            out += '(';
+            out += str;
+            out += ')';
+            args.at(0)->render(out);
+            break;
+        case INDEX: {
+            // In ((CAST)X)[0], add extra parens.
+            const LExpr &arg = *args.at(0);
+            if (arg.t == CAST) out += '(';
+            arg.render(out);
+            if (arg.t == CAST) out += ')';
+            out += '[';
+            append_uint(out, value, 10);
+            out += ']';
+            break;
+        }
+        case IFDEF:
+            out += "\n#ifdef ";
+            out += str;
+            infix(out, "\n", "\n#else\n", "\n#endif\n");
+            break;
+        case ASM:
+            out += "__asm__(\"";
+            for (size_t i = 0; i < instrs.size(); i++) {
+                if (i > 0) out += "\\n\\t";
+                out += instrs[i];
+            }
+            out += "\" : : ";
+            infix(out, "\"rm\" (", "), \"rm\" (", ")");
+            out += ')';
+            break;
+        case DEREF:
+            out += '*';
+            args.at(0)->render(out);
+            break;
+        case ASSIGN:
+            args.at(0)->render(out);
+            out += " = ";
+            args.at(1)->render(out);
+            break;
+        default:
+            assert(false && "Bad expr!");
         }
     }
 
     std::string render() const {
-        std::stringstream os;
-        os << *this;
-        return os.str();
+        std::string out;
+        render(out);
+        return out;
     }
 
-    void infix(std::ostream &os, std::string begin, std::string sep, std::string end) const {
-        auto it = args.cbegin();
-        os << begin;
-        if (args.size() == 0) {
-            os << end;
-            return;
+    void infix(std::string &out, const char *begin, const char *sep,
+            const char *end) const {
+        out += begin;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (i > 0) out += sep;
+            args[i]->render(out);
         }
-        for (; it != args.cend() - 1; it++) {
-            os << **it << sep;
-        }
-        os << **it << end;
+        out += end;
+    }
+
+    static void append_uint(std::string &out, uint32_t value, uint32_t base) {
+        char buf[16];
+        char *p = buf + sizeof(buf);
+        do {
+            *--p = "0123456789abcdef"[value % base];
+            value /= base;
+        } while (value != 0);
+        out.append(p, buf + sizeof(buf));
     }
 
     friend std::ostream &operator<<(std::ostream &os, const LExpr &expr) {
-        if (expr.t == STR) {
-            os << expr.str;
-        } else if (expr.t == LExpr::HEX) {
-            os << "0x" << std::hex << expr.value;
-        } else if (expr.t == LExpr::DECIMAL) {
-            os << std::dec << expr.value;
-        } else if (expr.t == LExpr::BINOP) {
-            expr.infix(os, "(", " " + expr.str + " ", ")");
-        } else if (expr.t == LExpr::FUNC) {
-            os << expr.str;
-            expr.infix(os, "(", ", ", ")");
-        } else if (expr.t == LExpr::BLOCK) {
-            expr.infix(os, "({", "; ", ";})");
-        } else if (expr.t == LExpr::IF) {
-            os << "if (" << expr.str << ") ";
-            expr.infix(os, "{\n", ";\n", ";\n}\n");
-        } else if (expr.t == LExpr::CAST) {
-            // Careful about precedence. Only problem is (CAST)INDEX[0].
-            os << "(" << expr.str << ")" << *expr.args.at(0);
-        } else if (expr.t == LExpr::INDEX) {
-            // In ((CAST)X)[0], add extra parens.
-            const LExpr &arg = *expr.args.at(0);
-            if (arg.t == LExpr::CAST) os << "(";
-            os << arg;
-            if (arg.t == LExpr::CAST) os << ")";
-            os << "[" << std::dec << expr.value << "]";
-        } else if (expr.t == LExpr::IFDEF) {
-            os << "\n#ifdef " << expr.str;
-            expr.infix(os, "\n", "\n#else\n", "\n#endif\n");
-        } else if (expr.t == LExpr::ASM) {
-            os << "__asm__(";
-            ::infix(expr.instrs.cbegin(), expr.instrs.cend(), os,
-                    "\"", "\\n\\t", "\"");
-            os << " : : ";
-            expr.infix(os, "\"rm\" (", "), \"rm\" (", ")");
-            os << ")";
-        } else if (expr.t == LExpr::DEREF) {
-            os << '*' << *expr.args.at(0);
-        } else if (expr.t == LExpr::ASSIGN) {
-            os << *expr.args.at(0) << " = " << *expr.args.at(1);
-        } else { assert(false && "Bad expr!"); }
-
-        return os;
+        return os << expr.render();
     }
 };
 
+// A node whose args are moved in, where building it from an initializer
+// list would copy them.
+template<typename... Args>
+LExpr LNode(LExpr::Type t, uint32_t value, std::string str, Args&&... args) {
+    LExpr result(t, value, std::move(str));
+    result.args.reserve(sizeof...(args));
+    int expand[] = { 0, (result.args.push_back(
+                std::make_shared<LExpr>(std::forward<Args>(args))), 0)... };
+    (void)expand;
+    return result;
+}
+
 LExpr LStr(std::string str) {
-    return LExpr(LExpr::STR, 0, str);
+    return LExpr(LExpr::STR, 0, std::move(str));
 }
 
 LExpr LHex(uint32_t value) {
@@ -141,7 +198,8 @@ LExpr LBinop(std::string op, LExpr left, LExpr right) {
             && right.value == 0) {
         return left;
     }
-    return LExpr(LExpr::BINOP, 0, op, { left, right });
+    return LNode(LExpr::BINOP, 0, std::move(op), std::move(left),
+            std::move(right));
 }
 
 LExpr LBinop(std::string op, std::vector<LExpr> args) {
@@ -151,57 +209,83 @@ LExpr LBinop(std::string op, std::vector<LExpr> args) {
         else if (op == "*") return LDecimal(1);
         else { assert(false); return LStr(""); }
     } else if (len == 1) {
-        return args.front();
+        return std::move(args.front());
     } else {
-        return LExpr(LExpr::BINOP, 0, op, std::move(args));
+        return LExpr(LExpr::BINOP, 0, std::move(op), std::move(args));
     }
 }
 
-LExpr operator-(LExpr us, LExpr other) { return LBinop("-", us, other); }
-LExpr operator+(LExpr us, LExpr other) { return LBinop("+", us, other); }
-LExpr operator*(LExpr us, LExpr other) { return LBinop("*", us, other); }
-LExpr operator==(LExpr us, LExpr other) { return LBinop("==", us, other); }
-LExpr operator&&(LExpr us, LExpr other) { return LBinop("&&", us, other); }
-LExpr operator||(LExpr us, LExpr other) { return LBinop("||", us, other); }
-LExpr operator>>(LExpr us, LExpr other) { return LBinop(">>", us, other); }
-LExpr operator<<(LExpr us, LExpr other) { return LBinop("<<", us, other); }
-LExpr operator&(LExpr us, LExpr other) { return LBinop("&", us, other); }
-LExpr operator|(LExpr us, LExpr other) { return LBinop("|", us, other); }
-LExpr operator<(LExpr us, LExpr other) { return LBinop("<", us, other); }
-LExpr operator^(LExpr us, LExpr other) { return LBinop("^", us, other); }
-LExpr operator%(LExpr us, LExpr other) { return LBinop("%", us, other); }
+LExpr operator-(LExpr us, LExpr other) {
+    return LBinop("-", std::move(us), std::move(other));
+}
+LExpr operator+(LExpr us, LExpr other) {
+    return LBinop("+", std::move(us), std::move(other));
+}
+LExpr operator*(LExpr us, LExpr other) {
+    return LBinop("*", std::move(us), std::move(other));
+}
+LExpr operator==(LExpr us, LExpr other) {
+    return LBinop("==", std::move(us), std::move(other));
+}
+LExpr operator&&(LExpr us, LExpr other) {
+    return LBinop("&&", std::move(us), std::move(other));
+}
+LExpr operator||(LExpr us, LExpr other) {
+    return LBinop("||", std::move(us), std::move(other));
+}
+LExpr operator>>(LExpr us, LExpr other) {
+    return LBinop(">>", std::move(us), std::move(other));
+}
+LExpr operator<<(LExpr us, LExpr other) {
+    return LBinop("<<", std::move(us), std::move(other));
+}
+LExpr operator&(LExpr us, LExpr other) {
+    return LBinop("&", std::move(us), std::move(other));
+}
+LExpr operator|(LExpr us, LExpr other) {
+    return LBinop("|", std::move(us), std::move(other));
+}
+LExpr operator<(LExpr us, LExpr other) {
+    return LBinop("<", std::move(us), std::move(other));
+}
+LExpr operator^(LExpr us, LExpr other) {
+    return LBinop("^", std::move(us), std::move(other));
+}
+LExpr operator%(LExpr us, LExpr other) {
+    return LBinop("%", std::move(us), std::move(other));
+}
 
 LExpr LBlock(std::initializer_list<LExpr> stmts) {
     return LExpr(LExpr::BLOCK, 0, "", stmts);
 }
 
 LExpr LFunc(std::string name, std::initializer_list<LExpr> args) {
-    return LExpr(LExpr::FUNC, 0, name, args);
+    return LExpr(LExpr::FUNC, 0, std::move(name), args);
 }
 
 LExpr LIf(std::string cond, std::initializer_list<LExpr> stmts) {
-    return LExpr(LExpr::IF, 0, cond, stmts);
+    return LExpr(LExpr::IF, 0, std::move(cond), stmts);
 }
 
 LExpr LIf(std::string cond, LExpr stmt) {
-    return LExpr(LExpr::IF, 0, cond, { stmt });
+    return LNode(LExpr::IF, 0, std::move(cond), std::move(stmt));
 }
 
 LExpr LIfDef(std::string cond, std::initializer_list<LExpr> stmts) {
-    return LExpr(LExpr::IFDEF, 0, cond, stmts);
+    return LExpr(LExpr::IFDEF, 0, std::move(cond), stmts);
 }
 
 LExpr LCast(std::string type, LExpr value) {
     if (value.t == LExpr::CAST) {
         // Casting twice is a no-op.
-        return LExpr(LExpr::CAST, 0, type, { value.args[0] });
+        return LExpr(LExpr::CAST, 0, std::move(type), { value.args[0] });
     } else {
-        return LExpr(LExpr::CAST, 0, type, { value });
+        return LNode(LExpr::CAST, 0, std::move(type), std::move(value));
     }
 }
 
 LExpr LIndex(LExpr array, uint32_t index) {
-    return LExpr(LExpr::INDEX, index, "", { array });
+    return LNode(LExpr::INDEX, index, "", std::move(array));
 }
 
 LExpr LAsm(std::initializer_list<LExpr> args,
@@ -210,11 +294,11 @@ LExpr LAsm(std::initializer_list<LExpr> args,
 }
 
 LExpr LDeref(LExpr ptr) {
-    return LExpr(LExpr::DEREF, 0, "", { ptr });
+    return LNode(LExpr::DEREF, 0, "", std::move(ptr));
 }
 
 LExpr LAssign(LExpr left, LExpr right) {
-    return LExpr(LExpr::ASSIGN, 0, "", { left, right });
+    return LNode(LExpr::ASSIGN, 0, "", std::move(left), std::move(right));
 }
 
 LExpr LavaGet(uint32_t slot) {
@@ -225,8 +309,12 @@ LExpr DataFlowGet(uint32_t slot) {
     return LIndex(LStr("data_flow"), slot);
 }
 
-LExpr UCharCast(LExpr arg) { return LCast("const unsigned char *", arg); }
-LExpr UIntCast(LExpr arg) { return LCast("const unsigned int *", arg); }
+LExpr UCharCast(LExpr arg) {
+    return LCast("const unsigned char *", std::move(arg));
+}
+LExpr UIntCast(LExpr arg) {
+    return LCast("const unsigned int *", std::move(arg));
+}
 
 LExpr SelectCast(const SourceLval *lval, Range selected) {
     const std::string &lval_name = lval->ast_name;
@@ -248,7 +336,7 @@ LExpr DataFlowSet(const SourceLval *lval, Range selected, uint32_t slot) {
 
 template<typename UInt>
 LExpr MagicTest(UInt magic_value, LExpr maskedLavaGet) {
-    return LHex(magic_value) == maskedLavaGet;
+    return LHex(magic_value) == std::move(maskedLavaGet);
 }
 
 template<LExpr Get(const Bug *)>
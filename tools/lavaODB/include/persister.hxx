@@ -0,0 +1,42 @@
+#ifndef __PERSISTER_HXX
+#define __PERSISTER_HXX
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "lava.hxx"
+
+// Where fbi sends the objects it creates. Every persist() assigns obj.id;
+// the object may not reach its final destination until flush()/finish().
+struct Persister {
+    virtual ~Persister() = default;
+
+    virtual void persist(SourceLval &lval) = 0;
+    virtual void persist(LabelSet &ls) = 0;
+    virtual void persist(AttackPoint &atp) = 0;
+    virtual void persist(Dua &dua) = 0;
+    virtual void persist(DuaBytes &dua_bytes) = 0;
+    virtual void persist(Bug &bug) = 0;
+
+    virtual void maybe_flush() {}
+    virtual void flush() {}
+
+    // For fbi checkpoints. save_state() flushes, so that everything
+    // persisted so far is durable, then writes whatever the persister needs
+    // to carry on in a later process to path. restore_state() reads that
+    // back and throws away anything persisted for inputfile after it was
+    // saved, since the resumed run will persist it again.
+    virtual void save_state(const std::string &path) {
+        throw std::runtime_error("This output doesn't support checkpoints");
+    }
+    virtual void restore_state(const std::string &path,
+            const std::string &inputfile) {
+        throw std::runtime_error("This output doesn't support checkpoints");
+    }
+
+    // Called once at the end of the run. Nothing may be persisted after.
+    virtual void finish() = 0;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include <cstdint>
 #include <sstream>
 
+#include "label_vec.hxx"
+
 #include <odb/core.hxx>
 #include <odb/pgsql/database.hxx>
 
@@ -144,6 +146,43 @@ namespace odb
                  static const char* to() { return "(?)::INTEGER[]"; }
              };
         };
+
+        // Interned label arrays go through std::vector<uint32_t>.
+        template <>
+        class value_traits<LabelVec, id_string>
+        {
+        public:
+            typedef LabelVec value_type;
+            typedef value_type query_type;
+            typedef details::buffer image_type;
+
+            typedef value_traits<std::vector<uint32_t>, id_string> vector_traits;
+
+            static void
+            set_value (value_type& v, const details::buffer& b,
+                    std::size_t n, bool is_null)
+            {
+                std::vector<uint32_t> labels;
+                vector_traits::set_value (labels, b, n, is_null);
+                v = LabelVec (labels);
+            }
+
+            static void
+            set_image (details::buffer& b, std::size_t& n,
+                    bool& is_null, const value_type& v)
+            {
+                vector_traits::set_image (b, n, is_null, v.to_vector ());
+            }
+        };
+
+        template<>
+        struct type_traits<LabelVec>
+        {
+             static const database_type_id db_type_id = id_string;
+             struct conversion {
+                 static const char* to() { return "(?)::INTEGER[]"; }
+             };
+        };
     }
 }
 
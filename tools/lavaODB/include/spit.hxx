@@ -5,7 +5,8 @@
 #include <vector>
 #include <string>
 
-extern std::vector<std::string> ind2str;
+// The string with a lavadb index; fbi defines it.
+std::string ind2str(uint32_t id);
 
 static void spit_tquls(const Panda__TaintQueryUniqueLabelSet *tquls) {
     printf("tquls=[ptr=0x%" PRIx64 ",n_label=%d,label=[", tquls->ptr, (int) tquls->n_label);
@@ -21,8 +22,8 @@ static void spit_tq(Panda__TaintQuery *tq) {
 }
 
 static void spit_si(Panda__SrcInfo *si) {
-    printf("si=[filename='%s',line=%d,", (char*) ind2str[si->filename].c_str(), si->linenum);
-    printf("astnodename='%s',", (char *) ind2str[si->astnodename].c_str());
+    printf("si=[filename='%s',line=%d,", (char*) ind2str(si->filename).c_str(), si->linenum);
+    printf("astnodename='%s',", (char *) ind2str(si->astnodename).c_str());
     if (si->has_insertionpoint) {
         printf("insertionpoint=%d", si->insertionpoint);
     }
@@ -0,0 +1,134 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "label_vec.hxx"
+
+// The arena and hash table behind LabelVec; see label_vec.hxx.
+
+constexpr size_t LabelPool::HEADER_WORDS;
+
+// Arena chunk size in words. Bigger arrays get a chunk of their own.
+static const size_t CHUNK_WORDS = 1 << 18;
+
+namespace {
+
+struct Pool {
+    std::mutex mutex;
+    LabelPool::Stats stats;
+    std::vector<const uint32_t *> table = std::vector<const uint32_t *>(1024);
+    std::vector<std::unique_ptr<uint32_t[]>> chunks;
+    uint32_t *chunk_pos = nullptr;
+    size_t chunk_left = 0;
+
+    uint32_t *allocate(size_t words);
+    void grow();
+};
+
+} // namespace
+
+// Built on first use, so LabelVecs can be made during static
+// initialization elsewhere.
+static Pool &pool() {
+    static Pool p;
+    return p;
+}
+
+static uint32_t hash(const uint32_t *labels, size_t n) {
+    // FNV-1a over the words.
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ labels[i]) * 16777619u;
+    }
+    return h ^ (uint32_t)n;
+}
+
+uint32_t *Pool::allocate(size_t words) {
+    if (words > CHUNK_WORDS / 4) {
+        chunks.emplace_back(new uint32_t[words]);
+        stats.arena_bytes += words * sizeof(uint32_t);
+        return chunks.back().get();
+    }
+    if (words > chunk_left) {
+        chunks.emplace_back(new uint32_t[CHUNK_WORDS]);
+        stats.arena_bytes += CHUNK_WORDS * sizeof(uint32_t);
+        chunk_pos = chunks.back().get();
+        chunk_left = CHUNK_WORDS;
+    }
+    uint32_t *result = chunk_pos;
+    chunk_pos += words;
+    chunk_left -= words;
+    return result;
+}
+
+void Pool::grow() {
+    std::vector<const uint32_t *> old(table.size() * 2);
+    old.swap(table);
+    size_t mask = table.size() - 1;
+    for (const uint32_t *words : old) {
+        if (!words) continue;
+        size_t i = words[1] & mask;
+        while (table[i]) i = (i + 1) & mask;
+        table[i] = words;
+    }
+}
+
+const uint32_t *LabelPool::intern(const uint32_t *labels, size_t n) {
+    if (n == 0) return empty();
+
+    uint32_t h = hash(labels, n);
+    Pool &p = pool();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    std::vector<const uint32_t *> &table = p.table;
+    Stats &stats = p.stats;
+    stats.requests++;
+    stats.request_words += n;
+
+    if ((stats.unique + 1) * 2 > table.size()) p.grow();
+    size_t mask = table.size() - 1;
+    size_t i = h & mask;
+    for (; table[i]; i = (i + 1) & mask) {
+        const uint32_t *words = table[i];
+        if (words[1] == h && words[0] == n
+                && std::memcmp(words + HEADER_WORDS, labels,
+                    n * sizeof(uint32_t)) == 0) {
+            return words;
+        }
+    }
+
+    uint32_t *words = p.allocate(HEADER_WORDS + n);
+    words[0] = n;
+    words[1] = h;
+    std::memcpy(words + HEADER_WORDS, labels, n * sizeof(uint32_t));
+    table[i] = words;
+    stats.unique++;
+    stats.unique_words += n;
+    return words;
+}
+
+LabelPool::Stats LabelPool::get_stats() {
+    Pool &p = pool();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    Stats result = p.stats;
+    result.table_bytes = p.table.size() * sizeof(p.table[0]);
+    return result;
+}
+
+void LabelPool::report(std::ostream &os, const Stats &s) {
+    const uint64_t malloc_overhead = 16;
+    uint64_t as_vectors = s.requests * (sizeof(std::vector<uint32_t>)
+            + malloc_overhead) + s.request_words * sizeof(uint32_t);
+    uint64_t interned = s.requests * sizeof(const uint32_t *)
+        + s.arena_bytes + s.table_bytes;
+    os << "label arrays: " << s.requests << " interned ("
+        << s.request_words << " labels), " << s.unique << " unique ("
+        << s.unique_words << " labels)\n";
+    os << "label memory: " << interned / 1024 << " KiB interned vs ~"
+        << as_vectors / 1024 << " KiB as vectors; saved ~"
+        << (as_vectors > interned ? (as_vectors - interned) / 1024 : 0)
+        << " KiB\n";
+}
@@ -11,17 +11,20 @@ using namespace clang;
 using namespace clang::tooling;
 /*
  * Keeps track of a list of insertions and makes sure conflicts are resolved.
+ * Insertion points are SourceLocations, or, when injecting from a site index
+ * without clang, offsets into the file.
  */
-class Insertions {
+template<typename Point>
+class BasicInsertions {
 private:
     // TODO: use map and "beforeness" concept to robustly avoid duplicate
     // insertions.
-    std::map<SourceLocation, std::list<std::string>> impl;
+    std::map<Point, std::list<std::string>> impl;
 
 public:
     void clear() { impl.clear(); }
 
-    void InsertAfter(SourceLocation loc, std::string str) {
+    void InsertAfter(Point loc, std::string str) {
         if (!str.empty()) {
             std::list<std::string> &strs = impl[loc];
             if (strs.empty() || strs.back() != str || str == ")") {
@@ -30,7 +33,7 @@ public:
         }
     }
 
-    void InsertBefore(SourceLocation loc, std::string str) {
+    void InsertBefore(Point loc, std::string str) {
         if (!str.empty()) {
             std::list<std::string> &strs = impl[loc];
             if (strs.empty() || strs.front() != str || str == "(") {
@@ -39,14 +42,26 @@ public:
         }
     }
 
-    void render(const SourceManager &sm, std::vector<Replacement> &out) {
-        out.reserve(impl.size() + out.size());
+    // Each insertion point, with everything inserted there.
+    std::vector<std::pair<Point, std::string>> rendered() const {
+        std::vector<std::pair<Point, std::string>> out;
+        out.reserve(impl.size());
         for (const auto &keyvalue : impl) {
             std::stringstream ss;
             for (const std::string &s : keyvalue.second) ss << s;
-            out.emplace_back(sm, keyvalue.first, 0, ss.str());
+            out.emplace_back(keyvalue.first, ss.str());
+        }
+        return out;
+    }
+
+    void render(const SourceManager &sm, std::vector<Replacement> &out) {
+        out.reserve(impl.size() + out.size());
+        for (const auto &keyvalue : rendered()) {
+            out.emplace_back(sm, keyvalue.first, 0, keyvalue.second);
         }
     }
 };
 
+typedef BasicInsertions<SourceLocation> Insertions;
+
 #endif
@@ -3,6 +3,7 @@
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/ReplacementsYaml.h"
 
+#include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/ASTMatchers/ASTMatchersInternal.h"
@@ -16,6 +17,55 @@ using namespace clang::ast_matchers;
 using namespace clang::driver;
 using namespace llvm;
 
+/*
+  The function each statement in a TU is in. Built in one pass over the TU
+  the first time it's asked, rather than walking up the parent map from
+  every statement a handler looks at. Statements outside any function
+  aren't in it.
+*/
+class EnclosingFunctions : public RecursiveASTVisitor<EnclosingFunctions> {
+public:
+    // Call at the start of each TU.
+    void reset() {
+        built = false;
+        functions.clear();
+    }
+
+    // The function stmt is in, or null if there isn't one.
+    const FunctionDecl *get(ASTContext &ctx, const Stmt *stmt) {
+        if (!built) {
+            TraverseDecl(ctx.getTranslationUnitDecl());
+            built = true;
+        }
+        auto it = functions.find(stmt);
+        return it == functions.end() ? nullptr : it->second;
+    }
+
+    // Match what the matchers see.
+    bool shouldVisitTemplateInstantiations() const { return true; }
+    bool shouldVisitImplicitCode() const { return true; }
+
+    bool TraverseDecl(Decl *decl) {
+        FunctionDecl *fd = dyn_cast_or_null<FunctionDecl>(decl);
+        if (!fd) return RecursiveASTVisitor::TraverseDecl(decl);
+        const FunctionDecl *outer = current;
+        current = fd;
+        bool result = RecursiveASTVisitor::TraverseDecl(decl);
+        current = outer;
+        return result;
+    }
+
+    bool VisitStmt(Stmt *stmt) {
+        if (current) functions[stmt] = current;
+        return true;
+    }
+
+private:
+    bool built = false;
+    const FunctionDecl *current = nullptr;
+    llvm::DenseMap<const Stmt *, const FunctionDecl *> functions;
+};
+
 /*******************************
  * Matcher Handlers
  *******************************/
@@ -102,7 +152,13 @@ struct LavaMatchHandler : public MatchFinder::MatchCallback {
     }
 
     std::pair<std::string,std::string> get_containing_function_name(const MatchFinder::MatchResult &Result, const Stmt &stmt) {
+        if (Functions) {
+            const FunctionDecl *fd = Functions->get(*Result.Context, &stmt);
+            if (fd) return fundecl_fun_name(Result, fd);
+        }
 
+        // Not in a function body, so far as the traversal saw. Walk up the
+        // parents to be sure.
         const Stmt *pstmt = &stmt;
 
         std::pair<std::string,std::string> fail = std::make_pair(std::string("Notinafunction"), std::string("Notinafunction"));
@@ -159,29 +215,21 @@ struct LavaMatchHandler : public MatchFinder::MatchCallback {
 
     // A query inserted at a possible attack point. Used, dynamically, just to
     // tell us when an input gets to the attack point.
-    LExpr LavaAtpQuery(LavaASTLoc ast_loc, AttackPoint::Type atpType) {
+    static LExpr LavaAtpQuery(LavaASTLoc ast_loc, AttackPoint::Type atpType) {
         return LBlock({
                 LFunc("vm_lava_attack_point2",
-                    { LDecimal(GetStringID(StringIDs, ast_loc)), LDecimal(0),
+                    { LDecimal(GetStringID(ast_loc)), LDecimal(0),
                         LDecimal(atpType) }),
                 LDecimal(0) });
     }
 
-    /*
-      An attack expression.  That is, this is where we would *like* to
-      attack something.  Currently used by FunctionArgHandler and
-      MemoryAccessHandler.  So, for
-    */
-    void AttackExpression(const SourceManager &sm, const Expr *toAttack,
-            const Expr *parent, const Expr *rhs, AttackPoint::Type atpType) {
-        LavaASTLoc ast_loc = GetASTLoc(sm, toAttack);
+    // What to add to the expression at an attack point: the sum to add to
+    // it and, for competitions, each bug id with its trigger. False if
+    // there's nothing to add.
+    static bool AttackText(LavaASTLoc ast_loc, AttackPoint::Type atpType,
+            std::string &addend,
+            std::vector<std::pair<uint64_t, std::string>> &logs) {
         std::vector<LExpr> pointerAddends;
-        std::vector<LExpr> valueAddends;
-        std::vector<LExpr> triggers;
-        std::vector<Bug*> bugs;
-
-        debug(INJECT) << "Inserting expression attack (AttackExpression).\n";
-        const Bug *this_bug = NULL;
 
         if (LavaAction == LavaInjectBugs) {
             const std::vector<const Bug*> &injectable_bugs =
@@ -190,27 +238,25 @@ struct LavaMatchHandler : public MatchFinder::MatchCallback {
 
             if (injectable_bugs.size() == 0 && ArgCompetition) {
                 debug(INJECT) << "Abort, no injectable bugs and it's a competition\n";
-                return;
+                return false;
             }
 
             // this should be a function bug -> LExpr to add.
             auto pointerAttack = KnobTrigger ? knobTriggerAttack : traditionalAttack;
             for (const Bug *bug : injectable_bugs) {
                 assert(bug->atp->type == atpType);
-                // was in if ArgCompetition, but we want to inject bugs more often
-                Bug *bug2 = NULL;
-                bug2 = (Bug*)malloc(sizeof(Bug));
-                memcpy(bug2, bug, sizeof(Bug));
-                bugs.push_back(bug2);
-
                 if (bug->type == Bug::PTR_ADD) {
                     pointerAddends.push_back(pointerAttack(bug));
-                    triggers.push_back(Test(bug)); //  Might fail for knobTriggers?
+                    //  Might fail for knobTriggers?
+                    logs.emplace_back(bug->id, Test(bug).render());
                 } else if (bug->type == Bug::REL_WRITE) {
-                    const DuaBytes *extra0 = db->load<DuaBytes>(bug2->extra_duas[0]);
-                    const DuaBytes *extra1 = db->load<DuaBytes>(bug2->extra_duas[1]);
-                    auto bug_combo = threeDuaTest(bug2, extra0, extra1); // Non-deterministic, need one object for triggers and ptr addends
-                    triggers.push_back(bug_combo);
+                    // threeDuaTest picks the bug's magic value, so works on
+                    // a copy.
+                    Bug bug2 = *bug;
+                    const DuaBytes *extra0 = get_dua_bytes(bug2.extra_duas[0]);
+                    const DuaBytes *extra1 = get_dua_bytes(bug2.extra_duas[1]);
+                    auto bug_combo = threeDuaTest(&bug2, extra0, extra1); // Non-deterministic, need one object for triggers and ptr addends
+                    logs.emplace_back(bug->id, bug_combo.render());
 
                     pointerAddends.push_back(bug_combo * Get(extra0));
                 }
@@ -222,39 +268,83 @@ struct LavaMatchHandler : public MatchFinder::MatchCallback {
             num_atp_queries++;
         }
 
+        if (pointerAddends.empty()) return false;
+        addend = LBinop("+", std::move(pointerAddends)).render();
+        return true;
+    }
 
-        if (!pointerAddends.empty()) {
-            LExpr addToPointer = LBinop("+", std::move(pointerAddends));
-            Mod.Change(toAttack).Add(addToPointer, parent);
-
-            // For competitions, wrap pointer value in LAVALOG macro call-
-            // it's effectively just a NOP that prints a message when the trigger is true
-            // so we can identify when bugs are potentially triggered
-            if (ArgCompetition) {
-                assert (triggers.size() == bugs.size());
-
-                for (int i=0; i < triggers.size(); i++) {
-                    Bug *bug = bugs[i];
-                    std::stringstream start_str;
-                    start_str << "LAVALOG(" << bug->id << ", ";
-                    Mod.Change(toAttack).InsertBefore(start_str.str());
-
-                    std::stringstream end_str;
-
-                    end_str << ", " << triggers[i] << ")";
-                    Mod.Change(toAttack).InsertAfter(end_str.str());
-                    free(bug);
-                }
+    // Adds addend to the expression between before and after, and for
+    // competitions wraps it in a LAVALOG macro call per bug. That's
+    // effectively just a NOP that prints a message when the trigger is
+    // true, so we can identify when bugs are potentially triggered.
+    // paren_inner and paren_outer are as in IndexedSite.
+    template<typename Point>
+    static void AttackAt(BasicInsertions<Point> &Insert, Point before,
+            Point after, bool paren_inner, bool paren_outer,
+            const std::string &addend,
+            const std::vector<std::pair<uint64_t, std::string>> &logs) {
+        if (paren_inner) {
+            Insert.InsertBefore(before, "(");
+            Insert.InsertAfter(after, ")");
+        }
+        Insert.InsertAfter(after, " + " + addend);
+        if (paren_outer) {
+            Insert.InsertBefore(before, "(");
+            Insert.InsertAfter(after, ")");
+        }
+        if (ArgCompetition) {
+            for (const auto &log : logs) {
+                std::stringstream start_str;
+                start_str << "LAVALOG(" << log.first << ", ";
+                Insert.InsertBefore(before, start_str.str());
+
+                std::stringstream end_str;
+                end_str << ", " << log.second << ")";
+                Insert.InsertAfter(after, end_str.str());
             }
         }
+    }
+
+    // With -site-index, adds a site to the TU being recorded. loc and end
+    // are where its insertions go.
+    void RecordSite(const SourceManager &sm, SourceLocation loc,
+            SourceLocation end, bool attack, AttackPoint::Type atpType,
+            bool paren_inner, bool paren_outer, const LavaASTLoc &ast_loc) {
+        if (!recording_tu) return;
+        std::pair<FileID, unsigned> before = sm.getDecomposedLoc(loc);
+        std::pair<FileID, unsigned> after = sm.getDecomposedLoc(end);
+        if (before.first != sm.getMainFileID()
+                || after.first != sm.getMainFileID()) {
+            recording_tu->complete = false;
+            return;
+        }
+        recording_tu->sites.push_back(IndexedSite{attack, before.second,
+                after.second, atpType, paren_inner, paren_outer, ast_loc});
+    }
+
+    /*
+      An attack expression.  That is, this is where we would *like* to
+      attack something.  Currently used by FunctionArgHandler and
+      MemoryAccessHandler.
+    */
+    void AttackExpression(const SourceManager &sm, const Expr *toAttack,
+            const Expr *parent, const Expr *rhs, AttackPoint::Type atpType) {
+        LavaASTLoc ast_loc = GetASTLoc(sm, toAttack);
+        debug(INJECT) << "Inserting expression attack (AttackExpression).\n";
 
-        /*
-        if (!valueAddends.empty()) {
-            assert(rhs);
-            LExpr addToValue = LBinop("+", std::move(valueAddends));
-            Mod.Change(rhs).Add(addToValue, nullptr);
+        Mod.Change(toAttack);
+        SourceLocation before = Mod.before(), after = Mod.after();
+        bool paren_inner = Modifier::NeedsParens(toAttack);
+        bool paren_outer = Modifier::ParentNeedsParens(parent);
+        RecordSite(sm, before, after, true, atpType, paren_inner, paren_outer,
+                ast_loc);
+
+        std::string addend;
+        std::vector<std::pair<uint64_t, std::string>> logs;
+        if (AttackText(ast_loc, atpType, addend, logs)) {
+            AttackAt(Mod.Insert, before, after, paren_inner, paren_outer,
+                    addend, logs);
         }
-        */
     }
 
     virtual void handle(const MatchFinder::MatchResult &Result) = 0;
@@ -282,6 +372,8 @@ struct LavaMatchHandler : public MatchFinder::MatchCallback {
     }
 
     const LangOptions *LangOpts = nullptr;
+    // The current TU's, shared by every handler.
+    EnclosingFunctions *Functions = nullptr;
 
 protected:
     Modifier &Mod;
@@ -153,14 +153,87 @@ public:
         }
     }
     virtual bool handleBeginSource(CompilerInstance &CI, StringRef Filename) override {
+        return beginSource(CI.getLangOpts(), CI.getSourceManager(), Filename);
+    }
+
+    // Runs the matchers over a TU that's already been parsed, as Tool.run
+    // would have while parsing it.
+    void matchUnit(ASTUnit &Unit, StringRef Filename) {
+        SourceManager &SM = Unit.getSourceManager();
+        // An AST loaded from a file may not say which file was the main one.
+        if (SM.getMainFileID().isInvalid()) {
+            if (const FileEntry *FE = Unit.getFileManager().getFile(Filename)) {
+                SM.setMainFileID(SM.translateFile(FE));
+            }
+        }
+        beginSource(Unit.getLangOpts(), SM, Filename);
+        matchAST(Unit.getASTContext());
+        handleEndSource();
+    }
+
+    bool beginSource(const LangOptions &LangOpts, const SourceManager &SM,
+            StringRef Filename) {
         Insert.clear();
-        Mod.Reset(&CI.getLangOpts(), &CI.getSourceManager());
+        Mod.Reset(&LangOpts, &SM);
         TUReplace.Replacements.clear();
         TUReplace.MainSourceFile = Filename;
-        CurrentCI = &CI;
+        CurrentSM = &SM;
 
         debug(INJECT) << "*** handleBeginSource for: " << Filename << "\n";
 
+        if (SiteIndex != "XXX") {
+            recorded_tus.emplace_back();
+            recording_tu = &recorded_tus.back();
+            recording_tu->path = getAbsolutePath(Filename);
+        }
+
+        debug(INJECT) << "Inserting macros and lava_set/get or dataflow at top of file\n";
+        TUReplace.Replacements.emplace_back(Filename, 0, 0, TopOfFile(Filename));
+
+        Functions.reset();
+        for (auto it = MatchHandlers.begin();
+                it != MatchHandlers.end(); it++) {
+            (*it)->LangOpts = &LangOpts;
+            (*it)->Functions = &Functions;
+        }
+
+        return true;
+    }
+
+    virtual void handleEndSource() override {
+        debug(INJECT) << "*** handleEndSource\n";
+
+        if (recording_tu) {
+            RecordDeps(*CurrentSM, *recording_tu);
+            // Sites in a TU that didn't parse may not all have been found.
+            if (CurrentSM->getDiagnostics().hasErrorOccurred()) {
+                recording_tu->complete = false;
+            }
+            recording_tu = nullptr;
+        }
+
+        Insert.render(*CurrentSM, TUReplace.Replacements);
+        if (ApplyManifest != "XXX") {
+            // ClangTool runs each TU in its compile directory, which is
+            // what relative paths here are relative to.
+            for (const Replacement &R : TUReplace.Replacements) {
+                if (!R.isApplicable()) continue;
+                pending_edits[getAbsolutePath(R.getFilePath())].insert(
+                        std::make_tuple(R.getOffset(), R.getLength(),
+                            R.getReplacementText().str()));
+            }
+            return;
+        }
+        std::error_code EC;
+        llvm::raw_fd_ostream YamlFile(TUReplace.MainSourceFile + ".yaml",
+                EC, llvm::sys::fs::F_RW);
+        yaml::Output Yaml(YamlFile);
+        Yaml << TUReplace;
+    }
+
+    // What goes at the top of each file: macros, and lava_set/get or
+    // dataflow.
+    static std::string TopOfFile(StringRef Filename) {
         std::stringstream logging_macros;
         logging_macros << "#ifdef LAVA_LOGGING\n" // enable logging with (LAVA_LOGGING, FULL_LAVA_LOGGING) and (DUA_LOGGING) flags. Logging requires stdio to be included
                        << "#define LAVALOG(bugid, x, trigger)  ({(trigger && fprintf(stderr, \"\\nLAVALOG: %d: %s:%d\\n\", bugid, __FILE__, __LINE__)), (x);})\n"
@@ -207,27 +280,33 @@ public:
                 }
             }
         }
-
-        debug(INJECT) << "Inserting macros and lava_set/get or dataflow at top of file\n";
-        TUReplace.Replacements.emplace_back(Filename, 0, 0, insert_at_top);
-
-        for (auto it = MatchHandlers.begin();
-                it != MatchHandlers.end(); it++) {
-            (*it)->LangOpts = &CI.getLangOpts();
-        }
-
-        return true;
+        return insert_at_top;
     }
 
-    virtual void handleEndSource() override {
-        debug(INJECT) << "*** handleEndSource\n";
-
-        Insert.render(CurrentCI->getSourceManager(), TUReplace.Replacements);
-        std::error_code EC;
-        llvm::raw_fd_ostream YamlFile(TUReplace.MainSourceFile + ".yaml",
-                EC, llvm::sys::fs::F_RW);
-        yaml::Output Yaml(YamlFile);
-        Yaml << TUReplace;
+    // Every file the TU read, with its md5. Goes by the SourceManager's
+    // entries rather than its file infos, so that an AST loaded from a file
+    // lists the headers the matchers never looked in too.
+    static void RecordDeps(const SourceManager &SM, IndexedTU &tu) {
+        std::set<std::string> paths;
+        auto add = [&](const SrcMgr::SLocEntry &entry) {
+            if (!entry.isFile()) return;
+            const SrcMgr::ContentCache *cache =
+                entry.getFile().getContentCache();
+            if (cache && cache->OrigEntry) {
+                paths.insert(getAbsolutePath(cache->OrigEntry->getName()));
+            }
+        };
+        for (unsigned i = 0; i < SM.local_sloc_entry_size(); i++) {
+            add(SM.getLocalSLocEntry(i));
+        }
+        for (unsigned i = 0; i < SM.loaded_sloc_entry_size(); i++) {
+            add(SM.getLoadedSLocEntry(i));
+        }
+        for (const std::string &path : paths) {
+            std::string md5 = file_md5(path);
+            if (md5.empty()) tu.complete = false;
+            tu.deps.push_back(std::make_pair(md5, path));
+        }
     }
 
     template<class Handler>
@@ -241,6 +320,7 @@ private:
     Modifier Mod;
     TranslationUnitReplacements TUReplace;
     std::vector<std::unique_ptr<LavaMatchHandler>> MatchHandlers;
-    CompilerInstance *CurrentCI = nullptr;
+    const SourceManager *CurrentSM = nullptr;
+    EnclosingFunctions Functions;
 };
 #endif
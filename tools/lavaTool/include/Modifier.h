@@ -107,21 +107,31 @@ public:
         return InsertBefore("(").InsertAfter(")");
     }
 
+    // Whether stmt has lower precedence than addition, so needs parens
+    // before something can be added to it.
+    static bool NeedsParens(const Stmt *stmt) {
+        const BinaryOperator *binop = dyn_cast<BinaryOperator>(stmt);
+        return isa<AbstractConditionalOperator>(stmt)
+            || (binop && !binop->isMultiplicativeOp()
+                    && !binop->isAdditiveOp());
+    }
+
+    // Whether the result of an operation needs parens inside parent.
+    static bool ParentNeedsParens(const Stmt *parent) {
+        return parent && !isa<ArraySubscriptExpr>(parent)
+            && !isa<ParenExpr>(parent);
+    }
+
     const Modifier &Operate(std::string op, const LExpr &addend, const Stmt *parent) const {
         InsertAfter(" " + op + " " + addend.render());
-        if (parent && !isa<ArraySubscriptExpr>(parent)
-                && !isa<ParenExpr>(parent)) {
+        if (ParentNeedsParens(parent)) {
             Parenthesize();
         }
         return *this;
     }
 
     const Modifier &Add(const LExpr &addend, const Stmt *parent) const {
-        // If inner stmt has lower precedence than addition, add parens.
-        const BinaryOperator *binop = dyn_cast<BinaryOperator>(stmt);
-        if (isa<AbstractConditionalOperator>(stmt)
-                || (binop && !binop->isMultiplicativeOp()
-                    && !binop->isAdditiveOp())) {
+        if (NeedsParens(stmt)) {
             Parenthesize();
         }
         return Operate("+", addend, parent);
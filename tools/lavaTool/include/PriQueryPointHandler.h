@@ -49,8 +49,8 @@ struct PriQueryPointHandler : public LavaMatchHandler {
     // for dua x, offset o, generates:
     // lava_set(slot, *(const unsigned int *)(((const unsigned char *)x)+o)
     // Each lval gets an if clause containing one siphon
-    std::string SiphonsForLocation(LavaASTLoc ast_loc) {
-        std::stringstream result_ss;
+    static std::string SiphonsForLocation(LavaASTLoc ast_loc) {
+        std::string result;
         for (const LvalBytes &lval_bytes : map_get_default(siphons_at, ast_loc)) {
             // NB: lava_bytes.lval->ast_name is a string that came from
             // libdwarf.  So it could be something like
@@ -61,10 +61,10 @@ struct PriQueryPointHandler : public LavaMatchHandler {
             std::string nntests = (createNonNullTests(lval_bytes.lval->ast_name));
             if (nntests.size() > 0)
                 nntests = nntests + " && ";
-            result_ss << LIf(nntests + lval_bytes.lval->ast_name, Set(lval_bytes));
+            LIf(nntests + lval_bytes.lval->ast_name, Set(lval_bytes))
+                .render(result);
         }
 
-        std::string result = result_ss.str();
         if (!result.empty()) {
             debug(PRI) << " Injecting dua siphon at " << ast_loc << "\n";
             debug(PRI) << "    Text: " << result << "\n";
@@ -73,14 +73,14 @@ struct PriQueryPointHandler : public LavaMatchHandler {
         return result;
     }
 
-    std::string AttackRetBuffer(LavaASTLoc ast_loc) {
-        std::stringstream result_ss;
+    static std::string AttackRetBuffer(LavaASTLoc ast_loc) {
+        std::string result;
         auto key = std::make_pair(ast_loc, AttackPoint::QUERY_POINT);
         for (const Bug *bug : map_get_default(bugs_with_atp_at, key)) {
             if (bug->type == Bug::RET_BUFFER) {
-                const DuaBytes *buffer = db->load<DuaBytes>(bug->extra_duas[0]);
+                const DuaBytes *buffer = get_dua_bytes(bug->extra_duas[0]);
                 if (ArgCompetition) {
-                    result_ss << LIf(Test(bug).render(), {
+                    LIf(Test(bug).render(), {
                             LBlock({
                                 //It's always safe to call lavalog here since we're in the if
                                 LFunc("LAVALOG", {LDecimal(1), LDecimal(1), LDecimal(bug->id)}),
@@ -90,21 +90,21 @@ struct PriQueryPointHandler : public LavaMatchHandler {
                                         { "movq %0, %%rsp", "ret" }),
                                     LAsm({ UCharCast(LStr(buffer->dua->lval->ast_name)) +
                                         LDecimal(buffer->selected.low), },
-                                        { "movl %0, %%esp", "ret" })})})});
+                                        { "movl %0, %%esp", "ret" })})})}).render(result);
                 } else{
-                    result_ss << LIf(Test(bug).render(), {
+                    LIf(Test(bug).render(), {
                                 LIfDef("__x86_64__", {
                                     LAsm({ UCharCast(LStr(buffer->dua->lval->ast_name)) +
                                         LDecimal(buffer->selected.low), },
                                         { "movq %0, %%rsp", "ret" }),
                                     LAsm({ UCharCast(LStr(buffer->dua->lval->ast_name)) +
                                         LDecimal(buffer->selected.low), },
-                                        { "movl %0, %%esp", "ret" })})});
+                                        { "movl %0, %%esp", "ret" })})}).render(result);
                 }
             }
         }
         bugs_with_atp_at.erase(key); // Only inject once.
-        return result_ss.str();
+        return result;
     }
 
     virtual void handle(const MatchFinder::MatchResult &Result) override {
@@ -129,13 +129,16 @@ struct PriQueryPointHandler : public LavaMatchHandler {
 
         LavaASTLoc ast_loc = GetASTLoc(sm, toSiphon);
         debug(PRI) << "Have a query point @ " << ast_loc << "!\n";
+        SourceLocation loc = Mod.Change(toSiphon).before();
+        RecordSite(sm, loc, loc, false, AttackPoint::QUERY_POINT, false, false,
+                ast_loc);
 
         std::string before;
         if (LavaAction == LavaQueries) {
             // this is used in first pass clang tool, adding queries
             // to be intercepted by panda to query taint on in-scope variables
             before = "; " + LFunc("vm_lava_pri_query_point", {
-                LDecimal(GetStringID(StringIDs, ast_loc)),
+                LDecimal(GetStringID(ast_loc)),
                 LDecimal(ast_loc.begin.line),
                 LDecimal(0)}).render() + "; ";
 
@@ -148,7 +151,7 @@ struct PriQueryPointHandler : public LavaMatchHandler {
             // stack-pivot-then-return.  Ugh.
             before = SiphonsForLocation(ast_loc) + AttackRetBuffer(ast_loc);
         }
-        Mod.Change(toSiphon).InsertBefore(before);
+        Mod.InsertBefore(before);
     }
 };
 
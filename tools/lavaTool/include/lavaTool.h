@@ -12,6 +12,7 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <tuple>
 #include <string>
 #include <memory>
 #include <cstdint>
@@ -21,11 +22,14 @@
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <csignal>
 #include <execinfo.h>
 
 extern "C" {
 #include <unistd.h>
 #include <libgen.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 }
 
 #include <jsoncpp/json/json.h>
@@ -34,6 +38,7 @@ extern "C" {
 #include "clang/AST/AST.h"
 #include "clang/Lex/Lexer.h"
 #include "clang/Driver/Options.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 
 #include "clang/Tooling/Tooling.h"
@@ -42,6 +47,7 @@ extern "C" {
 #include "clang/Tooling/ReplacementsYaml.h"
 
 #include "llvm/Option/OptTable.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "lavaDB.h"
@@ -56,6 +62,7 @@ using namespace llvm;
 
 using clang::tooling::getAbsolutePath;
 using clang::tooling::CommonOptionsParser;
+using clang::tooling::CompilationDatabase;
 
 #define MATCHER (1 << 0)
 #define INJECT (1 << 1)
@@ -119,9 +126,100 @@ Loc::Loc(const FullSourceLoc &full_loc)
     column(full_loc.getExpansionColumnNumber()) {}
 
 static std::vector<const Bug*> bugs;
+
+// The bugs to inject and everything they point to, keyed by id. load_bugs
+// or load_bug_manifest fills these in before Tool.run, so no handler goes
+// to the database. std::map so that pointers between them stay valid.
+static std::map<uint64_t, SourceLval> loaded_lvals;
+static std::map<uint64_t, AttackPoint> loaded_atps;
+static std::map<uint64_t, Dua> loaded_duas;
+static std::map<uint64_t, DuaBytes> loaded_dua_bytes;
+static std::map<uint64_t, Bug> loaded_bugs;
+
+// A trigger or extra dua of one of the bugs being injected.
+static const DuaBytes *get_dua_bytes(uint64_t id) {
+    auto it = loaded_dua_bytes.find(id);
+    assert(it != loaded_dua_bytes.end());
+    return &it->second;
+}
 static std::set<std::string> main_files;
 
-static std::map<std::string, uint32_t> StringIDs;
+// Strings (source locations) -> the ids the queries we add refer to them by.
+// The lavaDB file given with -lava-db, or a throwaway one without it.
+static std::unique_ptr<LavaDB> StringIDs;
+
+static uint32_t GetStringID(const std::string &s) {
+    return StringIDs->id(s);
+}
+
+// Edits to one file: (offset, length, replacement text). Kept sorted and
+// without duplicates, so a header edited the same way by many TUs is only
+// edited once; that is also the order clang-apply-replacements uses.
+typedef std::set<std::tuple<unsigned, unsigned, std::string>> FileEdits;
+
+// With -apply, the replacements from every TU so far, by absolute path.
+static std::map<std::string, FileEdits> pending_edits;
+
+static bool read_file(const std::string &path, std::string &contents) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    contents = ss.str();
+    return true;
+}
+
+static std::string md5_hex(StringRef data) {
+    llvm::MD5 hash;
+    hash.update(data);
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    SmallString<32> hex;
+    llvm::MD5::stringifyResult(result, hex);
+    return hex.str();
+}
+
+// The md5 of the file at path, or "" if it can't be read.
+static std::string file_md5(const std::string &path) {
+    std::string contents;
+    return read_file(path, contents) ? md5_hex(contents) : "";
+}
+
+// -site-index: every place in a TU the handlers would insert something,
+// whatever the bugs. Where bugs go depends on nothing else the matchers
+// look at, so with these a run can inject any bugs into the TU from its
+// source bytes alone.
+struct IndexedSite {
+    // An attack point (FunctionArgHandler, MemoryAccessHandler), or else a
+    // query point (PriQueryPointHandler).
+    bool attack;
+    // Offsets into the main file of the start of the expression or
+    // statement and, for an attack point, of the end of the expression.
+    unsigned before, after;
+    AttackPoint::Type atp_type;
+    // Whether the expression needs parens before it's added to, and then
+    // the sum needs them too. See Modifier::Add.
+    bool paren_inner, paren_outer;
+    LavaASTLoc ast_loc;
+};
+
+struct IndexedTU {
+    // The main file, absolute, and a hash of the commands it's compiled
+    // with.
+    std::string path;
+    std::string key;
+    // (md5, absolute path) of every file the TU read.
+    std::vector<std::pair<std::string, std::string>> deps;
+    // In the order the handlers ran, which is the order to insert in.
+    std::vector<IndexedSite> sites;
+    // False if a site was somewhere other than the main file, which the
+    // index can't describe.
+    bool complete = true;
+};
+
+// TUs recorded this run, and the one being recorded now (null if none).
+static std::vector<IndexedTU> recorded_tus;
+static IndexedTU *recording_tu = nullptr;
 
 // Map of bugs with attack points at a given loc.
 std::map<std::pair<LavaASTLoc, AttackPoint::Type>, std::vector<const Bug *>>
@@ -148,7 +246,7 @@ static cl::opt<std::string> LavaWL("lava-wl",
     cl::desc("Path to whitelist of fns to instrument with bugs and data_flow "),
     cl::cat(LavaCategory),
     cl::init("XXX"));
-static cl::opt<std::string> LavaDB("lava-db",
+static cl::opt<std::string> LavaDBFile("lava-db",
     cl::desc("Path to LAVA database (custom binary file for source info).  "
         "Created in query mode."),
     cl::cat(LavaCategory),
@@ -157,6 +255,12 @@ static cl::opt<std::string> DBName("db",
     cl::desc("database name."),
     cl::cat(LavaCategory),
     cl::init("XXX"));
+static cl::opt<std::string> BugManifest("bug-manifest",
+    cl::desc("JSON manifest of the bugs to inject, from write_bug_manifest "
+        "in lava.py. Used instead of --db. With --bug-list, only those "
+        "bugs; otherwise all of them."),
+    cl::cat(LavaCategory),
+    cl::init("XXX"));
 static cl::opt<std::string> ProjectFile("project-file",
     cl::desc("Path to project.json file."),
     cl::cat(LavaCategory),
@@ -185,6 +289,28 @@ static cl::opt<unsigned int> ArgRandSeed("randseed",
     cl::desc("Value to use as random seed when generating solutions"),
     cl::cat(LavaCategory),
     cl::init(0));
+static cl::opt<unsigned> Jobs("jobs",
+    cl::desc("Process up to this many source files at once, each worker in "
+        "its own process"),
+    cl::cat(LavaCategory),
+    cl::init(1));
+static cl::opt<std::string> ApplyManifest("apply",
+    cl::desc("Apply replacements to the sources at the end of the run, "
+        "instead of writing a .yaml file per TU for clang-apply-replacements, "
+        "and write a summary of the changes to this JSON file"),
+    cl::cat(LavaCategory),
+    cl::init("XXX"));
+static cl::opt<std::string> ASTCache("ast-cache",
+    cl::desc("Directory to save each TU's parsed AST in, to load instead of "
+        "parsing again while its sources are unchanged"),
+    cl::cat(LavaCategory),
+    cl::init("XXX"));
+static cl::opt<std::string> SiteIndex("site-index",
+    cl::desc("Index of the places in each TU bugs can be injected. TUs in "
+        "it whose sources are unchanged are injected into without running "
+        "clang; the rest are run as usual and added to it. Needs --apply"),
+    cl::cat(LavaCategory),
+    cl::init("XXX"));
 static cl::opt<bool> ArgCompetition("competition",
     cl::desc("Log before/after bugs when competition is #defined"),
     cl::cat(LavaCategory),
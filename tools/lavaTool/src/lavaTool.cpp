@@ -33,13 +33,741 @@ void parse_whitelist(std::string whitelist_filename) {
     debug(FNARG) << "whitelist is " << whitelist.size() << " entries\n";
 }
 
+// The rows with ids in ids, in one query.
+template<typename T, typename Ids>
+static odb::result<T> query_ids(const Ids &ids) {
+    typedef odb::query<T> Query;
+    return db->query<T>(Query::id.in_range(ids.begin(), ids.end()));
+}
+
+// Links up rows loaded from the database or a manifest, leaves first, and
+// adds the bugs to bugs. The lvals and atps they refer to must be loaded.
+static void link_bugs(const std::vector<BugRow> &bug_rows,
+        const std::vector<DuaBytesRow> &dua_bytes_rows,
+        const std::vector<DuaRow> &dua_rows) {
+    for (const DuaRow &row : dua_rows) {
+        Dua &dua = loaded_duas[row.id];
+        dua.id = row.id;
+        dua.lval = &loaded_lvals.at(row.lval);
+        dua.inputfile = row.inputfile;
+        dua.max_tcn = row.max_tcn;
+        dua.max_cardinality = row.max_cardinality;
+        dua.instr = row.instr;
+        dua.fake_dua = row.fake_dua;
+    }
+    for (const DuaBytesRow &row : dua_bytes_rows) {
+        DuaBytes &dua_bytes = loaded_dua_bytes[row.id];
+        dua_bytes.id = row.id;
+        dua_bytes.dua = &loaded_duas.at(row.dua);
+        dua_bytes.selected = row.selected;
+    }
+    for (const BugRow &row : bug_rows) {
+        Bug &bug = loaded_bugs[row.id];
+        bug.id = row.id;
+        bug.type = row.type;
+        bug.trigger = get_dua_bytes(row.trigger);
+        bug.trigger_lval = &loaded_lvals.at(row.trigger_lval);
+        bug.atp = &loaded_atps.at(row.atp);
+        bug.max_liveness = row.max_liveness;
+        bug.extra_duas = row.extra_duas;
+        bug.magic = row.magic;
+    }
+    for (const auto &kvp : loaded_bugs) bugs.push_back(&kvp.second);
+}
+
+// Loads the bugs with ids in bug_ids into bugs, along with the DuaBytes,
+// Duas, lvals and attack points they refer to: one query per table, rather
+// than one per object. Needs a transaction.
+static void load_bugs(const std::set<uint32_t> &bug_ids) {
+    if (bug_ids.empty()) return;
+
+    std::set<uint64_t> dua_bytes_ids, dua_ids, lval_ids, atp_ids;
+    std::vector<BugRow> bug_rows;
+    for (const BugRow &row : query_ids<BugRow>(bug_ids)) {
+        bug_rows.push_back(row);
+        dua_bytes_ids.insert(row.trigger);
+        dua_bytes_ids.insert(row.extra_duas.begin(), row.extra_duas.end());
+        lval_ids.insert(row.trigger_lval);
+        atp_ids.insert(row.atp);
+    }
+    if (bug_rows.size() != bug_ids.size()) {
+        errs() << "Error: Only " << bug_rows.size() << " of "
+            << bug_ids.size() << " bugs in --bug-list are in the database.\n";
+        exit(1);
+    }
+
+    std::vector<DuaBytesRow> dua_bytes_rows;
+    for (const DuaBytesRow &row : query_ids<DuaBytesRow>(dua_bytes_ids)) {
+        dua_bytes_rows.push_back(row);
+        dua_ids.insert(row.dua);
+    }
+    std::vector<DuaRow> dua_rows;
+    for (const DuaRow &row : query_ids<DuaRow>(dua_ids)) {
+        dua_rows.push_back(row);
+        lval_ids.insert(row.lval);
+    }
+    for (const SourceLval &lval : query_ids<SourceLval>(lval_ids)) {
+        loaded_lvals[lval.id] = lval;
+    }
+    for (const AttackPoint &atp : query_ids<AttackPoint>(atp_ids)) {
+        loaded_atps[atp.id] = atp;
+    }
+    link_bugs(bug_rows, dua_bytes_rows, dua_rows);
+}
+
+static Loc get_loc(const Json::Value &loc) {
+    return Loc(loc[0].asUInt(), loc[1].asUInt());
+}
+
+static LavaASTLoc get_ast_loc(const Json::Value &value) {
+    return LavaASTLoc(value["filename"].asString(), get_loc(value["begin"]),
+            get_loc(value["end"]));
+}
+
+// Loads bugs from a manifest written by write_bug_manifest in
+// scripts/lava.py instead of the database: the ones in bug_ids, or all of
+// them if bug_ids is empty.
+static void load_bug_manifest(const std::string &path,
+        const std::set<uint32_t> &bug_ids) {
+    std::ifstream in(path);
+    Json::Value manifest;
+    if (!(in >> manifest) || manifest["version"].asUInt() != 1) {
+        errs() << "Error: Could not read bug manifest " << path << "\n";
+        exit(1);
+    }
+
+    for (const Json::Value &value : manifest["lvals"]) {
+        SourceLval &lval = loaded_lvals[value["id"].asUInt64()];
+        lval.id = value["id"].asUInt64();
+        lval.loc = get_ast_loc(value["loc"]);
+        lval.ast_name = value["ast_name"].asString();
+        lval.len_bytes = value["len_bytes"].asUInt();
+    }
+    for (const Json::Value &value : manifest["atps"]) {
+        AttackPoint &atp = loaded_atps[value["id"].asUInt64()];
+        atp.id = value["id"].asUInt64();
+        atp.loc = get_ast_loc(value["loc"]);
+        atp.type = (AttackPoint::Type)value["type"].asUInt();
+    }
+    std::vector<DuaRow> dua_rows;
+    for (const Json::Value &value : manifest["duas"]) {
+        DuaRow row;
+        row.id = value["id"].asUInt64();
+        row.lval = value["lval"].asUInt64();
+        row.inputfile = value["inputfile"].asString();
+        row.max_tcn = value["max_tcn"].asUInt();
+        row.max_cardinality = value["max_cardinality"].asUInt();
+        row.instr = value["instr"].asUInt64();
+        row.fake_dua = value["fake_dua"].asBool();
+        dua_rows.push_back(row);
+    }
+    std::vector<DuaBytesRow> dua_bytes_rows;
+    for (const Json::Value &value : manifest["dua_bytes"]) {
+        DuaBytesRow row;
+        row.id = value["id"].asUInt64();
+        row.dua = value["dua"].asUInt64();
+        row.selected = Range{value["selected"][0].asUInt(),
+            value["selected"][1].asUInt()};
+        dua_bytes_rows.push_back(row);
+    }
+    std::vector<BugRow> bug_rows;
+    for (const Json::Value &value : manifest["bugs"]) {
+        BugRow row;
+        row.id = value["id"].asUInt64();
+        if (!bug_ids.empty() && bug_ids.count(row.id) == 0) continue;
+        row.type = (Bug::Type)value["type"].asUInt();
+        row.trigger = value["trigger"].asUInt64();
+        row.trigger_lval = value["trigger_lval"].asUInt64();
+        row.atp = value["atp"].asUInt64();
+        row.max_liveness = value["max_liveness"].asUInt64();
+        for (const Json::Value &extra : value["extra_duas"]) {
+            row.extra_duas.push_back(extra.asUInt64());
+        }
+        row.magic = value["magic"].asUInt();
+        bug_rows.push_back(row);
+    }
+    if (!bug_ids.empty() && bug_rows.size() != bug_ids.size()) {
+        errs() << "Error: Only " << bug_rows.size() << " of "
+            << bug_ids.size() << " bugs in --bug-list are in " << path
+            << ".\n";
+        exit(1);
+    }
+    link_bugs(bug_rows, dua_bytes_rows, dua_rows);
+}
+
+// -apply: edits are passed between processes as NUL-separated path,
+// offset, length and text, as the lavaDB used to be.
+static void save_edits(const std::string &path) {
+    std::ofstream out(path);
+    for (const auto &kvp : pending_edits) {
+        for (const auto &edit : kvp.second) {
+            out << kvp.first << '\0' << std::get<0>(edit) << '\0'
+                << std::get<1>(edit) << '\0' << std::get<2>(edit) << '\0';
+        }
+    }
+}
+
+static bool load_edits(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string file, offset, length, text;
+    while (std::getline(in, file, '\0') && std::getline(in, offset, '\0')
+            && std::getline(in, length, '\0') && std::getline(in, text, '\0')) {
+        pending_edits[file].insert(std::make_tuple(
+                    (unsigned)strtoul(offset.c_str(), NULL, 0),
+                    (unsigned)strtoul(length.c_str(), NULL, 0), text));
+    }
+    return true;
+}
+
+// Writes contents to a new file next to path, with path's permissions, and
+// sets tmp to its name. Renaming it over path then replaces the file without
+// it ever being half-written. On failure nothing is left behind.
+static bool write_temp_file(const std::string &path,
+        const std::string &contents, std::string &tmp) {
+    tmp = path + ".lava.XXXXXX";
+    std::vector<char> name(tmp.begin(), tmp.end());
+    name.push_back('\0');
+    int fd = mkstemp(name.data());
+    if (fd < 0) return false;
+    tmp = name.data();
+    struct stat st;
+    bool ok = stat(path.c_str(), &st) == 0
+        && fchmod(fd, st.st_mode & 07777) == 0;
+    for (size_t done = 0; ok && done < contents.size(); ) {
+        ssize_t n = write(fd, contents.data() + done, contents.size() - done);
+        if (n <= 0) ok = false;
+        else done += n;
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok) unlink(name.data());
+    return ok;
+}
+
+// Applies pending_edits to their files and writes a JSON summary of what
+// changed to manifest_path. If any file can't be read, or has edits that
+// overlap or run past its end, the summary lists them and no file is
+// changed. Likewise if any new file can't be written: they're all written
+// out before any is renamed into place. Each file's "written" says whether
+// it was replaced. False if the edits weren't all applied.
+static bool apply_edits(const std::string &manifest_path) {
+    Json::Value manifest;
+    manifest["version"] = 1;
+    Json::Value &files = manifest["files"];
+    files = Json::Value(Json::arrayValue);
+    Json::Value &conflicts = manifest["conflicts"];
+    conflicts = Json::Value(Json::arrayValue);
+
+    std::vector<std::pair<std::string, std::string>> outputs;
+    for (const auto &kvp : pending_edits) {
+        const std::string &path = kvp.first;
+        std::string before;
+        if (!read_file(path, before)) {
+            Json::Value conflict;
+            conflict["path"] = path;
+            conflict["error"] = "could not read file";
+            conflicts.append(conflict);
+            continue;
+        }
+
+        std::string after;
+        size_t pos = 0;
+        bool ok = true;
+        for (const auto &edit : kvp.second) {
+            unsigned offset = std::get<0>(edit), length = std::get<1>(edit);
+            if (offset < pos || offset + length > before.size()) {
+                Json::Value conflict;
+                conflict["path"] = path;
+                conflict["offset"] = offset;
+                conflict["length"] = length;
+                conflict["error"] = offset < pos
+                    ? "overlaps another replacement" : "past end of file";
+                conflicts.append(conflict);
+                ok = false;
+                break;
+            }
+            after.append(before, pos, offset - pos);
+            after += std::get<2>(edit);
+            pos = offset + length;
+        }
+        if (!ok) continue;
+        after.append(before, pos, std::string::npos);
+
+        Json::Value file;
+        file["path"] = path;
+        file["replacements"] = (Json::UInt)kvp.second.size();
+        file["bytes_before"] = (Json::UInt64)before.size();
+        file["bytes_after"] = (Json::UInt64)after.size();
+        file["written"] = false;
+        files.append(file);
+        outputs.push_back(std::make_pair(path, std::move(after)));
+    }
+
+    bool ok = conflicts.empty();
+    for (const Json::Value &conflict : conflicts) {
+        errs() << "Error: " << conflict["path"].asString();
+        if (conflict.isMember("offset")) {
+            errs() << " at offset " << conflict["offset"].asUInt();
+        }
+        errs() << ": " << conflict["error"].asString() << "\n";
+    }
+    if (ok) {
+        std::vector<std::string> temps;
+        for (const auto &output : outputs) {
+            std::string tmp;
+            if (!write_temp_file(output.first, output.second, tmp)) {
+                errs() << "Error: Could not write " << output.first << "\n";
+                ok = false;
+                break;
+            }
+            temps.push_back(tmp);
+        }
+        // outputs and files line up, one entry per file.
+        for (size_t i = 0; ok && i < temps.size(); i++) {
+            if (rename(temps[i].c_str(), outputs[i].first.c_str()) != 0) {
+                errs() << "Error: Could not replace " << outputs[i].first
+                    << "\n";
+                ok = false;
+            } else {
+                files[(Json::ArrayIndex)i]["written"] = true;
+            }
+        }
+        if (!ok) {
+            for (const std::string &tmp : temps) unlink(tmp.c_str());
+        }
+    }
+    manifest["applied"] = ok;
+
+    std::ofstream out(manifest_path);
+    out << manifest;
+    return ok && out;
+}
+
+// -ast-cache: the first time a TU is seen it's parsed into an ASTUnit and
+// saved as <key>.ast, key being a hash of its path and compile command.
+// Next to it, <key>.deps lists every file the TU read, with a hash of its
+// contents. While those all still match, later runs load the saved AST and
+// only run the matchers over it. What the handlers then do depends on the
+// bugs being injected, so that part always runs.
+static const char *AST_DEPS_HEADER = "lava-ast-cache 1";
+
+// True if every file in deps_path still has the contents it had.
+static bool ast_deps_match(const std::string &deps_path) {
+    std::ifstream deps(deps_path);
+    std::string line;
+    if (!std::getline(deps, line) || line != AST_DEPS_HEADER) return false;
+    std::string md5, path;
+    while (deps >> md5 && deps.get() == ' ' && std::getline(deps, path)) {
+        if (file_md5(path) != md5) return false;
+    }
+    return deps.eof();
+}
+
+// Saves unit and the list of files it read. dir is the compile directory,
+// which relative paths in unit are relative to.
+static bool save_ast(ASTUnit &unit, const std::string &dir,
+        const std::string &ast_path, const std::string &deps_path) {
+    std::string suffix = ".tmp" + std::to_string(getpid());
+    std::string ast_tmp = ast_path + suffix, deps_tmp = deps_path + suffix;
+    bool ok = !unit.Save(ast_tmp);
+
+    std::ofstream deps(deps_tmp);
+    deps << AST_DEPS_HEADER << "\n";
+    const SourceManager &SM = unit.getSourceManager();
+    for (auto it = SM.fileinfo_begin(); ok && it != SM.fileinfo_end(); ++it) {
+        std::string path = it->first->getName();
+        if (path.empty() || path[0] != '/') path = dir + "/" + path;
+        std::string md5 = file_md5(path);
+        if (md5.empty()) ok = false;
+        deps << md5 << " " << path << "\n";
+    }
+    deps.close();
+
+    // The .deps file goes last: it's what says the .ast is good.
+    ok = ok && deps && rename(ast_tmp.c_str(), ast_path.c_str()) == 0
+        && rename(deps_tmp.c_str(), deps_path.c_str()) == 0;
+    unlink(ast_tmp.c_str());
+    unlink(deps_tmp.c_str());
+    return ok;
+}
+
+// A hash of the lavaTool version, path, and the commands it's compiled with.
+static std::string compile_key(const std::string &path,
+        const std::vector<CompileCommand> &commands) {
+    std::string key = LAVA_VER;
+    key += '\0' + path;
+    for (const CompileCommand &command : commands) {
+        key += '\0' + command.Directory;
+        for (const std::string &arg : command.CommandLine) key += '\0' + arg;
+    }
+    return md5_hex(key);
+}
+
+// Runs Matcher over source, from its saved AST if -ast-cache has a good one.
+static void match_file(const CompilationDatabase &compilations,
+        const std::string &source, LavaMatchFinder &Matcher) {
+    std::string path = getAbsolutePath(source);
+    std::vector<CompileCommand> commands =
+        compilations.getCompileCommands(path);
+    if (ASTCache == "XXX" || commands.empty()) {
+        ClangTool Tool(compilations, source);
+        Tool.run(newFrontendActionFactory(&Matcher, &Matcher).get());
+        return;
+    }
+
+    std::string base = ASTCache + "/" + compile_key(path, commands);
+    std::string ast_path = base + ".ast", deps_path = base + ".deps";
+    const std::string &dir = commands.front().Directory;
+
+    std::unique_ptr<ASTUnit> unit;
+    if (ast_deps_match(deps_path)) {
+        // We've just checked the inputs by their contents. Clang's own
+        // check goes by modification time, which git checkout changes.
+        setenv("LIBCLANG_DISABLE_PCH_VALIDATION", "1", 1);
+        unit = ASTUnit::LoadFromASTFile(ast_path,
+                CompilerInstance::createDiagnostics(new DiagnosticOptions()),
+                FileSystemOptions());
+        unsetenv("LIBCLANG_DISABLE_PCH_VALIDATION");
+        if (unit) debug(INJECT) << "Loaded saved AST for " << path << "\n";
+    }
+    if (!unit) {
+        std::vector<std::unique_ptr<ASTUnit>> units;
+        ClangTool Tool(compilations, path);
+        if (Tool.buildASTs(units) != 0 || units.size() != 1) {
+            // Let the usual route report what's wrong.
+            ClangTool Tool(compilations, path);
+            Tool.run(newFrontendActionFactory(&Matcher, &Matcher).get());
+            return;
+        }
+        unit = std::move(units.front());
+        if (!unit->getDiagnostics().hasErrorOccurred()
+                && !save_ast(*unit, dir, ast_path, deps_path)) {
+            errs() << "Warning: Could not save the AST for " << path << "\n";
+        }
+    }
+
+    // Tool.run runs matchers in the compile directory, and relative paths
+    // in the AST are relative to it.
+    char *cwd = getcwd(nullptr, 0);
+    if (chdir(dir.c_str()) != 0) {
+        errs() << "Warning: Could not change to " << dir << "\n";
+    }
+    Matcher.matchUnit(*unit, path);
+    if (cwd && chdir(cwd) != 0) {
+        errs() << "Warning: Could not change back to " << cwd << "\n";
+    }
+    free(cwd);
+}
+
+// -site-index: the file is text, a header line then a line per TU, each
+// followed by lines for the files it read and its sites:
+//     tu <key> <path>
+//     dep <md5> <path>
+//     q <before> <ast loc>
+//     a <before> <after> <atp type> <paren inner> <paren outer> <ast loc>
+// with ast locs as begin line, column, end line, column, filename.
+// Filenames come last on their lines, so may have spaces.
+static const char *SITE_INDEX_HEADER = "lava-site-index 1";
+
+static void write_ast_loc(std::ostream &out, const LavaASTLoc &loc) {
+    out << loc.begin.line << " " << loc.begin.column << " " << loc.end.line
+        << " " << loc.end.column << " " << loc.filename << "\n";
+}
+
+static bool read_ast_loc(std::istream &in, LavaASTLoc &loc) {
+    return in >> loc.begin.line >> loc.begin.column >> loc.end.line
+        >> loc.end.column && in.get() == ' ' && std::getline(in, loc.filename);
+}
+
+// Saves the complete TUs in tus to path.
+static bool save_site_index(const std::string &path,
+        const std::vector<IndexedTU> &tus) {
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    std::ofstream out(tmp);
+    out << SITE_INDEX_HEADER << "\n";
+    for (const IndexedTU &tu : tus) {
+        if (!tu.complete) continue;
+        out << "tu " << tu.key << " " << tu.path << "\n";
+        for (const auto &dep : tu.deps) {
+            out << "dep " << dep.first << " " << dep.second << "\n";
+        }
+        for (const IndexedSite &site : tu.sites) {
+            if (site.attack) {
+                out << "a " << site.before << " " << site.after << " "
+                    << site.atp_type << " " << site.paren_inner << " "
+                    << site.paren_outer << " ";
+            } else {
+                out << "q " << site.before << " ";
+            }
+            write_ast_loc(out, site.ast_loc);
+        }
+    }
+    out.close();
+    bool ok = out && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+}
+
+// Adds the TUs in the index at path to tus. False if it's missing or bad.
+static bool load_site_index(const std::string &path,
+        std::vector<IndexedTU> &tus) {
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line) || line != SITE_INDEX_HEADER) return false;
+    std::vector<IndexedTU> loaded;
+    while (std::getline(in, line)) {
+        std::istringstream ss(line);
+        std::string kind;
+        ss >> kind;
+        if (kind == "tu") {
+            loaded.emplace_back();
+            if (ss >> loaded.back().key && ss.get() == ' '
+                    && std::getline(ss, loaded.back().path)) {
+                continue;
+            }
+        } else if (!loaded.empty() && kind == "dep") {
+            std::string md5, dep_path;
+            if (ss >> md5 && ss.get() == ' ' && std::getline(ss, dep_path)) {
+                loaded.back().deps.push_back(std::make_pair(md5, dep_path));
+                continue;
+            }
+        } else if (!loaded.empty() && (kind == "q" || kind == "a")) {
+            IndexedSite site = {};
+            site.attack = kind == "a";
+            site.atp_type = AttackPoint::QUERY_POINT;
+            unsigned type = 0;
+            bool ok = site.attack
+                ? (bool)(ss >> site.before >> site.after >> type
+                        >> site.paren_inner >> site.paren_outer)
+                : (bool)(ss >> site.before);
+            if (site.attack) site.atp_type = (AttackPoint::Type)type;
+            if (ok && ss.get() == ' ' && read_ast_loc(ss, site.ast_loc)) {
+                loaded.back().sites.push_back(site);
+                continue;
+            }
+        }
+        return false;
+    }
+    tus.insert(tus.end(), loaded.begin(), loaded.end());
+    return true;
+}
+
+// Fills in the keys of the TUs recorded this run.
+static void key_recorded_tus(const CompilationDatabase &compilations) {
+    for (IndexedTU &tu : recorded_tus) {
+        tu.key = compile_key(tu.path, compilations.getCompileCommands(tu.path));
+    }
+}
+
+// True if tu is still what its sources would give: same compile commands,
+// and every file it read unchanged. Headers are shared between TUs, so
+// their hashes are kept.
+static bool tu_unchanged(const CompilationDatabase &compilations,
+        const IndexedTU &tu) {
+    static std::map<std::string, std::string> md5s;
+    if (tu.key != compile_key(tu.path,
+                compilations.getCompileCommands(tu.path))) {
+        return false;
+    }
+    for (const auto &dep : tu.deps) {
+        auto it = md5s.find(dep.second);
+        if (it == md5s.end()) {
+            it = md5s.insert(std::make_pair(dep.second,
+                        file_md5(dep.second))).first;
+        }
+        if (it->second != dep.first) return false;
+    }
+    return true;
+}
+
+// Injects into tu from its sites, as the handlers would have if they had
+// run on it, adding the edits to pending_edits.
+static void inject_indexed(const IndexedTU &tu) {
+    debug(INJECT) << "Injecting into " << tu.path << " from the site index\n";
+    BasicInsertions<unsigned> Insert;
+    for (const IndexedSite &site : tu.sites) {
+        if (site.attack) {
+            std::string addend;
+            std::vector<std::pair<uint64_t, std::string>> logs;
+            if (LavaMatchHandler::AttackText(site.ast_loc, site.atp_type,
+                        addend, logs)) {
+                LavaMatchHandler::AttackAt(Insert, site.before, site.after,
+                        site.paren_inner, site.paren_outer, addend, logs);
+            }
+        } else {
+            Insert.InsertBefore(site.before,
+                    PriQueryPointHandler::SiphonsForLocation(site.ast_loc)
+                    + PriQueryPointHandler::AttackRetBuffer(site.ast_loc));
+        }
+    }
+
+    FileEdits &edits = pending_edits[tu.path];
+    edits.insert(std::make_tuple(0u, 0u, LavaMatchFinder::TopOfFile(tu.path)));
+    for (const auto &insertion : Insert.rendered()) {
+        edits.insert(std::make_tuple(insertion.first, 0u, insertion.second));
+    }
+}
+
+// -jobs: source files are handed out one at a time over a pipe to worker
+// processes, each of which runs its own ClangTool on them. Forking gives
+// every worker its own copy of the global state (siphons_at,
+// bugs_with_atp_at, data_slots), as set up by main. Workers add strings to
+// the lavaDB themselves; it keeps their ids apart. When a worker runs out
+// of files it leaves behind, in dir, its stdout and which attack points
+// and siphons it injected. merge_worker folds those back in here.
+static std::string worker_path(const std::string &dir, unsigned w,
+        const char *what) {
+    return dir + "/worker" + std::to_string(w) + "." + what;
+}
+
+template<typename Map>
+static std::vector<typename Map::key_type> keys_of(const Map &map) {
+    std::vector<typename Map::key_type> keys;
+    for (const auto &kvp : map) keys.push_back(kvp.first);
+    return keys;
+}
+
+// Keys of bugs_with_atp_at and siphons_at when the workers started.
+typedef std::vector<std::pair<LavaASTLoc, AttackPoint::Type>> AtpKeys;
+typedef std::vector<LavaASTLoc> SiphonKeys;
+
+static void run_worker(const CompilationDatabase &compilations,
+        const std::vector<std::string> &sources, int queue_fd, unsigned w,
+        const std::string &dir, const AtpKeys &atps,
+        const SiphonKeys &siphons) {
+    // SOL lines and the like go to a file, so outputs of different workers
+    // don't interleave.
+    fflush(stdout);
+    if (!freopen(worker_path(dir, w, "out").c_str(), "w", stdout)) _exit(1);
+
+    StringIDs->reopen();
+
+    LavaMatchFinder Matcher;
+    uint32_t i;
+    while (read(queue_fd, &i, sizeof(i)) == sizeof(i)) {
+        match_file(compilations, sources[i], Matcher);
+    }
+    if (ApplyManifest != "XXX") save_edits(worker_path(dir, w, "edits"));
+    if (SiteIndex != "XXX") {
+        key_recorded_tus(compilations);
+        save_site_index(worker_path(dir, w, "sites"), recorded_tus);
+    }
+
+    // The parent has the same keys in the same order, so indices will do.
+    std::ofstream done(worker_path(dir, w, "done"));
+    done << num_taint_queries << " " << num_atp_queries << "\n";
+    for (size_t k = 0; k < atps.size(); k++) {
+        if (bugs_with_atp_at.count(atps[k]) == 0) done << "atp " << k << "\n";
+    }
+    for (size_t k = 0; k < siphons.size(); k++) {
+        if (siphons_at.count(siphons[k]) == 0) done << "siphon " << k << "\n";
+    }
+    done.close();
+    fflush(stdout);
+    _exit(done ? 0 : 1);
+}
+
+static bool merge_worker(const std::string &dir, unsigned w,
+        const AtpKeys &atps, const SiphonKeys &siphons) {
+    std::ifstream out(worker_path(dir, w, "out"));
+    std::cout << out.rdbuf();
+    std::cout.flush();
+
+    if (ApplyManifest != "XXX" && !load_edits(worker_path(dir, w, "edits"))) {
+        return false;
+    }
+
+    if (SiteIndex != "XXX"
+            && !load_site_index(worker_path(dir, w, "sites"), recorded_tus)) {
+        return false;
+    }
+
+    std::ifstream done(worker_path(dir, w, "done"));
+    uint32_t taint_queries, atp_queries;
+    if (!(done >> taint_queries >> atp_queries)) return false;
+    num_taint_queries += taint_queries;
+    num_atp_queries += atp_queries;
+    std::string kind;
+    size_t k;
+    while (done >> kind >> k) {
+        if (kind == "atp" && k < atps.size()) {
+            bugs_with_atp_at.erase(atps[k]);
+        } else if (kind == "siphon" && k < siphons.size()) {
+            siphons_at.erase(siphons[k]);
+        }
+    }
+    return true;
+}
+
+// Runs the matchers over sources in up to Jobs workers. False if a worker
+// failed.
+static bool run_workers(const CompilationDatabase &compilations,
+        const std::vector<std::string> &sources) {
+    char dir_template[] = "/tmp/lavaTool.XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        errs() << "Error: Could not make a directory for workers.\n";
+        return false;
+    }
+    std::string dir = dir_template;
+
+    int queue[2];
+    if (pipe(queue) != 0) {
+        errs() << "Error: pipe failed.\n";
+        return false;
+    }
+    unsigned jobs = std::min<size_t>(Jobs, sources.size());
+    AtpKeys atps = keys_of(bugs_with_atp_at);
+    SiphonKeys siphons = keys_of(siphons_at);
+    std::vector<pid_t> pids;
+    fflush(stdout);
+    std::cout.flush();
+    for (unsigned w = 0; w < jobs; w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            errs() << "Error: fork failed.\n";
+            jobs = w;
+            break;
+        }
+        if (pid == 0) {
+            close(queue[1]);
+            run_worker(compilations, sources, queue[0], w, dir, atps,
+                    siphons);
+        }
+        pids.push_back(pid);
+    }
+    close(queue[0]);
+    // If every worker dies, write fails rather than killing us.
+    signal(SIGPIPE, SIG_IGN);
+    // Writes this small are atomic, so each read in a worker gets one whole
+    // index.
+    for (uint32_t i = 0; i < sources.size() && jobs > 0; i++) {
+        if (write(queue[1], &i, sizeof(i)) != sizeof(i)) break;
+    }
+    close(queue[1]);
+
+    bool ok = jobs > 0;
+    for (unsigned w = 0; w < pids.size(); w++) {
+        int status;
+        waitpid(pids[w], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0
+                || !merge_worker(dir, w, atps, siphons)) {
+            errs() << "Error: lavaTool worker " << w << " failed.\n";
+            ok = false;
+        }
+        for (const char *what : { "out", "done", "edits", "sites" }) {
+            unlink(worker_path(dir, w, what).c_str());
+        }
+    }
+    rmdir(dir.c_str());
+    return ok;
+}
+
 int main(int argc, const char **argv) {
     cl::SetVersionPrinter(printVersion);
     CommonOptionsParser op(argc, argv, LavaCategory);
 
     std::cout << "Starting lavaTool...\n";
     LavaPath = std::string(dirname(dirname(dirname(realpath(argv[0], NULL)))));
-    ClangTool Tool(op.getCompilations(), op.getSourcePathList());
     RANDOM_SEED = ArgRandSeed;
     srand(RANDOM_SEED);
 
@@ -49,36 +777,65 @@ int main(int argc, const char **argv) {
     else
         debug(FNARG) << "No whitelist\n";
 
+    if (ASTCache != "XXX") {
+        std::error_code EC = llvm::sys::fs::create_directories(ASTCache);
+        if (EC) {
+            errs() << "Error: Could not create " << ASTCache << ": "
+                << EC.message() << "\n";
+            exit(1);
+        }
+    }
+
+    if (SiteIndex != "XXX" && (LavaAction != LavaInjectBugs || ArgDataflow
+                || ApplyManifest == "XXX")) {
+        errs() << "Error: --site-index only works with --action=inject and "
+            "--apply, and not with --arg_dataflow.\n";
+        exit(1);
+    }
+
+    try {
+        StringIDs.reset(new LavaDB(LavaDBFile != "XXX" ? LavaDBFile : ""));
+    } catch (std::runtime_error &e) {
+        errs() << "Error: " << e.what() << "\n";
+        exit(1);
+    }
+
     if (ArgDebug) {
         errs() << "DEBUG MODE: Only adding data_flow\n";
 
         LavaMatchFinder Matcher;
+        ClangTool Tool(op.getCompilations(), op.getSourcePathList());
         Tool.run(newFrontendActionFactory(&Matcher, &Matcher).get());
+        if (ApplyManifest != "XXX" && !apply_edits(ApplyManifest)) return 1;
         return 0;
     }
 
-    if (LavaDB != "XXX") StringIDs = LoadDB(LavaDB);
-
-    odb::transaction *t = nullptr;
-
     if (LavaAction == LavaInjectBugs) {
-        if (DBName == "XXX") {
-            errs() << "Error: Specify a database name with \"--db [name]\".  Exiting . . .\n";
+        if (DBName == "XXX" && BugManifest == "XXX") {
+            errs() << "Error: Specify a database name with \"--db [name]\" or a manifest with \"--bug-manifest [file]\".  Exiting . . .\n";
             exit(1);
         }
-        db.reset(new odb::pgsql::database("postgres", "postgrespostgres",
-                    DBName));
-        t = new odb::transaction(db->begin());
 
         main_files = parse_commas_strings(MainFileList);
 
         // get bug info for the injections we are supposed to be doing.
         debug(INJECT) << "LavaBugList: [" << LavaBugList << "]\n";
 
-        std::set<uint32_t> bug_ids = parse_commas<uint32_t>(LavaBugList);
-        // for each bug_id, load that bug from DB and insert into bugs vector.
-        std::transform(bug_ids.begin(), bug_ids.end(), std::back_inserter(bugs),
-                [&](uint32_t bug_id) { return db->load<Bug>(bug_id); });
+        std::set<uint32_t> bug_ids;
+        if (LavaBugList != "XXX") {
+            bug_ids = parse_commas<uint32_t>(LavaBugList);
+        }
+        if (BugManifest != "XXX") {
+            load_bug_manifest(BugManifest, bug_ids);
+        } else {
+            db.reset(new odb::pgsql::database("postgres", "postgrespostgres",
+                        DBName));
+            odb::transaction t(db->begin());
+            load_bugs(bug_ids);
+            t.commit();
+            // Everything from here on works from the loaded bugs.
+            db.reset();
+        }
 
         for (const Bug *bug : bugs) {
             LavaASTLoc atp_loc = bug->atp->loc;
@@ -89,23 +846,86 @@ int main(int argc, const char **argv) {
 
             if (bug->type != Bug::RET_BUFFER) {
                 for (uint64_t dua_id : bug->extra_duas) {
-                    const DuaBytes *dua_bytes = db->load<DuaBytes>(dua_id);
-                    mark_for_siphon(dua_bytes);
+                    mark_for_siphon(get_dua_bytes(dua_id));
                 }
             }
         }
     }
 
+    // Sources the site index has good sites for don't need clang. The
+    // index keeps TUs from earlier runs that aren't in this one, as long as
+    // their sources are unchanged.
+    std::vector<std::string> sources;
+    std::vector<IndexedTU> index;
+    std::vector<const IndexedTU *> indexed;
+    if (SiteIndex != "XXX") {
+        std::vector<IndexedTU> loaded;
+        load_site_index(SiteIndex, loaded);
+        for (const IndexedTU &tu : loaded) {
+            if (tu_unchanged(op.getCompilations(), tu)) index.push_back(tu);
+        }
+        std::map<std::string, const IndexedTU *> by_path;
+        for (const IndexedTU &tu : index) by_path[tu.path] = &tu;
+        for (const std::string &source : op.getSourcePathList()) {
+            auto it = by_path.find(getAbsolutePath(source));
+            if (it != by_path.end()) indexed.push_back(it->second);
+            else sources.push_back(source);
+        }
+        std::cout << indexed.size() << " of " << op.getSourcePathList().size()
+            << " source files are in the site index.\n";
+    } else {
+        sources = op.getSourcePathList();
+    }
+
     debug(INJECT) << "about to call Tool.run \n";
-    LavaMatchFinder Matcher;
-    Tool.run(newFrontendActionFactory(&Matcher, &Matcher).get());
+    if (sources.empty()) {
+        // Everything is in the site index.
+    } else if (Jobs > 1 && sources.size() > 1) {
+        if (!run_workers(op.getCompilations(), sources)) {
+            errs() << "Error: Not all source files were processed.\n";
+            return 1;
+        }
+    } else if (ASTCache != "XXX") {
+        LavaMatchFinder Matcher;
+        for (const std::string &source : sources) {
+            match_file(op.getCompilations(), source, Matcher);
+        }
+    } else {
+        LavaMatchFinder Matcher;
+        ClangTool Tool(op.getCompilations(), sources);
+        Tool.run(newFrontendActionFactory(&Matcher, &Matcher).get());
+    }
     debug(INJECT) << "back from calling Tool.run \n";
 
+    for (const IndexedTU *tu : indexed) inject_indexed(*tu);
+
+    if (SiteIndex != "XXX" && !recorded_tus.empty()) {
+        key_recorded_tus(op.getCompilations());
+        // A source compiled more than one way was run more than once; leave
+        // it to clang.
+        std::map<std::string, unsigned> runs;
+        for (const IndexedTU &tu : recorded_tus) runs[tu.path]++;
+        std::vector<IndexedTU> updated;
+        for (const IndexedTU &tu : index) {
+            if (runs.count(tu.path) == 0) updated.push_back(tu);
+        }
+        for (const IndexedTU &tu : recorded_tus) {
+            if (runs[tu.path] == 1) updated.push_back(tu);
+        }
+        if (!save_site_index(SiteIndex, updated)) {
+            errs() << "Warning: Could not write " << SiteIndex << "\n";
+        }
+    }
+
+    if (ApplyManifest != "XXX" && !apply_edits(ApplyManifest)) {
+        errs() << "Error: Replacements not applied; see " << ApplyManifest
+            << ".\n";
+        return 1;
+    }
+
     if (LavaAction == LavaQueries) {
         std::cout << "num taint queries added " << num_taint_queries << "\n";
         std::cout << "num atp queries added " << num_atp_queries << "\n";
-
-        if (LavaDB != "XXX") SaveDB(StringIDs, LavaDB);
     } else if (LavaAction == LavaInjectBugs) {
         // TODO this logic is flawed, bugs can be injected across files/directories
         // and this is specific to one single run of lavaTool
@@ -138,10 +958,5 @@ int main(int argc, const char **argv) {
         }
     }
 
-    if (t) {
-        t->commit();
-        delete t;
-    }
-
     return 0;
 }
@@ -0,0 +1,383 @@
+/*
+  Microbenchmark for LExpr (lexpr.hxx) against the implementation it
+  replaced, which copied every subtree into each node built on it and
+  rendered through a std::stringstream.
+
+  ./lexpr_bench [iterations] [seed]
+
+  Each iteration builds and renders what lavaTool emits for one attack
+  point, the way its handlers do: a dua siphon (lava_set of a select cast
+  under an if on the lval), a ret-buffer attack (asm under an #ifdef under
+  an if on the magic test) and a pointer addend summing a PTR_ADD attack
+  with a three-dua REL_WRITE attack. Both implementations build the same
+  expressions from the same random slots, offsets and magic values; the
+  bench times each and checks that they render byte for byte the same.
+*/
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lava.hxx"
+#include "lexpr.hxx"
+
+// lexpr.hxx before it moved subtrees into nodes and rendered into a string,
+// kept as the reference. Unchanged but for the namespace, and for
+// qualifying calls that lookup through lava.hxx's types would make
+// ambiguous with the new ones.
+namespace old_lexpr {
+
+template<typename InputIt>
+static void infix(InputIt first, InputIt last, std::ostream &os,
+        std::string begin, std::string sep, std::string end) {
+    InputIt it = first;
+    os << begin;
+    for (; it != last - 1; it++) {
+        os << *it << sep;
+    }
+    os << *it << end;
+}
+
+struct LExpr {
+    enum Type {
+        STR, HEX, DECIMAL, BINOP, FUNC, BLOCK, IF, CAST, INDEX, ASM, DEREF,
+        ASSIGN, IFDEF
+    } t;
+
+    uint32_t value;
+    std::string str;
+    std::vector<std::shared_ptr<LExpr>> args;
+    std::vector<std::string> instrs;
+
+    LExpr(Type t, uint32_t value, std::string str)
+        : t(t), value(value), str(str) {}
+
+    LExpr(Type t, uint32_t value, std::string str,
+            std::initializer_list<std::shared_ptr<LExpr>> args)
+        : t(t), value(value), str(str), args(args) {}
+
+    LExpr(Type t, uint32_t value, std::string str,
+            std::initializer_list<LExpr> init_args,
+            std::initializer_list<std::string> instrs)
+        : t(t), value(value), str(str), instrs(instrs) {
+        for (const LExpr &arg : init_args) {
+            args.emplace_back(new LExpr(arg));
+        }
+    }
+
+    LExpr(Type t, uint32_t value, std::string str,
+            std::initializer_list<LExpr> init_args)
+        : LExpr(t, value, str, init_args, {}) {}
+
+    LExpr(Type t, uint32_t value, std::string str,
+            std::vector<LExpr> init_args)
+        : t(t), value(value), str(str) {
+        for (const LExpr &arg : init_args) {
+            args.emplace_back(new LExpr(std::move(arg)));
+        }
+    }
+
+    std::string render() const {
+        std::stringstream os;
+        os << *this;
+        return os.str();
+    }
+
+    void infix(std::ostream &os, std::string begin, std::string sep, std::string end) const {
+        auto it = args.cbegin();
+        os << begin;
+        if (args.size() == 0) {
+            os << end;
+            return;
+        }
+        for (; it != args.cend() - 1; it++) {
+            os << **it << sep;
+        }
+        os << **it << end;
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const LExpr &expr) {
+        if (expr.t == STR) {
+            os << expr.str;
+        } else if (expr.t == LExpr::HEX) {
+            os << "0x" << std::hex << expr.value;
+        } else if (expr.t == LExpr::DECIMAL) {
+            os << std::dec << expr.value;
+        } else if (expr.t == LExpr::BINOP) {
+            expr.infix(os, "(", " " + expr.str + " ", ")");
+        } else if (expr.t == LExpr::FUNC) {
+            os << expr.str;
+            expr.infix(os, "(", ", ", ")");
+        } else if (expr.t == LExpr::BLOCK) {
+            expr.infix(os, "({", "; ", ";})");
+        } else if (expr.t == LExpr::IF) {
+            os << "if (" << expr.str << ") ";
+            expr.infix(os, "{\n", ";\n", ";\n}\n");
+        } else if (expr.t == LExpr::CAST) {
+            // Careful about precedence. Only problem is (CAST)INDEX[0].
+            os << "(" << expr.str << ")" << *expr.args.at(0);
+        } else if (expr.t == LExpr::INDEX) {
+            // In ((CAST)X)[0], add extra parens.
+            const LExpr &arg = *expr.args.at(0);
+            if (arg.t == LExpr::CAST) os << "(";
+            os << arg;
+            if (arg.t == LExpr::CAST) os << ")";
+            os << "[" << std::dec << expr.value << "]";
+        } else if (expr.t == LExpr::IFDEF) {
+            os << "\n#ifdef " << expr.str;
+            expr.infix(os, "\n", "\n#else\n", "\n#endif\n");
+        } else if (expr.t == LExpr::ASM) {
+            os << "__asm__(";
+            old_lexpr::infix(expr.instrs.cbegin(), expr.instrs.cend(), os,
+                    "\"", "\\n\\t", "\"");
+            os << " : : ";
+            expr.infix(os, "\"rm\" (", "), \"rm\" (", ")");
+            os << ")";
+        } else if (expr.t == LExpr::DEREF) {
+            os << '*' << *expr.args.at(0);
+        } else if (expr.t == LExpr::ASSIGN) {
+            os << *expr.args.at(0) << " = " << *expr.args.at(1);
+        } else { assert(false && "Bad expr!"); }
+
+        return os;
+    }
+};
+
+LExpr LStr(std::string str) {
+    return LExpr(LExpr::STR, 0, str);
+}
+
+LExpr LHex(uint32_t value) {
+    return LExpr(LExpr::HEX, value, "");
+}
+
+LExpr LDecimal(uint32_t value) {
+    return LExpr(LExpr::DECIMAL, value, "");
+}
+
+// Binary operator.
+LExpr LBinop(std::string op, LExpr left, LExpr right) {
+    if (op == "+"
+            && (right.t == LExpr::DECIMAL || right.t == LExpr::HEX)
+            && right.value == 0) {
+        return left;
+    }
+    return LExpr(LExpr::BINOP, 0, op, { left, right });
+}
+
+LExpr LBinop(std::string op, std::vector<LExpr> args) {
+    size_t len = args.size();
+    if (len == 0) {
+        if (op == "+") return LDecimal(0);
+        else if (op == "*") return LDecimal(1);
+        else { assert(false); return LStr(""); }
+    } else if (len == 1) {
+        return args.front();
+    } else {
+        return LExpr(LExpr::BINOP, 0, op, std::move(args));
+    }
+}
+
+LExpr operator-(LExpr us, LExpr other) { return LBinop("-", us, other); }
+LExpr operator+(LExpr us, LExpr other) { return LBinop("+", us, other); }
+LExpr operator*(LExpr us, LExpr other) { return LBinop("*", us, other); }
+LExpr operator==(LExpr us, LExpr other) { return LBinop("==", us, other); }
+LExpr operator&&(LExpr us, LExpr other) { return LBinop("&&", us, other); }
+LExpr operator||(LExpr us, LExpr other) { return LBinop("||", us, other); }
+LExpr operator>>(LExpr us, LExpr other) { return LBinop(">>", us, other); }
+LExpr operator<<(LExpr us, LExpr other) { return LBinop("<<", us, other); }
+LExpr operator&(LExpr us, LExpr other) { return LBinop("&", us, other); }
+LExpr operator|(LExpr us, LExpr other) { return LBinop("|", us, other); }
+LExpr operator<(LExpr us, LExpr other) { return LBinop("<", us, other); }
+LExpr operator^(LExpr us, LExpr other) { return LBinop("^", us, other); }
+LExpr operator%(LExpr us, LExpr other) { return LBinop("%", us, other); }
+
+LExpr LBlock(std::initializer_list<LExpr> stmts) {
+    return LExpr(LExpr::BLOCK, 0, "", stmts);
+}
+
+LExpr LFunc(std::string name, std::initializer_list<LExpr> args) {
+    return LExpr(LExpr::FUNC, 0, name, args);
+}
+
+LExpr LIf(std::string cond, std::initializer_list<LExpr> stmts) {
+    return LExpr(LExpr::IF, 0, cond, stmts);
+}
+
+LExpr LIf(std::string cond, LExpr stmt) {
+    return LExpr(LExpr::IF, 0, cond, { stmt });
+}
+
+LExpr LIfDef(std::string cond, std::initializer_list<LExpr> stmts) {
+    return LExpr(LExpr::IFDEF, 0, cond, stmts);
+}
+
+LExpr LCast(std::string type, LExpr value) {
+    if (value.t == LExpr::CAST) {
+        // Casting twice is a no-op.
+        return LExpr(LExpr::CAST, 0, type, { value.args[0] });
+    } else {
+        return LExpr(LExpr::CAST, 0, type, { value });
+    }
+}
+
+LExpr LIndex(LExpr array, uint32_t index) {
+    return LExpr(LExpr::INDEX, index, "", { array });
+}
+
+LExpr LAsm(std::initializer_list<LExpr> args,
+        std::initializer_list<std::string> instrs) {
+    return LExpr(LExpr::ASM, 0, "", args, instrs);
+}
+
+LExpr LDeref(LExpr ptr) {
+    return LExpr(LExpr::DEREF, 0, "", { ptr });
+}
+
+LExpr LAssign(LExpr left, LExpr right) {
+    return LExpr(LExpr::ASSIGN, 0, "", { left, right });
+}
+
+LExpr LavaGet(uint32_t slot) {
+    return LFunc("lava_get", { LDecimal(slot) });
+}
+
+LExpr DataFlowGet(uint32_t slot) {
+    return LIndex(LStr("data_flow"), slot);
+}
+
+LExpr UCharCast(LExpr arg) { return LCast("const unsigned char *", arg); }
+LExpr UIntCast(LExpr arg) { return LCast("const unsigned int *", arg); }
+
+LExpr SelectCast(const SourceLval *lval, Range selected) {
+    const std::string &lval_name = lval->ast_name;
+    assert(selected.size() >= 4); // Maybe too specific?
+
+    LExpr pointer = selected.low % 4 == 0
+        ? UIntCast(LStr(lval_name)) + LDecimal(selected.low / 4)
+        : UIntCast(UCharCast(LStr(lval_name)) + LDecimal(selected.low));
+    return LDeref(pointer);
+}
+
+LExpr LavaSet(const SourceLval *lval, Range selected, uint32_t slot) {
+    return LFunc("lava_set", { LDecimal(slot),
+            old_lexpr::SelectCast(lval, selected) });
+}
+
+LExpr DataFlowSet(const SourceLval *lval, Range selected, uint32_t slot) {
+    return LFunc("DFLOG", { LDecimal(slot),
+            old_lexpr::SelectCast(lval, selected) });
+}
+
+template<typename UInt>
+LExpr MagicTest(UInt magic_value, LExpr maskedLavaGet) {
+    return LHex(magic_value) == maskedLavaGet;
+}
+
+template<LExpr Get(const Bug *)>
+LExpr MagicTest(const Bug *bug) {
+    return MagicTest(bug->magic, Get(bug));
+}
+
+// Renders as the handlers did: one expression at a time, through a stream.
+static void append(std::string &out, const LExpr &expr) {
+    out += expr.render();
+}
+
+} // namespace old_lexpr
+
+// Renders as the handlers do now, straight into the output.
+static void append(std::string &out, const LExpr &expr) {
+    expr.render(out);
+}
+
+struct Shape {
+    SourceLval lval;
+    Range selected;
+    uint32_t slots[3];
+    uint32_t magic;
+};
+
+// The expressions for one attack point, built with whichever
+// implementation's LExpr and constructors are visible where this expands:
+// in namespace old_lexpr, its own hide the global ones. LavaSet is in
+// parentheses so that its SourceLval argument doesn't find the global one
+// as well.
+#define LEXPR_BENCH_SHAPES                                                  \
+static void build(std::string &out, const Shape &s) {                       \
+    const std::string &name = s.lval.ast_name;                              \
+    append(out, LIf("pdtbl && *pdtbl && " + name,                           \
+                (LavaSet)(&s.lval, s.selected, s.slots[0])));               \
+                                                                            \
+    LExpr test = LHex(s.magic) == LavaGet(s.slots[0]);                      \
+    append(out, LIf(test.render(), {                                        \
+                LIfDef("__x86_64__", {                                      \
+                    LAsm({ UCharCast(LStr(name)) +                          \
+                        LDecimal(s.selected.low), },                        \
+                        { "movq %0, %%rsp", "ret" }),                       \
+                    LAsm({ UCharCast(LStr(name)) +                          \
+                        LDecimal(s.selected.low), },                        \
+                        { "movl %0, %%esp", "ret" })})}));                  \
+                                                                            \
+    LExpr a = LavaGet(s.slots[0]), b = LavaGet(s.slots[1]),                 \
+          c = LavaGet(s.slots[2]);                                          \
+    LExpr three = s.magic % 3 == 0 ? (a + b) * c == LHex(s.magic)           \
+        : s.magic % 3 == 1 ? (a * b) - c == LHex(s.magic)                   \
+        : (a + LHex(2)) * (c + LHex(3)) * (a + LHex(1)) == LHex(s.magic);   \
+    std::vector<LExpr> addends;                                             \
+    addends.push_back(a * test);                                            \
+    addends.push_back(three * b);                                           \
+    append(out, LBinop("+", std::move(addends)));                           \
+}
+
+namespace old_lexpr { LEXPR_BENCH_SHAPES }
+namespace new_lexpr { LEXPR_BENCH_SHAPES }
+
+static const char *NAMES[] = {
+    "buf", "s->len", "((*((**(pdtbl)).pub)).sent_table)", "(*ctx).header",
+    "cinfo->comp_info", "file_name",
+};
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    unsigned seed = argc > 2 ? strtoul(argv[2], nullptr, 10) : 0x6c617661;
+
+    std::mt19937 rng(seed);
+    std::vector<Shape> shapes(n);
+    for (Shape &s : shapes) {
+        s.lval.ast_name = NAMES[rng() % (sizeof(NAMES) / sizeof(NAMES[0]))];
+        s.selected.low = rng() % 64;
+        s.selected.high = s.selected.low + 4;
+        for (uint32_t &slot : s.slots) slot = rng() % 1000;
+        s.magic = rng();
+    }
+
+    std::string old_out, new_out;
+    auto start = std::chrono::steady_clock::now();
+    for (const Shape &s : shapes) old_lexpr::build(old_out, s);
+    double old_us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count() / n;
+
+    start = std::chrono::steady_clock::now();
+    for (const Shape &s : shapes) new_lexpr::build(new_out, s);
+    double new_us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count() / n;
+
+    printf("%zu attack points, %zu bytes\n", n, new_out.size());
+    printf("old %8.2f us/iter   new %8.2f us/iter   (%.2fx)\n", old_us,
+            new_us, old_us / new_us);
+    if (old_out != new_out) {
+        size_t i = 0;
+        while (i < old_out.size() && i < new_out.size()
+                && old_out[i] == new_out[i]) i++;
+        printf("MISMATCH at byte %zu\n", i);
+        return 1;
+    }
+    return 0;
+}